@@ -58,6 +58,12 @@ START_TEST(test_basic)
     ck_assert_msg(tcp_server_listen_count(tcp_s) == NUM_PORTS,
                   "Failed to bind a TCP relay server to all %d attempted ports.", NUM_PORTS);
 
+    Socket wait_socks[NUM_PORTS];
+    const uint32_t num_wait_socks = tcp_server_wait_sockets(tcp_s, wait_socks, NUM_PORTS);
+    ck_assert_msg(num_wait_socks >= 1 && num_wait_socks <= NUM_PORTS,
+                  "Unexpected number of sockets to wait on: %u.", num_wait_socks);
+    ck_assert_msg(!tcp_server_has_pending_data(tcp_s), "New TCP relay server has pending data.");
+
     Socket sock = {0};
 
     // Check all opened ports for connectivity.
@@ -116,6 +122,12 @@ START_TEST(test_basic)
     ret = decrypt_data(self_public_key, f_secret_key, response, response + CRYPTO_NONCE_SIZE,
                        TCP_SERVER_HANDSHAKE_SIZE - CRYPTO_NONCE_SIZE, response_plain);
     ck_assert_msg(ret == TCP_HANDSHAKE_PLAIN_SIZE, "Failed to decrypt handshake response.");
+
+    TCP_Server_Stats stats;
+    tcp_server_get_stats(tcp_s, &stats);
+    ck_assert_msg(stats.unconfirmed_connections == 1 && stats.connections == 0,
+                  "Wrong connection counts after the handshake: %u unconfirmed, %u confirmed.",
+                  stats.unconfirmed_connections, stats.connections);
     uint8_t f_nonce_r[CRYPTO_NONCE_SIZE];
     uint8_t f_shared_key[CRYPTO_SHARED_KEY_SIZE];
     encrypt_precompute(response_plain, t_secret_key, f_shared_key);
@@ -166,7 +178,38 @@ START_TEST(test_basic)
     ck_assert_msg(packet_resp_plain[1] == 0, "Server did not refuse the connection.");
     ck_assert_msg(public_key_cmp(packet_resp_plain + 2, f_public_key) == 0, "Server sent the wrong public key.");
 
+    tcp_server_get_stats(tcp_s, &stats);
+    ck_assert_msg(stats.unconfirmed_connections == 0 && stats.connections == 1,
+                  "Wrong connection counts after the first packet: %u unconfirmed, %u confirmed.",
+                  stats.unconfirmed_connections, stats.connections);
+    ck_assert_msg(stats.handshake_failures == 0, "Counted %u handshake failures.", (unsigned)stats.handshake_failures);
+    const TCP_Packet_Stats *routing_request = &stats.packets[TCP_PACKET_ROUTING_REQUEST];
+    const TCP_Packet_Stats *routing_response = &stats.packets[TCP_PACKET_ROUTING_RESPONSE];
+    ck_assert_msg(routing_request->packets_recv == 1 && routing_request->bytes_recv == 1 + CRYPTO_PUBLIC_KEY_SIZE,
+                  "Wrong routing request counters: %u packets, %u bytes.", (unsigned)routing_request->packets_recv,
+                  (unsigned)routing_request->bytes_recv);
+    ck_assert_msg(routing_response->packets_sent == 1 && routing_response->bytes_sent == 2 + CRYPTO_PUBLIC_KEY_SIZE,
+                  "Wrong routing response counters: %u packets, %u bytes.", (unsigned)routing_response->packets_sent,
+                  (unsigned)routing_response->bytes_sent);
+
+    // A handshake that doesn't decrypt gets the client killed.
+    Socket bad_sock = net_socket(net_family_ipv6, TOX_SOCK_STREAM, TOX_PROTO_TCP);
+    IP_Port ip_port_loopback;
+    ip_port_loopback.ip = get_loopback();
+    ip_port_loopback.port = net_htons(ports[0]);
+    ck_assert_msg(net_connect(bad_sock, ip_port_loopback) == 0, "Failed to connect to the TCP relay server.");
+    random_bytes(handshake, TCP_CLIENT_HANDSHAKE_SIZE);
+    ck_assert_msg(net_send(bad_sock, handshake, TCP_CLIENT_HANDSHAKE_SIZE) == TCP_CLIENT_HANDSHAKE_SIZE,
+                  "Failed to send an invalid handshake.");
+
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+
+    tcp_server_get_stats(tcp_s, &stats);
+    ck_assert_msg(stats.handshake_failures == 1, "Counted %u handshake failures instead of 1.",
+                  (unsigned)stats.handshake_failures);
+
     // Closing connections.
+    kill_sock(bad_sock);
     kill_sock(sock);
     kill_TCP_server(tcp_s);
 
@@ -278,6 +321,9 @@ START_TEST(test_some)
     TCP_Server *tcp_s = new_TCP_server(USE_IPV6, NUM_PORTS, ports, self_secret_key, nullptr);
     ck_assert_msg(tcp_s != nullptr, "Failed to create TCP relay server");
     ck_assert_msg(tcp_server_listen_count(tcp_s) == NUM_PORTS, "Failed to bind to all ports.");
+    ck_assert_msg(!tcp_server_set_read_limits(tcp_s, 0, 2), "Accepted an empty event batch.");
+    // Small limits, so the bursts below need the sockets to get another turn.
+    ck_assert_msg(tcp_server_set_read_limits(tcp_s, 1, 2), "Failed to set read limits.");
 
     struct sec_TCP_con *con1 = new_TCP_con(tcp_s, mono_time);
     struct sec_TCP_con *con2 = new_TCP_con(tcp_s, mono_time);
@@ -374,6 +420,200 @@ START_TEST(test_some)
 }
 END_TEST
 
+START_TEST(test_slow_consumer)
+{
+    Mono_Time *mono_time = mono_time_new();
+
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(USE_IPV6, NUM_PORTS, ports, self_secret_key, nullptr);
+    ck_assert_msg(tcp_s != nullptr, "Failed to create TCP relay server");
+
+    // Room for 3 data packets.
+    tcp_server_set_queue_limits(tcp_s, 3 * (2 + 512 + CRYPTO_MAC_SIZE), 2);
+
+    struct sec_TCP_con *con1 = new_TCP_con(tcp_s, mono_time);
+    struct sec_TCP_con *con2 = new_TCP_con(tcp_s, mono_time);
+
+    uint8_t requ_p[1 + CRYPTO_PUBLIC_KEY_SIZE];
+    requ_p[0] = 0;
+    memcpy(requ_p + 1, con2->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    write_packet_TCP_secure_connection(con1, requ_p, sizeof(requ_p));
+    memcpy(requ_p + 1, con1->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    write_packet_TCP_secure_connection(con2, requ_p, sizeof(requ_p));
+
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+
+    TCP_Server_Stats stats;
+    tcp_server_get_stats(tcp_s, &stats);
+    ck_assert_msg(stats.connections == 2, "Wrong number of connections: %u.", stats.connections);
+    ck_assert_msg(stats.dropped_packets == 0, "Dropped packets before any data was sent.");
+
+    // Packets for a connection are collected during a do_TCP_server() call,
+    // so a burst of 5 goes over the cap of the server.
+    uint8_t test_packet[512] = {16};
+
+    for (uint32_t i = 0; i < 5; ++i) {
+        write_packet_TCP_secure_connection(con1, test_packet, sizeof(test_packet));
+    }
+
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+    tcp_server_get_stats(tcp_s, &stats);
+    ck_assert_msg(stats.dropped_packets == 2, "Wrong number of dropped packets: %lu.",
+                  (unsigned long)stats.dropped_packets);
+
+    // con2 never reads, so once the socket buffers are full its send buffer
+    // stops draining and it gets killed for that after the drain timeout.
+    tcp_server_set_queue_limits(tcp_s, TCP_SERVER_QUEUE_SIZE, 2);
+
+    for (uint32_t i = 0; i < 2000 && stats.slow_kills == 0; ++i) {
+        for (uint32_t j = 0; j < 32; ++j) {
+            write_packet_TCP_secure_connection(con1, test_packet, sizeof(test_packet));
+        }
+
+        do_TCP_server_delay(tcp_s, mono_time, 2);
+        tcp_server_get_stats(tcp_s, &stats);
+        ck_assert_msg(stats.queued_bytes == 0 || tcp_server_has_pending_data(tcp_s),
+                      "Queued bytes are not reported as pending data.");
+    }
+
+    ck_assert_msg(stats.slow_kills == 1, "The slow client was not killed.");
+    ck_assert_msg(stats.connections == 1, "Wrong number of connections: %u.", stats.connections);
+    ck_assert_msg(stats.queued_bytes == 0, "Bytes of the killed client are still counted.");
+
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+    ck_assert_msg(!tcp_server_has_pending_data(tcp_s), "The killed client still has pending data.");
+
+    kill_TCP_server(tcp_s);
+    kill_TCP_con(con1);
+    kill_TCP_con(con2);
+
+    mono_time_free(mono_time);
+}
+END_TEST
+
+static void do_TCP_shards_delay(TCP_Server *tcp_s, Mono_Time *mono_time, int delay)
+{
+    c_sleep(delay);
+    mono_time_update(mono_time);
+
+    // Messages between shards are handled the next time the receiving shard runs.
+    for (uint32_t round = 0; round < 4; ++round) {
+        for (uint32_t i = 0; i < tcp_server_shard_count(tcp_s); ++i) {
+            do_TCP_server(tcp_server_shard(tcp_s, i), mono_time);
+        }
+    }
+
+    c_sleep(delay);
+}
+
+#define NUM_SHARDS 4
+#define NUM_SHARD_PAIRS 8
+
+START_TEST(test_shards)
+{
+    Mono_Time *mono_time = mono_time_new();
+
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(USE_IPV6, NUM_PORTS, ports, self_secret_key, nullptr);
+    ck_assert_msg(tcp_s != nullptr, "Failed to create TCP relay server");
+    ck_assert_msg(!tcp_server_set_shards(tcp_s, 0), "Split a TCP relay server into no shards.");
+    ck_assert_msg(tcp_server_set_shards(tcp_s, NUM_SHARDS), "Failed to split the TCP relay server into shards.");
+    ck_assert_msg(tcp_server_shard_count(tcp_s) == NUM_SHARDS, "Wrong shard count %u.", tcp_server_shard_count(tcp_s));
+    ck_assert_msg(tcp_server_shard(tcp_s, 0) == tcp_s, "Shard 0 is not the server itself.");
+    ck_assert_msg(tcp_server_shard(tcp_s, NUM_SHARDS) == nullptr, "Got a shard beyond the shard count.");
+    ck_assert_msg(!tcp_server_set_shards(tcp_s, 2), "Split a TCP relay server twice.");
+
+    // Clients are spread over the shards by their keys, so most pairs end up
+    // on different shards.
+    struct sec_TCP_con *cons[NUM_SHARD_PAIRS * 2];
+
+    for (uint32_t i = 0; i < NUM_SHARD_PAIRS * 2; ++i) {
+        cons[i] = new_TCP_con(tcp_s, mono_time);
+    }
+
+    uint8_t requ_p[1 + CRYPTO_PUBLIC_KEY_SIZE];
+    requ_p[0] = TCP_PACKET_ROUTING_REQUEST;
+
+    for (uint32_t i = 0; i < NUM_SHARD_PAIRS * 2; ++i) {
+        memcpy(requ_p + 1, cons[i ^ 1]->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        write_packet_TCP_secure_connection(cons[i], requ_p, sizeof(requ_p));
+    }
+
+    do_TCP_shards_delay(tcp_s, mono_time, 50);
+
+    uint8_t data[2048];
+
+    for (uint32_t i = 0; i < NUM_SHARD_PAIRS * 2; ++i) {
+        int len = read_packet_sec_TCP(cons[i], data, 2 + 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE);
+        ck_assert_msg(len == 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE, "Wrong response packet length of %d.", len);
+        ck_assert_msg(data[0] == TCP_PACKET_ROUTING_RESPONSE, "Wrong response packet id of %d.", data[0]);
+        ck_assert_msg(data[1] == NUM_RESERVED_PORTS, "Wrong connection id %u.", data[1]);
+        ck_assert_msg(public_key_cmp(data + 2, cons[i ^ 1]->public_key) == 0, "Key in response packet wrong.");
+
+        len = read_packet_sec_TCP(cons[i], data, 2 + 2 + CRYPTO_MAC_SIZE);
+        ck_assert_msg(len == 2, "wrong len %d", len);
+        ck_assert_msg(data[0] == TCP_PACKET_CONNECTION_NOTIFICATION, "wrong packet id %u", data[0]);
+        ck_assert_msg(data[1] == NUM_RESERVED_PORTS, "wrong peer id %u", data[1]);
+    }
+
+    uint8_t test_packet[512] = {NUM_RESERVED_PORTS, 0, 16, 86, 99, 127, 255, 189, 78};
+
+    for (uint32_t i = 0; i < NUM_SHARD_PAIRS * 2; ++i) {
+        test_packet[1] = i;
+        write_packet_TCP_secure_connection(cons[i], test_packet, sizeof(test_packet));
+    }
+
+    do_TCP_shards_delay(tcp_s, mono_time, 50);
+
+    for (uint32_t i = 0; i < NUM_SHARD_PAIRS * 2; ++i) {
+        const int len = read_packet_sec_TCP(cons[i], data, 2 + sizeof(test_packet) + CRYPTO_MAC_SIZE);
+        ck_assert_msg(len == sizeof(test_packet), "wrong len %d", len);
+        ck_assert_msg(data[0] == NUM_RESERVED_PORTS, "wrong peer id %u", data[0]);
+        ck_assert_msg(data[1] == (i ^ 1), "client %u got the packet of client %u", i, data[1]);
+        ck_assert_msg(memcmp(data + 2, test_packet + 2, sizeof(test_packet) - 2) == 0, "packet is wrong");
+    }
+
+    uint8_t oob_packet[1 + CRYPTO_PUBLIC_KEY_SIZE + 8] = {TCP_PACKET_OOB_SEND};
+    memcpy(oob_packet + 1, cons[1]->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memset(oob_packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, 7, 8);
+    write_packet_TCP_secure_connection(cons[0], oob_packet, sizeof(oob_packet));
+
+    do_TCP_shards_delay(tcp_s, mono_time, 50);
+
+    int len = read_packet_sec_TCP(cons[1], data, 2 + sizeof(oob_packet) + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == sizeof(oob_packet), "wrong len %d", len);
+    ck_assert_msg(data[0] == TCP_PACKET_OOB_RECV, "wrong packet id %u", data[0]);
+    ck_assert_msg(public_key_cmp(data + 1, cons[0]->public_key) == 0, "wrong sender of out of band packet");
+
+    uint8_t disconnect_packet[2] = {TCP_PACKET_DISCONNECT_NOTIFICATION, NUM_RESERVED_PORTS};
+
+    for (uint32_t i = 0; i < NUM_SHARD_PAIRS * 2; i += 2) {
+        write_packet_TCP_secure_connection(cons[i], disconnect_packet, sizeof(disconnect_packet));
+    }
+
+    do_TCP_shards_delay(tcp_s, mono_time, 50);
+
+    for (uint32_t i = 1; i < NUM_SHARD_PAIRS * 2; i += 2) {
+        len = read_packet_sec_TCP(cons[i], data, 2 + 2 + CRYPTO_MAC_SIZE);
+        ck_assert_msg(len == 2, "wrong len %d", len);
+        ck_assert_msg(data[0] == TCP_PACKET_DISCONNECT_NOTIFICATION, "wrong packet id %u", data[0]);
+        ck_assert_msg(data[1] == NUM_RESERVED_PORTS, "wrong peer id %u", data[1]);
+    }
+
+    kill_TCP_server(tcp_s);
+
+    for (uint32_t i = 0; i < NUM_SHARD_PAIRS * 2; ++i) {
+        kill_TCP_con(cons[i]);
+    }
+
+    mono_time_free(mono_time);
+}
+END_TEST
+
 static int response_callback_good;
 static uint8_t response_callback_connection_id;
 static uint8_t response_callback_public_key[CRYPTO_PUBLIC_KEY_SIZE];
@@ -693,6 +933,9 @@ START_TEST(test_tcp_connection)
     ck_assert_msg(new_tcp_connection_to(tc_2, tcp_connections_public_key(tc_1), 123) == -1,
                   "Managed to readd same connection\n");
 
+    // One relay socket, or the epoll descriptor covering it.
+    ck_assert_msg(tcp_connections_wait_sockets(tc_1, nullptr, 0) == 1, "Wrong number of sockets to wait on");
+
     do_TCP_server_delay(tcp_s, mono_time, 50);
 
     do_tcp_connections(tc_1, nullptr);
@@ -843,6 +1086,8 @@ static Suite *TCP_suite(void)
 
     DEFTESTCASE_SLOW(basic, 5);
     DEFTESTCASE_SLOW(some, 10);
+    DEFTESTCASE_SLOW(slow_consumer, 20);
+    DEFTESTCASE_SLOW(shards, 15);
     DEFTESTCASE_SLOW(client, 10);
     DEFTESTCASE_SLOW(client_invalid, 15);
     DEFTESTCASE_SLOW(tcp_connection, 20);
@@ -632,6 +632,11 @@ static void test_DHT_test(void)
         dhts[i] = new_dht(logs[i], mono_times[i], new_networking(logs[i], ip, DHT_DEFAULT_PORT + i), true);
         ck_assert_msg(dhts[i] != nullptr, "Failed to create dht instances %u", i);
         ck_assert_msg(net_port(dhts[i]->net) != DHT_DEFAULT_PORT + i, "Bound to wrong port");
+
+        // Half of the nodes compute the keys of new peers in the background.
+        if (i % 2 == 0) {
+            ck_assert_msg(dht_set_precompute_threads(dhts[i], 1), "Failed to start precompute threads");
+        }
     }
 
     struct {
@@ -807,12 +812,70 @@ static void test_dht_node_packing(void)
     free(data);
 }
 
+#define SHARED_KEYS_TEST_KEYS 64
+
+static void test_shared_keys(void)
+{
+    Mono_Time *mono_time = mono_time_new();
+    ck_assert_msg(mono_time != nullptr, "Failed to create mono_time.");
+
+    Shared_Keys shared_keys = {nullptr};
+    ck_assert_msg(shared_keys_init(&shared_keys, 20), "Failed to allocate shared keys.");
+    ck_assert_msg(shared_keys.capacity == 32, "Capacity not rounded up to a power of 2: %u", shared_keys.capacity);
+
+    uint8_t self_pk[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_sk[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_pk, self_sk);
+
+    uint8_t pks[SHARED_KEYS_TEST_KEYS][CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t sk[CRYPTO_SECRET_KEY_SIZE];
+
+    for (uint32_t i = 0; i < SHARED_KEYS_TEST_KEYS; ++i) {
+        crypto_new_keypair(pks[i], sk);
+    }
+
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t expected[CRYPTO_SHARED_KEY_SIZE];
+
+    get_shared_key(mono_time, &shared_keys, shared_key, self_sk, pks[0]);
+    get_shared_key(mono_time, &shared_keys, shared_key, self_sk, pks[0]);
+    encrypt_precompute(pks[0], self_sk, expected);
+    ck_assert_msg(memcmp(shared_key, expected, sizeof(expected)) == 0, "Cached shared key is wrong.");
+    ck_assert_msg(shared_keys.stats.hits == 1 && shared_keys.stats.misses == 1,
+                  "Expected 1 hit and 1 miss, got %u hits and %u misses",
+                  (unsigned)shared_keys.stats.hits, (unsigned)shared_keys.stats.misses);
+
+    // More keys than the cache holds: some must be evicted, but every key
+    // handed out must still be correct.
+    for (uint32_t i = 0; i < SHARED_KEYS_TEST_KEYS; ++i) {
+        get_shared_key(mono_time, &shared_keys, shared_key, self_sk, pks[i]);
+        encrypt_precompute(pks[i], self_sk, expected);
+        ck_assert_msg(memcmp(shared_key, expected, sizeof(expected)) == 0, "Shared key %u is wrong.", i);
+    }
+
+    ck_assert_msg(shared_keys.stats.evictions > 0, "No keys were evicted from a full cache.");
+    ck_assert_msg(shared_keys.hand < SHARED_KEYS_WAYS, "Clock hand %u is outside the window.", shared_keys.hand);
+    ck_assert_msg(shared_keys.stats.hits + shared_keys.stats.misses == SHARED_KEYS_TEST_KEYS + 2,
+                  "Lookups were not all counted.");
+
+    shared_keys_free(&shared_keys);
+    ck_assert_msg(shared_keys.capacity == 0, "Freed cache still has a capacity.");
+
+    // An empty cache still computes keys.
+    get_shared_key(mono_time, &shared_keys, shared_key, self_sk, pks[1]);
+    encrypt_precompute(pks[1], self_sk, expected);
+    ck_assert_msg(memcmp(shared_key, expected, sizeof(expected)) == 0, "Uncached shared key is wrong.");
+
+    mono_time_free(mono_time);
+}
+
 int main(void)
 {
     setvbuf(stdout, nullptr, _IONBF, 0);
 
     test_dht_create_packet();
     test_dht_node_packing();
+    test_shared_keys();
 
     test_list();
     test_DHT_test();
@@ -97,6 +97,7 @@ static uint64_t max_sending;
 static bool m_send_reached;
 static uint8_t sending_num;
 static bool file_sending_done;
+static size_t max_chunk_length;
 static void tox_file_chunk_request(Tox *tox, uint32_t friend_number, uint32_t file_number, uint64_t position,
                                    size_t length, void *user_data)
 {
@@ -104,6 +105,10 @@ static void tox_file_chunk_request(Tox *tox, uint32_t friend_number, uint32_t fi
 
     ck_assert_msg(sending_pos == position, "bad position %lu", (unsigned long)position);
 
+    if (length > max_chunk_length) {
+        max_chunk_length = length;
+    }
+
     if (length == 0) {
         ck_assert_msg(!file_sending_done, "file sending already done");
 
@@ -154,18 +159,25 @@ static void write_file(Tox *tox, uint32_t friendnumber, uint32_t filenumber, uin
     size_recv += length;
 }
 
-static void file_transfer_test(void)
+static void file_transfer_test(Tox_Congestion_Control congestion_control, uint16_t udp_batch_size)
 {
-    printf("Starting test: few_clients\n");
+    printf("Starting test: few_clients, congestion control %d, UDP batch size %u\n", congestion_control,
+           udp_batch_size);
     uint32_t index[] = { 1, 2, 3 };
     long long unsigned int cur_time = time(nullptr);
+    struct Tox_Options *options = tox_options_new(nullptr);
+    ck_assert_msg(options != nullptr, "tox_options_new failed");
+    tox_options_set_congestion_control(options, congestion_control);
+    tox_options_set_udp_recv_batch_size(options, udp_batch_size);
+    tox_options_set_udp_send_queue_size(options, udp_batch_size);
     TOX_ERR_NEW t_n_error;
-    Tox *tox1 = tox_new_log(nullptr, &t_n_error, &index[0]);
+    Tox *tox1 = tox_new_log(options, &t_n_error, &index[0]);
     ck_assert_msg(t_n_error == TOX_ERR_NEW_OK, "wrong error");
-    Tox *tox2 = tox_new_log(nullptr, &t_n_error, &index[1]);
+    Tox *tox2 = tox_new_log(options, &t_n_error, &index[1]);
     ck_assert_msg(t_n_error == TOX_ERR_NEW_OK, "wrong error");
-    Tox *tox3 = tox_new_log(nullptr, &t_n_error, &index[2]);
+    Tox *tox3 = tox_new_log(options, &t_n_error, &index[2]);
     ck_assert_msg(t_n_error == TOX_ERR_NEW_OK, "wrong error");
+    tox_options_free(options);
 
     ck_assert_msg(tox1 && tox2 && tox3, "Failed to create 3 tox instances");
 
@@ -206,6 +218,7 @@ static void file_transfer_test(void)
 
     file_accepted = file_size = sendf_ok = size_recv = 0;
     file_recv = 0;
+    file_sending_done = 0;
     max_sending = UINT64_MAX;
     uint64_t f_time = time(nullptr);
     tox_callback_file_recv_chunk(tox3, write_file);
@@ -264,6 +277,10 @@ static void file_transfer_test(void)
 
     printf("100MiB file sent in %lu seconds\n", (unsigned long)(time(nullptr) - f_time));
 
+    /* Path MTU discovery finds that loopback carries larger packets. */
+    ck_assert_msg(max_chunk_length > TOX_MAX_CUSTOM_PACKET_SIZE, "chunks were never larger than %u bytes",
+                  (unsigned)max_chunk_length);
+
     printf("Starting file streaming transfer test.\n");
 
     file_sending_done = 0;
@@ -365,6 +382,8 @@ static void file_transfer_test(void)
 int main(void)
 {
     setvbuf(stdout, nullptr, _IONBF, 0);
-    file_transfer_test();
+    file_transfer_test(TOX_CONGESTION_CONTROL_LEGACY, 0);
+    file_transfer_test(TOX_CONGESTION_CONTROL_CUBIC, 0);
+    file_transfer_test(TOX_CONGESTION_CONTROL_LEGACY, 32);
     return 0;
 }
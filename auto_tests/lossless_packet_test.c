@@ -55,6 +55,20 @@ static void test_lossless_packet(Tox **toxes, State *state)
     do {
         iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
     } while (!state[1].custom_packet_received);
+
+    Tox_Err_Friend_Query err;
+    const Tox_Transport_Path path = tox_friend_get_transport_path(toxes[0], 0, &err);
+    ck_assert_msg(err == TOX_ERR_FRIEND_QUERY_OK, "tox_friend_get_transport_path failed %d", err);
+    ck_assert_msg(path != TOX_TRANSPORT_PATH_NONE, "friend has no transport path");
+    const uint64_t packets_sent = tox_friend_get_transport_packets_sent(toxes[0], 0, nullptr);
+    ck_assert_msg(packets_sent >= 1, "sent lossless packet not counted: %lu", (unsigned long)packets_sent);
+    ck_assert_msg(tox_friend_get_transport_rtt(toxes[0], 0, nullptr) > 0, "rtt should not be 0");
+    ck_assert_msg(tox_friend_get_transport_recv_queue(toxes[1], 0, nullptr) == 0,
+                  "packets held back although nothing is missing");
+
+    ck_assert_msg(tox_friend_get_transport_path(toxes[0], 1, &err) == TOX_TRANSPORT_PATH_NONE,
+                  "got the path of a non-existent friend");
+    ck_assert_msg(err == TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND, "wrong error for a non-existent friend: %d", err);
 }
 
 int main(void)
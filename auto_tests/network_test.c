@@ -160,6 +160,182 @@ START_TEST(test_ip_equal)
 }
 END_TEST
 
+#define RECV_BATCH_TEST_PACKET_ID 170
+#define RECV_BATCH_TEST_NUM_PACKETS 100
+
+static uint32_t recv_batch_count;
+
+static int handle_recv_batch_test(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                  void *userdata)
+{
+    ck_assert_msg(length == 1 + sizeof(uint32_t), "unexpected packet length %u", length);
+
+    uint32_t seq;
+    net_unpack_u32(packet + 1, &seq);
+    ck_assert_msg(seq == recv_batch_count, "packets received out of order: %u != %u", seq, recv_batch_count);
+
+    ++recv_batch_count;
+    return 0;
+}
+
+START_TEST(test_recv_batch)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip.v4 = get_ip4_loopback();
+
+    Logger *log = logger_new();
+    Networking_Core *sender = new_networking(log, ip, 36580);
+    Networking_Core *receiver = new_networking(log, ip, 36590);
+    ck_assert_msg(sender != nullptr && receiver != nullptr, "failed to create networking");
+
+    ck_assert(networking_recv_batch_size(receiver) == 1);
+    ck_assert(!networking_set_recv_batch_size(receiver, MAX_RECV_BATCH_SIZE + 1));
+    ck_assert(networking_set_recv_batch_size(receiver, 16));
+    ck_assert(networking_recv_batch_size(receiver) == 16);
+
+    networking_registerhandler(receiver, RECV_BATCH_TEST_PACKET_ID, &handle_recv_batch_test, nullptr);
+
+    IP_Port dest;
+    dest.ip = ip;
+    dest.port = net_port(receiver);
+
+    for (uint32_t i = 0; i < RECV_BATCH_TEST_NUM_PACKETS; ++i) {
+        uint8_t packet[1 + sizeof(uint32_t)];
+        packet[0] = RECV_BATCH_TEST_PACKET_ID;
+        net_pack_u32(packet + 1, i);
+        ck_assert(sendpacket(sender, dest, packet, sizeof(packet)) == sizeof(packet));
+    }
+
+    recv_batch_count = 0;
+
+    for (uint32_t tries = 0; tries < 100 && recv_batch_count < RECV_BATCH_TEST_NUM_PACKETS; ++tries) {
+        networking_poll(receiver, nullptr);
+        c_sleep(10);
+    }
+
+    ck_assert_msg(recv_batch_count == RECV_BATCH_TEST_NUM_PACKETS, "received %u of %u packets",
+                  recv_batch_count, RECV_BATCH_TEST_NUM_PACKETS);
+
+    /* Switching back to unbatched receive frees the batch buffers. */
+    ck_assert(networking_set_recv_batch_size(receiver, 1));
+    ck_assert(networking_recv_batch_size(receiver) == 1);
+
+    kill_networking(receiver);
+    kill_networking(sender);
+    logger_kill(log);
+}
+END_TEST
+
+START_TEST(test_send_queue)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip.v4 = get_ip4_loopback();
+
+    Logger *log = logger_new();
+    Networking_Core *sender = new_networking(log, ip, 36600);
+    Networking_Core *receiver = new_networking(log, ip, 36610);
+    ck_assert_msg(sender != nullptr && receiver != nullptr, "failed to create networking");
+
+    ck_assert(networking_send_queue_size(sender) == 0);
+    ck_assert(!networking_set_send_queue_size(sender, MAX_SEND_QUEUE_SIZE + 1));
+    ck_assert(networking_set_send_queue_size(sender, 32));
+    ck_assert(networking_send_queue_size(sender) == 32);
+
+    networking_registerhandler(receiver, RECV_BATCH_TEST_PACKET_ID, &handle_recv_batch_test, nullptr);
+
+    IP_Port dest;
+    dest.ip = ip;
+    dest.port = net_port(receiver);
+
+    /* More packets than fit in the queue, so it is flushed at least once before networking_flush(). */
+    for (uint32_t i = 0; i < RECV_BATCH_TEST_NUM_PACKETS; ++i) {
+        uint8_t packet[1 + sizeof(uint32_t)];
+        packet[0] = RECV_BATCH_TEST_PACKET_ID;
+        net_pack_u32(packet + 1, i);
+        ck_assert(sendpacket(sender, dest, packet, sizeof(packet)) == sizeof(packet));
+    }
+
+    networking_flush(sender);
+
+    recv_batch_count = 0;
+
+    for (uint32_t tries = 0; tries < 100 && recv_batch_count < RECV_BATCH_TEST_NUM_PACKETS; ++tries) {
+        networking_poll(receiver, nullptr);
+        c_sleep(10);
+    }
+
+    ck_assert_msg(recv_batch_count == RECV_BATCH_TEST_NUM_PACKETS, "received %u of %u packets",
+                  recv_batch_count, RECV_BATCH_TEST_NUM_PACKETS);
+
+    ck_assert(networking_set_send_queue_size(sender, 0));
+    ck_assert(networking_send_queue_size(sender) == 0);
+
+    kill_networking(receiver);
+    kill_networking(sender);
+    logger_kill(log);
+}
+END_TEST
+
+START_TEST(test_packet_stats)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip.v4 = get_ip4_loopback();
+
+    Logger *log = logger_new();
+    Networking_Core *sender = new_networking(log, ip, 36620);
+    Networking_Core *receiver = new_networking(log, ip, 36630);
+    ck_assert_msg(sender != nullptr && receiver != nullptr, "failed to create networking");
+
+    Net_Packet_Stats stats[256];
+    ck_assert_msg(!networking_get_stats(sender, stats), "got stats before enabling them");
+    ck_assert(networking_enable_stats(sender));
+    ck_assert(networking_enable_stats(receiver));
+
+    networking_registerhandler(receiver, RECV_BATCH_TEST_PACKET_ID, &handle_recv_batch_test, nullptr);
+
+    IP_Port dest;
+    dest.ip = ip;
+    dest.port = net_port(receiver);
+
+    for (uint32_t i = 0; i < RECV_BATCH_TEST_NUM_PACKETS; ++i) {
+        uint8_t packet[1 + sizeof(uint32_t)];
+        packet[0] = RECV_BATCH_TEST_PACKET_ID;
+        net_pack_u32(packet + 1, i);
+        ck_assert(sendpacket(sender, dest, packet, sizeof(packet)) == sizeof(packet));
+    }
+
+    recv_batch_count = 0;
+
+    for (uint32_t tries = 0; tries < 100 && recv_batch_count < RECV_BATCH_TEST_NUM_PACKETS; ++tries) {
+        networking_poll(receiver, nullptr);
+        c_sleep(10);
+    }
+
+    ck_assert_msg(recv_batch_count == RECV_BATCH_TEST_NUM_PACKETS, "received %u of %u packets",
+                  recv_batch_count, RECV_BATCH_TEST_NUM_PACKETS);
+
+    const uint32_t num_bytes = RECV_BATCH_TEST_NUM_PACKETS * (1 + sizeof(uint32_t));
+
+    ck_assert(networking_get_stats(sender, stats));
+    ck_assert(stats[RECV_BATCH_TEST_PACKET_ID].packets_sent == RECV_BATCH_TEST_NUM_PACKETS);
+    ck_assert(stats[RECV_BATCH_TEST_PACKET_ID].bytes_sent == num_bytes);
+    ck_assert(stats[RECV_BATCH_TEST_PACKET_ID].packets_recv == 0);
+
+    ck_assert(networking_get_stats(receiver, stats));
+    ck_assert(stats[RECV_BATCH_TEST_PACKET_ID].packets_recv == RECV_BATCH_TEST_NUM_PACKETS);
+    ck_assert(stats[RECV_BATCH_TEST_PACKET_ID].bytes_recv == num_bytes);
+    ck_assert(stats[RECV_BATCH_TEST_PACKET_ID].packets_sent == 0);
+    ck_assert(stats[RECV_BATCH_TEST_PACKET_ID + 1].packets_recv == 0);
+
+    kill_networking(receiver);
+    kill_networking(sender);
+    logger_kill(log);
+}
+END_TEST
+
 static Suite *network_suite(void)
 {
     Suite *s = suite_create("Network");
@@ -168,6 +344,9 @@ static Suite *network_suite(void)
 
     DEFTESTCASE(addr_resolv_localhost);
     DEFTESTCASE(ip_equal);
+    DEFTESTCASE(recv_batch);
+    DEFTESTCASE(send_queue);
+    DEFTESTCASE(packet_stats);
 
     return s;
 }
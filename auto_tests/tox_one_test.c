@@ -129,12 +129,37 @@ static void test_one(void)
     tox_kill(tox2);
 }
 
+static void test_wait_sockets(void)
+{
+    uint32_t index[] = { 3 };
+    Tox *tox = tox_new_log(nullptr, nullptr, &index[0]);
+    ck_assert_msg(tox != nullptr, "Failed to create tox instance.");
+
+    tox_iterate(tox, nullptr);
+
+    const size_t num_socks = tox_get_wait_sockets_size(tox);
+    ck_assert_msg(num_socks >= 1, "UDP socket missing from wait sockets.");
+
+    VLA(int32_t, socks, num_socks);
+    ck_assert_msg(tox_get_wait_sockets(tox, socks, num_socks) == num_socks, "Wrong number of wait sockets written.");
+    ck_assert_msg(tox_get_wait_sockets(tox, nullptr, 0) == num_socks, "Wrong number of wait sockets reported.");
+
+    for (size_t i = 0; i < num_socks; ++i) {
+        ck_assert_msg(socks[i] >= 0, "Wait socket %u is invalid: %d.", (unsigned)i, socks[i]);
+    }
+
+    const uint32_t deadline = tox_iteration_deadline(tox);
+    ck_assert_msg(deadline <= 1000, "Deadline %u is later than the next second tick.", deadline);
+
+    tox_kill(tox);
+}
 
 int main(void)
 {
     setvbuf(stdout, nullptr, _IONBF, 0);
 
     test_one();
+    test_wait_sockets();
 
     return 0;
 }
@@ -244,6 +244,7 @@ int main(int argc, char *argv[])
         do_TCP_server(tcp_s, mono_time);
 #endif
         networking_poll(dht_get_net(dht), nullptr);
+        networking_flush(dht_get_net(dht));
 
         c_sleep(1);
     }
@@ -32,6 +32,8 @@
 
 #include <libconfig.h>
 
+#include "../../../toxcore/TCP_server.h"
+#include "../../../toxcore/precompute_pool.h"
 #include "../../bootstrap_node_packets.h"
 
 /**
@@ -143,7 +145,10 @@ static void parse_tcp_relay_ports_config(config_t *cfg, uint16_t **tcp_relay_por
 
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
                        int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay,
-                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd)
+                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_tcp_relay_thread,
+                       int *tcp_relay_threads, int *precompute_threads, int *udp_recv_batch_size,
+                       int *udp_send_queue_size, int *enable_motd, char **motd, int *enable_stats,
+                       char **stats_socket_path)
 {
     config_t cfg;
 
@@ -157,6 +162,14 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
     const char *NAME_ENABLE_MOTD          = "enable_motd";
     const char *NAME_MOTD                 = "motd";
 
+    const char *NAME_ENABLE_TCP_RELAY_THREAD = "enable_tcp_relay_thread";
+    const char *NAME_TCP_RELAY_THREADS       = "tcp_relay_threads";
+    const char *NAME_PRECOMPUTE_THREADS      = "precompute_threads";
+    const char *NAME_UDP_RECV_BATCH_SIZE     = "udp_recv_batch_size";
+    const char *NAME_UDP_SEND_QUEUE_SIZE     = "udp_send_queue_size";
+    const char *NAME_ENABLE_STATS            = "enable_stats";
+    const char *NAME_STATS_SOCKET_PATH       = "stats_socket_path";
+
     config_init(&cfg);
 
     // Read the file. If there is an error, report it and exit.
@@ -234,6 +247,69 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         *tcp_relay_port_count = 0;
     }
 
+    // Get TCP relay thread option
+    if (config_lookup_bool(&cfg, NAME_ENABLE_TCP_RELAY_THREAD, enable_tcp_relay_thread) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_ENABLE_TCP_RELAY_THREAD);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %s\n", NAME_ENABLE_TCP_RELAY_THREAD,
+                  DEFAULT_ENABLE_TCP_RELAY_THREAD ? "true" : "false");
+        *enable_tcp_relay_thread = DEFAULT_ENABLE_TCP_RELAY_THREAD;
+    }
+
+    // Get number of TCP relay threads
+    if (config_lookup_int(&cfg, NAME_TCP_RELAY_THREADS, tcp_relay_threads) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_TCP_RELAY_THREADS);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_TCP_RELAY_THREADS, DEFAULT_TCP_RELAY_THREADS);
+        *tcp_relay_threads = DEFAULT_TCP_RELAY_THREADS;
+    }
+
+    if (*tcp_relay_threads < 1 || *tcp_relay_threads > TCP_SERVER_MAX_SHARDS) {
+        log_write(LOG_LEVEL_WARNING, "Invalid '%s': %d, must be between 1 and %d.\n", NAME_TCP_RELAY_THREADS,
+                  *tcp_relay_threads, TCP_SERVER_MAX_SHARDS);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_TCP_RELAY_THREADS, DEFAULT_TCP_RELAY_THREADS);
+        *tcp_relay_threads = DEFAULT_TCP_RELAY_THREADS;
+    }
+
+    // Get shared key precompute threads option
+    if (config_lookup_int(&cfg, NAME_PRECOMPUTE_THREADS, precompute_threads) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_PRECOMPUTE_THREADS);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_PRECOMPUTE_THREADS, DEFAULT_PRECOMPUTE_THREADS);
+        *precompute_threads = DEFAULT_PRECOMPUTE_THREADS;
+    }
+
+    if (*precompute_threads < 0 || *precompute_threads > MAX_PRECOMPUTE_THREADS) {
+        log_write(LOG_LEVEL_WARNING, "Invalid '%s': %d, must be between 0 and %d.\n", NAME_PRECOMPUTE_THREADS,
+                  *precompute_threads, MAX_PRECOMPUTE_THREADS);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_PRECOMPUTE_THREADS, DEFAULT_PRECOMPUTE_THREADS);
+        *precompute_threads = DEFAULT_PRECOMPUTE_THREADS;
+    }
+
+    // Get UDP batching options
+    if (config_lookup_int(&cfg, NAME_UDP_RECV_BATCH_SIZE, udp_recv_batch_size) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_UDP_RECV_BATCH_SIZE);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_UDP_RECV_BATCH_SIZE, DEFAULT_UDP_RECV_BATCH_SIZE);
+        *udp_recv_batch_size = DEFAULT_UDP_RECV_BATCH_SIZE;
+    }
+
+    if (*udp_recv_batch_size < 1 || *udp_recv_batch_size > MAX_RECV_BATCH_SIZE) {
+        log_write(LOG_LEVEL_WARNING, "Invalid '%s': %d, must be between 1 and %d.\n", NAME_UDP_RECV_BATCH_SIZE,
+                  *udp_recv_batch_size, MAX_RECV_BATCH_SIZE);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_UDP_RECV_BATCH_SIZE, DEFAULT_UDP_RECV_BATCH_SIZE);
+        *udp_recv_batch_size = DEFAULT_UDP_RECV_BATCH_SIZE;
+    }
+
+    if (config_lookup_int(&cfg, NAME_UDP_SEND_QUEUE_SIZE, udp_send_queue_size) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_UDP_SEND_QUEUE_SIZE);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_UDP_SEND_QUEUE_SIZE, DEFAULT_UDP_SEND_QUEUE_SIZE);
+        *udp_send_queue_size = DEFAULT_UDP_SEND_QUEUE_SIZE;
+    }
+
+    if (*udp_send_queue_size < 0 || *udp_send_queue_size > MAX_SEND_QUEUE_SIZE) {
+        log_write(LOG_LEVEL_WARNING, "Invalid '%s': %d, must be between 0 and %d.\n", NAME_UDP_SEND_QUEUE_SIZE,
+                  *udp_send_queue_size, MAX_SEND_QUEUE_SIZE);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_UDP_SEND_QUEUE_SIZE, DEFAULT_UDP_SEND_QUEUE_SIZE);
+        *udp_send_queue_size = DEFAULT_UDP_SEND_QUEUE_SIZE;
+    }
+
     // Get MOTD option
     if (config_lookup_bool(&cfg, NAME_ENABLE_MOTD, enable_motd) == CONFIG_FALSE) {
         log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_ENABLE_MOTD);
@@ -259,6 +335,28 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         (*motd)[motd_length - 1] = '\0';
     }
 
+    // Get stats socket option
+    if (config_lookup_bool(&cfg, NAME_ENABLE_STATS, enable_stats) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_ENABLE_STATS);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %s\n", NAME_ENABLE_STATS,
+                  DEFAULT_ENABLE_STATS ? "true" : "false");
+        *enable_stats = DEFAULT_ENABLE_STATS;
+    }
+
+    if (*enable_stats) {
+        // Get stats socket location
+        const char *tmp_stats_socket;
+
+        if (config_lookup_string(&cfg, NAME_STATS_SOCKET_PATH, &tmp_stats_socket) == CONFIG_FALSE) {
+            log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_STATS_SOCKET_PATH);
+            log_write(LOG_LEVEL_WARNING, "Using default '%s': %s\n", NAME_STATS_SOCKET_PATH, DEFAULT_STATS_SOCKET_PATH);
+            tmp_stats_socket = DEFAULT_STATS_SOCKET_PATH;
+        }
+
+        *stats_socket_path = (char *)malloc(strlen(tmp_stats_socket) + 1);
+        strcpy(*stats_socket_path, tmp_stats_socket);
+    }
+
     config_destroy(&cfg);
 
     log_write(LOG_LEVEL_INFO, "Successfully read:\n");
@@ -283,14 +381,29 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
                 log_write(LOG_LEVEL_INFO, "Port #%d: %u\n", i, (*tcp_relay_ports)[i]);
             }
         }
+
+        log_write(LOG_LEVEL_INFO, "'%s': %s\n", NAME_ENABLE_TCP_RELAY_THREAD, *enable_tcp_relay_thread ? "true" : "false");
+
+        if (*enable_tcp_relay_thread) {
+            log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_TCP_RELAY_THREADS, *tcp_relay_threads);
+        }
     }
 
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_PRECOMPUTE_THREADS,   *precompute_threads);
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_UDP_RECV_BATCH_SIZE,  *udp_recv_batch_size);
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_UDP_SEND_QUEUE_SIZE,  *udp_send_queue_size);
     log_write(LOG_LEVEL_INFO, "'%s': %s\n", NAME_ENABLE_MOTD,          *enable_motd          ? "true" : "false");
 
     if (*enable_motd) {
         log_write(LOG_LEVEL_INFO, "'%s': %s\n", NAME_MOTD, *motd);
     }
 
+    log_write(LOG_LEVEL_INFO, "'%s': %s\n", NAME_ENABLE_STATS,         *enable_stats         ? "true" : "false");
+
+    if (*enable_stats) {
+        log_write(LOG_LEVEL_INFO, "'%s': %s\n", NAME_STATS_SOCKET_PATH, *stats_socket_path);
+    }
+
     return 1;
 }
 
@@ -32,14 +32,17 @@
  *
  * Important: You are responsible for freeing `pid_file_path` and `keys_file_path`
  *            also, iff `tcp_relay_ports_count` > 0, then you are responsible for freeing `tcp_relay_ports`
- *            and also `motd` iff `enable_motd` is set.
+ *            and also `motd` iff `enable_motd` is set, and `stats_socket_path` iff `enable_stats` is set.
  *
  * @return 1 on success,
  *         0 on failure, doesn't modify any data pointed by arguments.
  */
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
                        int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay,
-                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd);
+                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_tcp_relay_thread,
+                       int *tcp_relay_threads, int *precompute_threads, int *udp_recv_batch_size,
+                       int *udp_send_queue_size, int *enable_motd, char **motd, int *enable_stats,
+                       char **stats_socket_path);
 
 /**
  * Bootstraps off nodes listed in the config file.
@@ -27,16 +27,23 @@
 
 #include "global.h"
 
-#define DEFAULT_PID_FILE_PATH         "tox-bootstrapd.pid"
-#define DEFAULT_KEYS_FILE_PATH        "tox-bootstrapd.keys"
-#define DEFAULT_PORT                  33445
-#define DEFAULT_ENABLE_IPV6           1 // 1 - true, 0 - false
-#define DEFAULT_ENABLE_IPV4_FALLBACK  1 // 1 - true, 0 - false
-#define DEFAULT_ENABLE_LAN_DISCOVERY  1 // 1 - true, 0 - false
-#define DEFAULT_ENABLE_TCP_RELAY      1 // 1 - true, 0 - false
-#define DEFAULT_TCP_RELAY_PORTS       443, 3389, 33445 // comma-separated list of ports. make sure to adjust DEFAULT_TCP_RELAY_PORTS_COUNT accordingly
-#define DEFAULT_TCP_RELAY_PORTS_COUNT 3
-#define DEFAULT_ENABLE_MOTD           1 // 1 - true, 0 - false
-#define DEFAULT_MOTD                  DAEMON_NAME
+#define DEFAULT_PID_FILE_PATH           "tox-bootstrapd.pid"
+#define DEFAULT_KEYS_FILE_PATH          "tox-bootstrapd.keys"
+#define DEFAULT_PORT                    33445
+#define DEFAULT_ENABLE_IPV6             1 // 1 - true, 0 - false
+#define DEFAULT_ENABLE_IPV4_FALLBACK    1 // 1 - true, 0 - false
+#define DEFAULT_ENABLE_LAN_DISCOVERY    1 // 1 - true, 0 - false
+#define DEFAULT_ENABLE_TCP_RELAY        1 // 1 - true, 0 - false
+#define DEFAULT_TCP_RELAY_PORTS         443, 3389, 33445 // comma-separated list of ports. make sure to adjust DEFAULT_TCP_RELAY_PORTS_COUNT accordingly
+#define DEFAULT_TCP_RELAY_PORTS_COUNT   3
+#define DEFAULT_ENABLE_TCP_RELAY_THREAD 0 // 1 - true, 0 - false
+#define DEFAULT_TCP_RELAY_THREADS       1
+#define DEFAULT_PRECOMPUTE_THREADS      0
+#define DEFAULT_UDP_RECV_BATCH_SIZE     1
+#define DEFAULT_UDP_SEND_QUEUE_SIZE     0
+#define DEFAULT_ENABLE_MOTD             1 // 1 - true, 0 - false
+#define DEFAULT_MOTD                    DAEMON_NAME
+#define DEFAULT_ENABLE_STATS            0 // 1 - true, 0 - false
+#define DEFAULT_STATS_SOCKET_PATH       "tox-bootstrapd.sock"
 
 #endif // C_TOXCORE_OTHER_BOOTSTRAP_DAEMON_SRC_CONFIG_DEFAULTS_H
@@ -0,0 +1,306 @@
+/*
+ * Tox DHT bootstrap daemon.
+ * Stats socket reporting the counters of the node.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
+#include "stats.h"
+
+// system provided
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// C
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+// Room for the fixed counters and all four counters of every packet type.
+#define STATS_BUFFER_SIZE (64 * 1024)
+
+typedef struct Stats_Buffer {
+    char *data;
+    size_t length;
+} Stats_Buffer;
+
+// Appends a line to the buffer. Lines that don't fit are left out.
+
+static void stats_printf(Stats_Buffer *buffer, const char *format, ...) GNU_PRINTF(2, 3);
+static void stats_printf(Stats_Buffer *buffer, const char *format, ...)
+{
+    const size_t space = STATS_BUFFER_SIZE - buffer->length;
+    va_list args;
+    va_start(args, format);
+    const int length = vsnprintf(buffer->data + buffer->length, space, format, args);
+    va_end(args);
+
+    if (length > 0 && (size_t)length < space) {
+        buffer->length += length;
+    } else {
+        buffer->data[buffer->length] = '\0';
+    }
+}
+
+static void print_counter(Stats_Buffer *buffer, const char *name, uint64_t value)
+{
+    stats_printf(buffer, "%s %llu\n", name, (unsigned long long)value);
+}
+
+static void print_shared_keys_stats(Stats_Buffer *buffer, const char *name, const Shared_Keys_Stats *stats)
+{
+    stats_printf(buffer, "%s.hits %llu\n", name, (unsigned long long)stats->hits);
+    stats_printf(buffer, "%s.misses %llu\n", name, (unsigned long long)stats->misses);
+    stats_printf(buffer, "%s.evictions %llu\n", name, (unsigned long long)stats->evictions);
+}
+
+static void print_udp_stats(Stats_Buffer *buffer, const Networking_Core *net)
+{
+    Net_Packet_Stats packets[256];
+
+    if (!networking_get_stats(net, packets)) {
+        return;
+    }
+
+    Net_Packet_Stats total = {0};
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        total.packets_recv += packets[i].packets_recv;
+        total.bytes_recv += packets[i].bytes_recv;
+        total.packets_sent += packets[i].packets_sent;
+        total.bytes_sent += packets[i].bytes_sent;
+    }
+
+    print_counter(buffer, "udp.packets_recv", total.packets_recv);
+    print_counter(buffer, "udp.bytes_recv", total.bytes_recv);
+    print_counter(buffer, "udp.packets_sent", total.packets_sent);
+    print_counter(buffer, "udp.bytes_sent", total.bytes_sent);
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        const Net_Packet_Stats *const p = &packets[i];
+
+        if (p->packets_recv == 0 && p->packets_sent == 0) {
+            continue;
+        }
+
+        stats_printf(buffer, "udp.%u.packets_recv %llu\n", i, (unsigned long long)p->packets_recv);
+        stats_printf(buffer, "udp.%u.bytes_recv %llu\n", i, (unsigned long long)p->bytes_recv);
+        stats_printf(buffer, "udp.%u.packets_sent %llu\n", i, (unsigned long long)p->packets_sent);
+        stats_printf(buffer, "udp.%u.bytes_sent %llu\n", i, (unsigned long long)p->bytes_sent);
+    }
+}
+
+static const char *tcp_packet_name(uint32_t type)
+{
+    switch (type) {
+        case TCP_PACKET_ROUTING_REQUEST:
+            return "routing_request";
+
+        case TCP_PACKET_ROUTING_RESPONSE:
+            return "routing_response";
+
+        case TCP_PACKET_CONNECTION_NOTIFICATION:
+            return "connection_notification";
+
+        case TCP_PACKET_DISCONNECT_NOTIFICATION:
+            return "disconnect_notification";
+
+        case TCP_PACKET_PING:
+            return "ping";
+
+        case TCP_PACKET_PONG:
+            return "pong";
+
+        case TCP_PACKET_OOB_SEND:
+            return "oob_send";
+
+        case TCP_PACKET_OOB_RECV:
+            return "oob_recv";
+
+        case TCP_PACKET_ONION_REQUEST:
+            return "onion_request";
+
+        case TCP_PACKET_ONION_RESPONSE:
+            return "onion_response";
+
+        case TCP_STATS_PACKET_DATA:
+            return "data";
+    }
+
+    return nullptr;
+}
+
+static void print_tcp_packet_stats(Stats_Buffer *buffer, const TCP_Server_Stats *stats)
+{
+    for (uint32_t i = 0; i < TCP_STATS_PACKET_TYPES; ++i) {
+        const TCP_Packet_Stats *const p = &stats->packets[i];
+
+        if (p->packets_recv == 0 && p->packets_sent == 0) {
+            continue;
+        }
+
+        // Packet ids the relay doesn't know are listed by number.
+        char name[32];
+        const char *const known = tcp_packet_name(i);
+
+        if (known != nullptr) {
+            snprintf(name, sizeof(name), "%s", known);
+        } else {
+            snprintf(name, sizeof(name), "%u", i);
+        }
+
+        stats_printf(buffer, "tcp.%s.packets_recv %llu\n", name, (unsigned long long)p->packets_recv);
+        stats_printf(buffer, "tcp.%s.bytes_recv %llu\n", name, (unsigned long long)p->bytes_recv);
+        stats_printf(buffer, "tcp.%s.packets_sent %llu\n", name, (unsigned long long)p->packets_sent);
+        stats_printf(buffer, "tcp.%s.bytes_sent %llu\n", name, (unsigned long long)p->bytes_sent);
+    }
+}
+
+static void print_stats(Stats_Buffer *buffer, const Stats_Sources *sources)
+{
+    print_counter(buffer, "uptime", mono_time_get(sources->mono_time) - sources->start_time);
+
+    print_udp_stats(buffer, dht_get_net(sources->dht));
+
+    DHT_Stats dht_stats;
+    Shared_Keys_Stats keys_recv;
+    Shared_Keys_Stats keys_sent;
+    dht_get_stats(sources->dht, &dht_stats);
+    dht_get_shared_keys_stats(sources->dht, &keys_recv, &keys_sent);
+    print_counter(buffer, "dht.close_nodes", dht_stats.close_nodes);
+    print_counter(buffer, "dht.friends", dht_stats.friends);
+    print_counter(buffer, "dht.parked_packets", dht_stats.parked_packets);
+    print_counter(buffer, "dht.dropped_packets", dht_stats.dropped_packets);
+    print_shared_keys_stats(buffer, "dht.shared_keys_recv", &keys_recv);
+    print_shared_keys_stats(buffer, "dht.shared_keys_sent", &keys_sent);
+
+    Onion_Stats onion_stats;
+    Shared_Keys_Stats onion_keys[3];
+    onion_get_stats(sources->onion, &onion_stats);
+    onion_get_shared_keys_stats(sources->onion, onion_keys);
+    print_counter(buffer, "onion.relayed_requests", onion_stats.relayed_requests);
+    print_counter(buffer, "onion.relayed_responses", onion_stats.relayed_responses);
+    print_shared_keys_stats(buffer, "onion.shared_keys_1", &onion_keys[0]);
+    print_shared_keys_stats(buffer, "onion.shared_keys_2", &onion_keys[1]);
+    print_shared_keys_stats(buffer, "onion.shared_keys_3", &onion_keys[2]);
+
+    Shared_Keys_Stats announce_keys;
+    onion_announce_get_shared_keys_stats(sources->onion_a, &announce_keys);
+    print_counter(buffer, "onion_announce.entries", onion_announce_num_entries(sources->onion_a));
+    print_counter(buffer, "onion_announce.max_entries", ONION_ANNOUNCE_MAX_ENTRIES);
+    print_shared_keys_stats(buffer, "onion_announce.shared_keys", &announce_keys);
+
+    if (sources->tcp_server == nullptr) {
+        return;
+    }
+
+    TCP_Server_Stats tcp_stats;
+    tcp_server_get_stats(sources->tcp_server, &tcp_stats);
+    print_counter(buffer, "tcp.incoming_connections", tcp_stats.incoming_connections);
+    print_counter(buffer, "tcp.unconfirmed_connections", tcp_stats.unconfirmed_connections);
+    print_counter(buffer, "tcp.connections", tcp_stats.connections);
+    print_counter(buffer, "tcp.handshake_failures", tcp_stats.handshake_failures);
+    print_counter(buffer, "tcp.queued_bytes", tcp_stats.queued_bytes);
+    print_counter(buffer, "tcp.dropped_packets", tcp_stats.dropped_packets);
+    print_counter(buffer, "tcp.slow_kills", tcp_stats.slow_kills);
+    print_tcp_packet_stats(buffer, &tcp_stats);
+}
+
+Socket stats_socket_open(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_write(LOG_LEVEL_ERROR, "Stats socket path is too long: %s\n", path);
+        return net_invalid_socket;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // Only remove a socket, in case path was mistakenly set to some other file.
+    struct stat st;
+
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    const Socket sock = {socket(AF_UNIX, SOCK_STREAM, 0)};
+
+    if (!sock_valid(sock)) {
+        return net_invalid_socket;
+    }
+
+    if (bind(sock.socket, (const struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock.socket, 8) != 0
+            || !set_socket_nonblock(sock)) {
+        kill_sock(sock);
+        return net_invalid_socket;
+    }
+
+    return sock;
+}
+
+void stats_socket_handle(Socket sock, const Stats_Sources *sources)
+{
+    Stats_Buffer buffer = {nullptr};
+
+    while (1) {
+        const Socket client = net_accept(sock);
+
+        if (!sock_valid(client)) {
+            break;
+        }
+
+        // The report is only put together once for all waiting clients.
+        if (buffer.data == nullptr) {
+            buffer.data = (char *)malloc(STATS_BUFFER_SIZE);
+
+            if (buffer.data == nullptr) {
+                kill_sock(client);
+                break;
+            }
+
+            buffer.data[0] = '\0';
+            print_stats(&buffer, sources);
+        }
+
+        // A send buffer as large as the report lets it go out in one call
+        // without blocking the daemon on a client that doesn't read.
+        const int size = STATS_BUFFER_SIZE;
+        setsockopt(client.socket, SOL_SOCKET, SO_SNDBUF, (const char *)&size, sizeof(size));
+
+        if (set_socket_nonblock(client) && set_socket_nosigpipe(client)) {
+            net_send(client, buffer.data, buffer.length);
+        }
+
+        kill_sock(client);
+    }
+
+    free(buffer.data);
+}
@@ -0,0 +1,59 @@
+/*
+ * Tox DHT bootstrap daemon.
+ * Stats socket reporting the counters of the node.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_OTHER_BOOTSTRAP_DAEMON_SRC_STATS_H
+#define C_TOXCORE_OTHER_BOOTSTRAP_DAEMON_SRC_STATS_H
+
+#include "../../../toxcore/DHT.h"
+#include "../../../toxcore/TCP_server.h"
+#include "../../../toxcore/onion.h"
+#include "../../../toxcore/onion_announce.h"
+
+// The parts of the node whose counters are reported. tcp_server may be NULL.
+typedef struct Stats_Sources {
+    const Mono_Time *mono_time;
+    uint64_t start_time;
+    const DHT *dht;
+    const Onion *onion;
+    const Onion_Announce *onion_a;
+    const TCP_Server *tcp_server;
+} Stats_Sources;
+
+/**
+ * Opens a Unix stream socket listening at path. A socket left at path by an
+ * earlier run is replaced.
+ * @return the listening socket, or net_invalid_socket on failure.
+ */
+Socket stats_socket_open(const char *path);
+
+/**
+ * Sends the counters of the node to every client waiting on the stats
+ * socket and disconnects them. Each counter is a line with its name and value
+ * separated by a space. The per packet type counters of the UDP socket and
+ * the TCP relay are only listed for packet types that were seen.
+ *
+ * Clients that don't take the whole report at once get a truncated one.
+ */
+void stats_socket_handle(Socket sock, const Stats_Sources *sources);
+
+#endif // C_TOXCORE_OTHER_BOOTSTRAP_DAEMON_SRC_STATS_H
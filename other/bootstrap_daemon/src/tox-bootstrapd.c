@@ -27,6 +27,8 @@
 #endif
 
 // system provided
+#include <poll.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -51,10 +53,110 @@
 #include "config.h"
 #include "global.h"
 #include "log.h"
+#include "stats.h"
 
 
 #define SLEEP_MILLISECONDS(MS) usleep(1000*MS)
 
+// Longest time onion requests from the TCP relay threads may wait for the main
+// thread when it can't wait on the request mailboxes, which needs epoll.
+// Responses wake the relay threads up as soon as they are queued.
+#define MAILBOX_WAIT_MILLISECONDS 30
+
+// Sleep time while TCP relay clients have data we couldn't send yet.
+#define PENDING_DATA_WAIT_MILLISECONDS 30
+
+// Sleep time while DHT packets wait for the precompute threads.
+#define PARKED_PACKETS_WAIT_MILLISECONDS 5
+
+typedef struct Event_Loop {
+    struct pollfd *fds;
+    Socket *socks;
+    uint32_t size;
+} Event_Loop;
+
+// Returns milliseconds until toxcore timers may next expire. Timers have a
+// resolution of one second, so nothing can become due before the monotonic
+// clock reaches the next full second.
+
+static int next_timer_timeout(Mono_Time *mono_time)
+{
+    return 1000 - (int)(current_time_monotonic(mono_time) % 1000);
+}
+
+// Blocks until the UDP socket, the stats socket or one of the TCP relay sockets
+// becomes readable, until onion_tcp_server queues onion requests, or until
+// timeout_ms passes. Any of net, tcp_server and onion_tcp_server may be NULL,
+// and stats_sock may be invalid.
+
+static void wait_for_events(Event_Loop *loop, const Networking_Core *net, Socket stats_sock,
+                            const TCP_Server *tcp_server, const TCP_Server *onion_tcp_server, int timeout_ms)
+{
+    uint32_t count = 0;
+
+    while (1) {
+        count = 0;
+
+        if (net != nullptr && sock_valid(net_udp_socket(net))) {
+            if (loop->size > 0) {
+                loop->socks[0] = net_udp_socket(net);
+            }
+
+            count = 1;
+        }
+
+        if (sock_valid(stats_sock)) {
+            if (loop->size > count) {
+                loop->socks[count] = stats_sock;
+            }
+
+            ++count;
+        }
+
+        if (tcp_server != nullptr) {
+            const uint32_t max_socks = loop->size > count ? loop->size - count : 0;
+            count += tcp_server_wait_sockets(tcp_server, loop->socks + count, max_socks);
+        }
+
+        if (onion_tcp_server != nullptr) {
+            const uint32_t max_socks = loop->size > count ? loop->size - count : 0;
+            count += tcp_server_onion_wait_sockets(onion_tcp_server, loop->socks + count, max_socks);
+        }
+
+        if (count <= loop->size) {
+            break;
+        }
+
+        const uint32_t new_size = count * 2;
+        struct pollfd *fds = (struct pollfd *)realloc(loop->fds, new_size * sizeof(struct pollfd));
+
+        if (fds == nullptr) {
+            SLEEP_MILLISECONDS(timeout_ms);
+            return;
+        }
+
+        loop->fds = fds;
+
+        Socket *socks = (Socket *)realloc(loop->socks, new_size * sizeof(Socket));
+
+        if (socks == nullptr) {
+            SLEEP_MILLISECONDS(timeout_ms);
+            return;
+        }
+
+        loop->socks = socks;
+        loop->size = new_size;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        loop->fds[i].fd = loop->socks[i].socket;
+        loop->fds[i].events = POLLIN;
+        loop->fds[i].revents = 0;
+    }
+
+    poll(loop->fds, count, timeout_ms);
+}
+
 // Uses the already existing key or creates one if it didn't exist
 //
 // returns 1 on success
@@ -178,6 +280,40 @@ static void daemonize(LOG_BACKEND log_backend, char *pid_file_path)
     }
 }
 
+// Runs the TCP relay, or one shard of it, on its own thread when
+// enable_tcp_relay_thread is set. Onion packets are exchanged with the main
+// thread through the TCP server's onion mailbox, so the threads never touch
+// each other's state.
+
+static void *tcp_relay_thread(void *arg)
+{
+    TCP_Server *tcp_server = (TCP_Server *)arg;
+    Mono_Time *const mono_time = mono_time_new();
+
+    if (mono_time == nullptr) {
+        log_write(LOG_LEVEL_ERROR, "Couldn't initialize monotonic timer for TCP relay thread. Exiting.\n");
+        exit(1);
+    }
+
+    Event_Loop loop = {nullptr};
+
+    while (1) {
+        mono_time_update(mono_time);
+
+        do_TCP_server(tcp_server, mono_time);
+
+        int timeout_ms = next_timer_timeout(mono_time);
+
+        if (tcp_server_has_pending_data(tcp_server)) {
+            timeout_ms = min_s32(timeout_ms, PENDING_DATA_WAIT_MILLISECONDS);
+        }
+
+        wait_for_events(&loop, nullptr, net_invalid_socket, tcp_server, nullptr, timeout_ms);
+    }
+
+    return nullptr;
+}
+
 // Logs toxcore logger message using our logger facility
 
 static void toxcore_logger_callback(void *context, Logger_Level level, const char *file, int line,
@@ -240,11 +376,20 @@ int main(int argc, char *argv[])
     int enable_tcp_relay;
     uint16_t *tcp_relay_ports;
     int tcp_relay_port_count;
+    int enable_tcp_relay_thread;
+    int tcp_relay_threads;
+    int precompute_threads;
+    int udp_recv_batch_size;
+    int udp_send_queue_size;
     int enable_motd;
     char *motd;
+    int enable_stats;
+    char *stats_socket_path;
 
     if (get_general_config(cfg_file_path, &pid_file_path, &keys_file_path, &port, &enable_ipv6, &enable_ipv4_fallback,
-                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd)) {
+                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count,
+                           &enable_tcp_relay_thread, &tcp_relay_threads, &precompute_threads, &udp_recv_batch_size,
+                           &udp_send_queue_size, &enable_motd, &motd, &enable_stats, &stats_socket_path)) {
         log_write(LOG_LEVEL_INFO, "General config read successfully\n");
     } else {
         log_write(LOG_LEVEL_ERROR, "Couldn't read config file: %s. Exiting.\n", cfg_file_path);
@@ -293,6 +438,14 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (!networking_set_recv_batch_size(net, udp_recv_batch_size)
+            || !networking_set_send_queue_size(net, udp_send_queue_size)) {
+        log_write(LOG_LEVEL_ERROR, "Couldn't allocate the UDP packet batches. Exiting.\n");
+        kill_networking(net);
+        logger_kill(logger);
+        return 1;
+    }
+
     Mono_Time *const mono_time = mono_time_new();
 
     if (mono_time == nullptr) {
@@ -346,6 +499,17 @@ int main(int argc, char *argv[])
 
     free(keys_file_path);
 
+    if (precompute_threads > 0) {
+        if (dht_set_precompute_threads(dht, precompute_threads)) {
+            log_write(LOG_LEVEL_INFO, "Started %d shared key precompute threads.\n", precompute_threads);
+        } else {
+            log_write(LOG_LEVEL_ERROR, "Couldn't start shared key precompute threads. Exiting.\n");
+            mono_time_free(mono_time);
+            logger_kill(logger);
+            return 1;
+        }
+    }
+
     TCP_Server *tcp_server = nullptr;
 
     if (enable_tcp_relay) {
@@ -369,6 +533,49 @@ int main(int argc, char *argv[])
             logger_kill(logger);
             return 1;
         }
+
+        if (enable_tcp_relay_thread) {
+            if (!tcp_server_enable_onion_mailbox(tcp_server) || !tcp_server_set_shards(tcp_server, tcp_relay_threads)) {
+                log_write(LOG_LEVEL_ERROR, "Couldn't split the TCP relay between %d threads. Exiting.\n",
+                          tcp_relay_threads);
+                mono_time_free(mono_time);
+                logger_kill(logger);
+                return 1;
+            }
+
+            for (int i = 0; i < tcp_relay_threads; ++i) {
+                pthread_t thread;
+
+                if (pthread_create(&thread, nullptr, tcp_relay_thread, tcp_server_shard(tcp_server, i)) != 0) {
+                    log_write(LOG_LEVEL_ERROR, "Couldn't start TCP relay thread. Exiting.\n");
+                    mono_time_free(mono_time);
+                    logger_kill(logger);
+                    return 1;
+                }
+
+                pthread_detach(thread);
+            }
+
+            log_write(LOG_LEVEL_INFO, "Started %d TCP relay threads successfully.\n", tcp_relay_threads);
+        }
+    }
+
+    Socket stats_sock = net_invalid_socket;
+    const Stats_Sources stats_sources = {mono_time, mono_time_get(mono_time), dht, onion, onion_a, tcp_server};
+
+    if (enable_stats) {
+        stats_sock = stats_socket_open(stats_socket_path);
+
+        if (sock_valid(stats_sock) && networking_enable_stats(dht_get_net(dht))) {
+            log_write(LOG_LEVEL_INFO, "Opened stats socket %s successfully.\n", stats_socket_path);
+        } else {
+            log_write(LOG_LEVEL_ERROR, "Couldn't open stats socket %s. Exiting.\n", stats_socket_path);
+            mono_time_free(mono_time);
+            logger_kill(logger);
+            return 1;
+        }
+
+        free(stats_socket_path);
     }
 
     if (bootstrap_from_config(cfg_file_path, dht, enable_ipv6)) {
@@ -392,6 +599,8 @@ int main(int argc, char *argv[])
         log_write(LOG_LEVEL_INFO, "Initialized LAN discovery successfully.\n");
     }
 
+    Event_Loop loop = {nullptr};
+
     while (1) {
         mono_time_update(mono_time);
 
@@ -403,7 +612,11 @@ int main(int argc, char *argv[])
         }
 
         if (enable_tcp_relay) {
-            do_TCP_server(tcp_server, mono_time);
+            if (enable_tcp_relay_thread) {
+                tcp_server_do_onion(tcp_server);
+            } else {
+                do_TCP_server(tcp_server, mono_time);
+            }
         }
 
         networking_poll(dht_get_net(dht), nullptr);
@@ -413,6 +626,36 @@ int main(int argc, char *argv[])
             waiting_for_dht_connection = 0;
         }
 
-        SLEEP_MILLISECONDS(30);
+        networking_flush(dht_get_net(dht));
+
+        if (enable_stats) {
+            stats_socket_handle(stats_sock, &stats_sources);
+        }
+
+        int timeout_ms = next_timer_timeout(mono_time);
+        const TCP_Server *wait_tcp_server = nullptr;
+        const TCP_Server *onion_tcp_server = nullptr;
+
+        if (enable_tcp_relay) {
+            if (enable_tcp_relay_thread) {
+                onion_tcp_server = tcp_server;
+
+                if (tcp_server_onion_wait_sockets(tcp_server, nullptr, 0) == 0) {
+                    timeout_ms = min_s32(timeout_ms, MAILBOX_WAIT_MILLISECONDS);
+                }
+            } else {
+                wait_tcp_server = tcp_server;
+
+                if (tcp_server_has_pending_data(tcp_server)) {
+                    timeout_ms = min_s32(timeout_ms, PENDING_DATA_WAIT_MILLISECONDS);
+                }
+            }
+        }
+
+        if (dht_has_parked_packets(dht)) {
+            timeout_ms = min_s32(timeout_ms, PARKED_PACKETS_WAIT_MILLISECONDS);
+        }
+
+        wait_for_events(&loop, dht_get_net(dht), stats_sock, wait_tcp_server, onion_tcp_server, timeout_ms);
     }
 }
@@ -0,0 +1,133 @@
+/* Crypto connection lookup benchmark
+ *
+ * Creates a growing number of crypto connections, each with its own public
+ * key and direct IPv4 address, and measures the two lookups on the hot path:
+ * finding a connection by the real public key of the peer (every handshake and
+ * every new_crypto_connection() call) and by the source address of a UDP packet
+ * (every inbound data packet). The packets are sent to connections that are
+ * still requesting a cookie, so they are dropped right after the lookup.
+ *
+ * Usage: crypto_lookup_bench [MAX_CONNECTIONS [LOOKUPS]]
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../toxcore/mono_time.h"
+#include "../toxcore/net_crypto.h"
+
+#define DEFAULT_MAX_CONNECTIONS 50000
+#define DEFAULT_LOOKUPS 200000
+
+/* Public, non-LAN address of connection i. */
+static IP_Port connection_ip_port(uint32_t i)
+{
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, false);
+    ip_port.ip.ip.v4.uint8[0] = 1;
+    ip_port.ip.ip.v4.uint8[1] = (uint8_t)(i >> 16);
+    ip_port.ip.ip.v4.uint8[2] = (uint8_t)(i >> 8);
+    ip_port.ip.ip.v4.uint8[3] = (uint8_t)i;
+    ip_port.port = net_htons(33445);
+    return ip_port;
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t max_connections = argc > 1 ? strtoul(argv[1], nullptr, 10) : DEFAULT_MAX_CONNECTIONS;
+    const uint32_t num_lookups = argc > 2 ? strtoul(argv[2], nullptr, 10) : DEFAULT_LOOKUPS;
+
+    if (max_connections == 0 || max_connections > (1 << 24) || num_lookups == 0) {
+        printf("Usage: %s [MAX_CONNECTIONS [LOOKUPS]]\n", argv[0]);
+        return 1;
+    }
+
+    Logger *log = logger_new();
+    Mono_Time *mono_time = mono_time_new();
+    IP ip;
+    ip_init(&ip, false);
+    Networking_Core *net = new_networking(log, ip, 33445);
+    DHT *dht = net != nullptr ? new_dht(log, mono_time, net, true) : nullptr;
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
+    Net_Crypto *c = dht != nullptr ? new_net_crypto(log, mono_time, dht, &proxy_info) : nullptr;
+    uint8_t *public_keys = (uint8_t *)malloc((size_t)max_connections * CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (c == nullptr || public_keys == nullptr) {
+        printf("Failed to set up Net_Crypto.\n");
+        return 1;
+    }
+
+    random_bytes(public_keys, (size_t)max_connections * CRYPTO_PUBLIC_KEY_SIZE);
+
+    uint8_t packet[128] = {NET_PACKET_CRYPTO_DATA};
+    uint32_t num_connections = 0;
+
+    for (uint32_t target = 10; num_connections < max_connections; target *= 10) {
+        if (target > max_connections) {
+            target = max_connections;
+        }
+
+        for (; num_connections < target; ++num_connections) {
+            const uint8_t *public_key = public_keys + (size_t)num_connections * CRYPTO_PUBLIC_KEY_SIZE;
+            const int id = new_crypto_connection(c, public_key, public_key);
+
+            if (id == -1 || set_direct_ip_port(c, id, connection_ip_port(num_connections), false) != 0) {
+                printf("Failed to create connection %u.\n", num_connections);
+                return 1;
+            }
+        }
+
+        uint64_t start = current_time_monotonic(mono_time);
+
+        for (uint32_t i = 0; i < num_lookups; ++i) {
+            const uint32_t n = random_u32() % num_connections;
+            new_crypto_connection(c, public_keys + (size_t)n * CRYPTO_PUBLIC_KEY_SIZE, nullptr);
+        }
+
+        const uint64_t pk_time = current_time_monotonic(mono_time) - start;
+        start = current_time_monotonic(mono_time);
+
+        for (uint32_t i = 0; i < num_lookups; ++i) {
+            const uint32_t n = random_u32() % num_connections;
+            networking_handle_packet(net, connection_ip_port(n), packet, sizeof(packet), nullptr);
+        }
+
+        const uint64_t ip_port_time = current_time_monotonic(mono_time) - start;
+
+        printf("%6u connections: %7.3f us/public key lookup, %7.3f us/packet\n", num_connections,
+               1000.0 * pk_time / num_lookups, 1000.0 * ip_port_time / num_lookups);
+    }
+
+    for (uint32_t i = 0; i < num_connections; ++i) {
+        crypto_kill(c, i);
+    }
+
+    kill_net_crypto(c);
+    kill_dht(dht);
+    kill_networking(net);
+    mono_time_free(mono_time);
+    logger_kill(log);
+    free(public_keys);
+
+    return 0;
+}
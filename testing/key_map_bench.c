@@ -0,0 +1,199 @@
+/* Public key lookup structure benchmark
+ *
+ * Compares Key_Map with the BS_List it replaces for public keys, at sizes
+ * from 1000 keys up to MAX_KEYS in steps of 10x. For each size it prints the
+ * time per lookup of a present key, per lookup of a missing key, and per
+ * churn operation, which removes one key and adds a new one.
+ *
+ * The BS_List is filled with sorted keys, so that filling it doesn't take
+ * quadratic time, but every churn operation still moves half of it on
+ * average. CHURN_OPS bounds how many of those are timed.
+ *
+ * Usage: key_map_bench [MAX_KEYS [CHURN_OPS]]
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/ccompat.h"
+#include "../toxcore/key_map.h"
+#include "../toxcore/list.h"
+
+#define DEFAULT_MAX_KEYS 1000000
+#define DEFAULT_CHURN_OPS 1000
+
+/* Lookups timed per size. */
+#define LOOKUPS 1000000
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+    return memcmp(a, b, KEY_MAP_KEY_SIZE);
+}
+
+static const uint8_t *key_at(const uint8_t *keys, uint32_t i)
+{
+    return keys + (size_t)i * KEY_MAP_KEY_SIZE;
+}
+
+/* Sums the ids found, so that the lookups can't be optimised away. */
+static volatile int sink;
+
+static void bench_list(const uint8_t *keys, const uint8_t *sorted, const uint8_t *missing, uint32_t num_keys,
+                       uint32_t churn_ops)
+{
+    BS_List list;
+
+    if (!bs_list_init(&list, KEY_MAP_KEY_SIZE, num_keys + churn_ops)) {
+        printf("Out of memory.\n");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < num_keys; ++i) {
+        bs_list_add(&list, key_at(sorted, i), i);
+    }
+
+    int sum = 0;
+    uint64_t start = now_ns();
+
+    for (uint32_t i = 0; i < LOOKUPS; ++i) {
+        sum += bs_list_find(&list, key_at(keys, i % num_keys));
+    }
+
+    const double hit = (double)(now_ns() - start) / LOOKUPS;
+    start = now_ns();
+
+    for (uint32_t i = 0; i < LOOKUPS; ++i) {
+        sum += bs_list_find(&list, key_at(missing, i % churn_ops));
+    }
+
+    const double miss = (double)(now_ns() - start) / LOOKUPS;
+    start = now_ns();
+
+    /* The ids of the sorted keys are their sorted positions. */
+    for (uint32_t i = 0; i < churn_ops; ++i) {
+        const uint32_t old = i * (num_keys / churn_ops);
+        bs_list_remove(&list, key_at(sorted, old), old);
+        bs_list_add(&list, key_at(missing, i), num_keys + i);
+    }
+
+    const double churn = (double)(now_ns() - start) / churn_ops;
+    sink = sum;
+
+    printf("%8u keys  BS_List  %8.1f ns/hit  %8.1f ns/miss  %10.1f ns/churn\n", num_keys, hit, miss, churn);
+    bs_list_free(&list);
+}
+
+static void bench_map(const uint8_t *keys, const uint8_t *missing, uint32_t num_keys, uint32_t churn_ops)
+{
+    Key_Map map;
+
+    if (!key_map_init(&map, 0)) {
+        printf("Out of memory.\n");
+        exit(1);
+    }
+
+    uint64_t start = now_ns();
+
+    for (uint32_t i = 0; i < num_keys; ++i) {
+        key_map_add(&map, key_at(keys, i), i);
+    }
+
+    const double add = (double)(now_ns() - start) / num_keys;
+    int sum = 0;
+    start = now_ns();
+
+    for (uint32_t i = 0; i < LOOKUPS; ++i) {
+        sum += key_map_find(&map, key_at(keys, i % num_keys));
+    }
+
+    const double hit = (double)(now_ns() - start) / LOOKUPS;
+    start = now_ns();
+
+    for (uint32_t i = 0; i < LOOKUPS; ++i) {
+        sum += key_map_find(&map, key_at(missing, i % churn_ops));
+    }
+
+    const double miss = (double)(now_ns() - start) / LOOKUPS;
+    start = now_ns();
+
+    for (uint32_t i = 0; i < churn_ops; ++i) {
+        const uint32_t old = i * (num_keys / churn_ops);
+        key_map_remove(&map, key_at(keys, old), old);
+        key_map_add(&map, key_at(missing, i), num_keys + i);
+    }
+
+    const double churn = (double)(now_ns() - start) / churn_ops;
+    sink = sum;
+
+    printf("%8u keys  Key_Map  %8.1f ns/hit  %8.1f ns/miss  %10.1f ns/churn  %6.1f ns/add\n", num_keys, hit, miss,
+           churn, add);
+    key_map_free(&map);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t max_keys = argc > 1 ? strtoul(argv[1], nullptr, 10) : DEFAULT_MAX_KEYS;
+    const uint32_t churn_ops = argc > 2 ? strtoul(argv[2], nullptr, 10) : DEFAULT_CHURN_OPS;
+
+    if (max_keys < 1000 || max_keys > 10000000 || churn_ops == 0 || churn_ops > 1000) {
+        printf("Usage: %s [MAX_KEYS [CHURN_OPS]]\n", argv[0]);
+        return 1;
+    }
+
+    uint8_t *keys = (uint8_t *)malloc((size_t)max_keys * KEY_MAP_KEY_SIZE);
+    uint8_t *sorted = (uint8_t *)malloc((size_t)max_keys * KEY_MAP_KEY_SIZE);
+    uint8_t *missing = (uint8_t *)malloc((size_t)churn_ops * KEY_MAP_KEY_SIZE);
+
+    if (keys == nullptr || sorted == nullptr || missing == nullptr) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+
+    random_bytes(keys, (size_t)max_keys * KEY_MAP_KEY_SIZE);
+    random_bytes(missing, (size_t)churn_ops * KEY_MAP_KEY_SIZE);
+
+    for (uint32_t num_keys = 1000; num_keys <= max_keys; num_keys *= 10) {
+        memcpy(sorted, keys, (size_t)num_keys * KEY_MAP_KEY_SIZE);
+        qsort(sorted, num_keys, KEY_MAP_KEY_SIZE, cmp_key);
+
+        bench_list(keys, sorted, missing, num_keys, churn_ops);
+        bench_map(keys, missing, num_keys, churn_ops);
+    }
+
+    free(missing);
+    free(sorted);
+    free(keys);
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+/* Lossless packet throughput benchmark
+ *
+ * Starts two Tox instances on localhost, makes them friends and pushes
+ * lossless custom packets of the largest size from one to the other as fast
+ * as the congestion control lets them through. Prints the throughput and the
+ * user and system CPU time used per MiB, which covers the whole receive path:
+ * decryption, reordering in the receive buffer and delivery to the client.
+ *
+ * Usage: lossless_throughput_bench [MIBIBYTES]
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "../toxcore/ccompat.h"
+#include "../toxcore/mono_time.h"
+#include "../toxcore/tox.h"
+#include "misc_tools.h"
+
+#define DEFAULT_MIBIBYTES 100
+
+/* First byte of the custom lossless packets, in the range tox reserves for them. */
+#define BENCH_PACKET_ID 160
+
+static uint64_t bytes_received;
+
+static void handle_lossless_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+                                   void *user_data)
+{
+    bytes_received += length;
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+           + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+static void iterate(Tox *sender, Tox *receiver)
+{
+    tox_iterate(sender, nullptr);
+    tox_iterate(receiver, nullptr);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint64_t mibibytes = argc > 1 ? strtoull(argv[1], nullptr, 10) : DEFAULT_MIBIBYTES;
+
+    if (mibibytes == 0) {
+        printf("Usage: %s [MIBIBYTES]\n", argv[0]);
+        return 1;
+    }
+
+    Tox *sender = tox_new_log(nullptr, nullptr, nullptr);
+    Tox *receiver = tox_new_log(nullptr, nullptr, nullptr);
+    Mono_Time *mono_time = mono_time_new();
+
+    if (sender == nullptr || receiver == nullptr || mono_time == nullptr) {
+        printf("Failed to create the Tox instances.\n");
+        return 1;
+    }
+
+    uint8_t sender_pk[TOX_PUBLIC_KEY_SIZE];
+    uint8_t receiver_pk[TOX_PUBLIC_KEY_SIZE];
+    uint8_t dht_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_public_key(sender, sender_pk);
+    tox_self_get_public_key(receiver, receiver_pk);
+    tox_self_get_dht_id(receiver, dht_key);
+
+    const uint32_t friend_number = tox_friend_add_norequest(sender, receiver_pk, nullptr);
+    tox_friend_add_norequest(receiver, sender_pk, nullptr);
+    tox_bootstrap(sender, "127.0.0.1", tox_self_get_udp_port(receiver, nullptr), dht_key, nullptr);
+    tox_callback_friend_lossless_packet(receiver, handle_lossless_packet);
+
+    while (tox_friend_get_connection_status(sender, friend_number, nullptr) != TOX_CONNECTION_UDP
+            || tox_friend_get_connection_status(receiver, 0, nullptr) != TOX_CONNECTION_UDP) {
+        iterate(sender, receiver);
+        c_sleep(tox_iteration_interval(sender));
+    }
+
+    uint8_t packet[TOX_MAX_CUSTOM_PACKET_SIZE];
+    memset(packet, 0x42, sizeof(packet));
+    packet[0] = BENCH_PACKET_ID;
+
+    const uint64_t total = mibibytes * 1024 * 1024;
+    uint64_t bytes_sent = 0;
+    const uint64_t start = current_time_monotonic(mono_time);
+    const double start_cpu = cpu_seconds();
+
+    while (bytes_received < total) {
+        while (bytes_sent < total
+                && tox_friend_send_lossless_packet(sender, friend_number, packet, sizeof(packet), nullptr)) {
+            bytes_sent += sizeof(packet);
+        }
+
+        iterate(sender, receiver);
+    }
+
+    const uint64_t elapsed = current_time_monotonic(mono_time) - start;
+    const double cpu = cpu_seconds() - start_cpu;
+    const double received_mib = bytes_received / (1024.0 * 1024.0);
+
+    printf("%.1f MiB in %lu ms: %.2f MiB/s, %.2f ms CPU/MiB\n", received_mib, (unsigned long)elapsed,
+           received_mib * 1000.0 / (elapsed > 0 ? elapsed : 1), cpu * 1000.0 / received_mib);
+
+    tox_kill(sender);
+    tox_kill(receiver);
+    mono_time_free(mono_time);
+
+    return 0;
+}
@@ -0,0 +1,164 @@
+/* Packet buffer allocator benchmark
+ *
+ * Simulates the send buffers of a few connections doing file transfers: each
+ * connection keeps a window of packets in flight, and every round a random
+ * part of the window is acknowledged and freed while new packets are queued.
+ * The packets are allocated with either plain malloc() or a Mem_Pool like the
+ * one net_crypto uses. Prints the time taken, the maximum resident set size
+ * and, in pool mode, the pool counters.
+ *
+ * Usage: packet_pool_bench malloc|pool [CONNECTIONS [ROUNDS]]
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "../toxcore/mono_time.h"
+#include "../toxcore/net_crypto.h"
+
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_ROUNDS 20000
+
+/* Packets in flight per connection. */
+#define WINDOW_SIZE 1024
+
+/* Same layout as a Packet_Data of MAX_CRYPTO_DATA_SIZE bytes in net_crypto.c. */
+typedef struct Bench_Packet {
+    uint64_t sent_time;
+    uint16_t length;
+    uint8_t data[MAX_CRYPTO_DATA_SIZE];
+} Bench_Packet;
+
+static Mem_Pool *pool;
+
+static Bench_Packet *packet_alloc(void)
+{
+    if (pool != nullptr) {
+        return (Bench_Packet *)mem_pool_alloc(pool);
+    }
+
+    return (Bench_Packet *)malloc(sizeof(Bench_Packet));
+}
+
+static void packet_free(Bench_Packet *packet)
+{
+    if (pool != nullptr) {
+        mem_pool_free(pool, packet);
+    } else {
+        free(packet);
+    }
+}
+
+static Bench_Packet *packet_new(uint64_t time)
+{
+    Bench_Packet *packet = packet_alloc();
+
+    if (packet == nullptr) {
+        return nullptr;
+    }
+
+    packet->sent_time = time;
+    packet->length = MAX_CRYPTO_DATA_SIZE;
+    /* Touch the whole block like a real packet copy would. */
+    memset(packet->data, (uint8_t)time, sizeof(packet->data));
+    return packet;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || (strcmp(argv[1], "malloc") != 0 && strcmp(argv[1], "pool") != 0)) {
+        printf("Usage: %s malloc|pool [CONNECTIONS [ROUNDS]]\n", argv[0]);
+        return 1;
+    }
+
+    const uint32_t num_connections = argc > 2 ? strtoul(argv[2], nullptr, 10) : DEFAULT_CONNECTIONS;
+    const uint32_t num_rounds = argc > 3 ? strtoul(argv[3], nullptr, 10) : DEFAULT_ROUNDS;
+
+    if (num_connections == 0 || num_rounds == 0) {
+        printf("Usage: %s malloc|pool [CONNECTIONS [ROUNDS]]\n", argv[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "pool") == 0) {
+        pool = mem_pool_new(sizeof(Bench_Packet), CRYPTO_PACKET_POOL_SIZE);
+    }
+
+    Bench_Packet **window = (Bench_Packet **)calloc((size_t)num_connections * WINDOW_SIZE, sizeof(Bench_Packet *));
+    Mono_Time *mono_time = mono_time_new();
+
+    if (window == nullptr || mono_time == nullptr || (strcmp(argv[1], "pool") == 0 && pool == nullptr)) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+
+    const uint64_t start = current_time_monotonic(mono_time);
+    uint64_t packets = 0;
+
+    for (uint32_t round = 0; round < num_rounds; ++round) {
+        Bench_Packet **conn = window + (size_t)(round % num_connections) * WINDOW_SIZE;
+
+        /* A burst of acks frees a random run of the window, then the freed
+         * slots are refilled with new packets. */
+        const uint32_t first = random_u32() % WINDOW_SIZE;
+        const uint32_t count = random_u32() % (WINDOW_SIZE / 4) + 1;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            Bench_Packet **slot = &conn[(first + i) % WINDOW_SIZE];
+            packet_free(*slot);
+            *slot = packet_new(round);
+
+            if (*slot == nullptr) {
+                printf("Out of memory.\n");
+                return 1;
+            }
+
+            ++packets;
+        }
+    }
+
+    const uint64_t elapsed = current_time_monotonic(mono_time) - start;
+
+    for (size_t i = 0; i < (size_t)num_connections * WINDOW_SIZE; ++i) {
+        packet_free(window[i]);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("%s: %lu packets in %lu ms, %.3f us/packet, max RSS %ld KiB\n", argv[1], (unsigned long)packets,
+           (unsigned long)elapsed, 1000.0 * elapsed / packets, usage.ru_maxrss);
+
+    if (pool != nullptr) {
+        Mem_Pool_Stats stats;
+        mem_pool_get_stats(pool, &stats);
+        printf("pool: %lu allocs, %lu reused, %lu released, peak %u in use, %u cached\n",
+               (unsigned long)stats.allocs, (unsigned long)stats.reused, (unsigned long)stats.released,
+               stats.peak_in_use, stats.cached);
+        mem_pool_kill(pool);
+    }
+
+    mono_time_free(mono_time);
+    free(window);
+
+    return 0;
+}
@@ -0,0 +1,206 @@
+/* Concurrent send benchmark
+ *
+ * Runs two Messenger instances that are friends over UDP on localhost. The
+ * main thread iterates both as fast as it can while a number of sender threads
+ * push lossy packets at a fixed rate, the way toxav sends audio and video
+ * frames from its own threads. Prints the average, 99th percentile and maximum
+ * time a send call took, which is the time a sender spent waiting for locks
+ * held by the iteration.
+ *
+ * Usage: send_contention_bench [THREADS [PACKETS_PER_THREAD]]
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/Messenger.h"
+#include "misc_tools.h"
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_PACKETS 5000
+
+/* Pause between two packets of a sender thread, in microseconds. */
+#define SEND_INTERVAL 1000
+
+#define PACKET_SIZE 1000
+
+typedef struct Sender {
+    pthread_t thread;
+    Messenger *m;
+    uint32_t num_packets;
+    uint64_t *latencies; /* in ns */
+    uint32_t failed;
+} Sender;
+
+static pthread_mutex_t senders_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t senders_done;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *sender_thread(void *arg)
+{
+    Sender *sender = (Sender *)arg;
+    uint8_t packet[PACKET_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = PACKET_ID_RANGE_LOSSY_AV_START;
+
+    for (uint32_t i = 0; i < sender->num_packets; ++i) {
+        const uint64_t start = now_ns();
+
+        if (m_send_custom_lossy_packet(sender->m, 0, packet, sizeof(packet)) != 0) {
+            ++sender->failed;
+        }
+
+        sender->latencies[i] = now_ns() - start;
+
+        const struct timespec pause = {0, SEND_INTERVAL * 1000};
+        nanosleep(&pause, nullptr);
+    }
+
+    pthread_mutex_lock(&senders_mutex);
+    ++senders_done;
+    pthread_mutex_unlock(&senders_mutex);
+    return nullptr;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void iterate(Mono_Time *mono_time, Messenger *m1, Messenger *m2)
+{
+    mono_time_update(mono_time);
+    do_messenger(m1, nullptr);
+    do_messenger(m2, nullptr);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t num_threads = argc > 1 ? strtoul(argv[1], nullptr, 10) : DEFAULT_THREADS;
+    const uint32_t num_packets = argc > 2 ? strtoul(argv[2], nullptr, 10) : DEFAULT_PACKETS;
+
+    if (num_threads == 0 || num_packets == 0) {
+        printf("Usage: %s [THREADS [PACKETS_PER_THREAD]]\n", argv[0]);
+        return 1;
+    }
+
+    Mono_Time *mono_time = mono_time_new();
+    Messenger_Options options = {0};
+    options.ipv6enabled = false;
+    options.port_range[0] = 33445;
+    options.port_range[1] = 33545;
+    Messenger *m1 = mono_time != nullptr ? new_messenger(mono_time, &options, nullptr) : nullptr;
+    Messenger *m2 = m1 != nullptr ? new_messenger(mono_time, &options, nullptr) : nullptr;
+
+    if (m2 == nullptr) {
+        printf("Failed to create the Messenger instances.\n");
+        return 1;
+    }
+
+    m_addfriend_norequest(m1, nc_get_self_public_key(m2->net_crypto));
+    m_addfriend_norequest(m2, nc_get_self_public_key(m1->net_crypto));
+
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, false);
+    ip_port.ip.ip.v4 = get_ip4_loopback();
+    ip_port.port = net_port(m2->net);
+    dht_bootstrap(m1->dht, ip_port, dht_get_self_public_key(m2->dht));
+
+    while (m_get_friend_connectionstatus(m1, 0) != CONNECTION_UDP
+            || m_get_friend_connectionstatus(m2, 0) != CONNECTION_UDP) {
+        iterate(mono_time, m1, m2);
+        c_sleep(20);
+    }
+
+    Sender *senders = (Sender *)calloc(num_threads, sizeof(Sender));
+
+    if (senders == nullptr) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        senders[i].m = m1;
+        senders[i].num_packets = num_packets;
+        senders[i].latencies = (uint64_t *)calloc(num_packets, sizeof(uint64_t));
+
+        if (senders[i].latencies == nullptr
+                || pthread_create(&senders[i].thread, nullptr, sender_thread, &senders[i]) != 0) {
+            printf("Failed to start sender thread %u.\n", i);
+            return 1;
+        }
+    }
+
+    uint32_t done = 0;
+
+    while (done < num_threads) {
+        iterate(mono_time, m1, m2);
+
+        pthread_mutex_lock(&senders_mutex);
+        done = senders_done;
+        pthread_mutex_unlock(&senders_mutex);
+    }
+
+    uint64_t *all = (uint64_t *)calloc((size_t)num_threads * num_packets, sizeof(uint64_t));
+    uint32_t failed = 0;
+
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        pthread_join(senders[i].thread, nullptr);
+        memcpy(all + (size_t)i * num_packets, senders[i].latencies, num_packets * sizeof(uint64_t));
+        failed += senders[i].failed;
+        free(senders[i].latencies);
+    }
+
+    const size_t total = (size_t)num_threads * num_packets;
+    qsort(all, total, sizeof(uint64_t), cmp_u64);
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < total; ++i) {
+        sum += all[i];
+    }
+
+    printf("%u threads, %lu sends (%u failed): avg %.1f us, p99 %.1f us, max %.1f us\n", num_threads,
+           (unsigned long)total, failed, sum / 1000.0 / total, all[total * 99 / 100] / 1000.0,
+           all[total - 1] / 1000.0);
+
+    free(all);
+    free(senders);
+    kill_messenger(m2);
+    kill_messenger(m1);
+    mono_time_free(mono_time);
+
+    return 0;
+}
@@ -0,0 +1,146 @@
+/* Shared key cache benchmark
+ *
+ * Replays a stream of DHT public keys drawn from a Zipf distribution, which
+ * is roughly what a busy public node sees: a few peers send most packets and
+ * a long tail of peers shows up once or twice. For a few cache capacities it
+ * prints the hit rate, the number of evictions and the average time per
+ * get_shared_key() call.
+ *
+ * Usage: shared_keys_bench [NUM_PEERS [NUM_LOOKUPS]]
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/mono_time.h"
+
+#define DEFAULT_NUM_PEERS 20000
+#define DEFAULT_NUM_LOOKUPS 200000
+
+/* Fill cdf with the cumulative Zipf distribution (exponent 1) over num_peers ranks. */
+static void zipf_cdf(double *cdf, uint32_t num_peers)
+{
+    double sum = 0;
+
+    for (uint32_t i = 0; i < num_peers; ++i) {
+        sum += 1.0 / (i + 1);
+        cdf[i] = sum;
+    }
+
+    for (uint32_t i = 0; i < num_peers; ++i) {
+        cdf[i] /= sum;
+    }
+}
+
+static uint32_t zipf_sample(const double *cdf, uint32_t num_peers)
+{
+    const double u = (double)random_u32() / UINT32_MAX;
+    uint32_t low = 0;
+    uint32_t high = num_peers - 1;
+
+    while (low < high) {
+        const uint32_t mid = low + (high - low) / 2;
+
+        if (cdf[mid] < u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+static void run(Mono_Time *mono_time, uint32_t capacity, const uint8_t *self_sk, const uint8_t *pks,
+                const uint32_t *trace, uint32_t num_lookups)
+{
+    Shared_Keys shared_keys = {nullptr};
+
+    if (!shared_keys_init(&shared_keys, capacity)) {
+        printf("capacity %u: allocation failed\n", capacity);
+        return;
+    }
+
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    const uint64_t start = current_time_monotonic(mono_time);
+
+    for (uint32_t i = 0; i < num_lookups; ++i) {
+        get_shared_key(mono_time, &shared_keys, shared_key, self_sk, pks + trace[i] * CRYPTO_PUBLIC_KEY_SIZE);
+    }
+
+    const uint64_t elapsed = current_time_monotonic(mono_time) - start;
+    const Shared_Keys_Stats *stats = &shared_keys.stats;
+
+    printf("capacity %7u: hit rate %5.1f%%, %8lu evictions, %7.3f us/lookup\n",
+           shared_keys.capacity, 100.0 * stats->hits / num_lookups, (unsigned long)stats->evictions,
+           1000.0 * elapsed / num_lookups);
+
+    shared_keys_free(&shared_keys);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t num_peers = argc > 1 ? strtoul(argv[1], nullptr, 10) : DEFAULT_NUM_PEERS;
+    const uint32_t num_lookups = argc > 2 ? strtoul(argv[2], nullptr, 10) : DEFAULT_NUM_LOOKUPS;
+
+    if (num_peers == 0 || num_lookups == 0) {
+        printf("Usage: %s [NUM_PEERS [NUM_LOOKUPS]]\n", argv[0]);
+        return 1;
+    }
+
+    uint8_t *pks = (uint8_t *)malloc((size_t)num_peers * CRYPTO_PUBLIC_KEY_SIZE);
+    double *cdf = (double *)malloc(num_peers * sizeof(double));
+    uint32_t *trace = (uint32_t *)malloc(num_lookups * sizeof(uint32_t));
+    Mono_Time *mono_time = mono_time_new();
+
+    if (pks == nullptr || cdf == nullptr || trace == nullptr || mono_time == nullptr) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+
+    uint8_t self_pk[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_sk[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_pk, self_sk);
+
+    /* Peer keys are random points, so random bytes hash the same way. */
+    random_bytes(pks, (size_t)num_peers * CRYPTO_PUBLIC_KEY_SIZE);
+
+    zipf_cdf(cdf, num_peers);
+
+    for (uint32_t i = 0; i < num_lookups; ++i) {
+        trace[i] = zipf_sample(cdf, num_peers);
+    }
+
+    printf("%u peers, %u lookups\n", num_peers, num_lookups);
+
+    for (uint32_t capacity = SHARED_KEYS_DEFAULT_CAPACITY; capacity <= 16 * SHARED_KEYS_DEFAULT_CAPACITY;
+            capacity *= 4) {
+        run(mono_time, capacity, self_sk, pks, trace, num_lookups);
+    }
+
+    mono_time_free(mono_time);
+    free(trace);
+    free(cdf);
+    free(pks);
+
+    return 0;
+}
@@ -0,0 +1,197 @@
+/* TCP relay connection churn benchmark
+ *
+ * Starts a local TCP relay and connects a population of clients to it. Then
+ * every round a batch of clients disconnects and is replaced by new clients
+ * with fresh keys, like during a reconnect storm. Prints the wall time spent
+ * in do_TCP_server() per replaced client, which covers dropping the old
+ * connection and accepting the new one.
+ *
+ * Every client uses two sockets in this process, so the population is bounded
+ * by the open file limit.
+ *
+ * Usage: tcp_churn_bench [CLIENTS [BATCH [ROUNDS]]]
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../toxcore/TCP_client.h"
+#include "../toxcore/TCP_server.h"
+#include "../toxcore/mono_time.h"
+#include "misc_tools.h"
+
+#define DEFAULT_CLIENTS 2000
+#define DEFAULT_BATCH 64
+#define DEFAULT_ROUNDS 100
+
+/* Below the usual range of ephemeral ports. */
+#define RELAY_PORT 20000
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static TCP_Client_Connection *new_client(const Mono_Time *mono_time, IP_Port ip_port, const uint8_t *relay_public_key)
+{
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(public_key, secret_key);
+    return new_TCP_connection(mono_time, ip_port, relay_public_key, public_key, secret_key, nullptr);
+}
+
+/* Run the relay and clients first to first + count until those clients are
+ * confirmed.
+ *
+ * return the wall time spent in do_TCP_server(), 0 on timeout.
+ */
+static uint64_t connect_clients(TCP_Server *relay, Mono_Time *mono_time, TCP_Client_Connection **clients,
+                                uint32_t first, uint32_t count)
+{
+    uint64_t relay_time = 0;
+    const uint64_t start = current_time_monotonic(mono_time);
+    uint32_t confirmed = 0;
+
+    while (confirmed < count) {
+        mono_time_update(mono_time);
+
+        const uint64_t relay_start = now_ns();
+        do_TCP_server(relay, mono_time);
+        relay_time += now_ns() - relay_start;
+
+        confirmed = 0;
+
+        for (uint32_t i = first; i < first + count; ++i) {
+            do_TCP_connection(mono_time, clients[i], nullptr);
+            confirmed += tcp_con_status(clients[i]) == TCP_CLIENT_CONFIRMED;
+        }
+
+        if (current_time_monotonic(mono_time) - start > 10000) {
+            printf("Only %u of %u clients got connected.\n", confirmed, count);
+            return 0;
+        }
+    }
+
+    return relay_time;
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t num_clients = argc > 1 ? strtoul(argv[1], nullptr, 10) : DEFAULT_CLIENTS;
+    const uint32_t batch = argc > 2 ? strtoul(argv[2], nullptr, 10) : DEFAULT_BATCH;
+    const uint32_t num_rounds = argc > 3 ? strtoul(argv[3], nullptr, 10) : DEFAULT_ROUNDS;
+
+    if (num_clients == 0 || num_clients > 100000 || batch == 0 || batch > num_clients || batch > 256
+            || num_rounds == 0) {
+        printf("Usage: %s [CLIENTS [BATCH [ROUNDS]]]\n", argv[0]);
+        return 1;
+    }
+
+    Mono_Time *mono_time = mono_time_new();
+    TCP_Client_Connection **clients = (TCP_Client_Connection **)calloc(num_clients, sizeof(TCP_Client_Connection *));
+
+    uint8_t relay_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t relay_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(relay_public_key, relay_secret_key);
+    const uint16_t port = RELAY_PORT;
+    TCP_Server *relay = new_TCP_server(0, 1, &port, relay_secret_key, nullptr);
+
+    if (mono_time == nullptr || clients == nullptr || relay == nullptr) {
+        printf("Failed to start the relay on port %u.\n", port);
+        return 1;
+    }
+
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, false);
+    ip_port.ip.ip.v4 = get_ip4_loopback();
+    ip_port.port = net_htons(port);
+
+    /* The relay only queues a limited number of handshakes, so the clients
+     * connect a batch at a time. */
+    for (uint32_t first = 0; first < num_clients; first += batch) {
+        const uint32_t count = first + batch <= num_clients ? batch : num_clients - first;
+
+        for (uint32_t i = first; i < first + count; ++i) {
+            clients[i] = new_client(mono_time, ip_port, relay_public_key);
+
+            if (clients[i] == nullptr) {
+                printf("Failed to create client %u, is the open file limit too low?\n", i);
+                return 1;
+            }
+        }
+
+        if (connect_clients(relay, mono_time, clients, first, count) == 0) {
+            return 1;
+        }
+    }
+
+    /* Idle clients don't answer pings, so the rounds have to end well before
+     * the relay would time them out. */
+    uint64_t relay_time = 0;
+    uint32_t replaced = 0;
+    uint32_t next = 0;
+
+    for (uint32_t round = 0; round < num_rounds; ++round) {
+        if (next + batch > num_clients) {
+            next = 0;
+        }
+
+        for (uint32_t i = next; i < next + batch; ++i) {
+            kill_TCP_connection(clients[i]);
+            clients[i] = new_client(mono_time, ip_port, relay_public_key);
+
+            if (clients[i] == nullptr) {
+                printf("Failed to create client %u.\n", i);
+                return 1;
+            }
+        }
+
+        const uint64_t round_time = connect_clients(relay, mono_time, clients, next, batch);
+
+        if (round_time == 0) {
+            return 1;
+        }
+
+        relay_time += round_time;
+        replaced += batch;
+        next += batch;
+    }
+
+    printf("%u clients, batch %u: %u replaced, %.3f us relay time per replaced client\n", num_clients, batch,
+           replaced, relay_time / 1000.0 / replaced);
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        kill_TCP_connection(clients[i]);
+    }
+
+    kill_TCP_server(relay);
+    free(clients);
+    mono_time_free(mono_time);
+
+    return 0;
+}
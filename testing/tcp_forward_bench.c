@@ -0,0 +1,305 @@
+/* TCP relay forwarding benchmark
+ *
+ * Starts a local TCP relay and a number of client pairs routed to each other
+ * through it. Every round each client sends a burst of data packets to its
+ * peer, the relay runs once and the receivers read what arrived. Prints the
+ * rate of forwarded packets and the wall time spent in do_TCP_server() per
+ * forwarded packet.
+ *
+ * With SHARDS above 1 the relay is split into that many shards, each running
+ * on its own thread, and only the rate of forwarded packets is measured.
+ *
+ * Usage: tcp_forward_bench [PAIRS [BURST [ROUNDS [SHARDS]]]]
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/TCP_client.h"
+#include "../toxcore/TCP_server.h"
+#include "../toxcore/mono_time.h"
+#include "misc_tools.h"
+
+#define DEFAULT_PAIRS 32
+#define DEFAULT_BURST 32
+#define DEFAULT_ROUNDS 2000
+
+#define PACKET_SIZE 512
+
+/* Below the usual range of ephemeral ports. */
+#define RELAY_PORT 20000
+
+typedef struct Bench_Client {
+    TCP_Client_Connection *con;
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t connection_id;
+    bool routed;
+    uint64_t received;
+} Bench_Client;
+
+typedef struct Shard_Thread {
+    pthread_t thread;
+    TCP_Server *shard;
+    pthread_mutex_t *mutex;
+    const bool *stop;
+} Shard_Thread;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int response_callback(void *object, uint8_t connection_id, const uint8_t *public_key)
+{
+    Bench_Client *client = (Bench_Client *)object;
+    client->connection_id = connection_id;
+    return 0;
+}
+
+static int status_callback(void *object, uint32_t number, uint8_t connection_id, uint8_t status)
+{
+    Bench_Client *client = (Bench_Client *)object;
+    client->routed = status == 2;
+    return 0;
+}
+
+static int data_callback(void *object, uint32_t number, uint8_t connection_id, const uint8_t *data, uint16_t length,
+                         void *userdata)
+{
+    Bench_Client *client = (Bench_Client *)object;
+    ++client->received;
+    return 0;
+}
+
+static bool stopped(Shard_Thread *thread)
+{
+    pthread_mutex_lock(thread->mutex);
+    const bool stop = *thread->stop;
+    pthread_mutex_unlock(thread->mutex);
+    return stop;
+}
+
+static void *shard_thread(void *arg)
+{
+    Shard_Thread *thread = (Shard_Thread *)arg;
+    Mono_Time *mono_time = mono_time_new();
+    Socket sock;
+
+    while (!stopped(thread)) {
+        mono_time_update(mono_time);
+        do_TCP_server(thread->shard, mono_time);
+
+        /* Sharding needs epoll, so there is only the one socket. */
+        tcp_server_wait_sockets(thread->shard, &sock, 1);
+        struct pollfd fd;
+        fd.fd = sock.socket;
+        fd.events = POLLIN;
+        poll(&fd, 1, 1);
+    }
+
+    mono_time_free(mono_time);
+    return nullptr;
+}
+
+static void run_all(TCP_Server *relay, Mono_Time *mono_time, Bench_Client *clients, uint32_t num_clients)
+{
+    mono_time_update(mono_time);
+
+    for (uint32_t i = 0; i < tcp_server_shard_count(relay); ++i) {
+        do_TCP_server(tcp_server_shard(relay, i), mono_time);
+    }
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        do_TCP_connection(mono_time, clients[i].con, nullptr);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t num_pairs = argc > 1 ? strtoul(argv[1], nullptr, 10) : DEFAULT_PAIRS;
+    const uint32_t burst = argc > 2 ? strtoul(argv[2], nullptr, 10) : DEFAULT_BURST;
+    const uint32_t num_rounds = argc > 3 ? strtoul(argv[3], nullptr, 10) : DEFAULT_ROUNDS;
+    const uint32_t num_shards = argc > 4 ? strtoul(argv[4], nullptr, 10) : 1;
+
+    if (num_pairs == 0 || num_pairs > 500 || burst == 0 || num_rounds == 0 || num_shards == 0
+            || num_shards > TCP_SERVER_MAX_SHARDS) {
+        printf("Usage: %s [PAIRS [BURST [ROUNDS [SHARDS]]]]\n", argv[0]);
+        return 1;
+    }
+
+    const uint32_t num_clients = num_pairs * 2;
+    Mono_Time *mono_time = mono_time_new();
+    Bench_Client *clients = (Bench_Client *)calloc(num_clients, sizeof(Bench_Client));
+
+    uint8_t relay_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t relay_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(relay_public_key, relay_secret_key);
+    const uint16_t port = RELAY_PORT;
+    TCP_Server *relay = new_TCP_server(0, 1, &port, relay_secret_key, nullptr);
+
+    if (mono_time == nullptr || clients == nullptr || relay == nullptr || !tcp_server_set_shards(relay, num_shards)) {
+        printf("Failed to start the relay on port %u.\n", port);
+        return 1;
+    }
+
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, false);
+    ip_port.ip.ip.v4 = get_ip4_loopback();
+    ip_port.port = net_htons(port);
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+        crypto_new_keypair(clients[i].public_key, secret_key);
+        clients[i].con = new_TCP_connection(mono_time, ip_port, relay_public_key, clients[i].public_key, secret_key,
+                                            nullptr);
+
+        if (clients[i].con == nullptr) {
+            printf("Failed to create client %u.\n", i);
+            return 1;
+        }
+
+        routing_response_handler(clients[i].con, response_callback, &clients[i]);
+        routing_status_handler(clients[i].con, status_callback, &clients[i]);
+        routing_data_handler(clients[i].con, data_callback, &clients[i]);
+    }
+
+    /* Client 2n talks to client 2n + 1. */
+    bool requested = false;
+    uint32_t ready = 0;
+    const uint64_t connect_start = current_time_monotonic(mono_time);
+
+    while (ready < num_clients) {
+        run_all(relay, mono_time, clients, num_clients);
+        ready = 0;
+
+        for (uint32_t i = 0; i < num_clients; ++i) {
+            ready += requested ? clients[i].routed : tcp_con_status(clients[i].con) == TCP_CLIENT_CONFIRMED;
+        }
+
+        if (!requested && ready == num_clients) {
+            for (uint32_t i = 0; i < num_clients; ++i) {
+                send_routing_request(clients[i].con, clients[i ^ 1].public_key);
+            }
+
+            requested = true;
+            ready = 0;
+        }
+
+        if (current_time_monotonic(mono_time) - connect_start > 10000) {
+            printf("Only %u of %u clients got %s.\n", ready, num_clients, requested ? "routed" : "connected");
+            return 1;
+        }
+
+        c_sleep(1);
+    }
+
+    pthread_mutex_t mutex;
+    pthread_mutex_init(&mutex, nullptr);
+    bool stop = false;
+    Shard_Thread *threads = (Shard_Thread *)calloc(num_shards, sizeof(Shard_Thread));
+
+    for (uint32_t i = 0; num_shards > 1 && i < num_shards; ++i) {
+        threads[i].shard = tcp_server_shard(relay, i);
+        threads[i].mutex = &mutex;
+        threads[i].stop = &stop;
+
+        if (pthread_create(&threads[i].thread, nullptr, shard_thread, &threads[i]) != 0) {
+            printf("Failed to start shard thread %u.\n", i);
+            return 1;
+        }
+    }
+
+    uint8_t packet[PACKET_SIZE];
+    random_bytes(packet, sizeof(packet));
+    uint64_t sent = 0;
+    uint64_t relay_time = 0;
+    const uint64_t start = now_ns();
+
+    for (uint32_t round = 0; round < num_rounds; ++round) {
+        for (uint32_t i = 0; i < num_clients; ++i) {
+            for (uint32_t j = 0; j < burst; ++j) {
+                if (send_data(clients[i].con, clients[i].connection_id, packet, sizeof(packet)) != 1) {
+                    break;
+                }
+
+                ++sent;
+            }
+        }
+
+        mono_time_update(mono_time);
+
+        if (num_shards == 1) {
+            const uint64_t relay_start = now_ns();
+            do_TCP_server(relay, mono_time);
+            relay_time += now_ns() - relay_start;
+        }
+
+        for (uint32_t i = 0; i < num_clients; ++i) {
+            do_TCP_connection(mono_time, clients[i].con, nullptr);
+        }
+    }
+
+    const uint64_t elapsed = now_ns() - start;
+    uint64_t received = 0;
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        received += clients[i].received;
+    }
+
+    pthread_mutex_lock(&mutex);
+    stop = true;
+    pthread_mutex_unlock(&mutex);
+
+    for (uint32_t i = 0; num_shards > 1 && i < num_shards; ++i) {
+        pthread_join(threads[i].thread, nullptr);
+    }
+
+    if (num_shards == 1) {
+        printf("%u pairs, burst %u: %lu sent, %lu forwarded, %.0f packets/s, %.3f us relay time per packet\n",
+               num_pairs, burst, (unsigned long)sent, (unsigned long)received, received * 1e9 / elapsed,
+               received != 0 ? relay_time / 1000.0 / received : 0.0);
+    } else {
+        printf("%u pairs, burst %u, %u shards: %lu sent, %lu forwarded, %.0f packets/s\n", num_pairs, burst,
+               num_shards, (unsigned long)sent, (unsigned long)received, received * 1e9 / elapsed);
+    }
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        kill_TCP_connection(clients[i].con);
+    }
+
+    kill_TCP_server(relay);
+    pthread_mutex_destroy(&mutex);
+    free(threads);
+    free(clients);
+    mono_time_free(mono_time);
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+/* TCP relay client iteration benchmark
+ *
+ * Starts a number of local TCP relay servers and connects one TCP_Connections
+ * to all of them, like a client with friends on many relays. Once the relays
+ * are online they are idle, since the friends never come online, and the
+ * benchmark measures the CPU time of a do_tcp_connections() call.
+ *
+ * Usage: tcp_relays_bench [RELAYS [ITERATIONS]]
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "../toxcore/TCP_connection.h"
+#include "../toxcore/TCP_server.h"
+#include "../toxcore/mono_time.h"
+#include "misc_tools.h"
+
+#define DEFAULT_RELAYS 64
+#define DEFAULT_ITERATIONS 20000
+
+/* Below the usual range of ephemeral ports. */
+#define FIRST_PORT 20000
+
+static uint64_t cpu_time_us(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+           + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t num_relays = argc > 1 ? strtoul(argv[1], nullptr, 10) : DEFAULT_RELAYS;
+    const uint32_t num_iterations = argc > 2 ? strtoul(argv[2], nullptr, 10) : DEFAULT_ITERATIONS;
+
+    if (num_relays == 0 || num_relays > 1000 || num_iterations == 0) {
+        printf("Usage: %s [RELAYS [ITERATIONS]]\n", argv[0]);
+        return 1;
+    }
+
+    Mono_Time *mono_time = mono_time_new();
+    TCP_Server **servers = (TCP_Server **)calloc(num_relays, sizeof(TCP_Server *));
+
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
+    TCP_Connections *tcp_c = new_tcp_connections(mono_time, self_secret_key, &proxy_info);
+
+    if (mono_time == nullptr || servers == nullptr || tcp_c == nullptr) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < num_relays; ++i) {
+        uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+        crypto_new_keypair(public_key, secret_key);
+        const uint16_t port = FIRST_PORT + i;
+        servers[i] = new_TCP_server(0, 1, &port, secret_key, nullptr);
+
+        IP_Port ip_port;
+        ip_init(&ip_port.ip, false);
+        ip_port.ip.ip.v4 = get_ip4_loopback();
+        ip_port.port = net_htons(port);
+
+        /* A relay that no connection uses would be closed right away. */
+        uint8_t friend_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        random_bytes(friend_public_key, sizeof(friend_public_key));
+        const int friend_number = new_tcp_connection_to(tcp_c, friend_public_key, i);
+
+        if (servers[i] == nullptr || friend_number == -1
+                || add_tcp_relay_connection(tcp_c, friend_number, ip_port, public_key) != 0) {
+            printf("Failed to set up relay %u on port %u.\n", i, port);
+            return 1;
+        }
+    }
+
+    /* Relays whose friends did not come online are closed after
+     * TCP_CONNECTION_ANNOUNCE_TIMEOUT, so the measurement has to fit in that. */
+    Node_format *relays = (Node_format *)calloc(num_relays, sizeof(Node_format));
+    uint32_t online = 0;
+    const uint64_t connect_start = current_time_monotonic(mono_time);
+
+    while (online < num_relays) {
+        mono_time_update(mono_time);
+
+        for (uint32_t i = 0; i < num_relays; ++i) {
+            do_TCP_server(servers[i], mono_time);
+        }
+
+        do_tcp_connections(tcp_c, nullptr);
+        online = tcp_copy_connected_relays(tcp_c, relays, num_relays);
+
+        if (current_time_monotonic(mono_time) - connect_start > 5000) {
+            printf("Only %u of %u relays came online.\n", online, num_relays);
+            return 1;
+        }
+
+        c_sleep(1);
+    }
+
+    const uint64_t start = current_time_monotonic(mono_time);
+    const uint64_t cpu_start = cpu_time_us();
+    uint32_t iterations = 0;
+
+    for (; iterations < num_iterations; ++iterations) {
+        if (iterations % 1024 == 0) {
+            mono_time_update(mono_time);
+
+            if (current_time_monotonic(mono_time) - start > 1000 * (TCP_CONNECTION_ANNOUNCE_TIMEOUT / 2)) {
+                break;
+            }
+        }
+
+        do_tcp_connections(tcp_c, nullptr);
+    }
+
+    const uint64_t cpu_time = cpu_time_us() - cpu_start;
+    online = tcp_copy_connected_relays(tcp_c, relays, num_relays);
+
+    printf("%u relays (%u still online): %u iterations, %.3f us CPU per do_tcp_connections()\n", num_relays, online,
+           iterations, (double)cpu_time / iterations);
+
+    kill_tcp_connections(tcp_c);
+
+    for (uint32_t i = 0; i < num_relays; ++i) {
+        kill_TCP_server(servers[i]);
+    }
+
+    free(relays);
+    free(servers);
+    mono_time_free(mono_time);
+
+    return 0;
+}
@@ -32,6 +32,7 @@
 #include "mono_time.h"
 #include "network.h"
 #include "ping.h"
+#include "precompute_pool.h"
 #include "state.h"
 #include "util.h"
 
@@ -115,6 +116,9 @@ struct DHT {
 
     Shared_Keys shared_keys_recv;
     Shared_Keys shared_keys_sent;
+    Precompute_Pool *precompute_pool;
+    uint64_t precompute_dropped;
+    bool handling_parked; /* A parked packet is handed to its handler again. */
 
     struct Ping   *ping;
     Ping_Array    *dht_ping_array;
@@ -238,55 +242,178 @@ static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
     return i * 8 + j;
 }
 
-/* Shared key generations are costly, it is therefor smart to store commonly used
- * ones so that they can re used later without being computed again.
+static uint32_t next_power_of_two(uint32_t n)
+{
+    uint32_t p = 1;
+
+    while (p < n) {
+        p <<= 1;
+    }
+
+    return p;
+}
+
+bool shared_keys_init(Shared_Keys *shared_keys, uint32_t capacity)
+{
+    shared_keys_free(shared_keys);
+    memset(&shared_keys->stats, 0, sizeof(shared_keys->stats));
+
+    if (capacity < SHARED_KEYS_WAYS) {
+        capacity = SHARED_KEYS_WAYS;
+    }
+
+    capacity = next_power_of_two(min_u32(capacity, SHARED_KEYS_MAX_CAPACITY));
+
+    Shared_Key *keys = (Shared_Key *)calloc(capacity, sizeof(Shared_Key));
+
+    if (keys == nullptr) {
+        return false;
+    }
+
+    shared_keys->keys = keys;
+    shared_keys->capacity = capacity;
+    shared_keys->hash_seed = random_u64();
+    shared_keys->hand = 0;
+    return true;
+}
+
+void shared_keys_free(Shared_Keys *shared_keys)
+{
+    free(shared_keys->keys);
+    shared_keys->keys = nullptr;
+    shared_keys->capacity = 0;
+}
+
+/* Hash the whole public key. The seed is random per cache so that peers can't
+ * pick keys that all land in the same slots.
+ */
+static uint32_t shared_keys_hash(const Shared_Keys *shared_keys, const uint8_t *public_key)
+{
+    uint64_t hash = shared_keys->hash_seed;
+
+    for (uint32_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, public_key + i, sizeof(word));
+        hash ^= word;
+        hash *= 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+
+    return (uint32_t)(hash >> 32);
+}
+
+/* Copy the cached shared key for public_key into shared_key, without counting
+ * the lookup in the stats.
  *
- * If shared key is already in shared_keys, copy it to shared_key.
- * else generate it into shared_key and copy it to shared_keys
+ * return true on a cache hit.
  */
-void get_shared_key(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_t *shared_key,
-                    const uint8_t *secret_key, const uint8_t *public_key)
+static bool shared_keys_find(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_t *shared_key,
+                             const uint8_t *public_key)
 {
-    uint32_t num = ~0;
-    uint32_t curr = 0;
+    if (shared_keys->capacity == 0) {
+        return false;
+    }
 
-    for (uint32_t i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
-        const int index = public_key[30] * MAX_KEYS_PER_SLOT + i;
-        Shared_Key *const key = &shared_keys->keys[index];
+    const uint32_t mask = shared_keys->capacity - 1;
+    const uint32_t start = shared_keys_hash(shared_keys, public_key) & mask;
 
-        if (key->stored) {
-            if (id_equal(public_key, key->public_key)) {
-                memcpy(shared_key, key->shared_key, CRYPTO_SHARED_KEY_SIZE);
-                ++key->times_requested;
-                key->time_last_requested = mono_time_get(mono_time);
-                return;
-            }
+    for (uint32_t i = 0; i < SHARED_KEYS_WAYS; ++i) {
+        Shared_Key *const key = &shared_keys->keys[(start + i) & mask];
 
-            if (num != 0) {
-                if (mono_time_is_timeout(mono_time, key->time_last_requested, KEYS_TIMEOUT)) {
-                    num = 0;
-                    curr = index;
-                } else if (num > key->times_requested) {
-                    num = key->times_requested;
-                    curr = index;
-                }
+        if (key->stored && id_equal(public_key, key->public_key)) {
+            memcpy(shared_key, key->shared_key, CRYPTO_SHARED_KEY_SIZE);
+            key->referenced = true;
+            key->time_last_requested = mono_time_get(mono_time);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Copy the cached shared key for public_key into shared_key.
+ *
+ * return true on a cache hit.
+ */
+static bool shared_keys_lookup(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_t *shared_key,
+                               const uint8_t *public_key)
+{
+    if (shared_keys_find(mono_time, shared_keys, shared_key, public_key)) {
+        ++shared_keys->stats.hits;
+        return true;
+    }
+
+    ++shared_keys->stats.misses;
+    return false;
+}
+
+static void shared_keys_insert(const Mono_Time *mono_time, Shared_Keys *shared_keys, const uint8_t *public_key,
+                               const uint8_t *shared_key)
+{
+    if (shared_keys->capacity == 0) {
+        return;
+    }
+
+    const uint32_t mask = shared_keys->capacity - 1;
+    const uint32_t start = shared_keys_hash(shared_keys, public_key) & mask;
+    Shared_Key *free_key = nullptr;
+
+    for (uint32_t i = 0; i < SHARED_KEYS_WAYS; ++i) {
+        Shared_Key *const key = &shared_keys->keys[(start + i) & mask];
+
+        if (!key->stored || id_equal(public_key, key->public_key)) {
+            free_key = key;
+            break;
+        }
+
+        if (free_key == nullptr && mono_time_is_timeout(mono_time, key->time_last_requested, KEYS_TIMEOUT)) {
+            free_key = key;
+        }
+    }
+
+    if (free_key == nullptr) {
+        /* Sweep from the hand, giving every recently used key a second chance.
+         * If they were all used, the key under the hand goes. */
+        uint32_t offset = shared_keys->hand;
+
+        for (uint32_t i = 0; i < SHARED_KEYS_WAYS; ++i) {
+            Shared_Key *const key = &shared_keys->keys[(start + offset) & mask];
+
+            if (!key->referenced) {
+                break;
             }
-        } else if (num != 0) {
-            num = 0;
-            curr = index;
+
+            key->referenced = false;
+            offset = (offset + 1) % SHARED_KEYS_WAYS;
         }
+
+        free_key = &shared_keys->keys[(start + offset) & mask];
+        shared_keys->hand = (offset + 1) % SHARED_KEYS_WAYS;
+        ++shared_keys->stats.evictions;
     }
 
-    encrypt_precompute(public_key, secret_key, shared_key);
+    free_key->stored = true;
+    free_key->referenced = false;
+    memcpy(free_key->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(free_key->shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
+    free_key->time_last_requested = mono_time_get(mono_time);
+}
 
-    if (num != UINT32_MAX) {
-        Shared_Key *const key = &shared_keys->keys[curr];
-        key->stored = true;
-        key->times_requested = 1;
-        memcpy(key->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-        memcpy(key->shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
-        key->time_last_requested = mono_time_get(mono_time);
+/* Shared key generations are costly, it is therefor smart to store commonly used
+ * ones so that they can re used later without being computed again.
+ *
+ * If shared key is already in shared_keys, copy it to shared_key.
+ * else generate it into shared_key and copy it to shared_keys
+ */
+void get_shared_key(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_t *shared_key,
+                    const uint8_t *secret_key, const uint8_t *public_key)
+{
+    if (shared_keys_lookup(mono_time, shared_keys, shared_key, public_key)) {
+        return;
     }
+
+    encrypt_precompute(public_key, secret_key, shared_key);
+    shared_keys_insert(mono_time, shared_keys, public_key, shared_key);
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -305,6 +432,138 @@ void dht_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *publi
     get_shared_key(dht->mono_time, &dht->shared_keys_sent, shared_key, dht->self_secret_key, public_key);
 }
 
+/* The packet handler finds the key in the cache when the packet is handed to
+ * it again.
+ */
+static void dht_handle_parked(DHT *dht, Shared_Keys *shared_keys, const uint8_t *public_key,
+                              const uint8_t *shared_key, IP_Port source, const uint8_t *data, uint16_t length,
+                              void *userdata)
+{
+    shared_keys_insert(dht->mono_time, shared_keys, public_key, shared_key);
+
+    dht->handling_parked = true;
+    networking_handle_packet(dht->net, source, data, length, userdata);
+    dht->handling_parked = false;
+}
+
+static void dht_precompute_done_recv(void *object, const uint8_t *public_key, const uint8_t *shared_key,
+                                     IP_Port source, const uint8_t *data, uint16_t length, void *userdata)
+{
+    DHT *const dht = (DHT *)object;
+    dht_handle_parked(dht, &dht->shared_keys_recv, public_key, shared_key, source, data, length, userdata);
+}
+
+static void dht_precompute_done_sent(void *object, const uint8_t *public_key, const uint8_t *shared_key,
+                                     IP_Port source, const uint8_t *data, uint16_t length, void *userdata)
+{
+    DHT *const dht = (DHT *)object;
+    dht_handle_parked(dht, &dht->shared_keys_sent, public_key, shared_key, source, data, length, userdata);
+}
+
+static bool dht_get_shared_key_or_park(DHT *dht, Shared_Keys *shared_keys, precompute_done_cb *callback,
+                                       uint8_t *shared_key, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    const uint8_t *const public_key = packet + 1;
+
+    if (dht->precompute_pool == nullptr || shared_keys->capacity == 0) {
+        get_shared_key(dht->mono_time, shared_keys, shared_key, dht->self_secret_key, public_key);
+        return true;
+    }
+
+    if (shared_keys_find(dht->mono_time, shared_keys, shared_key, public_key)) {
+        /* A parked packet was counted as a miss already when it was parked. */
+        if (!dht->handling_parked) {
+            ++shared_keys->stats.hits;
+        }
+
+        return true;
+    }
+
+    const int ret = precompute_pool_submit(dht->precompute_pool, public_key, dht->self_secret_key, source, packet,
+                                           length, callback, dht);
+
+    /* Packets that join the job of an earlier packet from the same peer don't
+     * make the cache compute another key. */
+    if (ret != 0) {
+        ++shared_keys->stats.misses;
+    }
+
+    if (ret == -1) {
+        LOGGER_DEBUG(dht->log, "shared key precompute pool is full, dropping packet %u", packet[0]);
+        ++dht->precompute_dropped;
+    }
+
+    return false;
+}
+
+bool dht_get_shared_key_recv_or_park(DHT *dht, uint8_t *shared_key, IP_Port source, const uint8_t *packet,
+                                     uint16_t length)
+{
+    return dht_get_shared_key_or_park(dht, &dht->shared_keys_recv, dht_precompute_done_recv, shared_key, source,
+                                      packet, length);
+}
+
+bool dht_get_shared_key_sent_or_park(DHT *dht, uint8_t *shared_key, IP_Port source, const uint8_t *packet,
+                                     uint16_t length)
+{
+    return dht_get_shared_key_or_park(dht, &dht->shared_keys_sent, dht_precompute_done_sent, shared_key, source,
+                                      packet, length);
+}
+
+bool dht_has_parked_packets(const DHT *dht)
+{
+    return dht->precompute_pool != nullptr && precompute_pool_packets(dht->precompute_pool) > 0;
+}
+
+bool dht_set_precompute_threads(DHT *dht, uint32_t num_threads)
+{
+    precompute_pool_kill(dht->precompute_pool);
+    dht->precompute_pool = nullptr;
+
+    if (num_threads == 0) {
+        return true;
+    }
+
+    dht->precompute_pool = precompute_pool_new(num_threads, DHT_PRECOMPUTE_MAX_PACKETS);
+    return dht->precompute_pool != nullptr;
+}
+
+bool dht_set_shared_keys_capacity(DHT *dht, uint32_t capacity)
+{
+    const bool recv_ok = shared_keys_init(&dht->shared_keys_recv, capacity);
+    const bool sent_ok = shared_keys_init(&dht->shared_keys_sent, capacity);
+    return recv_ok && sent_ok;
+}
+
+void dht_get_shared_keys_stats(const DHT *dht, Shared_Keys_Stats *recv, Shared_Keys_Stats *sent)
+{
+    if (recv != nullptr) {
+        *recv = dht->shared_keys_recv.stats;
+    }
+
+    if (sent != nullptr) {
+        *sent = dht->shared_keys_sent.stats;
+    }
+}
+
+void dht_get_stats(const DHT *dht, DHT_Stats *stats)
+{
+    stats->close_nodes = 0;
+
+    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
+        const Client_data *const client = &dht->close_clientlist[i];
+
+        if (!mono_time_is_timeout(dht->mono_time, client->assoc4.timestamp, BAD_NODE_TIMEOUT) ||
+                !mono_time_is_timeout(dht->mono_time, client->assoc6.timestamp, BAD_NODE_TIMEOUT)) {
+            ++stats->close_nodes;
+        }
+    }
+
+    stats->friends = dht->num_friends;
+    stats->parked_packets = dht->precompute_pool != nullptr ? precompute_pool_packets(dht->precompute_pool) : 0;
+    stats->dropped_packets = dht->precompute_dropped;
+}
+
 #define CRYPTO_SIZE 1 + CRYPTO_PUBLIC_KEY_SIZE * 2 + CRYPTO_NONCE_SIZE
 
 /* Create a request to peer.
@@ -1419,7 +1678,10 @@ static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet,
     uint8_t plain[CRYPTO_NODE_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
 
-    dht_get_shared_key_recv(dht, shared_key, packet + 1);
+    if (!dht_get_shared_key_recv_or_park(dht, shared_key, source, packet, length)) {
+        return true;
+    }
+
     const int len = decrypt_data_symmetric(
                         shared_key,
                         packet + 1 + CRYPTO_PUBLIC_KEY_SIZE,
@@ -1489,7 +1751,11 @@ static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *pa
 
     VLA(uint8_t, plain, 1 + data_size + sizeof(uint64_t));
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    dht_get_shared_key_sent(dht, shared_key, packet + 1);
+
+    if (!dht_get_shared_key_sent_or_park(dht, shared_key, source, packet, length)) {
+        return 1;
+    }
+
     const int len = decrypt_data_symmetric(
                         shared_key,
                         packet + 1 + CRYPTO_PUBLIC_KEY_SIZE,
@@ -2724,7 +2990,7 @@ DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool
 
     dht->ping = ping_new(mono_time, dht);
 
-    if (dht->ping == nullptr) {
+    if (dht->ping == nullptr || !dht_set_shared_keys_capacity(dht, SHARED_KEYS_DEFAULT_CAPACITY)) {
         kill_dht(dht);
         return nullptr;
     }
@@ -2755,6 +3021,10 @@ DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool
 
 void do_dht(DHT *dht)
 {
+    if (dht->precompute_pool != nullptr) {
+        precompute_pool_dispatch(dht->precompute_pool, nullptr);
+    }
+
     if (dht->last_run == mono_time_get(dht->mono_time)) {
         return;
     }
@@ -2783,6 +3053,9 @@ void kill_dht(DHT *dht)
     ping_array_kill(dht->dht_ping_array);
     ping_array_kill(dht->dht_harden_ping_array);
     ping_kill(dht->ping);
+    precompute_pool_kill(dht->precompute_pool);
+    shared_keys_free(&dht->shared_keys_recv);
+    shared_keys_free(&dht->shared_keys_sent);
     free(dht->friends_list);
     free(dht->loaded_nodes_list);
     free(dht);
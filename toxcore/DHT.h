@@ -195,22 +195,53 @@ int unpack_nodes(Node_format *nodes, uint16_t max_num_nodes, uint16_t *processed
 
 
 /*----------------------------------------------------------------------------------*/
-/* struct to store some shared keys so we don't have to regenerate them for each request. */
-#define MAX_KEYS_PER_SLOT 4
+/* struct to store some shared keys so we don't have to regenerate them for each request.
+ *
+ * The cache is an open addressing hash table indexed by a seeded hash of the
+ * full public key. A key can live in any of the SHARED_KEYS_WAYS slots
+ * following its hash position, and when they are all taken one of them is
+ * evicted with the CLOCK (second chance) algorithm. The clock hand is kept
+ * per cache as an offset into the window, so each eviction resumes the sweep
+ * where the previous one stopped.
+ */
+#define SHARED_KEYS_DEFAULT_CAPACITY 1024
+#define SHARED_KEYS_MAX_CAPACITY (1 << 20)
+#define SHARED_KEYS_WAYS 8
 #define KEYS_TIMEOUT 600
 
 typedef struct Shared_Key {
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    uint32_t times_requested;
     bool stored;
+    bool referenced;
     uint64_t time_last_requested;
 } Shared_Key;
 
+typedef struct Shared_Keys_Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} Shared_Keys_Stats;
+
 typedef struct Shared_Keys {
-    Shared_Key keys[256 * MAX_KEYS_PER_SLOT];
+    Shared_Key *keys;
+    uint32_t capacity;
+    uint64_t hash_seed;
+    uint32_t hand; /* Offset of the CLOCK hand in the window, below SHARED_KEYS_WAYS. */
+    Shared_Keys_Stats stats;
 } Shared_Keys;
 
+/* Allocate room for capacity keys in shared_keys, discarding any keys it held.
+ * The capacity is rounded up to a power of 2 between SHARED_KEYS_WAYS and
+ * SHARED_KEYS_MAX_CAPACITY. The statistics are reset.
+ *
+ * return true on success.
+ * return false if the memory could not be allocated. shared_keys is then empty
+ *   and get_shared_key() computes every key.
+ */
+bool shared_keys_init(Shared_Keys *shared_keys, uint32_t capacity);
+void shared_keys_free(Shared_Keys *shared_keys);
+
 /*----------------------------------------------------------------------------------*/
 
 typedef int cryptopacket_handler_cb(void *object, IP_Port ip_port, const uint8_t *source_pubkey,
@@ -254,6 +285,67 @@ void dht_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *publi
  */
 void dht_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *public_key);
 
+/* Maximum number of packets parked while their shared key is computed by the
+ * precompute pool. Packets from new peers beyond that are dropped.
+ */
+#define DHT_PRECOMPUTE_MAX_PACKETS 1024
+
+/* Compute the shared keys for packets from peers that are not in the receive
+ * cache on num_threads worker threads instead of on the network thread.
+ * 0 turns the worker threads off, which is the default.
+ *
+ * return true on success.
+ */
+bool dht_set_precompute_threads(DHT *dht, uint32_t num_threads);
+
+/* Copy the shared key for a received DHT packet into shared_key, like
+ * dht_get_shared_key_recv() with the sender public key at packet + 1.
+ *
+ * If precompute threads are on and the key is not cached, the packet is
+ * parked and handed to its network packet handler again from do_dht() once
+ * the key is known, or dropped if too many packets are parked already.
+ * Packets from a peer whose key is being computed wait for that computation,
+ * and only the first of them counts as a cache miss.
+ *
+ * return true if shared_key was written and the packet can be handled now.
+ * return false if the packet was parked or dropped.
+ */
+bool dht_get_shared_key_recv_or_park(DHT *dht, uint8_t *shared_key, IP_Port source, const uint8_t *packet,
+                                     uint16_t length);
+
+/* Like dht_get_shared_key_recv_or_park(), for a response to a packet we sent,
+ * with the key from the cache that dht_get_shared_key_sent() uses.
+ */
+bool dht_get_shared_key_sent_or_park(DHT *dht, uint8_t *shared_key, IP_Port source, const uint8_t *packet,
+                                     uint16_t length);
+
+/* return true if some parked packets are waiting for their shared key. An
+ * event loop should call do_dht() again soon, since finished keys don't wake
+ * up the sockets it waits on.
+ */
+bool dht_has_parked_packets(const DHT *dht);
+
+/* Change the capacity of both DHT shared key caches. All cached keys are
+ * dropped.
+ *
+ * return true on success.
+ */
+bool dht_set_shared_keys_capacity(DHT *dht, uint32_t capacity);
+
+/* Copy the hit, miss and eviction counters of the shared key caches for
+ * received and sent packets. Either pointer may be NULL.
+ */
+void dht_get_shared_keys_stats(const DHT *dht, Shared_Keys_Stats *recv, Shared_Keys_Stats *sent);
+
+typedef struct DHT_Stats {
+    uint32_t close_nodes;     /* Nodes in the close list that are not bad. */
+    uint32_t friends;         /* Public keys whose nodes are searched for. */
+    uint32_t parked_packets;  /* Packets waiting for the precompute threads. */
+    uint64_t dropped_packets; /* Packets from new peers dropped because too many were parked. */
+} DHT_Stats;
+
+void dht_get_stats(const DHT *dht, DHT_Stats *stats);
+
 void dht_getnodes(DHT *dht, const IP_Port *from_ipp, const uint8_t *from_id, const uint8_t *which_id);
 
 typedef void dht_ip_cb(void *object, int32_t number, IP_Port ip_port);
@@ -474,6 +474,27 @@ int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber)
     return CONNECTION_NONE;
 }
 
+int m_get_friend_transport_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats)
+{
+    if (friend_not_valid(m, friendnumber)) {
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(Crypto_Connection_Stats));
+    // Memsetting float/double to 0 is non-portable, so we explicitly set them to 0
+    stats->send_rate = 0;
+    stats->recv_rate = 0;
+    stats->path = CRYPTO_PATH_NONE;
+
+    if (m->friendlist[friendnumber].status != FRIEND_ONLINE) {
+        return 0;
+    }
+
+    const int crypt_conn_id = friend_connection_crypt_connection_id(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+    crypto_connection_get_stats(m->net_crypto, crypt_conn_id, stats);
+    return 0;
+}
+
 int m_friend_exists(const Messenger *m, int32_t friendnumber)
 {
     if (friend_not_valid(m, friendnumber)) {
@@ -1395,8 +1416,31 @@ static int64_t send_file_data_packet(const Messenger *m, int32_t friendnumber, u
                              m->friendlist[friendnumber].friendcon_id), packet, SIZEOF_VLA(packet), 1);
 }
 
+/* Chunks of files of known size are MAX_FILE_JUMBO_DATA_SIZE long when the
+ * connection carries larger packets. A chunk shorter than MAX_FILE_DATA_SIZE
+ * ends the transfer, so streams of unknown size always use MAX_FILE_DATA_SIZE.
+ */
 #define MAX_FILE_DATA_SIZE (MAX_CRYPTO_DATA_SIZE - 2)
+#define MAX_FILE_JUMBO_DATA_SIZE (MAX_CRYPTO_JUMBO_DATA_SIZE - 2)
 #define MIN_SLOTS_FREE (CRYPTO_MIN_QUEUE_LENGTH / 4)
+
+/* Return the size of the next chunk to request for a file being sent. */
+static uint16_t file_chunk_size(const Messenger *m, int32_t friendnumber, const struct File_Transfers *ft)
+{
+    if (ft->size == UINT64_MAX) {
+        return MAX_FILE_DATA_SIZE;
+    }
+
+    const uint16_t max_data_size = crypto_connection_max_data_size(m->net_crypto,
+                                   friend_connection_crypt_connection_id(m->fr_c, m->friendlist[friendnumber].friendcon_id));
+
+    if (max_data_size < MAX_CRYPTO_DATA_SIZE) {
+        return MAX_FILE_DATA_SIZE;
+    }
+
+    return max_data_size - 2;
+}
+
 /* Send file data.
  *
  *  return 0 on success
@@ -1429,7 +1473,7 @@ int file_data(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uin
         return -4;
     }
 
-    if (length > MAX_FILE_DATA_SIZE) {
+    if (length > MAX_FILE_JUMBO_DATA_SIZE) {
         return -5;
     }
 
@@ -1437,7 +1481,7 @@ int file_data(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uin
         return -5;
     }
 
-    if (ft->size != UINT64_MAX && length != MAX_FILE_DATA_SIZE && (ft->transferred + length) != ft->size) {
+    if (ft->size != UINT64_MAX && length < MAX_FILE_DATA_SIZE && (ft->transferred + length) != ft->size) {
         return -5;
     }
 
@@ -1445,6 +1489,15 @@ int file_data(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uin
         return -7;
     }
 
+    /* The connection stopped carrying larger packets since the chunk was
+     * requested. Drop it and the chunks requested after it, the next
+     * do_reqchunk_filecb() requests them again at the size it takes now. */
+    if (length > MAX_FILE_DATA_SIZE && length > file_chunk_size(m, friendnumber, ft)) {
+        ft->requested = ft->transferred;
+        ft->slots_allocated = 0;
+        return 0;
+    }
+
     /* Prevent file sending from filling up the entire buffer preventing messages from being sent.
      * TODO(irungentoo): remove */
     if (crypto_num_free_sendqueue_slots(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
@@ -1462,7 +1515,7 @@ int file_data(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uin
             --ft->slots_allocated;
         }
 
-        if (length != MAX_FILE_DATA_SIZE || ft->size == ft->transferred) {
+        if (length < MAX_FILE_DATA_SIZE || ft->size == ft->transferred) {
             ft->status = FILESTATUS_FINISHED;
             ft->last_packet_number = ret;
         }
@@ -1576,7 +1629,7 @@ static bool do_all_filetransfers(Messenger *m, int32_t friendnumber, void *userd
             // Allocate 1 slot to this file transfer.
             ++ft->slots_allocated;
 
-            const uint16_t length = min_u64(ft->size - ft->requested, MAX_FILE_DATA_SIZE);
+            const uint16_t length = min_u64(ft->size - ft->requested, file_chunk_size(m, friendnumber, ft));
             const uint64_t position = ft->requested;
             ft->requested += length;
 
@@ -2013,6 +2066,15 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
         return nullptr;
     }
 
+    if (!networking_set_recv_batch_size(m->net, options->udp_recv_batch_size)
+            || !networking_set_send_queue_size(m->net, options->udp_send_queue_size)) {
+        kill_networking(m->net);
+        friendreq_kill(m->fr);
+        logger_kill(m->log);
+        free(m);
+        return nullptr;
+    }
+
     m->dht = new_dht(m->log, m->mono_time, m->net, options->hole_punching_enabled);
 
     if (m->dht == nullptr) {
@@ -2034,6 +2096,8 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
         return nullptr;
     }
 
+    nc_set_congestion_control(m->net_crypto, options->congestion_control);
+
     m->onion = new_onion(m->mono_time, m->dht);
     m->onion_a = new_onion_announce(m->mono_time, m->dht);
     m->onion_c =  new_onion_client(m->mono_time, m->net_crypto);
@@ -2432,7 +2496,7 @@ static int m_handle_packet(void *object, int i, const uint8_t *temp, uint16_t le
 
             ft->transferred += file_data_length;
 
-            if (file_data_length && (ft->transferred >= ft->size || file_data_length != MAX_FILE_DATA_SIZE)) {
+            if (file_data_length && (ft->transferred >= ft->size || file_data_length < MAX_FILE_DATA_SIZE)) {
                 file_data_length = 0;
                 file_data = nullptr;
                 position = ft->transferred;
@@ -2586,6 +2650,65 @@ uint32_t messenger_run_interval(const Messenger *m)
     return crypto_interval;
 }
 
+/* How long to wait before checking whether the keys for parked DHT packets
+ * have been computed.
+ */
+#define PARKED_PACKETS_WAIT_MILLISECONDS 5
+
+/* How long to wait before trying again to send TCP data that a socket did not
+ * take. Event loops only wait for the sockets to become readable.
+ */
+#define PENDING_DATA_WAIT_MILLISECONDS 10
+
+uint32_t messenger_run_deadline(const Messenger *m)
+{
+    const uint32_t next_tick = 1000 - (current_time_monotonic(m->mono_time) % 1000);
+    uint32_t deadline = min_u32(next_tick, crypto_run_interval(m->net_crypto));
+
+    if (tcp_connections_have_pending_data(nc_get_tcp_c(m->net_crypto))
+            || (m->tcp_server != nullptr && tcp_server_has_pending_data(m->tcp_server))) {
+        deadline = min_u32(deadline, PENDING_DATA_WAIT_MILLISECONDS);
+    }
+
+    if (dht_has_parked_packets(m->dht)) {
+        deadline = min_u32(deadline, PARKED_PACKETS_WAIT_MILLISECONDS);
+    }
+
+    return deadline;
+}
+
+uint32_t messenger_wait_sockets(const Messenger *m, Socket *socks, uint32_t max_socks)
+{
+    uint32_t count = 0;
+    const Socket udp_sock = net_udp_socket(m->net);
+
+    if (sock_valid(udp_sock)) {
+        if (count < max_socks) {
+            socks[count] = udp_sock;
+        }
+
+        ++count;
+    }
+
+    if (count < max_socks) {
+        count += tcp_connections_wait_sockets(nc_get_tcp_c(m->net_crypto), socks + count, max_socks - count);
+    } else {
+        count += tcp_connections_wait_sockets(nc_get_tcp_c(m->net_crypto), nullptr, 0);
+    }
+
+    if (m->tcp_server == nullptr) {
+        return count;
+    }
+
+    if (count < max_socks) {
+        count += tcp_server_wait_sockets(m->tcp_server, socks + count, max_socks - count);
+    } else {
+        count += tcp_server_wait_sockets(m->tcp_server, nullptr, 0);
+    }
+
+    return count;
+}
+
 /* The main loop that needs to be run at least 20 times per second. */
 void do_messenger(Messenger *m, void *userdata)
 {
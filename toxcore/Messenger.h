@@ -91,6 +91,11 @@ typedef struct Messenger_Options {
     bool hole_punching_enabled;
     bool local_discovery_enabled;
 
+    Crypto_Congestion_Control congestion_control;
+
+    uint16_t udp_recv_batch_size;
+    uint16_t udp_send_queue_size;
+
     logger_cb *log_callback;
     void *log_context;
     void *log_user_data;
@@ -394,6 +399,14 @@ int m_delfriend(Messenger *m, int32_t friendnumber);
  */
 int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber);
 
+/* Copy the transport statistics of the connection to the friend to stats.
+ * If the friend is not online, stats is zeroed and its path is CRYPTO_PATH_NONE.
+ *
+ *  return 0 if success.
+ *  return -1 if failure.
+ */
+int m_get_friend_transport_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats);
+
 /* Checks if there exists a friend with given friendnumber.
  *
  *  return 1 if friend exists.
@@ -676,6 +689,9 @@ int file_control(const Messenger *m, int32_t friendnumber, uint32_t filenumber,
 int file_seek(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uint64_t position);
 
 /* Send file data.
+ *
+ * A chunk requested at a size the connection no longer carries is dropped
+ * and requested again in smaller pieces, and 0 is returned.
  *
  *  return 0 on success
  *  return -1 if friend not valid.
@@ -788,6 +804,29 @@ void do_messenger(Messenger *m, void *userdata);
  */
 uint32_t messenger_run_interval(const Messenger *m);
 
+/* Return the time in milliseconds until the earliest timer of do_messenger()
+ * expires. Unlike messenger_run_interval() this is not capped to a minimum
+ * run interval, so an event loop waiting on messenger_wait_sockets() can sleep
+ * until either a socket becomes readable or this deadline passes.
+ *
+ * The DHT, onion, friend connection and conference timers all run on the one
+ * second resolution of mono_time, so they can only expire when it ticks over.
+ * net_crypto keeps its own millisecond timers. While TCP data waits for a
+ * socket to become writable, the deadline is a short back-off.
+ *
+ * returns 0 if do_messenger() should be called again immediately.
+ */
+uint32_t messenger_run_deadline(const Messenger *m);
+
+/* Copy every socket do_messenger() reads from to socks: the UDP socket, the
+ * TCP relay connections and, if enabled, the local TCP server.
+ *
+ * At most max_socks sockets are written to socks.
+ *
+ * return the total number of sockets, which may be larger than max_socks.
+ */
+uint32_t messenger_wait_sockets(const Messenger *m, Socket *socks, uint32_t max_socks);
+
 /* SAVING AND LOADING FUNCTIONS: */
 
 /* Registers a state plugin for saving, loadding, and getting the size of a section of the save
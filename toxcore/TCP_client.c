@@ -32,6 +32,7 @@
 #include <string.h>
 
 #include "mono_time.h"
+#include "send_buffer.h"
 #include "util.h"
 
 typedef struct TCP_Client_Conn {
@@ -55,12 +56,12 @@ struct TCP_Client_Connection {
 
     uint8_t temp_secret_key[CRYPTO_SECRET_KEY_SIZE];
 
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
+    /* Proxy requests, the handshake and encrypted packets the socket did not
+     * take yet. */
+    Send_Buffer send_buffer;
 
-    TCP_Priority_List *priority_queue_start;
-    TCP_Priority_List *priority_queue_end;
+    /* Counts the connection while send_buffer is not empty, if set. */
+    uint32_t *pending_count;
 
     uint64_t kill_at;
 
@@ -102,6 +103,32 @@ TCP_Client_Status tcp_con_status(const TCP_Client_Connection *con)
 {
     return con->status;
 }
+Socket tcp_con_sock(const TCP_Client_Connection *con)
+{
+    return con->sock;
+}
+bool tcp_con_has_pending_data(const TCP_Client_Connection *con)
+{
+    return send_buffer_length(&con->send_buffer) != 0;
+}
+void tcp_con_set_pending_count(TCP_Client_Connection *con, uint32_t *count)
+{
+    if (con->pending_count == count) {
+        return;
+    }
+
+    if (tcp_con_has_pending_data(con)) {
+        if (con->pending_count != nullptr) {
+            --*con->pending_count;
+        }
+
+        if (count != nullptr) {
+            ++*count;
+        }
+    }
+
+    con->pending_count = count;
+}
 void *tcp_con_custom_object(const TCP_Client_Connection *con)
 {
     return con->custom_object;
@@ -133,6 +160,25 @@ static int connect_sock_to(Socket sock, IP_Port ip_port, TCP_Proxy_Info *proxy_i
     return 1;
 }
 
+/* Append to the send buffer, keeping the pending count up to date.
+ *
+ * return false if it does not fit or memory allocation failed.
+ */
+static bool client_queue_data(TCP_Client_Connection *con, const uint8_t *data, uint32_t length)
+{
+    const bool was_empty = send_buffer_length(&con->send_buffer) == 0;
+
+    if (!send_buffer_add(&con->send_buffer, data, length)) {
+        return false;
+    }
+
+    if (was_empty && length != 0 && con->pending_count != nullptr) {
+        ++*con->pending_count;
+    }
+
+    return true;
+}
+
 /* return 1 on success.
  * return 0 on failure.
  */
@@ -149,17 +195,14 @@ static int proxy_http_generate_connection_request(TCP_Client_Connection *tcp_con
     }
 
     const uint16_t port = net_ntohs(tcp_conn->ip_port.port);
-    const int written = snprintf((char *)tcp_conn->last_packet, MAX_PACKET_SIZE, "%s%s:%hu%s%s:%hu%s", one, ip, port, two,
-                                 ip, port, three);
+    char request[MAX_PACKET_SIZE];
+    const int written = snprintf(request, sizeof(request), "%s%s:%hu%s%s:%hu%s", one, ip, port, two, ip, port, three);
 
     if (written < 0 || MAX_PACKET_SIZE < written) {
         return 0;
     }
 
-    tcp_conn->last_packet_length = written;
-    tcp_conn->last_packet_sent = 0;
-
-    return 1;
+    return client_queue_data(tcp_conn, (const uint8_t *)request, written);
 }
 
 /* return 1 on success.
@@ -194,14 +237,17 @@ static int proxy_http_read_connection_response(TCP_Client_Connection *tcp_conn)
     return -1;
 }
 
-static void proxy_socks5_generate_handshake(TCP_Client_Connection *tcp_conn)
+/* return 1 on success.
+ * return 0 on failure.
+ */
+static int proxy_socks5_generate_handshake(TCP_Client_Connection *tcp_conn)
 {
-    tcp_conn->last_packet[0] = 5; /* SOCKSv5 */
-    tcp_conn->last_packet[1] = 1; /* number of authentication methods supported */
-    tcp_conn->last_packet[2] = 0; /* No authentication */
+    uint8_t request[3];
+    request[0] = 5; /* SOCKSv5 */
+    request[1] = 1; /* number of authentication methods supported */
+    request[2] = 0; /* No authentication */
 
-    tcp_conn->last_packet_length = 3;
-    tcp_conn->last_packet_sent = 0;
+    return client_queue_data(tcp_conn, request, sizeof(request));
 }
 
 /* return 1 on success.
@@ -224,30 +270,33 @@ static int socks5_read_handshake_response(TCP_Client_Connection *tcp_conn)
     return -1;
 }
 
-static void proxy_socks5_generate_connection_request(TCP_Client_Connection *tcp_conn)
+/* return 1 on success.
+ * return 0 on failure.
+ */
+static int proxy_socks5_generate_connection_request(TCP_Client_Connection *tcp_conn)
 {
-    tcp_conn->last_packet[0] = 5; /* SOCKSv5 */
-    tcp_conn->last_packet[1] = 1; /* command code: establish a TCP/IP stream connection */
-    tcp_conn->last_packet[2] = 0; /* reserved, must be 0 */
+    uint8_t request[4 + sizeof(IP6) + sizeof(uint16_t)];
+    request[0] = 5; /* SOCKSv5 */
+    request[1] = 1; /* command code: establish a TCP/IP stream connection */
+    request[2] = 0; /* reserved, must be 0 */
     uint16_t length = 3;
 
     if (net_family_is_ipv4(tcp_conn->ip_port.ip.family)) {
-        tcp_conn->last_packet[3] = 1; /* IPv4 address */
+        request[3] = 1; /* IPv4 address */
         ++length;
-        memcpy(tcp_conn->last_packet + length, tcp_conn->ip_port.ip.ip.v4.uint8, sizeof(IP4));
+        memcpy(request + length, tcp_conn->ip_port.ip.ip.v4.uint8, sizeof(IP4));
         length += sizeof(IP4);
     } else {
-        tcp_conn->last_packet[3] = 4; /* IPv6 address */
+        request[3] = 4; /* IPv6 address */
         ++length;
-        memcpy(tcp_conn->last_packet + length, tcp_conn->ip_port.ip.ip.v6.uint8, sizeof(IP6));
+        memcpy(request + length, tcp_conn->ip_port.ip.ip.v6.uint8, sizeof(IP6));
         length += sizeof(IP6);
     }
 
-    memcpy(tcp_conn->last_packet + length, &tcp_conn->ip_port.port, sizeof(uint16_t));
+    memcpy(request + length, &tcp_conn->ip_port.port, sizeof(uint16_t));
     length += sizeof(uint16_t);
 
-    tcp_conn->last_packet_length = length;
-    tcp_conn->last_packet_sent = 0;
+    return client_queue_data(tcp_conn, request, length);
 }
 
 /* return 1 on success.
@@ -292,17 +341,20 @@ static int generate_handshake(TCP_Client_Connection *tcp_conn)
     crypto_new_keypair(plain, tcp_conn->temp_secret_key);
     random_nonce(tcp_conn->sent_nonce);
     memcpy(plain + CRYPTO_PUBLIC_KEY_SIZE, tcp_conn->sent_nonce, CRYPTO_NONCE_SIZE);
-    memcpy(tcp_conn->last_packet, tcp_conn->self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    random_nonce(tcp_conn->last_packet + CRYPTO_PUBLIC_KEY_SIZE);
-    int len = encrypt_data_symmetric(tcp_conn->shared_key, tcp_conn->last_packet + CRYPTO_PUBLIC_KEY_SIZE, plain,
-                                     sizeof(plain), tcp_conn->last_packet + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE);
+    uint8_t handshake[TCP_CLIENT_HANDSHAKE_SIZE];
+    memcpy(handshake, tcp_conn->self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    random_nonce(handshake + CRYPTO_PUBLIC_KEY_SIZE);
+    int len = encrypt_data_symmetric(tcp_conn->shared_key, handshake + CRYPTO_PUBLIC_KEY_SIZE, plain,
+                                     sizeof(plain), handshake + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE);
 
     if (len != sizeof(plain) + CRYPTO_MAC_SIZE) {
         return -1;
     }
 
-    tcp_conn->last_packet_length = CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + sizeof(plain) + CRYPTO_MAC_SIZE;
-    tcp_conn->last_packet_sent = 0;
+    if (!client_queue_data(tcp_conn, handshake, sizeof(handshake))) {
+        return -1;
+    }
+
     return 0;
 }
 
@@ -327,107 +379,18 @@ static int handle_handshake(TCP_Client_Connection *tcp_conn, const uint8_t *data
     return 0;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
- */
-static int client_send_pending_data_nonpriority(TCP_Client_Connection *con)
-{
-    if (con->last_packet_length == 0) {
-        return 0;
-    }
-
-    const uint16_t left = con->last_packet_length - con->last_packet_sent;
-    const int len = net_send(con->sock, con->last_packet + con->last_packet_sent, left);
-
-    if (len <= 0) {
-        return -1;
-    }
-
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
-        return 0;
-    }
-
-    con->last_packet_sent += len;
-    return -1;
-}
-
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
- */
-static int client_send_pending_data(TCP_Client_Connection *con)
-{
-    /* finish sending current non-priority packet */
-    if (client_send_pending_data_nonpriority(con) == -1) {
-        return -1;
-    }
-
-    TCP_Priority_List *p = con->priority_queue_start;
-
-    while (p) {
-        const uint16_t left = p->size - p->sent;
-        const int len = net_send(con->sock, p->data + p->sent, left);
-
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
-
-            break;
-        }
-
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
-
-    con->priority_queue_start = p;
-
-    if (!p) {
-        con->priority_queue_end = nullptr;
-        return 0;
-    }
-
-    return -1;
-}
-
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
+/* return true if the send buffer was sent completely.
  */
-static bool client_add_priority(TCP_Client_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
+static bool client_send_pending_data(TCP_Client_Connection *con)
 {
-    TCP_Priority_List *p = con->priority_queue_end;
-    TCP_Priority_List *new_list = (TCP_Priority_List *)malloc(sizeof(TCP_Priority_List) + size);
+    const bool had_data = send_buffer_length(&con->send_buffer) != 0;
+    const bool empty = send_buffer_flush(&con->send_buffer, con->sock);
 
-    if (!new_list) {
-        return 0;
+    if (had_data && empty && con->pending_count != nullptr) {
+        --*con->pending_count;
     }
 
-    new_list->next = nullptr;
-    new_list->size = size;
-    new_list->sent = sent;
-    memcpy(new_list->data, packet, size);
-
-    if (p) {
-        p->next = new_list;
-    } else {
-        con->priority_queue_start = new_list;
-    }
-
-    con->priority_queue_end = new_list;
-    return 1;
-}
-
-static void wipe_priority_list(TCP_Client_Connection *con)
-{
-    TCP_Priority_List *p = con->priority_queue_start;
-
-    while (p) {
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
+    return empty;
 }
 
 /* return 1 on success.
@@ -443,7 +406,7 @@ static int write_packet_TCP_client_secure_connection(TCP_Client_Connection *con,
 
     bool sendpriority = 1;
 
-    if (client_send_pending_data(con) == -1) {
+    if (!client_send_pending_data(con)) {
         if (priority) {
             sendpriority = 0;
         } else {
@@ -453,6 +416,12 @@ static int write_packet_TCP_client_secure_connection(TCP_Client_Connection *con,
 
     VLA(uint8_t, packet, sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
 
+    /* Check before the nonce is used up: once it is, the packet has to go out. */
+    if (send_buffer_space(&con->send_buffer) < SIZEOF_VLA(packet)) {
+        ++con->send_buffer.refused;
+        return 0;
+    }
+
     uint16_t c_length = net_htons(length + CRYPTO_MAC_SIZE);
     memcpy(packet, &c_length, sizeof(uint16_t));
     int len = encrypt_data_symmetric(con->shared_key, con->sent_nonce, data, length, packet + sizeof(uint16_t));
@@ -467,20 +436,12 @@ static int write_packet_TCP_client_secure_connection(TCP_Client_Connection *con,
         if (len <= 0) {
             len = 0;
         }
+    } else {
+        len = net_send(con->sock, packet, SIZEOF_VLA(packet));
 
-        increment_nonce(con->sent_nonce);
-
-        if ((unsigned int)len == SIZEOF_VLA(packet)) {
-            return 1;
+        if (len <= 0) {
+            return 0;
         }
-
-        return client_add_priority(con, packet, SIZEOF_VLA(packet), len);
-    }
-
-    len = net_send(con->sock, packet, SIZEOF_VLA(packet));
-
-    if (len <= 0) {
-        return 0;
     }
 
     increment_nonce(con->sent_nonce);
@@ -489,9 +450,10 @@ static int write_packet_TCP_client_secure_connection(TCP_Client_Connection *con,
         return 1;
     }
 
-    memcpy(con->last_packet, packet, SIZEOF_VLA(packet));
-    con->last_packet_length = SIZEOF_VLA(packet);
-    con->last_packet_sent = len;
+    if (!client_queue_data(con, packet + len, SIZEOF_VLA(packet) - len)) {
+        return -1;
+    }
+
     return 1;
 }
 
@@ -736,6 +698,7 @@ TCP_Client_Connection *new_TCP_connection(const Mono_Time *mono_time, IP_Port ip
     }
 
     temp->sock = sock;
+    send_buffer_init(&temp->send_buffer, TCP_SEND_BUFFER_SIZE);
     memcpy(temp->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(temp->self_public_key, self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
     encrypt_precompute(temp->public_key, self_secret_key, temp->shared_key);
@@ -949,7 +912,7 @@ static bool tcp_process_packet(TCP_Client_Connection *conn, void *userdata)
     return true;
 }
 
-static int do_confirmed_TCP(TCP_Client_Connection *conn, const Mono_Time *mono_time, void *userdata)
+static int do_confirmed_TCP(TCP_Client_Connection *conn, const Mono_Time *mono_time, bool readable, void *userdata)
 {
     client_send_pending_data(conn);
     tcp_send_ping_response(conn);
@@ -973,6 +936,10 @@ static int do_confirmed_TCP(TCP_Client_Connection *conn, const Mono_Time *mono_t
         return 0;
     }
 
+    if (!readable) {
+        return 0;
+    }
+
     while (tcp_process_packet(conn, userdata)) {
         // Keep reading until error or out of data.
         continue;
@@ -984,13 +951,19 @@ static int do_confirmed_TCP(TCP_Client_Connection *conn, const Mono_Time *mono_t
 /* Run the TCP connection
  */
 void do_TCP_connection(Mono_Time *mono_time, TCP_Client_Connection *tcp_connection, void *userdata)
+{
+    do_TCP_connection_ready(mono_time, tcp_connection, true, userdata);
+}
+
+void do_TCP_connection_ready(Mono_Time *mono_time, TCP_Client_Connection *tcp_connection, bool readable,
+                             void *userdata)
 {
     if (tcp_connection->status == TCP_CLIENT_DISCONNECTED) {
         return;
     }
 
     if (tcp_connection->status == TCP_CLIENT_PROXY_HTTP_CONNECTING) {
-        if (client_send_pending_data(tcp_connection) == 0) {
+        if (client_send_pending_data(tcp_connection) && readable) {
             int ret = proxy_http_read_connection_response(tcp_connection);
 
             if (ret == -1) {
@@ -1006,7 +979,7 @@ void do_TCP_connection(Mono_Time *mono_time, TCP_Client_Connection *tcp_connecti
     }
 
     if (tcp_connection->status == TCP_CLIENT_PROXY_SOCKS5_CONNECTING) {
-        if (client_send_pending_data(tcp_connection) == 0) {
+        if (client_send_pending_data(tcp_connection) && readable) {
             int ret = socks5_read_handshake_response(tcp_connection);
 
             if (ret == -1) {
@@ -1022,7 +995,7 @@ void do_TCP_connection(Mono_Time *mono_time, TCP_Client_Connection *tcp_connecti
     }
 
     if (tcp_connection->status == TCP_CLIENT_PROXY_SOCKS5_UNCONFIRMED) {
-        if (client_send_pending_data(tcp_connection) == 0) {
+        if (client_send_pending_data(tcp_connection) && readable) {
             int ret = proxy_socks5_read_connection_response(tcp_connection);
 
             if (ret == -1) {
@@ -1038,12 +1011,12 @@ void do_TCP_connection(Mono_Time *mono_time, TCP_Client_Connection *tcp_connecti
     }
 
     if (tcp_connection->status == TCP_CLIENT_CONNECTING) {
-        if (client_send_pending_data(tcp_connection) == 0) {
+        if (client_send_pending_data(tcp_connection)) {
             tcp_connection->status = TCP_CLIENT_UNCONFIRMED;
         }
     }
 
-    if (tcp_connection->status == TCP_CLIENT_UNCONFIRMED) {
+    if (tcp_connection->status == TCP_CLIENT_UNCONFIRMED && readable) {
         uint8_t data[TCP_SERVER_HANDSHAKE_SIZE];
         int len = read_TCP_packet(tcp_connection->sock, data, sizeof(data));
 
@@ -1059,7 +1032,7 @@ void do_TCP_connection(Mono_Time *mono_time, TCP_Client_Connection *tcp_connecti
     }
 
     if (tcp_connection->status == TCP_CLIENT_CONFIRMED) {
-        do_confirmed_TCP(tcp_connection, mono_time, userdata);
+        do_confirmed_TCP(tcp_connection, mono_time, readable, userdata);
     }
 
     if (tcp_connection->kill_at <= mono_time_get(mono_time)) {
@@ -1075,8 +1048,9 @@ void kill_TCP_connection(TCP_Client_Connection *tcp_connection)
         return;
     }
 
-    wipe_priority_list(tcp_connection);
     kill_sock(tcp_connection->sock);
+    tcp_con_set_pending_count(tcp_connection, nullptr);
+    send_buffer_free(&tcp_connection->send_buffer);
     crypto_memzero(tcp_connection, sizeof(TCP_Client_Connection));
     free(tcp_connection);
 }
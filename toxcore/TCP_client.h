@@ -56,6 +56,19 @@ typedef struct TCP_Client_Connection TCP_Client_Connection;
 const uint8_t *tcp_con_public_key(const TCP_Client_Connection *con);
 IP_Port tcp_con_ip_port(const TCP_Client_Connection *con);
 TCP_Client_Status tcp_con_status(const TCP_Client_Connection *con);
+Socket tcp_con_sock(const TCP_Client_Connection *con);
+
+/* return true if the connection has data that could not be sent yet because
+ * the socket was not writable.
+ */
+bool tcp_con_has_pending_data(const TCP_Client_Connection *con);
+
+/* Keep *count increased by one for as long as the connection has pending
+ * data, so that the owner of many connections doesn't have to check each one.
+ * Pass NULL to stop. The count is decreased again when the connection is
+ * killed.
+ */
+void tcp_con_set_pending_count(TCP_Client_Connection *con, uint32_t *count);
 
 void *tcp_con_custom_object(const TCP_Client_Connection *con);
 uint32_t tcp_con_custom_uint(const TCP_Client_Connection *con);
@@ -71,6 +84,13 @@ TCP_Client_Connection *new_TCP_connection(const Mono_Time *mono_time, IP_Port ip
  */
 void do_TCP_connection(Mono_Time *mono_time, TCP_Client_Connection *tcp_connection, void *userdata);
 
+/* Run the TCP connection like do_TCP_connection(), but only read from its
+ * socket if readable is true, e.g. because an event loop saw it become
+ * readable. Pending data, pings and timeouts are handled either way.
+ */
+void do_TCP_connection_ready(Mono_Time *mono_time, TCP_Client_Connection *tcp_connection, bool readable,
+                             void *userdata);
+
 /* Kill the TCP connection
  */
 void kill_TCP_connection(TCP_Client_Connection *tcp_connection);
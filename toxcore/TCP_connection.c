@@ -31,6 +31,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef TCP_SERVER_USE_EPOLL
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
 #include "mono_time.h"
 #include "util.h"
 
@@ -59,8 +64,17 @@ struct TCP_Connections {
 
     TCP_Proxy_Info proxy_info;
 
+    /* Relay connections with data the socket did not take yet. */
+    uint32_t pending_connections;
+
     bool onion_status;
     uint16_t onion_num_conns;
+
+#ifdef TCP_SERVER_USE_EPOLL
+    /* Readiness of the sockets of all relay connections, -1 if epoll could not
+     * be used and every socket is read from on each iteration. */
+    int efd;
+#endif
 };
 
 
@@ -115,6 +129,70 @@ static int realloc_TCP_con(TCP_con **array, size_t num)
 }
 
 
+#ifdef TCP_SERVER_USE_EPOLL
+/* Maximum number of events taken from the epoll set per epoll_wait() call. */
+#define TCP_CONNECTIONS_MAX_EVENTS 64
+
+static void tcp_relays_stop_epoll(TCP_Connections *tcp_c)
+{
+    if (tcp_c->efd != -1) {
+        close(tcp_c->efd);
+        tcp_c->efd = -1;
+    }
+}
+#endif
+
+/* Add the socket of the relay connection to the epoll set. */
+static void tcp_relay_watch(TCP_Connections *tcp_c, int tcp_connections_number)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+    const TCP_con *tcp_con = &tcp_c->tcp_connections[tcp_connections_number];
+
+    if (tcp_c->efd == -1 || tcp_con->connection == nullptr) {
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = tcp_connections_number;
+
+    if (epoll_ctl(tcp_c->efd, EPOLL_CTL_ADD, tcp_con_sock(tcp_con->connection).socket, &ev) == -1) {
+        /* A socket missing from the set would never be read, so read all of
+         * them instead. */
+        tcp_relays_stop_epoll(tcp_c);
+    }
+
+#endif
+}
+
+/* Remove the socket of the relay connection from the epoll set. Call this
+ * before the connection is killed. */
+static void tcp_relay_unwatch(TCP_Connections *tcp_c, const TCP_con *tcp_con)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_c->efd == -1 || tcp_con->connection == nullptr) {
+        return;
+    }
+
+    struct epoll_event ev;
+    epoll_ctl(tcp_c->efd, EPOLL_CTL_DEL, tcp_con_sock(tcp_con->connection).socket, &ev);
+#endif
+}
+
+/* return true if do_tcp_conns() should read from the socket of the relay connection. */
+static bool tcp_relay_readable(const TCP_Connections *tcp_c, const TCP_con *tcp_con)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_c->efd != -1) {
+        return tcp_con->readable;
+    }
+
+#endif
+    return true;
+}
+
 /* return 1 if the connections_number is not valid.
  * return 0 if the connections_number is valid.
  */
@@ -774,6 +852,7 @@ static int kill_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connections
         --tcp_c->onion_num_conns;
     }
 
+    tcp_relay_unwatch(tcp_c, tcp_con);
     kill_TCP_connection(tcp_con->connection);
 
     return wipe_tcp_connection(tcp_c, tcp_connections_number);
@@ -794,6 +873,7 @@ static int reconnect_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connec
     IP_Port ip_port = tcp_con_ip_port(tcp_con->connection);
     uint8_t relay_pk[CRYPTO_PUBLIC_KEY_SIZE];
     memcpy(relay_pk, tcp_con_public_key(tcp_con->connection), CRYPTO_PUBLIC_KEY_SIZE);
+    tcp_relay_unwatch(tcp_c, tcp_con);
     kill_TCP_connection(tcp_con->connection);
     tcp_con->connection = new_TCP_connection(tcp_c->mono_time, ip_port, relay_pk, tcp_c->self_public_key,
                           tcp_c->self_secret_key, &tcp_c->proxy_info);
@@ -803,6 +883,9 @@ static int reconnect_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connec
         return -1;
     }
 
+    tcp_con_set_pending_count(tcp_con->connection, &tcp_c->pending_connections);
+    tcp_relay_watch(tcp_c, tcp_connections_number);
+
     unsigned int i;
 
     for (i = 0; i < tcp_c->connections_length; ++i) {
@@ -846,6 +929,7 @@ static int sleep_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connection
     tcp_con->ip_port = tcp_con_ip_port(tcp_con->connection);
     memcpy(tcp_con->relay_pk, tcp_con_public_key(tcp_con->connection), CRYPTO_PUBLIC_KEY_SIZE);
 
+    tcp_relay_unwatch(tcp_c, tcp_con);
     kill_TCP_connection(tcp_con->connection);
     tcp_con->connection = nullptr;
 
@@ -893,6 +977,9 @@ static int unsleep_tcp_relay_connection(TCP_Connections *tcp_c, int tcp_connecti
         return -1;
     }
 
+    tcp_con_set_pending_count(tcp_con->connection, &tcp_c->pending_connections);
+    tcp_relay_watch(tcp_c, tcp_connections_number);
+
     tcp_con->lock_count = 0;
     tcp_con->sleep_count = 0;
     tcp_con->connected_time = 0;
@@ -1164,6 +1251,8 @@ static int add_tcp_relay_instance(TCP_Connections *tcp_c, IP_Port ip_port, const
     }
 
     tcp_con->status = TCP_CONN_VALID;
+    tcp_con_set_pending_count(tcp_con->connection, &tcp_c->pending_connections);
+    tcp_relay_watch(tcp_c, tcp_connections_number);
 
     return tcp_connections_number;
 }
@@ -1410,11 +1499,49 @@ TCP_Connections *new_tcp_connections(Mono_Time *mono_time, const uint8_t *secret
     crypto_derive_public_key(temp->self_public_key, temp->self_secret_key);
     temp->proxy_info = *proxy_info;
 
+#ifdef TCP_SERVER_USE_EPOLL
+    temp->efd = epoll_create(8);
+#endif
+
     return temp;
 }
 
+/* Mark the relay connections whose sockets have data as readable. */
+static void poll_tcp_relays(TCP_Connections *tcp_c)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_c->efd == -1) {
+        return;
+    }
+
+    struct epoll_event events[TCP_CONNECTIONS_MAX_EVENTS];
+
+    /* Sockets that stay readable go to the back of the ready list, so each
+     * call returns different ones. */
+    for (uint32_t polled = 0; polled < tcp_c->tcp_connections_length; polled += TCP_CONNECTIONS_MAX_EVENTS) {
+        const int nfds = epoll_wait(tcp_c->efd, events, TCP_CONNECTIONS_MAX_EVENTS, 0);
+
+        for (int n = 0; n < nfds; ++n) {
+            TCP_con *tcp_con = get_tcp_connection(tcp_c, events[n].data.u64);
+
+            if (tcp_con) {
+                tcp_con->readable = 1;
+            }
+        }
+
+        if (nfds < TCP_CONNECTIONS_MAX_EVENTS) {
+            break;
+        }
+    }
+
+#endif
+}
+
 static void do_tcp_conns(TCP_Connections *tcp_c, void *userdata)
 {
+    poll_tcp_relays(tcp_c);
+
     unsigned int i;
 
     for (i = 0; i < tcp_c->tcp_connections_length; ++i) {
@@ -1422,7 +1549,9 @@ static void do_tcp_conns(TCP_Connections *tcp_c, void *userdata)
 
         if (tcp_con) {
             if (tcp_con->status != TCP_CONN_SLEEPING) {
-                do_TCP_connection(tcp_c->mono_time, tcp_con->connection, userdata);
+                const bool readable = tcp_relay_readable(tcp_c, tcp_con);
+                tcp_con->readable = 0;
+                do_TCP_connection_ready(tcp_c->mono_time, tcp_con->connection, readable, userdata);
 
                 /* callbacks can change TCP connection address. */
                 tcp_con = get_tcp_connection(tcp_c, i);
@@ -1506,6 +1635,44 @@ void do_tcp_connections(TCP_Connections *tcp_c, void *userdata)
     kill_nonused_tcp(tcp_c);
 }
 
+uint32_t tcp_connections_wait_sockets(const TCP_Connections *tcp_c, Socket *socks, uint32_t max_socks)
+{
+    uint32_t count = 0;
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_c->efd != -1) {
+        if (max_socks > 0) {
+            socks[0].socket = tcp_c->efd;
+        }
+
+        return 1;
+    }
+
+#endif
+
+    for (uint32_t i = 0; i < tcp_c->tcp_connections_length; ++i) {
+        const TCP_Client_Connection *const con = tcp_c->tcp_connections[i].connection;
+
+        if (con == nullptr) {
+            continue;
+        }
+
+        if (count < max_socks) {
+            socks[count] = tcp_con_sock(con);
+        }
+
+        ++count;
+    }
+
+    return count;
+}
+
+bool tcp_connections_have_pending_data(const TCP_Connections *tcp_c)
+{
+    return tcp_c->pending_connections != 0;
+}
+
 void kill_tcp_connections(TCP_Connections *tcp_c)
 {
     unsigned int i;
@@ -1514,6 +1681,10 @@ void kill_tcp_connections(TCP_Connections *tcp_c)
         kill_TCP_connection(tcp_c->tcp_connections[i].connection);
     }
 
+#ifdef TCP_SERVER_USE_EPOLL
+    tcp_relays_stop_epoll(tcp_c);
+#endif
+
     free(tcp_c->tcp_connections);
     free(tcp_c->connections);
     free(tcp_c);
@@ -78,6 +78,8 @@ typedef struct TCP_con {
     IP_Port ip_port;
     uint8_t relay_pk[CRYPTO_PUBLIC_KEY_SIZE];
     bool unsleep; /* set to 1 to unsleep connection. */
+
+    bool readable; /* The socket had data at the last epoll_wait(). */
 } TCP_con;
 
 typedef struct TCP_Connections TCP_Connections;
@@ -222,6 +224,23 @@ uint32_t tcp_copy_connected_relays(TCP_Connections *tcp_c, Node_format *tcp_rela
 TCP_Connections *new_tcp_connections(Mono_Time *mono_time, const uint8_t *secret_key, TCP_Proxy_Info *proxy_info);
 
 void do_tcp_connections(TCP_Connections *tcp_c, void *userdata);
+
+/* Copy the sockets of all TCP relay connections to socks, e.g. to wait for
+ * them to become readable in an event loop before calling
+ * do_tcp_connections(). Sleeping connections have no socket. With epoll this
+ * is a single epoll descriptor covering the sockets of all relay connections,
+ * and do_tcp_connections() only reads from the sockets it reports.
+ *
+ * At most max_socks sockets are written to socks.
+ *
+ * return the total number of sockets, which may be larger than max_socks.
+ */
+uint32_t tcp_connections_wait_sockets(const TCP_Connections *tcp_c, Socket *socks, uint32_t max_socks);
+
+/* return true if some relay connection has data that could not be sent yet
+ * because its socket was not writable.
+ */
+bool tcp_connections_have_pending_data(const TCP_Connections *tcp_c);
 void kill_tcp_connections(TCP_Connections *tcp_c);
 
 #endif
@@ -27,6 +27,7 @@
 
 #include "TCP_server.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,10 +37,13 @@
 
 #ifdef TCP_SERVER_USE_EPOLL
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #endif
 
+#include "key_map.h"
 #include "mono_time.h"
+#include "send_buffer.h"
 #include "util.h"
 
 #ifdef TCP_SERVER_USE_EPOLL
@@ -47,6 +51,7 @@
 #define TCP_SOCKET_INCOMING 1
 #define TCP_SOCKET_UNCONFIRMED 2
 #define TCP_SOCKET_CONFIRMED 3
+#define TCP_SOCKET_WAKEUP 4
 #endif
 
 typedef struct TCP_Secure_Conn {
@@ -55,6 +60,7 @@ typedef struct TCP_Secure_Conn {
     // TODO(iphydf): Add an enum for this (same as in TCP_client.c, probably).
     uint8_t status; /* 0 if not used, 1 if other is offline, 2 if other is online. */
     uint8_t other_id;
+    uint8_t shard;  /* Shard of the other connection if status is 2, index is into its array. */
 } TCP_Secure_Conn;
 
 typedef struct TCP_Secure_Connection {
@@ -65,13 +71,20 @@ typedef struct TCP_Secure_Connection {
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
     uint16_t next_packet_length;
     TCP_Secure_Conn connections[NUM_CLIENT_CONNECTIONS];
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
     uint8_t status;
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
 
-    TCP_Priority_List *priority_queue_start;
-    TCP_Priority_List *priority_queue_end;
+    /* Encrypted packets the socket did not take yet. */
+    Send_Buffer send_buffer;
+    /* The connection is on the batch list and send_buffer only holds packets
+     * from the current do_TCP_server() call. */
+    bool batched;
+    /* The connection is on the unread list: reading stopped at the per-socket
+     * limit, so its socket may still have data. */
+    bool unread;
+    /* send_buffer got emptied since do_TCP_confirmed() last looked. */
+    bool drained;
+    /* Last time do_TCP_confirmed() found send_buffer empty or drained. */
+    uint64_t last_drained;
 
     uint64_t identifier;
 
@@ -80,13 +93,115 @@ typedef struct TCP_Secure_Connection {
 } TCP_Secure_Connection;
 
 
+/* Onion packet waiting in a mailbox to be handed to the other thread. */
+typedef struct TCP_Onion_Packet TCP_Onion_Packet;
+
+struct TCP_Onion_Packet {
+    TCP_Onion_Packet *next;
+    IP_Port ip_port;
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    uint16_t length;
+    uint8_t data[];
+};
+
+typedef struct TCP_Onion_Mailbox {
+    pthread_mutex_t mutex;
+    TCP_Onion_Packet *start;
+    TCP_Onion_Packet *end;
+    uint32_t count;
+#ifdef TCP_SERVER_USE_EPOLL
+    /* Readable while the mailbox has packets, so that the thread taking them
+     * out wakes up when the mailbox stops being empty. The server waits on the
+     * one for responses in its epoll set, the onion thread polls the one for
+     * requests. -1 if nothing waits on it. */
+    int wakeup;
+#endif
+} TCP_Onion_Mailbox;
+
+/* Counters of a server that runs on another thread than the one reading
+ * them, as of its last do_TCP_server() call that published them. */
+typedef struct TCP_Stats_Snapshot {
+    pthread_mutex_t mutex;
+    TCP_Server_Stats stats;
+} TCP_Stats_Snapshot;
+
+/* Messages between the shards of a server, see tcp_server_set_shards(). */
+#define TCP_SHARD_HANDOFF 0 /* A connection that completed the handshake, for the shard its key maps to. */
+#define TCP_SHARD_LINK 1    /* A client asked to be routed to a client of the receiving shard. */
+#define TCP_SHARD_UNLINK 2  /* A routed connection went away on the sending side. */
+#define TCP_SHARD_DATA 3    /* Data packet for the other end of a routed connection. */
+#define TCP_SHARD_OOB 4     /* Out of band packet for a client of the receiving shard. */
+
+typedef struct TCP_Shard_Message {
+    uint8_t type;
+    uint8_t slot;         /* Entry in the connections array of the receiving client. */
+    uint8_t other_slot;   /* Entry in the connections array of the sending client. */
+    uint16_t length;      /* Bytes of data following the message. */
+    uint32_t index;       /* Receiving client in the accepted connections of its shard. */
+    uint32_t other_index; /* Sending client in the accepted connections of its shard. */
+} TCP_Shard_Message;
+
+/* Messages from one shard to another, written one after the other into data.
+ * A shard collects its messages for another shard in one batch while it runs
+ * and hands the whole batch over at the end. */
+typedef struct TCP_Shard_Batch TCP_Shard_Batch;
+
+struct TCP_Shard_Batch {
+    TCP_Shard_Batch *next;
+    uint32_t from;
+    uint32_t length;
+    uint32_t size;
+    uint8_t data[];
+};
+
+typedef struct TCP_Shard_Mailbox {
+    pthread_mutex_t mutex;
+    TCP_Shard_Batch *start;
+    TCP_Shard_Batch *end;
+    uint32_t length; /* Bytes of messages in all batches. */
+#ifdef TCP_SERVER_USE_EPOLL
+    /* In the epoll set of the shard, so that a shard waiting for its sockets
+     * wakes up when the mailbox stops being empty. */
+    int wakeup;
+#endif
+} TCP_Shard_Mailbox;
+
 struct TCP_Server {
     Onion *onion;
 
+    /* Non-NULL when the onion instance is run on a different thread, see
+     * tcp_server_enable_onion_mailbox().
+     */
+    TCP_Onion_Mailbox *onion_requests;
+    TCP_Onion_Mailbox *onion_responses;
+    TCP_Stats_Snapshot *stats_snapshot;
+
+    /* Set by tcp_server_set_shards(). The list is shared by all shards and
+     * owned by the server they were split from, which is shards[0]. */
+    TCP_Server **shards;
+    uint32_t num_shards;
+    uint32_t shard_id;
+    /* Seed of the hash picking the shard of a public key, the same on all
+     * shards. Random so that clients can't pick keys that pile onto one. */
+    uint64_t shard_seed;
+    TCP_Shard_Mailbox *mailbox;
+    TCP_Shard_Batch **outbox; /* Messages for each shard that were not handed over yet. */
+
 #ifdef TCP_SERVER_USE_EPOLL
     int efd;
     uint64_t last_run_pinged;
+
+    struct epoll_event *events;
+    uint32_t max_events;
+
+    /* Accepted connections whose sockets were not read dry. Edge-triggered
+     * epoll won't report them again until more data arrives. */
+    uint32_t *unread;
+    uint32_t unread_length;
+    uint32_t unread_size;
 #endif
+    uint32_t max_socket_reads;
+
     Socket *socks_listening;
     unsigned int num_listening_socks;
 
@@ -101,9 +216,41 @@ struct TCP_Server {
     uint32_t size_accepted_connections;
     uint32_t num_accepted_connections;
 
+    /* Unused indices of accepted_connection_array, the next one to use last. */
+    uint32_t *free_indices;
+    uint32_t num_free_indices;
+
     uint64_t counter;
 
-    BS_List accepted_key_list;
+    /* Cap of the send buffer of new connections. */
+    uint32_t send_buffer_size;
+
+    /* Bytes in the send buffers of all accepted connections, and the cap on
+     * them, see tcp_server_set_queue_limits(). */
+    uint64_t queued_bytes;
+    uint64_t max_queued_bytes;
+    uint32_t drain_timeout;
+
+    /* Accepted connections with bytes in their send buffers. */
+    uint32_t pending_connections;
+
+    uint64_t handshake_failures;
+    uint64_t dropped_packets;
+    uint64_t slow_kills;
+    TCP_Packet_Stats packet_stats[TCP_STATS_PACKET_TYPES];
+
+    /* When the stats were last published to stats_snapshot. */
+    uint64_t last_published;
+
+    /* While do_TCP_server() runs, packets are only added to the send buffers,
+     * and the connections that got some are listed here to be flushed with one
+     * send call each at the end. */
+    bool batching;
+    uint32_t *batch;
+    uint32_t batch_length;
+    uint32_t batch_size;
+
+    Key_Map accepted_key_list;
 };
 
 const uint8_t *tcp_server_public_key(const TCP_Server *tcp_server)
@@ -116,6 +263,40 @@ size_t tcp_server_listen_count(const TCP_Server *tcp_server)
     return tcp_server->num_listening_socks;
 }
 
+void tcp_server_set_send_buffer_size(TCP_Server *tcp_server, uint32_t size)
+{
+    tcp_server->send_buffer_size = size < TCP_MIN_SEND_BUFFER_SIZE ? TCP_MIN_SEND_BUFFER_SIZE : size;
+}
+
+void tcp_server_set_queue_limits(TCP_Server *tcp_server, uint64_t max_queued_bytes, uint32_t drain_timeout)
+{
+    tcp_server->max_queued_bytes = max_queued_bytes < TCP_MIN_SEND_BUFFER_SIZE ? TCP_MIN_SEND_BUFFER_SIZE
+                                   : max_queued_bytes;
+    tcp_server->drain_timeout = drain_timeout;
+}
+
+bool tcp_server_set_read_limits(TCP_Server *tcp_server, uint32_t max_events, uint32_t max_socket_reads)
+{
+    if (max_events == 0 || max_socket_reads == 0) {
+        return false;
+    }
+
+#ifdef TCP_SERVER_USE_EPOLL
+    struct epoll_event *events = (struct epoll_event *)realloc(tcp_server->events,
+                                 max_events * sizeof(struct epoll_event));
+
+    if (events == nullptr) {
+        return false;
+    }
+
+    tcp_server->events = events;
+    tcp_server->max_events = max_events;
+#endif
+
+    tcp_server->max_socket_reads = max_socket_reads;
+    return true;
+}
+
 /* This is needed to compile on Android below API 21
  */
 #ifdef TCP_SERVER_USE_EPOLL
@@ -124,24 +305,39 @@ size_t tcp_server_listen_count(const TCP_Server *tcp_server)
 #endif
 #endif
 
-/* Set the size of the connection list to numfriends.
+/* Free the connection list. */
+static void free_connections(TCP_Server *tcp_server)
+{
+    free(tcp_server->accepted_connection_array);
+    tcp_server->accepted_connection_array = nullptr;
+    tcp_server->size_accepted_connections = 0;
+    free(tcp_server->free_indices);
+    tcp_server->free_indices = nullptr;
+    tcp_server->num_free_indices = 0;
+}
+
+/* Grow the connection list to num entries, adding the new ones to the free
+ * indices.
  *
  *  return -1 if realloc fails.
  *  return 0 if it succeeds.
  */
 static int realloc_connection(TCP_Server *tcp_server, uint32_t num)
 {
-    if (num == 0) {
-        free(tcp_server->accepted_connection_array);
-        tcp_server->accepted_connection_array = nullptr;
-        tcp_server->size_accepted_connections = 0;
+    const uint32_t old_size = tcp_server->size_accepted_connections;
+
+    if (num <= old_size) {
         return 0;
     }
 
-    if (num == tcp_server->size_accepted_connections) {
-        return 0;
+    uint32_t *free_indices = (uint32_t *)realloc(tcp_server->free_indices, num * sizeof(uint32_t));
+
+    if (free_indices == nullptr) {
+        return -1;
     }
 
+    tcp_server->free_indices = free_indices;
+
     TCP_Secure_Connection *new_connections = (TCP_Secure_Connection *)realloc(
                 tcp_server->accepted_connection_array,
                 num * sizeof(TCP_Secure_Connection));
@@ -150,10 +346,12 @@ static int realloc_connection(TCP_Server *tcp_server, uint32_t num)
         return -1;
     }
 
-    if (num > tcp_server->size_accepted_connections) {
-        uint32_t old_size = tcp_server->size_accepted_connections;
-        uint32_t size_new_entries = (num - old_size) * sizeof(TCP_Secure_Connection);
-        memset(new_connections + old_size, 0, size_new_entries);
+    memset(new_connections + old_size, 0, (num - old_size) * sizeof(TCP_Secure_Connection));
+
+    /* Lowest new index last, so it is used first. */
+    for (uint32_t i = num; i > old_size; --i) {
+        free_indices[tcp_server->num_free_indices] = i - 1;
+        ++tcp_server->num_free_indices;
     }
 
     tcp_server->accepted_connection_array = new_connections;
@@ -166,7 +364,7 @@ static int realloc_connection(TCP_Server *tcp_server, uint32_t num)
  */
 static int get_TCP_connection_index(const TCP_Server *tcp_server, const uint8_t *public_key)
 {
-    return bs_list_find(&tcp_server->accepted_key_list, public_key);
+    return key_map_find(&tcp_server->accepted_key_list, public_key);
 }
 
 
@@ -183,41 +381,35 @@ static int add_accepted(TCP_Server *tcp_server, const Mono_Time *mono_time, cons
 
     if (index != -1) { /* If an old connection to the same public key exists, kill it. */
         kill_accepted(tcp_server, index);
-        index = -1;
     }
 
-    if (tcp_server->size_accepted_connections == tcp_server->num_accepted_connections) {
-        if (realloc_connection(tcp_server, tcp_server->size_accepted_connections + 4) == -1) {
-            return -1;
-        }
-
-        index = tcp_server->num_accepted_connections;
-    } else {
-        uint32_t i;
+    if (tcp_server->num_free_indices == 0) {
+        const uint32_t size = tcp_server->size_accepted_connections;
 
-        for (i = tcp_server->size_accepted_connections; i != 0; --i) {
-            if (tcp_server->accepted_connection_array[i - 1].status == TCP_STATUS_NO_STATUS) {
-                index = i - 1;
-                break;
-            }
+        if (realloc_connection(tcp_server, size + size / 2 + 4) == -1) {
+            return -1;
         }
     }
 
-    if (index == -1) {
-        fprintf(stderr, "FAIL index is -1\n");
-        return -1;
-    }
+    index = tcp_server->free_indices[tcp_server->num_free_indices - 1];
 
-    if (!bs_list_add(&tcp_server->accepted_key_list, con->public_key, index)) {
+    if (!key_map_add(&tcp_server->accepted_key_list, con->public_key, index)) {
         return -1;
     }
 
+    --tcp_server->num_free_indices;
     memcpy(&tcp_server->accepted_connection_array[index], con, sizeof(TCP_Secure_Connection));
     tcp_server->accepted_connection_array[index].status = TCP_STATUS_CONFIRMED;
     ++tcp_server->num_accepted_connections;
     tcp_server->accepted_connection_array[index].identifier = ++tcp_server->counter;
     tcp_server->accepted_connection_array[index].last_pinged = mono_time_get(mono_time);
     tcp_server->accepted_connection_array[index].ping_id = 0;
+    tcp_server->accepted_connection_array[index].last_drained = mono_time_get(mono_time);
+    tcp_server->queued_bytes += send_buffer_length(&con->send_buffer);
+
+    if (send_buffer_length(&con->send_buffer) != 0) {
+        ++tcp_server->pending_connections;
+    }
 
     return index;
 }
@@ -237,15 +429,27 @@ static int del_accepted(TCP_Server *tcp_server, int index)
         return -1;
     }
 
-    if (!bs_list_remove(&tcp_server->accepted_key_list, tcp_server->accepted_connection_array[index].public_key, index)) {
+    const uint8_t *public_key = tcp_server->accepted_connection_array[index].public_key;
+
+    if (!key_map_remove(&tcp_server->accepted_key_list, public_key, index)) {
         return -1;
     }
 
+    const uint32_t queued = send_buffer_length(&tcp_server->accepted_connection_array[index].send_buffer);
+    tcp_server->queued_bytes -= queued;
+
+    if (queued != 0) {
+        --tcp_server->pending_connections;
+    }
+
+    send_buffer_free(&tcp_server->accepted_connection_array[index].send_buffer);
     crypto_memzero(&tcp_server->accepted_connection_array[index], sizeof(TCP_Secure_Connection));
     --tcp_server->num_accepted_connections;
+    tcp_server->free_indices[tcp_server->num_free_indices] = index;
+    ++tcp_server->num_free_indices;
 
     if (tcp_server->num_accepted_connections == 0) {
-        realloc_connection(tcp_server, 0);
+        free_connections(tcp_server);
     }
 
     return 0;
@@ -351,104 +555,106 @@ int read_packet_TCP_secure_connection(Socket sock, uint16_t *next_packet_length,
     return len;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
+/* Send what the socket takes of the send buffer of an accepted connection.
+ *
+ * return true if the buffer is empty afterwards.
  */
-static int send_pending_data_nonpriority(TCP_Secure_Connection *con)
+static bool flush_send_buffer(TCP_Server *tcp_server, TCP_Secure_Connection *con)
 {
-    if (con->last_packet_length == 0) {
-        return 0;
-    }
+    const uint32_t length = send_buffer_length(&con->send_buffer);
 
-    const uint16_t left = con->last_packet_length - con->last_packet_sent;
-    const int len = net_send(con->sock, con->last_packet + con->last_packet_sent, left);
-
-    if (len <= 0) {
-        return -1;
+    if (length == 0) {
+        return true;
     }
 
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
-        return 0;
+    const bool empty = send_buffer_flush(&con->send_buffer, con->sock);
+    tcp_server->queued_bytes -= length - send_buffer_length(&con->send_buffer);
+
+    if (empty) {
+        con->drained = 1;
+        --tcp_server->pending_connections;
     }
 
-    con->last_packet_sent += len;
-    return -1;
+    return empty;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
+/* Append to the send buffer of an accepted connection.
+ *
+ * return false if it does not fit under the cap of the connection.
  */
-static int send_pending_data(TCP_Secure_Connection *con)
+static bool queue_packet(TCP_Server *tcp_server, TCP_Secure_Connection *con, const uint8_t *packet, uint32_t length)
 {
-    /* finish sending current non-priority packet */
-    if (send_pending_data_nonpriority(con) == -1) {
-        return -1;
-    }
+    const bool was_empty = send_buffer_length(&con->send_buffer) == 0;
 
-    TCP_Priority_List *p = con->priority_queue_start;
+    if (!send_buffer_add(&con->send_buffer, packet, length)) {
+        return false;
+    }
 
-    while (p) {
-        const uint16_t left = p->size - p->sent;
-        const int len = net_send(con->sock, p->data + p->sent, left);
+    tcp_server->queued_bytes += length;
 
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
+    if (was_empty && length != 0) {
+        ++tcp_server->pending_connections;
+    }
 
-            break;
-        }
+    return true;
+}
 
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
+/* Put the connection on the batch list so that its send buffer is flushed at
+ * the end of do_TCP_server().
+ */
+static void add_to_batch(TCP_Server *tcp_server, TCP_Secure_Connection *con)
+{
+    if (tcp_server->batch_length == tcp_server->batch_size) {
+        const uint32_t new_size = tcp_server->batch_size == 0 ? 16 : tcp_server->batch_size * 2;
+        uint32_t *new_batch = (uint32_t *)realloc(tcp_server->batch, new_size * sizeof(uint32_t));
 
-    con->priority_queue_start = p;
+        if (new_batch == nullptr) {
+            flush_send_buffer(tcp_server, con);
+            return;
+        }
 
-    if (!p) {
-        con->priority_queue_end = nullptr;
-        return 0;
+        tcp_server->batch = new_batch;
+        tcp_server->batch_size = new_size;
     }
 
-    return -1;
+    tcp_server->batch[tcp_server->batch_length] = con - tcp_server->accepted_connection_array;
+    ++tcp_server->batch_length;
+    con->batched = 1;
 }
 
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
- */
-static bool add_priority(TCP_Secure_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
+static void flush_batch(TCP_Server *tcp_server)
 {
-    TCP_Priority_List *p = con->priority_queue_end;
-    TCP_Priority_List *new_list = (TCP_Priority_List *)malloc(sizeof(TCP_Priority_List) + size);
+    for (uint32_t i = 0; i < tcp_server->batch_length; ++i) {
+        const uint32_t index = tcp_server->batch[i];
 
-    if (!new_list) {
-        return 0;
-    }
+        if (index >= tcp_server->size_accepted_connections) {
+            continue;
+        }
 
-    new_list->next = nullptr;
-    new_list->size = size;
-    new_list->sent = sent;
-    memcpy(new_list->data, packet, size);
+        /* Connections killed since then are all zero. */
+        TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[index];
 
-    if (p) {
-        p->next = new_list;
-    } else {
-        con->priority_queue_start = new_list;
+        if (con->batched) {
+            con->batched = 0;
+            flush_send_buffer(tcp_server, con);
+        }
     }
 
-    con->priority_queue_end = new_list;
-    return 1;
+    tcp_server->batch_length = 0;
+}
+
+/* return the entry of the packet starting with id in the packet stats. */
+static uint8_t packet_stats_index(uint8_t id)
+{
+    return id < NUM_RESERVED_PORTS ? id : TCP_STATS_PACKET_DATA;
 }
 
 /* return 1 on success.
  * return 0 if could not send packet.
  * return -1 on failure (connection must be killed).
  */
-static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
-        bool priority)
+static int write_packet_TCP_secure_connection(TCP_Server *tcp_server, TCP_Secure_Connection *con, const uint8_t *data,
+        uint16_t length, bool priority)
 {
     if (length + CRYPTO_MAC_SIZE > MAX_PACKET_SIZE) {
         return -1;
@@ -456,16 +662,31 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
 
     bool sendpriority = 1;
 
-    if (send_pending_data(con) == -1) {
+    if (!con->batched && !flush_send_buffer(tcp_server, con)) {
         if (priority) {
             sendpriority = 0;
         } else {
+            ++tcp_server->dropped_packets;
             return 0;
         }
     }
 
     VLA(uint8_t, packet, sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
 
+    /* Check before the nonce is used up: once it is, the packet has to go out.
+     * Packets of the relay itself are small and few, so only the ones relayed
+     * for others count against the cap of the whole server. */
+    if (send_buffer_space(&con->send_buffer) < SIZEOF_VLA(packet)
+            || (!priority && tcp_server->queued_bytes + SIZEOF_VLA(packet) > tcp_server->max_queued_bytes)) {
+        ++con->send_buffer.refused;
+        ++tcp_server->dropped_packets;
+        return 0;
+    }
+
+    TCP_Packet_Stats *const packet_stats = &tcp_server->packet_stats[packet_stats_index(data[0])];
+    ++packet_stats->packets_sent;
+    packet_stats->bytes_sent += length;
+
     const uint16_t c_length = net_htons(length + CRYPTO_MAC_SIZE);
     memcpy(packet, &c_length, sizeof(uint16_t));
     int len = encrypt_data_symmetric(con->shared_key, con->sent_nonce, data, length, packet + sizeof(uint16_t));
@@ -474,26 +695,36 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
         return -1;
     }
 
-    if (priority) {
-        len = sendpriority ? net_send(con->sock, packet, SIZEOF_VLA(packet)) : 0;
-
-        if (len <= 0) {
-            len = 0;
+    /* Only batch behind packets of this round: a backlog from earlier rounds
+     * means the socket is full and must keep refusing non-priority packets. */
+    if (tcp_server->batching && sendpriority) {
+        if (!queue_packet(tcp_server, con, packet, SIZEOF_VLA(packet))) {
+            return -1;
         }
 
         increment_nonce(con->sent_nonce);
 
-        if ((unsigned int)len == SIZEOF_VLA(packet)) {
-            return 1;
+        if (!con->batched) {
+            add_to_batch(tcp_server, con);
+        } else if (send_buffer_length(&con->send_buffer) >= TCP_SERVER_BATCH_SIZE) {
+            flush_send_buffer(tcp_server, con);
         }
 
-        return add_priority(con, packet, SIZEOF_VLA(packet), len);
+        return 1;
     }
 
-    len = net_send(con->sock, packet, SIZEOF_VLA(packet));
+    if (priority) {
+        len = sendpriority ? net_send(con->sock, packet, SIZEOF_VLA(packet)) : 0;
 
-    if (len <= 0) {
-        return 0;
+        if (len <= 0) {
+            len = 0;
+        }
+    } else {
+        len = net_send(con->sock, packet, SIZEOF_VLA(packet));
+
+        if (len <= 0) {
+            return 0;
+        }
     }
 
     increment_nonce(con->sent_nonce);
@@ -502,9 +733,10 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
         return 1;
     }
 
-    memcpy(con->last_packet, packet, SIZEOF_VLA(packet));
-    con->last_packet_length = SIZEOF_VLA(packet);
-    con->last_packet_sent = len;
+    if (!queue_packet(tcp_server, con, packet + len, SIZEOF_VLA(packet) - len)) {
+        return -1;
+    }
+
     return 1;
 }
 
@@ -513,9 +745,211 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
 static void kill_TCP_secure_connection(TCP_Secure_Connection *con)
 {
     kill_sock(con->sock);
+    send_buffer_free(&con->send_buffer);
     crypto_memzero(con, sizeof(TCP_Secure_Connection));
 }
 
+/* return the shard that serves the client with public_key. */
+static uint32_t key_shard(const TCP_Server *tcp_server, const uint8_t *public_key)
+{
+    if (tcp_server->shards == nullptr) {
+        return tcp_server->shard_id;
+    }
+
+    uint64_t hash = tcp_server->shard_seed;
+
+    for (uint32_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, public_key + i, sizeof(word));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 32;
+    }
+
+    return hash % tcp_server->num_shards;
+}
+
+/* Free a list of batches. Connections handed over in them are closed. */
+static void free_shard_batches(TCP_Shard_Batch *batch)
+{
+    while (batch) {
+        uint32_t offset = 0;
+
+        while (offset + sizeof(TCP_Shard_Message) <= batch->length) {
+            TCP_Shard_Message msg;
+            memcpy(&msg, batch->data + offset, sizeof(msg));
+            offset += sizeof(msg);
+
+            if (msg.type == TCP_SHARD_HANDOFF && msg.length == sizeof(TCP_Secure_Connection)) {
+                TCP_Secure_Connection con;
+                memcpy(&con, batch->data + offset, sizeof(con));
+                kill_TCP_secure_connection(&con);
+                crypto_memzero(batch->data + offset, msg.length);
+            }
+
+            offset += msg.length;
+        }
+
+        TCP_Shard_Batch *next = batch->next;
+        free(batch);
+        batch = next;
+    }
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+static TCP_Shard_Mailbox *new_shard_mailbox(void)
+{
+    TCP_Shard_Mailbox *mailbox = (TCP_Shard_Mailbox *)calloc(1, sizeof(TCP_Shard_Mailbox));
+
+    if (mailbox == nullptr) {
+        return nullptr;
+    }
+
+    if (pthread_mutex_init(&mailbox->mutex, nullptr) != 0) {
+        free(mailbox);
+        return nullptr;
+    }
+
+    mailbox->wakeup = eventfd(0, EFD_NONBLOCK);
+
+    if (mailbox->wakeup == -1) {
+        pthread_mutex_destroy(&mailbox->mutex);
+        free(mailbox);
+        return nullptr;
+    }
+
+    return mailbox;
+}
+#endif
+
+static void kill_shard_mailbox(TCP_Shard_Mailbox *mailbox)
+{
+    if (mailbox == nullptr) {
+        return;
+    }
+
+    free_shard_batches(mailbox->start);
+#ifdef TCP_SERVER_USE_EPOLL
+    close(mailbox->wakeup);
+#endif
+    pthread_mutex_destroy(&mailbox->mutex);
+    free(mailbox);
+}
+
+/* Append a message to the batch for another shard.
+ *
+ * Data and out of band packets are refused once the batch holds
+ * TCP_SHARD_QUEUE_SIZE bytes, like packets for a client whose send buffer is
+ * full. The other messages are always taken unless memory runs out, because
+ * dropping them would leave the two shards disagreeing about a connection.
+ *
+ * return true on success.
+ */
+static bool shard_send(TCP_Server *tcp_server, uint32_t shard, uint8_t type, uint32_t index, uint8_t slot,
+                       uint32_t other_index, uint8_t other_slot, const uint8_t *data, uint16_t length)
+{
+    TCP_Shard_Batch *batch = tcp_server->outbox[shard];
+    const uint32_t used = batch != nullptr ? batch->length : 0;
+    const uint32_t needed = used + sizeof(TCP_Shard_Message) + length;
+
+    if ((type == TCP_SHARD_DATA || type == TCP_SHARD_OOB) && needed > TCP_SHARD_QUEUE_SIZE) {
+        ++tcp_server->dropped_packets;
+        return false;
+    }
+
+    if (batch == nullptr || needed > batch->size) {
+        uint32_t size = batch != nullptr ? batch->size * 2 : 4096;
+
+        while (size < needed) {
+            size *= 2;
+        }
+
+        batch = (TCP_Shard_Batch *)realloc(batch, sizeof(TCP_Shard_Batch) + size);
+
+        if (batch == nullptr) {
+            return false;
+        }
+
+        if (tcp_server->outbox[shard] == nullptr) {
+            batch->next = nullptr;
+            batch->from = tcp_server->shard_id;
+            batch->length = 0;
+        }
+
+        batch->size = size;
+        tcp_server->outbox[shard] = batch;
+    }
+
+    TCP_Shard_Message msg;
+    msg.type = type;
+    msg.slot = slot;
+    msg.other_slot = other_slot;
+    msg.length = length;
+    msg.index = index;
+    msg.other_index = other_index;
+
+    memcpy(batch->data + batch->length, &msg, sizeof(msg));
+
+    if (length != 0) {
+        memcpy(batch->data + batch->length + sizeof(msg), data, length);
+    }
+
+    batch->length = needed;
+    return true;
+}
+
+/* Hand the collected batches over to the other shards. A batch stays in the
+ * outbox if the mailbox of its shard is full.
+ */
+static void flush_shard_outboxes(TCP_Server *tcp_server)
+{
+    for (uint32_t i = 0; i < tcp_server->num_shards; ++i) {
+        TCP_Shard_Batch *const batch = tcp_server->outbox[i];
+
+        if (batch == nullptr) {
+            continue;
+        }
+
+        TCP_Shard_Mailbox *const mailbox = tcp_server->shards[i]->mailbox;
+
+        pthread_mutex_lock(&mailbox->mutex);
+
+        if (mailbox->length >= TCP_SHARD_QUEUE_SIZE) {
+            pthread_mutex_unlock(&mailbox->mutex);
+            continue;
+        }
+
+#ifdef TCP_SERVER_USE_EPOLL
+        const bool was_empty = mailbox->start == nullptr;
+#endif
+
+        if (mailbox->end) {
+            mailbox->end->next = batch;
+        } else {
+            mailbox->start = batch;
+        }
+
+        mailbox->end = batch;
+        mailbox->length += batch->length;
+
+        pthread_mutex_unlock(&mailbox->mutex);
+
+        tcp_server->outbox[i] = nullptr;
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+        if (was_empty) {
+            const uint64_t one = 1;
+
+            /* Only fails if the counter is full, and then the shard is awake anyway. */
+            if (write(mailbox->wakeup, &one, sizeof(one)) == -1) {
+                continue;
+            }
+        }
+
+#endif
+    }
+}
+
 static int rm_connection_index(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t con_number);
 
 /* Kill an accepted TCP_Secure_Connection
@@ -616,34 +1050,35 @@ static int read_connection_handshake(TCP_Secure_Connection *con, const uint8_t *
  * return 0 if could not send packet.
  * return -1 on failure (connection must be killed).
  */
-static int send_routing_response(TCP_Secure_Connection *con, uint8_t rpid, const uint8_t *public_key)
+static int send_routing_response(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t rpid,
+                                 const uint8_t *public_key)
 {
     uint8_t data[1 + 1 + CRYPTO_PUBLIC_KEY_SIZE];
     data[0] = TCP_PACKET_ROUTING_RESPONSE;
     data[1] = rpid;
     memcpy(data + 2, public_key, CRYPTO_PUBLIC_KEY_SIZE);
 
-    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+    return write_packet_TCP_secure_connection(tcp_server, con, data, sizeof(data), 1);
 }
 
 /* return 1 on success.
  * return 0 if could not send packet.
  * return -1 on failure (connection must be killed).
  */
-static int send_connect_notification(TCP_Secure_Connection *con, uint8_t id)
+static int send_connect_notification(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t id)
 {
     uint8_t data[2] = {TCP_PACKET_CONNECTION_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
-    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+    return write_packet_TCP_secure_connection(tcp_server, con, data, sizeof(data), 1);
 }
 
 /* return 1 on success.
  * return 0 if could not send packet.
  * return -1 on failure (connection must be killed).
  */
-static int send_disconnect_notification(TCP_Secure_Connection *con, uint8_t id)
+static int send_disconnect_notification(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t id)
 {
     uint8_t data[2] = {TCP_PACKET_DISCONNECT_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
-    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+    return write_packet_TCP_secure_connection(tcp_server, con, data, sizeof(data), 1);
 }
 
 /* return 0 on success.
@@ -657,7 +1092,7 @@ static int handle_TCP_routing_req(TCP_Server *tcp_server, uint32_t con_id, const
 
     /* If person tries to cennect to himself we deny the request*/
     if (public_key_cmp(con->public_key, public_key) == 0) {
-        if (send_routing_response(con, 0, public_key) == -1) {
+        if (send_routing_response(tcp_server, con, 0, public_key) == -1) {
             return -1;
         }
 
@@ -667,7 +1102,7 @@ static int handle_TCP_routing_req(TCP_Server *tcp_server, uint32_t con_id, const
     for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
         if (con->connections[i].status != 0) {
             if (public_key_cmp(public_key, con->connections[i].public_key) == 0) {
-                if (send_routing_response(con, i + NUM_RESERVED_PORTS, public_key) == -1) {
+                if (send_routing_response(tcp_server, con, i + NUM_RESERVED_PORTS, public_key) == -1) {
                     return -1;
                 }
 
@@ -679,14 +1114,14 @@ static int handle_TCP_routing_req(TCP_Server *tcp_server, uint32_t con_id, const
     }
 
     if (index == (uint32_t)~0) {
-        if (send_routing_response(con, 0, public_key) == -1) {
+        if (send_routing_response(tcp_server, con, 0, public_key) == -1) {
             return -1;
         }
 
         return 0;
     }
 
-    int ret = send_routing_response(con, index + NUM_RESERVED_PORTS, public_key);
+    int ret = send_routing_response(tcp_server, con, index + NUM_RESERVED_PORTS, public_key);
 
     if (ret == 0) {
         return 0;
@@ -698,6 +1133,18 @@ static int handle_TCP_routing_req(TCP_Server *tcp_server, uint32_t con_id, const
 
     con->connections[index].status = 1;
     memcpy(con->connections[index].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    const uint32_t other_shard = key_shard(tcp_server, public_key);
+
+    if (other_shard != tcp_server->shard_id) {
+        /* That shard links the two if the other client asked for this one too. */
+        uint8_t keys[CRYPTO_PUBLIC_KEY_SIZE * 2];
+        memcpy(keys, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        memcpy(keys + CRYPTO_PUBLIC_KEY_SIZE, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        shard_send(tcp_server, other_shard, TCP_SHARD_LINK, 0, 0, con_id, index, keys, sizeof(keys));
+        return 0;
+    }
+
     int other_index = get_TCP_connection_index(tcp_server, public_key);
 
     if (other_index != -1) {
@@ -716,18 +1163,40 @@ static int handle_TCP_routing_req(TCP_Server *tcp_server, uint32_t con_id, const
             con->connections[index].status = 2;
             con->connections[index].index = other_index;
             con->connections[index].other_id = other_id;
+            con->connections[index].shard = tcp_server->shard_id;
             other_conn->connections[other_id].status = 2;
             other_conn->connections[other_id].index = con_id;
             other_conn->connections[other_id].other_id = index;
+            other_conn->connections[other_id].shard = tcp_server->shard_id;
             // TODO(irungentoo): return values?
-            send_connect_notification(con, index);
-            send_connect_notification(other_conn, other_id);
+            send_connect_notification(tcp_server, con, index);
+            send_connect_notification(tcp_server, other_conn, other_id);
         }
     }
 
     return 0;
 }
 
+/* Pass an out of band packet from the client with sender_public_key on to the
+ * client with public_key, if it is connected.
+ */
+static void send_oob_recv(TCP_Server *tcp_server, const uint8_t *sender_public_key, const uint8_t *public_key,
+                          const uint8_t *data, uint16_t length)
+{
+    const int other_index = get_TCP_connection_index(tcp_server, public_key);
+
+    if (other_index == -1) {
+        return;
+    }
+
+    VLA(uint8_t, resp_packet, 1 + CRYPTO_PUBLIC_KEY_SIZE + length);
+    resp_packet[0] = TCP_PACKET_OOB_RECV;
+    memcpy(resp_packet + 1, sender_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(resp_packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length);
+    write_packet_TCP_secure_connection(tcp_server, &tcp_server->accepted_connection_array[other_index], resp_packet,
+                                       SIZEOF_VLA(resp_packet), 0);
+}
+
 /* return 0 on success.
  * return -1 on failure (connection must be killed).
  */
@@ -740,17 +1209,18 @@ static int handle_TCP_oob_send(TCP_Server *tcp_server, uint32_t con_id, const ui
 
     TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[con_id];
 
-    int other_index = get_TCP_connection_index(tcp_server, public_key);
+    const uint32_t other_shard = key_shard(tcp_server, public_key);
 
-    if (other_index != -1) {
-        VLA(uint8_t, resp_packet, 1 + CRYPTO_PUBLIC_KEY_SIZE + length);
-        resp_packet[0] = TCP_PACKET_OOB_RECV;
-        memcpy(resp_packet + 1, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
-        memcpy(resp_packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length);
-        write_packet_TCP_secure_connection(&tcp_server->accepted_connection_array[other_index], resp_packet,
-                                           SIZEOF_VLA(resp_packet), 0);
+    if (other_shard != tcp_server->shard_id) {
+        VLA(uint8_t, message, CRYPTO_PUBLIC_KEY_SIZE * 2 + length);
+        memcpy(message, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        memcpy(message + CRYPTO_PUBLIC_KEY_SIZE, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        memcpy(message + CRYPTO_PUBLIC_KEY_SIZE * 2, data, length);
+        shard_send(tcp_server, other_shard, TCP_SHARD_OOB, 0, 0, con_id, 0, message, SIZEOF_VLA(message));
+        return 0;
     }
 
+    send_oob_recv(tcp_server, con->public_key, public_key, data, length);
     return 0;
 }
 
@@ -769,7 +1239,10 @@ static int rm_connection_index(TCP_Server *tcp_server, TCP_Secure_Connection *co
         uint32_t index = con->connections[con_number].index;
         uint8_t other_id = con->connections[con_number].other_id;
 
-        if (con->connections[con_number].status == 2) {
+        if (con->connections[con_number].status == 2 && con->connections[con_number].shard != tcp_server->shard_id) {
+            shard_send(tcp_server, con->connections[con_number].shard, TCP_SHARD_UNLINK, index, other_id,
+                       con - tcp_server->accepted_connection_array, con_number, nullptr, 0);
+        } else if (con->connections[con_number].status == 2) {
 
             if (index >= tcp_server->size_accepted_connections) {
                 return -1;
@@ -777,13 +1250,15 @@ static int rm_connection_index(TCP_Server *tcp_server, TCP_Secure_Connection *co
 
             tcp_server->accepted_connection_array[index].connections[other_id].other_id = 0;
             tcp_server->accepted_connection_array[index].connections[other_id].index = 0;
+            tcp_server->accepted_connection_array[index].connections[other_id].shard = 0;
             tcp_server->accepted_connection_array[index].connections[other_id].status = 1;
             // TODO(irungentoo): return values?
-            send_disconnect_notification(&tcp_server->accepted_connection_array[index], other_id);
+            send_disconnect_notification(tcp_server, &tcp_server->accepted_connection_array[index], other_id);
         }
 
         con->connections[con_number].index = 0;
         con->connections[con_number].other_id = 0;
+        con->connections[con_number].shard = 0;
         con->connections[con_number].status = 0;
         return 0;
     }
@@ -791,32 +1266,277 @@ static int rm_connection_index(TCP_Server *tcp_server, TCP_Secure_Connection *co
     return -1;
 }
 
-static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
+static TCP_Onion_Mailbox *new_onion_mailbox(void)
 {
-    TCP_Server *tcp_server = (TCP_Server *)object;
-    uint32_t index = dest.ip.ip.v6.uint32[0];
+    TCP_Onion_Mailbox *mailbox = (TCP_Onion_Mailbox *)calloc(1, sizeof(TCP_Onion_Mailbox));
 
-    if (index >= tcp_server->size_accepted_connections) {
-        return 1;
+    if (mailbox == nullptr) {
+        return nullptr;
     }
 
-    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[index];
-
-    if (con->identifier != dest.ip.ip.v6.uint64[1]) {
-        return 1;
+    if (pthread_mutex_init(&mailbox->mutex, nullptr) != 0) {
+        free(mailbox);
+        return nullptr;
     }
 
-    VLA(uint8_t, packet, 1 + length);
-    memcpy(packet + 1, data, length);
+#ifdef TCP_SERVER_USE_EPOLL
+    mailbox->wakeup = -1;
+#endif
+
+    return mailbox;
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+/* Give the mailbox a wakeup descriptor.
+ *
+ * return true on success.
+ */
+static bool onion_mailbox_wakeup(TCP_Onion_Mailbox *mailbox)
+{
+    mailbox->wakeup = eventfd(0, EFD_NONBLOCK);
+    return mailbox->wakeup != -1;
+}
+
+/* Add a wakeup descriptor for the mailbox to the epoll set of the server that
+ * takes its packets out.
+ *
+ * return true on success.
+ */
+static bool onion_mailbox_watch(TCP_Onion_Mailbox *mailbox, int efd)
+{
+    if (!onion_mailbox_wakeup(mailbox)) {
+        return false;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint32_t)mailbox->wakeup | ((uint64_t)TCP_SOCKET_WAKEUP << 32);
+
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, mailbox->wakeup, &ev) == -1) {
+        close(mailbox->wakeup);
+        mailbox->wakeup = -1;
+        return false;
+    }
+
+    return true;
+}
+#endif
+
+static void free_onion_packets(TCP_Onion_Packet *p)
+{
+    while (p) {
+        TCP_Onion_Packet *next = p->next;
+        free(p);
+        p = next;
+    }
+}
+
+static void kill_onion_mailbox(TCP_Onion_Mailbox *mailbox)
+{
+    if (mailbox == nullptr) {
+        return;
+    }
+
+    free_onion_packets(mailbox->start);
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (mailbox->wakeup != -1) {
+        close(mailbox->wakeup);
+    }
+
+#endif
+
+    pthread_mutex_destroy(&mailbox->mutex);
+    free(mailbox);
+}
+
+/* Let tcp_server_get_stats() be called from another thread than the one running
+ * the server.
+ *
+ * return true on success.
+ */
+static bool enable_stats_snapshot(TCP_Server *tcp_server)
+{
+    if (tcp_server->stats_snapshot != nullptr) {
+        return true;
+    }
+
+    TCP_Stats_Snapshot *snapshot = (TCP_Stats_Snapshot *)calloc(1, sizeof(TCP_Stats_Snapshot));
+
+    if (snapshot == nullptr) {
+        return false;
+    }
+
+    if (pthread_mutex_init(&snapshot->mutex, nullptr) != 0) {
+        free(snapshot);
+        return false;
+    }
+
+    tcp_server->stats_snapshot = snapshot;
+    return true;
+}
+
+static void kill_stats_snapshot(TCP_Stats_Snapshot *snapshot)
+{
+    if (snapshot == nullptr) {
+        return;
+    }
+
+    pthread_mutex_destroy(&snapshot->mutex);
+    free(snapshot);
+}
+
+/* return true on success.
+ * return false if the mailbox is full or on allocation failure.
+ */
+static bool onion_mailbox_push(TCP_Onion_Mailbox *mailbox, IP_Port ip_port, const uint8_t *nonce,
+                               const uint8_t *data, uint16_t length)
+{
+    TCP_Onion_Packet *new_packet = (TCP_Onion_Packet *)malloc(sizeof(TCP_Onion_Packet) + length);
+
+    if (new_packet == nullptr) {
+        return false;
+    }
+
+    new_packet->next = nullptr;
+    new_packet->ip_port = ip_port;
+    new_packet->length = length;
+    memcpy(new_packet->data, data, length);
+
+    if (nonce) {
+        memcpy(new_packet->nonce, nonce, CRYPTO_NONCE_SIZE);
+    }
+
+    pthread_mutex_lock(&mailbox->mutex);
+
+    if (mailbox->count >= MAX_ONION_MAILBOX_SIZE) {
+        pthread_mutex_unlock(&mailbox->mutex);
+        free(new_packet);
+        return false;
+    }
+
+#ifdef TCP_SERVER_USE_EPOLL
+    const bool was_empty = mailbox->start == nullptr;
+#endif
+
+    if (mailbox->end) {
+        mailbox->end->next = new_packet;
+    } else {
+        mailbox->start = new_packet;
+    }
+
+    mailbox->end = new_packet;
+    ++mailbox->count;
+
+    pthread_mutex_unlock(&mailbox->mutex);
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (was_empty && mailbox->wakeup != -1) {
+        const uint64_t one = 1;
+
+        /* Only fails if the counter is full, and then the server is awake anyway. */
+        if (write(mailbox->wakeup, &one, sizeof(one)) == -1) {
+            return true;
+        }
+    }
+
+#endif
+
+    return true;
+}
+
+/* Take all packets out of the mailbox.
+ *
+ * return the first packet of the list, which the caller must free.
+ */
+static TCP_Onion_Packet *onion_mailbox_take(TCP_Onion_Mailbox *mailbox)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (mailbox->wakeup != -1) {
+        /* Cleared before the mailbox is emptied, so that a packet that comes
+         * in after that wakes the server up again. */
+        uint64_t count;
+
+        while (read(mailbox->wakeup, &count, sizeof(count)) > 0) {
+            continue;
+        }
+    }
+
+#endif
+
+    pthread_mutex_lock(&mailbox->mutex);
+    TCP_Onion_Packet *p = mailbox->start;
+    mailbox->start = nullptr;
+    mailbox->end = nullptr;
+    mailbox->count = 0;
+    pthread_mutex_unlock(&mailbox->mutex);
+    return p;
+}
+
+static int send_onion_response_to_client(TCP_Server *tcp_server, IP_Port dest, const uint8_t *data, uint16_t length)
+{
+    uint32_t index = dest.ip.ip.v6.uint32[0];
+
+    if (index >= tcp_server->size_accepted_connections) {
+        return 1;
+    }
+
+    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[index];
+
+    if (con->identifier != dest.ip.ip.v6.uint64[1]) {
+        return 1;
+    }
+
+    VLA(uint8_t, packet, 1 + length);
+    memcpy(packet + 1, data, length);
     packet[0] = TCP_PACKET_ONION_RESPONSE;
 
-    if (write_packet_TCP_secure_connection(con, packet, SIZEOF_VLA(packet), 0) != 1) {
+    if (write_packet_TCP_secure_connection(tcp_server, con, packet, SIZEOF_VLA(packet), 0) != 1) {
         return 1;
     }
 
     return 0;
 }
 
+static void do_TCP_onion_responses(TCP_Server *tcp_server)
+{
+    if (tcp_server->onion_responses == nullptr) {
+        return;
+    }
+
+    TCP_Onion_Packet *const responses = onion_mailbox_take(tcp_server->onion_responses);
+
+    for (const TCP_Onion_Packet *p = responses; p; p = p->next) {
+        send_onion_response_to_client(tcp_server, p->ip_port, p->data, p->length);
+    }
+
+    free_onion_packets(responses);
+}
+
+static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
+{
+    TCP_Server *tcp_server = (TCP_Server *)object;
+
+    if (tcp_server->shards != nullptr) {
+        const uint32_t shard = dest.ip.ip.v6.uint32[1];
+
+        if (shard >= tcp_server->num_shards) {
+            return 1;
+        }
+
+        tcp_server = tcp_server->shards[shard];
+    }
+
+    if (tcp_server->onion_responses) {
+        return onion_mailbox_push(tcp_server->onion_responses, dest, nullptr, data, length) ? 0 : 1;
+    }
+
+    return send_onion_response_to_client(tcp_server, dest, data, length);
+}
+
 /* return 0 on success
  * return -1 on failure
  */
@@ -828,6 +1548,10 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
 
     TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[con_id];
 
+    TCP_Packet_Stats *const packet_stats = &tcp_server->packet_stats[packet_stats_index(data[0])];
+    ++packet_stats->packets_recv;
+    packet_stats->bytes_recv += length;
+
     switch (data[0]) {
         case TCP_PACKET_ROUTING_REQUEST: {
             if (length != 1 + CRYPTO_PUBLIC_KEY_SIZE) {
@@ -861,7 +1585,7 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
             uint8_t response[1 + sizeof(uint64_t)];
             response[0] = TCP_PACKET_PONG;
             memcpy(response + 1, data + 1, sizeof(uint64_t));
-            write_packet_TCP_secure_connection(con, response, sizeof(response), 1);
+            write_packet_TCP_secure_connection(tcp_server, con, response, sizeof(response), 1);
             return 0;
         }
 
@@ -903,10 +1627,16 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
                 source.port = 0;  // dummy initialise
                 source.ip.family = net_family_tcp_onion;
                 source.ip.ip.v6.uint32[0] = con_id;
-                source.ip.ip.v6.uint32[1] = 0;
+                source.ip.ip.v6.uint32[1] = tcp_server->shard_id;
                 source.ip.ip.v6.uint64[1] = con->identifier;
-                onion_send_1(tcp_server->onion, data + 1 + CRYPTO_NONCE_SIZE, length - (1 + CRYPTO_NONCE_SIZE), source,
-                             data + 1);
+
+                if (tcp_server->onion_requests) {
+                    onion_mailbox_push(tcp_server->onion_requests, source, data + 1, data + 1 + CRYPTO_NONCE_SIZE,
+                                       length - (1 + CRYPTO_NONCE_SIZE));
+                } else {
+                    onion_send_1(tcp_server->onion, data + 1 + CRYPTO_NONCE_SIZE, length - (1 + CRYPTO_NONCE_SIZE), source,
+                                 data + 1);
+                }
             }
 
             return 0;
@@ -936,11 +1666,19 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
             }
 
             uint32_t index = con->connections[c_id].index;
+
+            if (con->connections[c_id].shard != tcp_server->shard_id) {
+                shard_send(tcp_server, con->connections[c_id].shard, TCP_SHARD_DATA, index,
+                           con->connections[c_id].other_id, con_id, c_id, data, length);
+                return 0;
+            }
+
             uint8_t other_c_id = con->connections[c_id].other_id + NUM_RESERVED_PORTS;
             VLA(uint8_t, new_data, length);
             memcpy(new_data, data, length);
             new_data[0] = other_c_id;
-            int ret = write_packet_TCP_secure_connection(&tcp_server->accepted_connection_array[index], new_data, length, 0);
+            int ret = write_packet_TCP_secure_connection(tcp_server, &tcp_server->accepted_connection_array[index], new_data,
+                      length, 0);
 
             if (ret == -1) {
                 return -1;
@@ -953,112 +1691,335 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
     return 0;
 }
 
-
-static int confirm_TCP_connection(TCP_Server *tcp_server, const Mono_Time *mono_time, TCP_Secure_Connection *con,
-                                  const uint8_t *data,
-                                  uint16_t length)
+/* Take over a connection that completed the handshake on another shard. */
+static void shard_take_connection(TCP_Server *tcp_server, uint8_t *data, uint16_t length)
 {
-    int index = add_accepted(tcp_server, mono_time, con);
+    if (length != sizeof(TCP_Secure_Connection)) {
+        return;
+    }
 
-    if (index == -1) {
-        kill_TCP_secure_connection(con);
-        return -1;
+    const uint32_t index = tcp_server->unconfirmed_connection_queue_index % MAX_INCOMING_CONNECTIONS;
+    TCP_Secure_Connection *conn = &tcp_server->unconfirmed_connection_queue[index];
+
+    if (conn->status != TCP_STATUS_NO_STATUS) {
+        kill_TCP_secure_connection(conn);
+        ++tcp_server->handshake_failures;
     }
 
-    crypto_memzero(con, sizeof(TCP_Secure_Connection));
+    memcpy(conn, data, sizeof(TCP_Secure_Connection));
+    crypto_memzero(data, length);
+    ++tcp_server->unconfirmed_connection_queue_index;
 
-    if (handle_TCP_packet(tcp_server, index, data, length) == -1) {
-        kill_accepted(tcp_server, index);
-        return -1;
+#ifdef TCP_SERVER_USE_EPOLL
+    /* Adding a socket reports it if it is readable already. */
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    ev.data.u64 = conn->sock.socket | ((uint64_t)TCP_SOCKET_UNCONFIRMED << 32) | ((uint64_t)index << 40);
+
+    if (epoll_ctl(tcp_server->efd, EPOLL_CTL_ADD, conn->sock.socket, &ev) == -1) {
+        kill_TCP_secure_connection(conn);
     }
 
-    return index;
+#endif
 }
 
-/* return index on success
- * return -1 on failure
+/* Link the client with the second key in data to the client with the first
+ * key on the sending shard, if it asked for that client too.
  */
-static int accept_connection(TCP_Server *tcp_server, Socket sock)
+static void shard_link(TCP_Server *tcp_server, uint32_t from, const TCP_Shard_Message *msg, const uint8_t *data)
 {
-    if (!sock_valid(sock)) {
-        return -1;
-    }
-
-    if (!set_socket_nonblock(sock)) {
-        kill_sock(sock);
-        return -1;
-    }
-
-    if (!set_socket_nosigpipe(sock)) {
-        kill_sock(sock);
-        return -1;
+    if (msg->length != CRYPTO_PUBLIC_KEY_SIZE * 2) {
+        return;
     }
 
-    uint16_t index = tcp_server->incoming_connection_queue_index % MAX_INCOMING_CONNECTIONS;
-
-    TCP_Secure_Connection *conn = &tcp_server->incoming_connection_queue[index];
+    const int index = get_TCP_connection_index(tcp_server, data + CRYPTO_PUBLIC_KEY_SIZE);
 
-    if (conn->status != TCP_STATUS_NO_STATUS) {
-        kill_TCP_secure_connection(conn);
+    if (index == -1) {
+        return;
     }
 
-    conn->status = TCP_STATUS_CONNECTED;
-    conn->sock = sock;
-    conn->next_packet_length = 0;
+    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[index];
 
-    ++tcp_server->incoming_connection_queue_index;
-    return index;
-}
+    for (uint32_t i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+        TCP_Secure_Conn *const entry = &con->connections[i];
 
-static Socket new_listening_TCP_socket(Family family, uint16_t port)
-{
-    Socket sock = net_socket(family, TOX_SOCK_STREAM, TOX_PROTO_TCP);
+        if (entry->status == 0 || public_key_cmp(entry->public_key, data) != 0) {
+            continue;
+        }
 
-    if (!sock_valid(sock)) {
-        return net_invalid_socket;
-    }
+        /* If both clients asked at the same time, this is the answer to the
+         * message this shard sent. */
+        if (entry->status == 2) {
+            return;
+        }
 
-    int ok = set_socket_nonblock(sock);
+        entry->status = 2;
+        entry->index = msg->other_index;
+        entry->other_id = msg->other_slot;
+        entry->shard = from;
+        send_connect_notification(tcp_server, con, i);
 
-    if (ok && net_family_is_ipv6(family)) {
-        ok = set_socket_dualstack(sock);
+        uint8_t keys[CRYPTO_PUBLIC_KEY_SIZE * 2];
+        memcpy(keys, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        memcpy(keys + CRYPTO_PUBLIC_KEY_SIZE, data, CRYPTO_PUBLIC_KEY_SIZE);
+        shard_send(tcp_server, from, TCP_SHARD_LINK, 0, 0, index, i, keys, sizeof(keys));
+        return;
     }
+}
 
-    if (ok) {
-        ok = set_socket_reuseaddr(sock);
+/* return the receiving end of a message about a routed connection, or NULL if
+ * the connection is no longer linked to the sender.
+ */
+static TCP_Secure_Connection *shard_linked_connection(TCP_Server *tcp_server, uint32_t from,
+        const TCP_Shard_Message *msg)
+{
+    if (msg->index >= tcp_server->size_accepted_connections || msg->slot >= NUM_CLIENT_CONNECTIONS) {
+        return nullptr;
     }
 
-    ok = ok && bind_to_port(sock, family, port) && (net_listen(sock, TCP_MAX_BACKLOG) == 0);
+    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[msg->index];
+    const TCP_Secure_Conn *const entry = &con->connections[msg->slot];
 
-    if (!ok) {
-        kill_sock(sock);
-        return net_invalid_socket;
+    if (con->status != TCP_STATUS_CONFIRMED || entry->status != 2 || entry->shard != from
+            || entry->index != msg->other_index || entry->other_id != msg->other_slot) {
+        return nullptr;
     }
 
-    return sock;
+    return con;
 }
 
-TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
-                           Onion *onion)
+static void handle_shard_message(TCP_Server *tcp_server, uint32_t from, const TCP_Shard_Message *msg, uint8_t *data)
 {
-    if (num_sockets == 0 || ports == nullptr) {
-        return nullptr;
-    }
+    switch (msg->type) {
+        case TCP_SHARD_HANDOFF: {
+            shard_take_connection(tcp_server, data, msg->length);
+            break;
+        }
 
-    if (networking_at_startup() != 0) {
-        return nullptr;
-    }
+        case TCP_SHARD_LINK: {
+            shard_link(tcp_server, from, msg, data);
+            break;
+        }
 
-    TCP_Server *temp = (TCP_Server *)calloc(1, sizeof(TCP_Server));
+        case TCP_SHARD_UNLINK: {
+            TCP_Secure_Connection *con = shard_linked_connection(tcp_server, from, msg);
 
-    if (temp == nullptr) {
-        return nullptr;
-    }
+            if (con != nullptr) {
+                con->connections[msg->slot].status = 1;
+                con->connections[msg->slot].index = 0;
+                con->connections[msg->slot].other_id = 0;
+                con->connections[msg->slot].shard = 0;
+                send_disconnect_notification(tcp_server, con, msg->slot);
+            }
 
-    temp->socks_listening = (Socket *)calloc(num_sockets, sizeof(Socket));
+            break;
+        }
 
-    if (temp->socks_listening == nullptr) {
-        free(temp);
+        case TCP_SHARD_DATA: {
+            TCP_Secure_Connection *con = shard_linked_connection(tcp_server, from, msg);
+
+            if (con != nullptr && msg->length != 0) {
+                data[0] = msg->slot + NUM_RESERVED_PORTS;
+
+                if (write_packet_TCP_secure_connection(tcp_server, con, data, msg->length, 0) == -1) {
+                    kill_accepted(tcp_server, msg->index);
+                }
+            }
+
+            break;
+        }
+
+        case TCP_SHARD_OOB: {
+            if (msg->length > CRYPTO_PUBLIC_KEY_SIZE * 2) {
+                send_oob_recv(tcp_server, data, data + CRYPTO_PUBLIC_KEY_SIZE, data + CRYPTO_PUBLIC_KEY_SIZE * 2,
+                              msg->length - CRYPTO_PUBLIC_KEY_SIZE * 2);
+            }
+
+            break;
+        }
+    }
+}
+
+/* Handle the messages the other shards sent to this one. */
+static void do_TCP_shard_messages(TCP_Server *tcp_server)
+{
+    TCP_Shard_Mailbox *const mailbox = tcp_server->mailbox;
+
+    if (mailbox == nullptr) {
+        return;
+    }
+
+#ifdef TCP_SERVER_USE_EPOLL
+    /* Cleared before the mailbox is emptied, so that a batch that comes in
+     * after that wakes the shard up again. */
+    uint64_t count;
+
+    while (read(mailbox->wakeup, &count, sizeof(count)) > 0) {
+        continue;
+    }
+
+#endif
+
+    pthread_mutex_lock(&mailbox->mutex);
+    TCP_Shard_Batch *const batches = mailbox->start;
+    mailbox->start = nullptr;
+    mailbox->end = nullptr;
+    mailbox->length = 0;
+    pthread_mutex_unlock(&mailbox->mutex);
+
+    for (TCP_Shard_Batch *batch = batches; batch; batch = batch->next) {
+        uint32_t offset = 0;
+
+        while (offset + sizeof(TCP_Shard_Message) <= batch->length) {
+            TCP_Shard_Message msg;
+            memcpy(&msg, batch->data + offset, sizeof(msg));
+            offset += sizeof(msg);
+            handle_shard_message(tcp_server, batch->from, &msg, batch->data + offset);
+            offset += msg.length;
+        }
+
+        /* Handed over connections are in the unconfirmed queue now. */
+        batch->length = 0;
+    }
+
+    free_shard_batches(batches);
+}
+
+/* Hand a connection that just completed the handshake over to the shard its
+ * public key maps to, if that is not this one.
+ *
+ * return true if the connection is gone from this shard.
+ */
+static bool shard_hand_off(TCP_Server *tcp_server, uint32_t index)
+{
+    TCP_Secure_Connection *conn = &tcp_server->unconfirmed_connection_queue[index];
+    const uint32_t shard = key_shard(tcp_server, conn->public_key);
+
+    if (shard == tcp_server->shard_id) {
+        return false;
+    }
+
+#ifdef TCP_SERVER_USE_EPOLL
+    epoll_ctl(tcp_server->efd, EPOLL_CTL_DEL, conn->sock.socket, nullptr);
+#endif
+
+    if (!shard_send(tcp_server, shard, TCP_SHARD_HANDOFF, 0, 0, 0, 0, (const uint8_t *)conn,
+                    sizeof(TCP_Secure_Connection))) {
+        kill_TCP_secure_connection(conn);
+        return true;
+    }
+
+    crypto_memzero(conn, sizeof(TCP_Secure_Connection));
+    return true;
+}
+
+static int confirm_TCP_connection(TCP_Server *tcp_server, const Mono_Time *mono_time, TCP_Secure_Connection *con,
+                                  const uint8_t *data,
+                                  uint16_t length)
+{
+    int index = add_accepted(tcp_server, mono_time, con);
+
+    if (index == -1) {
+        kill_TCP_secure_connection(con);
+        return -1;
+    }
+
+    crypto_memzero(con, sizeof(TCP_Secure_Connection));
+
+    if (handle_TCP_packet(tcp_server, index, data, length) == -1) {
+        kill_accepted(tcp_server, index);
+        return -1;
+    }
+
+    return index;
+}
+
+/* return index on success
+ * return -1 on failure
+ */
+static int accept_connection(TCP_Server *tcp_server, Socket sock)
+{
+    if (!sock_valid(sock)) {
+        return -1;
+    }
+
+    if (!set_socket_nonblock(sock)) {
+        kill_sock(sock);
+        return -1;
+    }
+
+    if (!set_socket_nosigpipe(sock)) {
+        kill_sock(sock);
+        return -1;
+    }
+
+    uint16_t index = tcp_server->incoming_connection_queue_index % MAX_INCOMING_CONNECTIONS;
+
+    TCP_Secure_Connection *conn = &tcp_server->incoming_connection_queue[index];
+
+    if (conn->status != TCP_STATUS_NO_STATUS) {
+        kill_TCP_secure_connection(conn);
+        ++tcp_server->handshake_failures;
+    }
+
+    conn->status = TCP_STATUS_CONNECTED;
+    conn->sock = sock;
+    conn->next_packet_length = 0;
+    send_buffer_init(&conn->send_buffer, tcp_server->send_buffer_size);
+
+    ++tcp_server->incoming_connection_queue_index;
+    return index;
+}
+
+static Socket new_listening_TCP_socket(Family family, uint16_t port)
+{
+    Socket sock = net_socket(family, TOX_SOCK_STREAM, TOX_PROTO_TCP);
+
+    if (!sock_valid(sock)) {
+        return net_invalid_socket;
+    }
+
+    int ok = set_socket_nonblock(sock);
+
+    if (ok && net_family_is_ipv6(family)) {
+        ok = set_socket_dualstack(sock);
+    }
+
+    if (ok) {
+        ok = set_socket_reuseaddr(sock);
+    }
+
+    ok = ok && bind_to_port(sock, family, port) && (net_listen(sock, TCP_MAX_BACKLOG) == 0);
+
+    if (!ok) {
+        kill_sock(sock);
+        return net_invalid_socket;
+    }
+
+    return sock;
+}
+
+TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
+                           Onion *onion)
+{
+    if (num_sockets == 0 || ports == nullptr) {
+        return nullptr;
+    }
+
+    if (networking_at_startup() != 0) {
+        return nullptr;
+    }
+
+    TCP_Server *temp = (TCP_Server *)calloc(1, sizeof(TCP_Server));
+
+    if (temp == nullptr) {
+        return nullptr;
+    }
+
+    temp->socks_listening = (Socket *)calloc(num_sockets, sizeof(Socket));
+
+    if (temp->socks_listening == nullptr) {
+        free(temp);
         return nullptr;
     }
 
@@ -1071,6 +2032,17 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
         return nullptr;
     }
 
+    temp->events = (struct epoll_event *)calloc(TCP_SERVER_MAX_EVENTS, sizeof(struct epoll_event));
+
+    if (temp->events == nullptr) {
+        close(temp->efd);
+        free(temp->socks_listening);
+        free(temp);
+        return nullptr;
+    }
+
+    temp->max_events = TCP_SERVER_MAX_EVENTS;
+
 #endif
 
     const Family family = ipv6_enabled ? net_family_ipv6 : net_family_ipv4;
@@ -1100,6 +2072,10 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     }
 
     if (temp->num_listening_socks == 0) {
+#ifdef TCP_SERVER_USE_EPOLL
+        close(temp->efd);
+        free(temp->events);
+#endif
         free(temp->socks_listening);
         free(temp);
         return nullptr;
@@ -1113,7 +2089,12 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     memcpy(temp->secret_key, secret_key, CRYPTO_SECRET_KEY_SIZE);
     crypto_derive_public_key(temp->public_key, temp->secret_key);
 
-    bs_list_init(&temp->accepted_key_list, CRYPTO_PUBLIC_KEY_SIZE, 8);
+    temp->send_buffer_size = TCP_SEND_BUFFER_SIZE;
+    temp->max_queued_bytes = TCP_SERVER_QUEUE_SIZE;
+    temp->drain_timeout = TCP_SERVER_DRAIN_TIMEOUT;
+    temp->max_socket_reads = TCP_SERVER_MAX_SOCKET_READS;
+
+    key_map_init(&temp->accepted_key_list, 0);
 
     return temp;
 }
@@ -1143,6 +2124,7 @@ static int do_incoming(TCP_Server *tcp_server, uint32_t i)
 
     if (ret == -1) {
         kill_TCP_secure_connection(&tcp_server->incoming_connection_queue[i]);
+        ++tcp_server->handshake_failures;
     } else if (ret == 1) {
         int index_new = tcp_server->unconfirmed_connection_queue_index % MAX_INCOMING_CONNECTIONS;
         TCP_Secure_Connection *conn_old = &tcp_server->incoming_connection_queue[i];
@@ -1150,12 +2132,17 @@ static int do_incoming(TCP_Server *tcp_server, uint32_t i)
 
         if (conn_new->status != TCP_STATUS_NO_STATUS) {
             kill_TCP_secure_connection(conn_new);
+            ++tcp_server->handshake_failures;
         }
 
         memcpy(conn_new, conn_old, sizeof(TCP_Secure_Connection));
         crypto_memzero(conn_old, sizeof(TCP_Secure_Connection));
         ++tcp_server->unconfirmed_connection_queue_index;
 
+        if (shard_hand_off(tcp_server, index_new)) {
+            return -1;
+        }
+
         return index_new;
     }
 
@@ -1180,6 +2167,7 @@ static int do_unconfirmed(TCP_Server *tcp_server, const Mono_Time *mono_time, ui
 
     if (len == -1) {
         kill_TCP_secure_connection(conn);
+        ++tcp_server->handshake_failures;
         return -1;
     }
 
@@ -1211,12 +2199,86 @@ static bool tcp_process_secure_packet(TCP_Server *tcp_server, uint32_t i)
     return true;
 }
 
-static void do_confirmed_recv(TCP_Server *tcp_server, uint32_t i)
+/* Read packets from an accepted connection until its socket runs dry, an error
+ * occurs or max_socket_reads packets were read, so that one busy client can't
+ * keep the server from reading the others.
+ *
+ * Instead of two reads per packet, one for the length and one for the rest,
+ * the buffered data is peeked at in large chunks and only the complete packets
+ * in it are taken out of the socket.
+ *
+ * return true if reading stopped at the limit.
+ */
+static bool do_confirmed_recv(TCP_Server *tcp_server, uint32_t i)
 {
-    while (tcp_process_secure_packet(tcp_server, i)) {
-        // Keep reading until an error occurs or there is no more data to read.
-        continue;
+    TCP_Secure_Connection *const conn = &tcp_server->accepted_connection_array[i];
+    uint32_t reads = 0;
+
+    /* The handshake code may have read just the length of a packet. */
+    if (conn->next_packet_length != 0) {
+        if (!tcp_process_secure_packet(tcp_server, i)) {
+            return false;
+        }
+
+        ++reads;
     }
+
+    uint8_t buffer[TCP_SERVER_READ_SIZE];
+
+    while (reads < tcp_server->max_socket_reads) {
+        const int len = net_peek(conn->sock, buffer, sizeof(buffer));
+
+        if (len <= 0) {
+            return false;
+        }
+
+        uint32_t offset = 0;
+
+        while (reads < tcp_server->max_socket_reads && offset + sizeof(uint16_t) <= (uint32_t)len) {
+            uint16_t length;
+            memcpy(&length, buffer + offset, sizeof(uint16_t));
+            length = net_ntohs(length);
+
+            if (length > MAX_PACKET_SIZE || length < CRYPTO_MAC_SIZE) {
+                kill_accepted(tcp_server, i);
+                return false;
+            }
+
+            if (offset + sizeof(uint16_t) + length > (uint32_t)len) {
+                break;
+            }
+
+            uint8_t packet[MAX_PACKET_SIZE];
+            const int packet_len = decrypt_data_symmetric(conn->shared_key, conn->recv_nonce,
+                                   buffer + offset + sizeof(uint16_t), length, packet);
+
+            if (packet_len + CRYPTO_MAC_SIZE != length) {
+                kill_accepted(tcp_server, i);
+                return false;
+            }
+
+            increment_nonce(conn->recv_nonce);
+            offset += sizeof(uint16_t) + length;
+            ++reads;
+
+            if (handle_TCP_packet(tcp_server, i, packet, packet_len) == -1) {
+                kill_accepted(tcp_server, i);
+                return false;
+            }
+        }
+
+        if (offset == 0) {
+            /* Only part of the next packet arrived so far. */
+            return false;
+        }
+
+        if (net_recv(conn->sock, buffer, offset) != (int)offset) {
+            kill_accepted(tcp_server, i);
+            return false;
+        }
+    }
+
+    return true;
 }
 
 #ifndef TCP_SERVER_USE_EPOLL
@@ -1264,7 +2326,7 @@ static void do_TCP_confirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
             }
 
             memcpy(ping + 1, &ping_id, sizeof(uint64_t));
-            int ret = write_packet_TCP_secure_connection(conn, ping, sizeof(ping), 1);
+            int ret = write_packet_TCP_secure_connection(tcp_server, conn, ping, sizeof(ping), 1);
 
             if (ret == 1) {
                 conn->last_pinged = mono_time_get(mono_time);
@@ -1282,7 +2344,19 @@ static void do_TCP_confirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
             continue;
         }
 
-        send_pending_data(conn);
+        flush_send_buffer(tcp_server, conn);
+
+        /* A client that reads just enough to answer the pings can still hold
+         * a full send buffer forever. */
+        if (conn->drained || send_buffer_length(&conn->send_buffer) == 0) {
+            conn->drained = 0;
+            conn->last_drained = mono_time_get(mono_time);
+        } else if (tcp_server->drain_timeout != 0
+                   && mono_time_is_timeout(mono_time, conn->last_drained, tcp_server->drain_timeout)) {
+            ++tcp_server->slow_kills;
+            kill_accepted(tcp_server, i);
+            continue;
+        }
 
 #ifndef TCP_SERVER_USE_EPOLL
 
@@ -1293,12 +2367,70 @@ static void do_TCP_confirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
 }
 
 #ifdef TCP_SERVER_USE_EPOLL
+static void add_unread(TCP_Server *tcp_server, uint32_t index)
+{
+    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[index];
+
+    if (con->unread) {
+        return;
+    }
+
+    if (tcp_server->unread_length == tcp_server->unread_size) {
+        const uint32_t new_size = tcp_server->unread_size == 0 ? 16 : tcp_server->unread_size * 2;
+        uint32_t *new_unread = (uint32_t *)realloc(tcp_server->unread, new_size * sizeof(uint32_t));
+
+        if (new_unread == nullptr) {
+            /* Nowhere to remember it, so read it dry now. */
+            while (tcp_process_secure_packet(tcp_server, index)) {
+                continue;
+            }
+
+            return;
+        }
+
+        tcp_server->unread = new_unread;
+        tcp_server->unread_size = new_size;
+    }
+
+    tcp_server->unread[tcp_server->unread_length] = index;
+    ++tcp_server->unread_length;
+    con->unread = 1;
+}
+
+/* Give every connection on the unread list another turn. */
+static void do_TCP_unread(TCP_Server *tcp_server)
+{
+    const uint32_t length = tcp_server->unread_length;
+    tcp_server->unread_length = 0;
+
+    /* Every entry is added back at most once, at a position that was already
+     * visited, so the list is rebuilt in place. */
+    for (uint32_t i = 0; i < length; ++i) {
+        const uint32_t index = tcp_server->unread[i];
+
+        if (index >= tcp_server->size_accepted_connections) {
+            continue;
+        }
+
+        /* Connections killed since then are all zero. */
+        TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[index];
+
+        if (!con->unread) {
+            continue;
+        }
+
+        con->unread = 0;
+
+        if (do_confirmed_recv(tcp_server, index)) {
+            add_unread(tcp_server, index);
+        }
+    }
+}
+
 static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time)
 {
-#define MAX_EVENTS 16
-    struct epoll_event events[MAX_EVENTS];
-    const int nfds = epoll_wait(tcp_server->efd, events, MAX_EVENTS, 0);
-#undef MAX_EVENTS
+    struct epoll_event *const events = tcp_server->events;
+    const int nfds = epoll_wait(tcp_server->efd, events, tcp_server->max_events, 0);
 
     for (int n = 0; n < nfds; ++n) {
         const Socket sock = {(int)(events[n].data.u64 & 0xFFFFFFFF)};
@@ -1326,6 +2458,11 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
                     kill_accepted(tcp_server, index);
                     break;
                 }
+
+                case TCP_SOCKET_WAKEUP: {
+                    // should never happen
+                    break;
+                }
             }
 
             continue;
@@ -1395,13 +2532,26 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
                         kill_accepted(tcp_server, index_new);
                         break;
                     }
+
+                    /* Packets that came right behind the first one won't
+                     * trigger another edge. */
+                    add_unread(tcp_server, index_new);
                 }
 
                 break;
             }
 
             case TCP_SOCKET_CONFIRMED: {
-                do_confirmed_recv(tcp_server, index);
+                if (do_confirmed_recv(tcp_server, index)) {
+                    add_unread(tcp_server, index);
+                }
+
+                break;
+            }
+
+            case TCP_SOCKET_WAKEUP: {
+                do_TCP_onion_responses(tcp_server);
+                do_TCP_shard_messages(tcp_server);
                 break;
             }
         }
@@ -1416,11 +2566,418 @@ static void do_TCP_epoll(TCP_Server *tcp_server, const Mono_Time *mono_time)
         // Keep processing packets until there are no more FDs ready for reading.
         continue;
     }
+
+    do_TCP_unread(tcp_server);
 }
 #endif
 
+static uint32_t add_wait_socket(Socket *socks, uint32_t max_socks, uint32_t count, Socket sock)
+{
+    if (count < max_socks) {
+        socks[count] = sock;
+    }
+
+    return count + 1;
+}
+
+uint32_t tcp_server_wait_sockets(const TCP_Server *tcp_server, Socket *socks, uint32_t max_socks)
+{
+    uint32_t count = 0;
+
+#ifdef TCP_SERVER_USE_EPOLL
+    const Socket efd = {tcp_server->efd};
+    count = add_wait_socket(socks, max_socks, count, efd);
+#else
+
+    for (uint32_t i = 0; i < tcp_server->num_listening_socks; ++i) {
+        count = add_wait_socket(socks, max_socks, count, tcp_server->socks_listening[i]);
+    }
+
+    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
+        if (tcp_server->incoming_connection_queue[i].status == TCP_STATUS_CONNECTED) {
+            count = add_wait_socket(socks, max_socks, count, tcp_server->incoming_connection_queue[i].sock);
+        }
+
+        if (tcp_server->unconfirmed_connection_queue[i].status == TCP_STATUS_UNCONFIRMED) {
+            count = add_wait_socket(socks, max_socks, count, tcp_server->unconfirmed_connection_queue[i].sock);
+        }
+    }
+
+    for (uint32_t i = 0; i < tcp_server->size_accepted_connections; ++i) {
+        if (tcp_server->accepted_connection_array[i].status == TCP_STATUS_CONFIRMED) {
+            count = add_wait_socket(socks, max_socks, count, tcp_server->accepted_connection_array[i].sock);
+        }
+    }
+
+#endif
+
+    return count;
+}
+
+uint32_t tcp_server_onion_wait_sockets(const TCP_Server *tcp_server, Socket *socks, uint32_t max_socks)
+{
+    uint32_t count = 0;
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_server->onion_requests == nullptr) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < tcp_server_shard_count(tcp_server); ++i) {
+        const TCP_Server *const shard = tcp_server->shards != nullptr ? tcp_server->shards[i] : tcp_server;
+        const Socket wakeup = {shard->onion_requests->wakeup};
+        count = add_wait_socket(socks, max_socks, count, wakeup);
+    }
+
+#endif
+
+    return count;
+}
+
+bool tcp_server_has_pending_data(const TCP_Server *tcp_server)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_server->unread_length != 0) {
+        return true;
+    }
+
+#endif
+
+    for (uint32_t i = 0; i < tcp_server->num_shards; ++i) {
+        if (tcp_server->outbox[i] != nullptr) {
+            return true;
+        }
+    }
+
+    return tcp_server->pending_connections != 0;
+}
+
+bool tcp_server_enable_onion_mailbox(TCP_Server *tcp_server)
+{
+    if (tcp_server->onion == nullptr) {
+        return false;
+    }
+
+    if (tcp_server->onion_requests) {
+        return true;
+    }
+
+    TCP_Onion_Mailbox *requests = new_onion_mailbox();
+    TCP_Onion_Mailbox *responses = new_onion_mailbox();
+
+    if (requests == nullptr || responses == nullptr || !enable_stats_snapshot(tcp_server)) {
+        kill_onion_mailbox(requests);
+        kill_onion_mailbox(responses);
+        return false;
+    }
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (!onion_mailbox_wakeup(requests) || !onion_mailbox_watch(responses, tcp_server->efd)) {
+        kill_onion_mailbox(requests);
+        kill_onion_mailbox(responses);
+        return false;
+    }
+
+#endif
+
+    tcp_server->onion_requests = requests;
+    tcp_server->onion_responses = responses;
+    return true;
+}
+
+/* Free what tcp_server_set_shards() set up for one shard. */
+static void free_shard(TCP_Server *shard)
+{
+    if (shard->outbox != nullptr) {
+        for (uint32_t i = 0; i < shard->num_shards; ++i) {
+            free_shard_batches(shard->outbox[i]);
+        }
+    }
+
+    free(shard->outbox);
+    kill_shard_mailbox(shard->mailbox);
+    shard->outbox = nullptr;
+    shard->mailbox = nullptr;
+    shard->shards = nullptr;
+    shard->num_shards = 0;
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+/* Create a shard without listening sockets, with the keys and settings of
+ * tcp_server.
+ */
+static TCP_Server *new_TCP_shard(const TCP_Server *tcp_server, uint32_t shard_id)
+{
+    TCP_Server *shard = (TCP_Server *)calloc(1, sizeof(TCP_Server));
+
+    if (shard == nullptr) {
+        return nullptr;
+    }
+
+    shard->efd = epoll_create(8);
+
+    if (shard->efd == -1) {
+        free(shard);
+        return nullptr;
+    }
+
+    shard->events = (struct epoll_event *)calloc(tcp_server->max_events, sizeof(struct epoll_event));
+
+    if (shard->events == nullptr) {
+        close(shard->efd);
+        free(shard);
+        return nullptr;
+    }
+
+    shard->max_events = tcp_server->max_events;
+    shard->max_socket_reads = tcp_server->max_socket_reads;
+    shard->send_buffer_size = tcp_server->send_buffer_size;
+    shard->max_queued_bytes = tcp_server->max_queued_bytes;
+    shard->drain_timeout = tcp_server->drain_timeout;
+    shard->shard_id = shard_id;
+    shard->shard_seed = tcp_server->shard_seed;
+    shard->onion = tcp_server->onion;
+    memcpy(shard->public_key, tcp_server->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(shard->secret_key, tcp_server->secret_key, CRYPTO_SECRET_KEY_SIZE);
+    key_map_init(&shard->accepted_key_list, 0);
+
+    if (tcp_server->onion_requests) {
+        shard->onion_requests = new_onion_mailbox();
+        shard->onion_responses = new_onion_mailbox();
+
+        if (shard->onion_requests == nullptr || shard->onion_responses == nullptr
+                || !onion_mailbox_wakeup(shard->onion_requests)
+                || !onion_mailbox_watch(shard->onion_responses, shard->efd)) {
+            kill_TCP_server(shard);
+            return nullptr;
+        }
+    }
+
+    return shard;
+}
+
+static bool init_shard(TCP_Server *shard, TCP_Server **shards, uint32_t num_shards)
+{
+    shard->mailbox = new_shard_mailbox();
+    shard->outbox = (TCP_Shard_Batch **)calloc(num_shards, sizeof(TCP_Shard_Batch *));
+
+    if (shard->mailbox == nullptr || shard->outbox == nullptr || !enable_stats_snapshot(shard)) {
+        free_shard(shard);
+        return false;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint32_t)shard->mailbox->wakeup | ((uint64_t)TCP_SOCKET_WAKEUP << 32);
+
+    if (epoll_ctl(shard->efd, EPOLL_CTL_ADD, shard->mailbox->wakeup, &ev) == -1) {
+        free_shard(shard);
+        return false;
+    }
+
+    shard->shards = shards;
+    shard->num_shards = num_shards;
+    return true;
+}
+#endif
+
+bool tcp_server_set_shards(TCP_Server *tcp_server, uint32_t num_shards)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (num_shards == 0 || num_shards > TCP_SERVER_MAX_SHARDS || tcp_server->shards != nullptr
+            || tcp_server->num_accepted_connections != 0) {
+        return false;
+    }
+
+    if (num_shards == 1) {
+        return true;
+    }
+
+    if (tcp_server->onion != nullptr && !tcp_server_enable_onion_mailbox(tcp_server)) {
+        return false;
+    }
+
+    TCP_Server **shards = (TCP_Server **)calloc(num_shards, sizeof(TCP_Server *));
+
+    if (shards == nullptr) {
+        return false;
+    }
+
+    shards[0] = tcp_server;
+    tcp_server->shard_seed = random_u64();
+    bool ok = true;
+
+    /* The cap on queued bytes is for the whole server. */
+    uint64_t max_queued_bytes = tcp_server->max_queued_bytes / num_shards;
+
+    if (max_queued_bytes < TCP_MIN_SEND_BUFFER_SIZE) {
+        max_queued_bytes = TCP_MIN_SEND_BUFFER_SIZE;
+    }
+
+    for (uint32_t i = 1; ok && i < num_shards; ++i) {
+        shards[i] = new_TCP_shard(tcp_server, i);
+        ok = shards[i] != nullptr;
+    }
+
+    for (uint32_t i = 0; ok && i < num_shards; ++i) {
+        ok = init_shard(shards[i], shards, num_shards);
+    }
+
+    for (uint32_t i = 0; ok && i < num_shards; ++i) {
+        shards[i]->max_queued_bytes = max_queued_bytes;
+    }
+
+    if (!ok) {
+        for (uint32_t i = 0; i < num_shards; ++i) {
+            if (shards[i] != nullptr) {
+                free_shard(shards[i]);
+            }
+        }
+
+        for (uint32_t i = 1; i < num_shards; ++i) {
+            if (shards[i] != nullptr) {
+                kill_TCP_server(shards[i]);
+            }
+        }
+
+        free(shards);
+        return false;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint32_t tcp_server_shard_count(const TCP_Server *tcp_server)
+{
+    return tcp_server->shards != nullptr ? tcp_server->num_shards : 1;
+}
+
+TCP_Server *tcp_server_shard(TCP_Server *tcp_server, uint32_t i)
+{
+    if (i >= tcp_server_shard_count(tcp_server)) {
+        return nullptr;
+    }
+
+    return tcp_server->shards != nullptr ? tcp_server->shards[i] : tcp_server;
+}
+
+static uint32_t count_status(const TCP_Secure_Connection *queue, TCP_Status status)
+{
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
+        count += queue[i].status == status;
+    }
+
+    return count;
+}
+
+static void get_shard_stats(const TCP_Server *tcp_server, TCP_Server_Stats *stats)
+{
+    stats->incoming_connections = count_status(tcp_server->incoming_connection_queue, TCP_STATUS_CONNECTED);
+    stats->unconfirmed_connections = count_status(tcp_server->unconfirmed_connection_queue, TCP_STATUS_UNCONFIRMED);
+    stats->connections = tcp_server->num_accepted_connections;
+    stats->handshake_failures = tcp_server->handshake_failures;
+    stats->queued_bytes = tcp_server->queued_bytes;
+    stats->dropped_packets = tcp_server->dropped_packets;
+    stats->slow_kills = tcp_server->slow_kills;
+    memcpy(stats->packets, tcp_server->packet_stats, sizeof(stats->packets));
+}
+
+void tcp_server_get_stats(const TCP_Server *tcp_server, TCP_Server_Stats *stats)
+{
+    if (tcp_server->stats_snapshot == nullptr) {
+        get_shard_stats(tcp_server, stats);
+        return;
+    }
+
+    /* The server or its shards run on other threads, so only their published
+     * stats are safe to read. */
+    const uint32_t num_shards = tcp_server_shard_count(tcp_server);
+    memset(stats, 0, sizeof(TCP_Server_Stats));
+
+    for (uint32_t i = 0; i < num_shards; ++i) {
+        const TCP_Server *const shard = tcp_server->shards != nullptr ? tcp_server->shards[i] : tcp_server;
+        TCP_Stats_Snapshot *const snapshot = shard->stats_snapshot;
+        pthread_mutex_lock(&snapshot->mutex);
+        stats->incoming_connections += snapshot->stats.incoming_connections;
+        stats->unconfirmed_connections += snapshot->stats.unconfirmed_connections;
+        stats->connections += snapshot->stats.connections;
+        stats->handshake_failures += snapshot->stats.handshake_failures;
+        stats->queued_bytes += snapshot->stats.queued_bytes;
+        stats->dropped_packets += snapshot->stats.dropped_packets;
+        stats->slow_kills += snapshot->stats.slow_kills;
+
+        for (uint32_t j = 0; j < TCP_STATS_PACKET_TYPES; ++j) {
+            const TCP_Packet_Stats *const p = &snapshot->stats.packets[j];
+            stats->packets[j].packets_recv += p->packets_recv;
+            stats->packets[j].bytes_recv += p->bytes_recv;
+            stats->packets[j].packets_sent += p->packets_sent;
+            stats->packets[j].bytes_sent += p->bytes_sent;
+        }
+
+        pthread_mutex_unlock(&snapshot->mutex);
+    }
+}
+
+/* Counting the handshake queues reads every slot, so it is only done once a
+ * second. */
+static void publish_stats(TCP_Server *tcp_server, const Mono_Time *mono_time)
+{
+    TCP_Stats_Snapshot *const snapshot = tcp_server->stats_snapshot;
+
+    if (snapshot == nullptr || tcp_server->last_published == mono_time_get(mono_time)) {
+        return;
+    }
+
+    tcp_server->last_published = mono_time_get(mono_time);
+
+    pthread_mutex_lock(&snapshot->mutex);
+    get_shard_stats(tcp_server, &snapshot->stats);
+    pthread_mutex_unlock(&snapshot->mutex);
+}
+
+static void do_onion_requests(TCP_Server *tcp_server, Onion *onion)
+{
+    TCP_Onion_Packet *const requests = onion_mailbox_take(tcp_server->onion_requests);
+
+    for (const TCP_Onion_Packet *p = requests; p; p = p->next) {
+        onion_send_1(onion, p->data, p->length, p->ip_port, p->nonce);
+    }
+
+    free_onion_packets(requests);
+}
+
+void tcp_server_do_onion(TCP_Server *tcp_server)
+{
+    if (tcp_server->onion_requests == nullptr) {
+        return;
+    }
+
+    if (tcp_server->shards == nullptr) {
+        do_onion_requests(tcp_server, tcp_server->onion);
+        return;
+    }
+
+    for (uint32_t i = 0; i < tcp_server->num_shards; ++i) {
+        do_onion_requests(tcp_server->shards[i], tcp_server->onion);
+    }
+}
+
 void do_TCP_server(TCP_Server *tcp_server, Mono_Time *mono_time)
 {
+    tcp_server->batching = 1;
+
+    do_TCP_onion_responses(tcp_server);
+    do_TCP_shard_messages(tcp_server);
+
 #ifdef TCP_SERVER_USE_EPOLL
     do_TCP_epoll(tcp_server, mono_time);
 
@@ -1431,27 +2988,59 @@ void do_TCP_server(TCP_Server *tcp_server, Mono_Time *mono_time)
 #endif
 
     do_TCP_confirmed(tcp_server, mono_time);
+
+    flush_shard_outboxes(tcp_server);
+    flush_batch(tcp_server);
+    tcp_server->batching = 0;
+
+    publish_stats(tcp_server, mono_time);
 }
 
 void kill_TCP_server(TCP_Server *tcp_server)
 {
     uint32_t i;
 
+    if (tcp_server->shards != nullptr && tcp_server->shard_id == 0) {
+        TCP_Server **const shards = tcp_server->shards;
+        const uint32_t num_shards = tcp_server->num_shards;
+
+        for (i = 0; i < num_shards; ++i) {
+            free_shard(shards[i]);
+        }
+
+        for (i = 1; i < num_shards; ++i) {
+            kill_TCP_server(shards[i]);
+        }
+
+        free(shards);
+    }
+
     for (i = 0; i < tcp_server->num_listening_socks; ++i) {
         kill_sock(tcp_server->socks_listening[i]);
     }
 
-    if (tcp_server->onion) {
+    if (tcp_server->onion && tcp_server->shard_id == 0) {
         set_callback_handle_recv_1(tcp_server->onion, nullptr, nullptr);
     }
 
-    bs_list_free(&tcp_server->accepted_key_list);
+    kill_onion_mailbox(tcp_server->onion_requests);
+    kill_onion_mailbox(tcp_server->onion_responses);
+    kill_stats_snapshot(tcp_server->stats_snapshot);
+
+    for (i = 0; i < tcp_server->size_accepted_connections; ++i) {
+        send_buffer_free(&tcp_server->accepted_connection_array[i].send_buffer);
+    }
+
+    key_map_free(&tcp_server->accepted_key_list);
+    free(tcp_server->batch);
 
 #ifdef TCP_SERVER_USE_EPOLL
     close(tcp_server->efd);
+    free(tcp_server->events);
+    free(tcp_server->unread);
 #endif
 
     free(tcp_server->socks_listening);
-    free(tcp_server->accepted_connection_array);
+    free_connections(tcp_server);
     free(tcp_server);
 }
@@ -25,7 +25,6 @@
 #define C_TOXCORE_TOXCORE_TCP_SERVER_H
 
 #include "crypto_core.h"
-#include "list.h"
 #include "onion.h"
 
 #define MAX_INCOMING_CONNECTIONS 256
@@ -66,14 +65,18 @@ typedef enum TCP_Status {
     TCP_STATUS_CONFIRMED,
 } TCP_Status;
 
-typedef struct TCP_Priority_List TCP_Priority_List;
+/* Default cap on the bytes queued for a connection whose socket does not take
+ * any more data. Packets that would go over it are refused.
+ */
+#define TCP_SEND_BUFFER_SIZE (256 * 1024)
+
+/* Smallest allowed cap, room for one packet of the largest size. */
+#define TCP_MIN_SEND_BUFFER_SIZE (2 + MAX_PACKET_SIZE)
 
-struct TCP_Priority_List {
-    TCP_Priority_List *next;
-    uint16_t size;
-    uint16_t sent;
-    uint8_t data[];
-};
+/* Packets for a connection are collected during do_TCP_server() and sent
+ * together at the end, or as soon as this many bytes are waiting.
+ */
+#define TCP_SERVER_BATCH_SIZE (64 * 1024)
 
 typedef struct TCP_Server TCP_Server;
 
@@ -85,10 +88,178 @@ size_t tcp_server_listen_count(const TCP_Server *tcp_server);
 TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
                            Onion *onion);
 
+/* Defaults for tcp_server_set_read_limits(). */
+#define TCP_SERVER_MAX_EVENTS 256
+#define TCP_SERVER_MAX_SOCKET_READS 64
+
+/* Received data of a client is read in chunks of up to this many bytes. */
+#define TCP_SERVER_READ_SIZE (16 * 1024)
+
+/* Set how many ready sockets do_TCP_server() takes from one epoll_wait() call
+ * (no effect without epoll), and how many packets it reads from one client
+ * socket before it moves on to the others. A socket that still has data after
+ * that gets another turn once the others had theirs.
+ *
+ * return false if either value is 0 or on allocation failure, in which case
+ * nothing is changed.
+ */
+bool tcp_server_set_read_limits(TCP_Server *tcp_server, uint32_t max_events, uint32_t max_socket_reads);
+
+/* Set the cap on queued bytes per connection, TCP_SEND_BUFFER_SIZE by default.
+ * Only affects connections accepted afterwards. Values below
+ * TCP_MIN_SEND_BUFFER_SIZE are raised to it.
+ */
+void tcp_server_set_send_buffer_size(TCP_Server *tcp_server, uint32_t size);
+
+/* Defaults for tcp_server_set_queue_limits(). */
+#define TCP_SERVER_QUEUE_SIZE (64 * 1024 * 1024)
+#define TCP_SERVER_DRAIN_TIMEOUT 60
+
+/* Set the cap on the bytes queued for all clients together, and how many
+ * seconds the send buffer of a client may stay non-empty.
+ *
+ * Once the send buffers of the clients hold max_queued_bytes, packets relayed
+ * to clients and onion responses are dropped, as for a client whose own send
+ * buffer is full. Packets of the relay itself, like pings, are only bound by
+ * the cap of their connection. Values below TCP_MIN_SEND_BUFFER_SIZE are
+ * raised to it.
+ *
+ * A client whose send buffer was not emptied once in drain_timeout seconds is
+ * killed as a slow consumer. 0 disables that.
+ *
+ * With shards every shard gets an even part of max_queued_bytes, so this must
+ * be called before tcp_server_set_shards().
+ */
+void tcp_server_set_queue_limits(TCP_Server *tcp_server, uint64_t max_queued_bytes, uint32_t drain_timeout);
+
+/* Index of the counters of all data packets in TCP_Server_Stats::packets. The
+ * other entries are for the packet with that id. */
+#define TCP_STATS_PACKET_DATA NUM_RESERVED_PORTS
+#define TCP_STATS_PACKET_TYPES (NUM_RESERVED_PORTS + 1)
+
+typedef struct TCP_Packet_Stats {
+    uint64_t packets_recv;
+    uint64_t bytes_recv;
+    uint64_t packets_sent; /* Sent or queued to be sent. */
+    uint64_t bytes_sent;
+} TCP_Packet_Stats;
+
+typedef struct TCP_Server_Stats {
+    uint32_t incoming_connections;    /* Clients that didn't send their handshake yet. */
+    uint32_t unconfirmed_connections; /* Clients that didn't send a packet after the handshake yet. */
+    uint32_t connections;     /* Clients that completed the handshake. */
+    uint64_t handshake_failures; /* Clients killed for an invalid handshake, or pushed out of a full queue. */
+    uint64_t queued_bytes;    /* Bytes waiting in the send buffers of the clients. */
+    uint64_t dropped_packets; /* Packets for clients dropped because a send buffer or queue cap was reached. */
+    uint64_t slow_kills;      /* Clients killed because of the drain timeout. */
+    /* Decrypted packets from and to the clients, by packet type. Bytes don't
+     * include the length and MAC added by the encryption. */
+    TCP_Packet_Stats packets[TCP_STATS_PACKET_TYPES];
+} TCP_Server_Stats;
+
+/* Fill stats with the counters of the server, summed over its shards.
+ *
+ * Once the server is split or its onion mailbox is enabled, do_TCP_server()
+ * publishes the counters once a second and this may be called from any
+ * thread. Otherwise, call it from the thread running do_TCP_server().
+ */
+void tcp_server_get_stats(const TCP_Server *tcp_server, TCP_Server_Stats *stats);
+
 /* Run the TCP_server
  */
 void do_TCP_server(TCP_Server *tcp_server, Mono_Time *mono_time);
 
+/* Get the sockets an event loop should wait on for readability before calling
+ * do_TCP_server(). With epoll this is a single epoll descriptor covering all
+ * sockets of the server, otherwise it is every listening and connected socket.
+ *
+ * At most max_socks sockets are written to socks.
+ *
+ * return the total number of sockets, which may be larger than max_socks.
+ */
+uint32_t tcp_server_wait_sockets(const TCP_Server *tcp_server, Socket *socks, uint32_t max_socks);
+
+/* return true if some connection has data that could not be sent yet because
+ * its socket was not writable, or received data that was left unread because
+ * of the per-socket read limit. do_TCP_server() handles both, but waiting on
+ * the sockets from tcp_server_wait_sockets() may not wake up for them.
+ */
+bool tcp_server_has_pending_data(const TCP_Server *tcp_server);
+
+/* Maximum number of onion packets waiting in each direction when the onion
+ * mailbox is enabled. Packets beyond this are dropped.
+ */
+#define MAX_ONION_MAILBOX_SIZE 4096
+
+/* Let the TCP server and its Onion instance run on different threads.
+ *
+ * Once enabled, onion requests from TCP clients are queued until the thread
+ * running the onion calls tcp_server_do_onion(), and onion responses for TCP
+ * clients are queued until the next do_TCP_server() call. With epoll, waiting
+ * on the socket from tcp_server_wait_sockets() wakes up when a response is
+ * queued, and waiting on the ones from tcp_server_onion_wait_sockets() when a
+ * request is. tcp_server_get_stats() may then be called from the thread running
+ * the onion. Must be called before either thread starts.
+ *
+ * return true on success.
+ * return false if the server has no onion or on allocation failure.
+ */
+bool tcp_server_enable_onion_mailbox(TCP_Server *tcp_server);
+
+/* Forward queued onion requests from TCP clients into the onion network.
+ * Call this from the thread that runs the Onion instance.
+ */
+void tcp_server_do_onion(TCP_Server *tcp_server);
+
+/* Get the sockets the thread running the onion should wait on for readability
+ * before calling tcp_server_do_onion(). They become readable when a request is
+ * queued. Only available with epoll, without it the onion thread has to call
+ * tcp_server_do_onion() at regular intervals.
+ *
+ * At most max_socks sockets are written to socks.
+ *
+ * return the total number of sockets, which may be larger than max_socks.
+ */
+uint32_t tcp_server_onion_wait_sockets(const TCP_Server *tcp_server, Socket *socks, uint32_t max_socks);
+
+#define TCP_SERVER_MAX_SHARDS 64
+
+/* Cap on the bytes of data and out of band packets one shard queues for
+ * another. Packets beyond it are dropped.
+ */
+#define TCP_SHARD_QUEUE_SIZE (4 * 1024 * 1024)
+
+/* Split the server into num_shards shards, each to be run with
+ * do_TCP_server() on a thread of its own. Every shard has its own epoll set
+ * and serves the clients whose public keys map to it through a hash with a
+ * random seed. The server itself is shard 0: it also accepts all connections
+ * and does all handshakes, and then hands each client over to its shard. The
+ * handshakes are not spread over the shards.
+ *
+ * Shards never touch each other's state. Routing requests, data and out of
+ * band packets for clients of other shards are passed on in batches through
+ * mailboxes, once per do_TCP_server() call. A shard waiting on the socket
+ * from tcp_server_wait_sockets() wakes up when its mailbox gets a batch.
+ *
+ * This enables the onion mailbox, so tcp_server_do_onion() must be called on
+ * the thread running the onion. Settings of the server are copied to the new
+ * shards. Must be called before the server accepts any connection. Only kill
+ * the server itself, after all shard threads stopped.
+ *
+ * Only supported with epoll.
+ *
+ * return true on success, or if num_shards is 1.
+ * return false if num_shards is 0 or above TCP_SERVER_MAX_SHARDS, if the
+ *   server was split already or on failure.
+ */
+bool tcp_server_set_shards(TCP_Server *tcp_server, uint32_t num_shards);
+
+/* return the number of shards, 1 if the server was not split. */
+uint32_t tcp_server_shard_count(const TCP_Server *tcp_server);
+
+/* return shard i, the server itself for 0, or NULL if there is no such shard. */
+TCP_Server *tcp_server_shard(TCP_Server *tcp_server, uint32_t i);
+
 /* Kill the TCP server
  */
 void kill_TCP_server(TCP_Server *tcp_server);
@@ -0,0 +1,250 @@
+/*
+ * Hash map which associates ids with public keys.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "key_map.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccompat.h"
+
+/* Smallest non-empty table. Must be a power of 2. */
+#define KEY_MAP_MIN_SLOTS 8
+
+#define KEY_MAP_SLOT_SIZE (KEY_MAP_KEY_SIZE + sizeof(uint32_t) + sizeof(int))
+
+static uint32_t key_hash(const Key_Map *map, const uint8_t *key)
+{
+    uint64_t hash = map->seed;
+
+    for (uint32_t i = 0; i < KEY_MAP_KEY_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, key + i, sizeof(word));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 32;
+    }
+
+    /* 0 marks an empty slot. */
+    return (uint32_t)hash != 0 ? (uint32_t)hash : 1;
+}
+
+/* Compares all the words of both keys without branching, which compilers turn
+ * into a couple of vector instructions.
+ */
+static bool key_equal(const uint8_t *a, const uint8_t *b)
+{
+    uint64_t diff = 0;
+
+    for (uint32_t i = 0; i < KEY_MAP_KEY_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word_a;
+        uint64_t word_b;
+        memcpy(&word_a, a + i, sizeof(word_a));
+        memcpy(&word_b, b + i, sizeof(word_b));
+        diff |= word_a ^ word_b;
+    }
+
+    return diff == 0;
+}
+
+/* return the slot holding key, or capacity if it isn't in the map. */
+static uint32_t find_slot(const Key_Map *map, const uint8_t *key)
+{
+    if (map->n == 0) {
+        return map->capacity;
+    }
+
+    const uint32_t mask = map->capacity - 1;
+    const uint32_t hash = key_hash(map, key);
+
+    for (uint32_t i = hash & mask; map->hashes[i] != 0; i = (i + 1) & mask) {
+        if (map->hashes[i] == hash && key_equal(map->keys + i * KEY_MAP_KEY_SIZE, key)) {
+            return i;
+        }
+    }
+
+    return map->capacity;
+}
+
+/* Put a key in the first empty slot of the run of its hash. */
+static void place(Key_Map *map, const uint8_t *key, uint32_t hash, int id)
+{
+    const uint32_t mask = map->capacity - 1;
+    uint32_t i = hash & mask;
+
+    while (map->hashes[i] != 0) {
+        i = (i + 1) & mask;
+    }
+
+    memcpy(map->keys + i * KEY_MAP_KEY_SIZE, key, KEY_MAP_KEY_SIZE);
+    map->hashes[i] = hash;
+    map->ids[i] = id;
+}
+
+/* Move all keys into a new table of capacity slots, which must hold them.
+ *
+ * return false if memory allocation failed. The map is unchanged then.
+ */
+static bool resize(Key_Map *map, uint32_t capacity)
+{
+    if (capacity > UINT32_MAX / KEY_MAP_SLOT_SIZE) {
+        return false;
+    }
+
+    uint8_t *keys = (uint8_t *)malloc(capacity * KEY_MAP_SLOT_SIZE);
+
+    if (keys == nullptr) {
+        return false;
+    }
+
+    Key_Map old = *map;
+
+    map->capacity = capacity;
+    map->keys = keys;
+    map->hashes = (uint32_t *)(keys + capacity * KEY_MAP_KEY_SIZE);
+    map->ids = (int *)(map->hashes + capacity);
+    memset(map->hashes, 0, capacity * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < old.capacity; ++i) {
+        if (old.hashes[i] != 0) {
+            place(map, old.keys + i * KEY_MAP_KEY_SIZE, old.hashes[i], old.ids[i]);
+        }
+    }
+
+    free(old.keys);
+    return true;
+}
+
+int key_map_init(Key_Map *map, uint32_t initial_capacity)
+{
+    map->n = 0;
+    map->capacity = 0;
+    map->min_capacity = 0;
+    map->seed = random_u64();
+    map->keys = nullptr;
+    map->hashes = nullptr;
+    map->ids = nullptr;
+
+    if (initial_capacity == 0) {
+        return 1;
+    }
+
+    uint32_t capacity = KEY_MAP_MIN_SLOTS;
+
+    while (capacity / 4 * 3 < initial_capacity) {
+        if (capacity > UINT32_MAX / 2) {
+            return 0;
+        }
+
+        capacity *= 2;
+    }
+
+    if (!resize(map, capacity)) {
+        return 0;
+    }
+
+    map->min_capacity = capacity;
+    return 1;
+}
+
+void key_map_free(Key_Map *map)
+{
+    free(map->keys);
+    map->keys = nullptr;
+    map->hashes = nullptr;
+    map->ids = nullptr;
+    map->n = 0;
+    map->capacity = 0;
+}
+
+int key_map_find(const Key_Map *map, const uint8_t *key)
+{
+    const uint32_t i = find_slot(map, key);
+
+    if (i == map->capacity) {
+        return -1;
+    }
+
+    return map->ids[i];
+}
+
+int key_map_add(Key_Map *map, const uint8_t *key, int id)
+{
+    if (find_slot(map, key) != map->capacity) {
+        return 0;
+    }
+
+    if (map->n + 1 > map->capacity / 4 * 3) {
+        if (map->capacity > UINT32_MAX / 2) {
+            return 0;
+        }
+
+        if (!resize(map, map->capacity != 0 ? map->capacity * 2 : KEY_MAP_MIN_SLOTS)) {
+            return 0;
+        }
+    }
+
+    place(map, key, key_hash(map, key), id);
+    ++map->n;
+    return 1;
+}
+
+int key_map_remove(Key_Map *map, const uint8_t *key, int id)
+{
+    uint32_t hole = find_slot(map, key);
+
+    if (hole == map->capacity || map->ids[hole] != id) {
+        return 0;
+    }
+
+    /* Move back every later key of the run whose home slot is not between the
+     * hole and itself, so that it stays reachable from its home. */
+    const uint32_t mask = map->capacity - 1;
+
+    for (uint32_t i = (hole + 1) & mask; map->hashes[i] != 0; i = (i + 1) & mask) {
+        const uint32_t home = map->hashes[i] & mask;
+
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            memcpy(map->keys + hole * KEY_MAP_KEY_SIZE, map->keys + i * KEY_MAP_KEY_SIZE, KEY_MAP_KEY_SIZE);
+            map->hashes[hole] = map->hashes[i];
+            map->ids[hole] = map->ids[i];
+            hole = i;
+        }
+    }
+
+    map->hashes[hole] = 0;
+    --map->n;
+
+    if (map->n == 0 && map->min_capacity == 0) {
+        key_map_free(map);
+    } else if (map->n < map->capacity / 8 && map->capacity / 2 >= map->min_capacity
+               && map->capacity / 2 >= KEY_MAP_MIN_SLOTS) {
+        /* Keeping the bigger table is fine if this fails. */
+        resize(map, map->capacity / 2);
+    }
+
+    return 1;
+}
@@ -0,0 +1,96 @@
+/*
+ * Hash map which associates ids with public keys.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_KEY_MAP_H
+#define C_TOXCORE_TOXCORE_KEY_MAP_H
+
+#include <stdint.h>
+
+#include "crypto_core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KEY_MAP_KEY_SIZE CRYPTO_PUBLIC_KEY_SIZE
+
+/* Does the same job as BS_List for public keys, but adding and removing keys
+ * takes constant time instead of moving the rest of the list.
+ *
+ * The keys are kept in an open addressing table with linear probing, at most
+ * 3/4 full. Each slot also holds a hash of its key, so probing mostly reads
+ * the small hashes array and only compares the keys of slots with the same
+ * hash. Removing a key shifts the rest of its run back instead of leaving a
+ * tombstone, so a table with churn doesn't fill up with deleted slots.
+ *
+ * The hash is seeded at random per map, since the keys often come from peers.
+ */
+typedef struct Key_Map {
+    uint32_t n; // number of keys
+    uint32_t capacity; // number of slots, 0 or a power of 2
+    uint32_t min_capacity; // the table doesn't shrink below this
+    uint64_t seed; // seed of the hash function
+    uint8_t *keys; // KEY_MAP_KEY_SIZE bytes per slot, also the start of the allocation
+    uint32_t *hashes; // hash of the key in each slot, 0 for an empty slot
+    int *ids; // id of the key in each slot
+} Key_Map;
+
+/* Initialize a map, with room for initial_capacity keys before it has to grow.
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure
+ */
+int key_map_init(Key_Map *map, uint32_t initial_capacity);
+
+/* Free a map initiated with key_map_init */
+void key_map_free(Key_Map *map);
+
+/* Retrieve the id associated with a key
+ *
+ * return value:
+ *  >= 0 : id associated with key
+ *  -1   : failure
+ */
+int key_map_find(const Key_Map *map, const uint8_t *key);
+
+/* Add a key with associated id to the map
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure (key already in map, or memory allocation failed)
+ */
+int key_map_add(Key_Map *map, const uint8_t *key, int id);
+
+/* Remove a key from the map
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure (key not found or id does not match)
+ */
+int key_map_remove(Key_Map *map, const uint8_t *key, int id);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_KEY_MAP_H
@@ -0,0 +1,175 @@
+#include "key_map.h"
+
+#include <array>
+#include <map>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using Key = std::array<uint8_t, KEY_MAP_KEY_SIZE>;
+
+Key random_key() {
+  Key key;
+  random_bytes(key.data(), key.size());
+  return key;
+}
+
+/* Keys that only differ in their last bytes. */
+Key counter_key(uint32_t i) {
+  Key key = {0};
+  key[KEY_MAP_KEY_SIZE - 2] = static_cast<uint8_t>(i >> 8);
+  key[KEY_MAP_KEY_SIZE - 1] = static_cast<uint8_t>(i);
+  return key;
+}
+
+TEST(KeyMap, StartsEmpty) {
+  Key_Map map;
+  ASSERT_EQ(key_map_init(&map, 0), 1);
+
+  const Key key = random_key();
+  EXPECT_EQ(key_map_find(&map, key.data()), -1);
+  EXPECT_EQ(key_map_remove(&map, key.data(), 0), 0);
+  EXPECT_EQ(map.keys, nullptr);
+
+  key_map_free(&map);
+}
+
+TEST(KeyMap, FindsAddedKeys) {
+  Key_Map map;
+  ASSERT_EQ(key_map_init(&map, 4), 1);
+
+  const Key first = random_key();
+  const Key second = random_key();
+  ASSERT_EQ(key_map_add(&map, first.data(), 7), 1);
+  ASSERT_EQ(key_map_add(&map, second.data(), 8), 1);
+  EXPECT_EQ(key_map_add(&map, first.data(), 9), 0);
+
+  EXPECT_EQ(key_map_find(&map, first.data()), 7);
+  EXPECT_EQ(key_map_find(&map, second.data()), 8);
+  EXPECT_EQ(map.n, 2);
+
+  key_map_free(&map);
+}
+
+TEST(KeyMap, RemoveNeedsTheRightId) {
+  Key_Map map;
+  ASSERT_EQ(key_map_init(&map, 0), 1);
+
+  const Key key = random_key();
+  ASSERT_EQ(key_map_add(&map, key.data(), 3), 1);
+  EXPECT_EQ(key_map_remove(&map, key.data(), 4), 0);
+  EXPECT_EQ(key_map_find(&map, key.data()), 3);
+
+  EXPECT_EQ(key_map_remove(&map, key.data(), 3), 1);
+  EXPECT_EQ(key_map_find(&map, key.data()), -1);
+  EXPECT_EQ(map.n, 0);
+
+  /* The key can be added again, with another id. */
+  ASSERT_EQ(key_map_add(&map, key.data(), 5), 1);
+  EXPECT_EQ(key_map_find(&map, key.data()), 5);
+
+  key_map_free(&map);
+}
+
+TEST(KeyMap, GrowsAndShrinks) {
+  Key_Map map;
+  ASSERT_EQ(key_map_init(&map, 0), 1);
+
+  const uint32_t count = 10000;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    const Key key = counter_key(i);
+    ASSERT_EQ(key_map_add(&map, key.data(), i), 1);
+  }
+
+  EXPECT_GE(map.capacity, count);
+
+  for (uint32_t i = 0; i < count; ++i) {
+    const Key key = counter_key(i);
+    ASSERT_EQ(key_map_find(&map, key.data()), i);
+  }
+
+  for (uint32_t i = 0; i < count; i += 2) {
+    const Key key = counter_key(i);
+    ASSERT_EQ(key_map_remove(&map, key.data(), i), 1);
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    const Key key = counter_key(i);
+    ASSERT_EQ(key_map_find(&map, key.data()), i % 2 == 0 ? -1 : static_cast<int>(i));
+  }
+
+  for (uint32_t i = 1; i < count; i += 2) {
+    const Key key = counter_key(i);
+    ASSERT_EQ(key_map_remove(&map, key.data(), i), 1);
+  }
+
+  EXPECT_EQ(map.n, 0);
+  EXPECT_EQ(map.keys, nullptr);
+
+  key_map_free(&map);
+}
+
+TEST(KeyMap, KeepsItsInitialCapacity) {
+  Key_Map map;
+  ASSERT_EQ(key_map_init(&map, 100), 1);
+  const uint32_t capacity = map.capacity;
+  EXPECT_GE(capacity / 4 * 3, 100);
+
+  for (uint32_t i = 0; i < 1000; ++i) {
+    const Key key = counter_key(i);
+    ASSERT_EQ(key_map_add(&map, key.data(), i), 1);
+  }
+
+  for (uint32_t i = 0; i < 1000; ++i) {
+    const Key key = counter_key(i);
+    ASSERT_EQ(key_map_remove(&map, key.data(), i), 1);
+  }
+
+  EXPECT_EQ(map.capacity, capacity);
+
+  key_map_free(&map);
+}
+
+TEST(KeyMap, ChurnMatchesStdMap) {
+  Key_Map map;
+  ASSERT_EQ(key_map_init(&map, 0), 1);
+
+  /* A small key space, so that adds of present keys and removes of missing
+   * ones happen too, and runs get long enough for removals to shift keys. */
+  std::vector<Key> keys;
+
+  for (uint32_t i = 0; i < 300; ++i) {
+    keys.push_back(counter_key(i));
+  }
+
+  std::map<Key, int> expected;
+
+  for (uint32_t i = 0; i < 50000; ++i) {
+    const Key &key = keys[random_u32() % keys.size()];
+    const int id = static_cast<int>(i);
+
+    if (random_u32() % 2 == 0) {
+      ASSERT_EQ(key_map_add(&map, key.data(), id), expected.count(key) == 0 ? 1 : 0);
+      expected.emplace(key, id);
+    } else if (expected.count(key) != 0) {
+      ASSERT_EQ(key_map_remove(&map, key.data(), expected[key]), 1);
+      expected.erase(key);
+    } else {
+      ASSERT_EQ(key_map_remove(&map, key.data(), id), 0);
+    }
+  }
+
+  ASSERT_EQ(map.n, expected.size());
+
+  for (const Key &key : keys) {
+    const auto it = expected.find(key);
+    ASSERT_EQ(key_map_find(&map, key.data()), it == expected.end() ? -1 : it->second);
+  }
+
+  key_map_free(&map);
+}
+
+}  // namespace
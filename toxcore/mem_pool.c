@@ -0,0 +1,530 @@
+/*
+ * A thread-safe pool of equally sized memory blocks.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "mem_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "ccompat.h"
+
+/* Most blocks a thread keeps for itself. Allocations and frees served from
+ * the thread's own cache don't take the pool mutex.
+ */
+#define MEM_POOL_THREAD_CACHE_SIZE 32
+
+typedef struct Mem_Pool_Cache Mem_Pool_Cache;
+
+struct Mem_Pool_Cache {
+    /* NULL once the pool was killed. Only used with caches_mutex held. */
+    Mem_Pool *pool;
+    uint64_t pool_id;
+
+    /* Next cache of the same pool, guarded by caches_mutex. */
+    Mem_Pool_Cache *next;
+    /* Next cache of the same thread, only used by that thread. */
+    Mem_Pool_Cache *thread_next;
+
+    void *blocks[MEM_POOL_THREAD_CACHE_SIZE];
+    uint32_t count;
+    uint32_t capacity;
+
+    /* count at the last merge, already included in the pool counters. */
+    uint32_t merged_count;
+
+    /* Cache hits and frees not yet added to the pool counters. */
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+/* The caches a thread has in any pool, the most recently used first. */
+typedef struct Mem_Pool_Thread {
+    Mem_Pool_Cache *caches;
+} Mem_Pool_Thread;
+
+struct Mem_Pool {
+    pthread_mutex_t mutex;
+
+    /* Never reused, unlike the address of a killed pool. */
+    uint64_t id;
+
+    size_t block_size;
+
+    /* Stack of free blocks shared by all threads. */
+    void **free_list;
+    uint32_t max_cached;
+
+    /* Thread caches, each holding up to its capacity of the max_cached
+     * blocks the pool may keep. reserved is the sum of their capacities. */
+    bool use_caches;
+    Mem_Pool_Cache *caches;
+    uint32_t reserved;
+    uint32_t thread_cached;
+
+    /* cached only counts the shared free list, see mem_pool_get_stats(). */
+    Mem_Pool_Stats stats;
+};
+
+/* A process only gets PTHREAD_KEYS_MAX keys, so all pools share one, made by
+ * the first mem_pool_new(). Its value is the calling thread's Mem_Pool_Thread.
+ */
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static bool has_thread_key;
+
+/* Guards the cache lists of the pools, the pool of each cache and
+ * next_pool_id. Only taken when a pool is made or killed, and when a thread
+ * starts using a pool or exits.
+ */
+static pthread_mutex_t caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t next_pool_id;
+
+static void release_thread(void *value);
+
+static void create_thread_key(void)
+{
+    /* Without a key every call takes the pool mutex, which is slower but still
+     * correct. */
+    has_thread_key = pthread_key_create(&thread_key, release_thread) == 0;
+}
+
+Mem_Pool *mem_pool_new(size_t block_size, uint32_t max_cached)
+{
+    if (block_size == 0) {
+        return nullptr;
+    }
+
+    Mem_Pool *pool = (Mem_Pool *)calloc(1, sizeof(Mem_Pool));
+
+    if (pool == nullptr) {
+        return nullptr;
+    }
+
+    if (max_cached > 0) {
+        pool->free_list = (void **)calloc(max_cached, sizeof(void *));
+
+        if (pool->free_list == nullptr) {
+            free(pool);
+            return nullptr;
+        }
+    }
+
+    if (pthread_mutex_init(&pool->mutex, nullptr) != 0) {
+        free(pool->free_list);
+        free(pool);
+        return nullptr;
+    }
+
+    pthread_once(&thread_key_once, create_thread_key);
+
+    pthread_mutex_lock(&caches_mutex);
+    pool->id = ++next_pool_id;
+    pthread_mutex_unlock(&caches_mutex);
+
+    pool->use_caches = max_cached > 0 && has_thread_key;
+    pool->block_size = block_size;
+    pool->max_cached = max_cached;
+    return pool;
+}
+
+void mem_pool_kill(Mem_Pool *pool)
+{
+    if (pool == nullptr) {
+        return;
+    }
+
+    /* The caches stay on their threads' lists until those threads drop them in
+     * new_cache() or when they exit. No thread uses the pool any more, so their
+     * blocks can be freed here. */
+    pthread_mutex_lock(&caches_mutex);
+
+    for (Mem_Pool_Cache *cache = pool->caches; cache != nullptr; cache = cache->next) {
+        for (uint32_t i = 0; i < cache->count; ++i) {
+            free(cache->blocks[i]);
+        }
+
+        cache->count = 0;
+        cache->pool = nullptr;
+    }
+
+    pool->caches = nullptr;
+    pthread_mutex_unlock(&caches_mutex);
+
+    for (uint32_t i = 0; i < pool->stats.cached; ++i) {
+        free(pool->free_list[i]);
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->free_list);
+    free(pool);
+}
+
+static uint32_t max_shared(const Mem_Pool *pool)
+{
+    return pool->max_cached - pool->reserved;
+}
+
+static void update_in_use(Mem_Pool *pool)
+{
+    /* A block freed by another thread than the one that allocated it may be
+     * merged first. */
+    if (pool->stats.frees >= pool->stats.allocs) {
+        pool->stats.in_use = 0;
+        return;
+    }
+
+    pool->stats.in_use = (uint32_t)(pool->stats.allocs - pool->stats.frees);
+
+    if (pool->stats.in_use > pool->stats.peak_in_use) {
+        pool->stats.peak_in_use = pool->stats.in_use;
+    }
+}
+
+/* Add the counters of a thread cache to the pool. Called with the mutex held. */
+static void merge_cache(Mem_Pool *pool, Mem_Pool_Cache *cache)
+{
+    pool->stats.allocs += cache->allocs;
+    pool->stats.reused += cache->allocs;
+    pool->stats.frees += cache->frees;
+    cache->allocs = 0;
+    cache->frees = 0;
+
+    pool->thread_cached -= cache->merged_count;
+    pool->thread_cached += cache->count;
+    cache->merged_count = cache->count;
+
+    update_in_use(pool);
+}
+
+/* Move blocks between a thread cache and the shared free list until the
+ * cache holds target blocks or can't get any more. Called with the mutex held.
+ */
+static void balance_cache(Mem_Pool *pool, Mem_Pool_Cache *cache, uint32_t target)
+{
+    while (cache->count < target && pool->stats.cached > 0) {
+        --pool->stats.cached;
+        cache->blocks[cache->count] = pool->free_list[pool->stats.cached];
+        ++cache->count;
+    }
+
+    while (cache->count > target && pool->stats.cached < max_shared(pool)) {
+        --cache->count;
+        pool->free_list[pool->stats.cached] = cache->blocks[cache->count];
+        ++pool->stats.cached;
+    }
+}
+
+/* Drop the caches of killed pools from the calling thread's list. Called with
+ * caches_mutex held.
+ */
+static void drop_dead_caches(Mem_Pool_Thread *thread)
+{
+    Mem_Pool_Cache **prev = &thread->caches;
+
+    while (*prev != nullptr) {
+        Mem_Pool_Cache *const cache = *prev;
+
+        if (cache->pool != nullptr) {
+            prev = &cache->thread_next;
+            continue;
+        }
+
+        *prev = cache->thread_next;
+        free(cache);
+    }
+}
+
+static Mem_Pool_Cache *new_cache(Mem_Pool *pool, Mem_Pool_Thread *thread)
+{
+    Mem_Pool_Cache *cache = (Mem_Pool_Cache *)calloc(1, sizeof(Mem_Pool_Cache));
+
+    if (cache == nullptr) {
+        return nullptr;
+    }
+
+    cache->pool_id = pool->id;
+
+    pthread_mutex_lock(&caches_mutex);
+    drop_dead_caches(thread);
+
+    cache->pool = pool;
+    cache->next = pool->caches;
+    pool->caches = cache;
+
+    pthread_mutex_lock(&pool->mutex);
+    cache->capacity = max_shared(pool);
+
+    if (cache->capacity > MEM_POOL_THREAD_CACHE_SIZE) {
+        cache->capacity = MEM_POOL_THREAD_CACHE_SIZE;
+    }
+
+    /* The shared free list may now hold more than it is allowed to. */
+    const uint32_t excess = pool->stats.cached > max_shared(pool) - cache->capacity
+                            ? pool->stats.cached - (max_shared(pool) - cache->capacity) : 0;
+    pool->reserved += cache->capacity;
+    balance_cache(pool, cache, excess);
+    merge_cache(pool, cache);
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_mutex_unlock(&caches_mutex);
+
+    cache->thread_next = thread->caches;
+    thread->caches = cache;
+    return cache;
+}
+
+/* Give the blocks of a thread cache back to its pool. Called with caches_mutex
+ * held.
+ */
+static void release_cache(Mem_Pool_Cache *cache)
+{
+    Mem_Pool *const pool = cache->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    merge_cache(pool, cache);
+    pool->reserved -= cache->capacity;
+    balance_cache(pool, cache, 0);
+    pool->stats.released += cache->count;
+
+    for (uint32_t i = 0; i < cache->count; ++i) {
+        free(cache->blocks[i]);
+    }
+
+    cache->count = 0;
+    merge_cache(pool, cache);
+    pthread_mutex_unlock(&pool->mutex);
+
+    Mem_Pool_Cache **prev = &pool->caches;
+
+    while (*prev != cache) {
+        prev = &(*prev)->next;
+    }
+
+    *prev = cache->next;
+}
+
+/* Release every cache of a thread when it exits. */
+static void release_thread(void *value)
+{
+    Mem_Pool_Thread *const thread = (Mem_Pool_Thread *)value;
+
+    pthread_mutex_lock(&caches_mutex);
+
+    while (thread->caches != nullptr) {
+        Mem_Pool_Cache *const cache = thread->caches;
+        thread->caches = cache->thread_next;
+
+        if (cache->pool != nullptr) {
+            release_cache(cache);
+        }
+
+        free(cache);
+    }
+
+    pthread_mutex_unlock(&caches_mutex);
+
+    free(thread);
+}
+
+/* Look the pool up in the calling thread's caches. A thread mostly works with
+ * one or two pools at a time, so a hit is moved to the front of the list.
+ */
+static Mem_Pool_Cache *find_cache(const Mem_Pool *pool, Mem_Pool_Thread *thread)
+{
+    Mem_Pool_Cache **prev = &thread->caches;
+
+    for (Mem_Pool_Cache *cache = thread->caches; cache != nullptr; cache = cache->thread_next) {
+        if (cache->pool_id == pool->id) {
+            *prev = cache->thread_next;
+            cache->thread_next = thread->caches;
+            thread->caches = cache;
+            return cache;
+        }
+
+        prev = &cache->thread_next;
+    }
+
+    return nullptr;
+}
+
+static Mem_Pool_Cache *get_cache(Mem_Pool *pool)
+{
+    if (!pool->use_caches) {
+        return nullptr;
+    }
+
+    Mem_Pool_Thread *thread = (Mem_Pool_Thread *)pthread_getspecific(thread_key);
+
+    if (thread == nullptr) {
+        thread = (Mem_Pool_Thread *)calloc(1, sizeof(Mem_Pool_Thread));
+
+        if (thread == nullptr) {
+            return nullptr;
+        }
+
+        if (pthread_setspecific(thread_key, thread) != 0) {
+            free(thread);
+            return nullptr;
+        }
+    }
+
+    Mem_Pool_Cache *const cache = find_cache(pool, thread);
+
+    if (cache != nullptr) {
+        return cache;
+    }
+
+    return new_cache(pool, thread);
+}
+
+static void count_alloc(Mem_Pool *pool)
+{
+    ++pool->stats.allocs;
+    update_in_use(pool);
+}
+
+void *mem_pool_alloc(Mem_Pool *pool)
+{
+    Mem_Pool_Cache *const cache = get_cache(pool);
+
+    if (cache != nullptr && cache->count > 0) {
+        --cache->count;
+        ++cache->allocs;
+        return cache->blocks[cache->count];
+    }
+
+    void *block = nullptr;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (cache != nullptr) {
+        /* Take half a cache worth so the next allocations are hits. */
+        balance_cache(pool, cache, (cache->capacity + 1) / 2);
+
+        if (cache->count > 0) {
+            --cache->count;
+            block = cache->blocks[cache->count];
+        }
+
+        merge_cache(pool, cache);
+    }
+
+    /* Only left when the cache got no share of max_cached. */
+    if (block == nullptr && pool->stats.cached > 0) {
+        --pool->stats.cached;
+        block = pool->free_list[pool->stats.cached];
+    }
+
+    if (block != nullptr) {
+        ++pool->stats.reused;
+        count_alloc(pool);
+        pthread_mutex_unlock(&pool->mutex);
+        return block;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    block = malloc(pool->block_size);
+
+    if (block == nullptr) {
+        return nullptr;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    count_alloc(pool);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return block;
+}
+
+void mem_pool_free(Mem_Pool *pool, void *block)
+{
+    if (block == nullptr) {
+        return;
+    }
+
+    Mem_Pool_Cache *const cache = get_cache(pool);
+
+    if (cache != nullptr && cache->count < cache->capacity) {
+        cache->blocks[cache->count] = block;
+        ++cache->count;
+        ++cache->frees;
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    ++pool->stats.frees;
+
+    if (cache != nullptr) {
+        /* Keep half a cache worth so the next frees are hits. */
+        balance_cache(pool, cache, cache->capacity / 2);
+    }
+
+    if (cache != nullptr && cache->count < cache->capacity) {
+        cache->blocks[cache->count] = block;
+        ++cache->count;
+        block = nullptr;
+    } else if (pool->stats.cached < max_shared(pool)) {
+        pool->free_list[pool->stats.cached] = block;
+        ++pool->stats.cached;
+        block = nullptr;
+    } else {
+        ++pool->stats.released;
+    }
+
+    if (cache != nullptr) {
+        merge_cache(pool, cache);
+    } else {
+        update_in_use(pool);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    free(block);
+}
+
+void mem_pool_get_stats(Mem_Pool *pool, Mem_Pool_Stats *stats)
+{
+    Mem_Pool_Cache *cache = nullptr;
+
+    if (pool->use_caches) {
+        Mem_Pool_Thread *const thread = (Mem_Pool_Thread *)pthread_getspecific(thread_key);
+
+        if (thread != nullptr) {
+            cache = find_cache(pool, thread);
+        }
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (cache != nullptr) {
+        merge_cache(pool, cache);
+    }
+
+    *stats = pool->stats;
+    stats->cached += pool->thread_cached;
+    pthread_mutex_unlock(&pool->mutex);
+}
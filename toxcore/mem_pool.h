@@ -0,0 +1,79 @@
+/*
+ * A thread-safe pool of equally sized memory blocks.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_MEM_POOL_H
+#define C_TOXCORE_TOXCORE_MEM_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Freed blocks are kept on a free list and handed out again by the next
+ * allocation instead of going back to malloc. At most max_cached blocks are
+ * kept, the rest are freed, so the memory held by an idle pool is bounded.
+ *
+ * Each thread using the pool keeps a small share of those blocks in a cache of
+ * its own, so a single thread allocating and freeing in a loop rarely takes
+ * the pool mutex. The shared free list is only touched when a thread's cache
+ * runs empty or full.
+ */
+typedef struct Mem_Pool Mem_Pool;
+
+typedef struct Mem_Pool_Stats {
+    uint64_t allocs;      /* Successful mem_pool_alloc() calls. */
+    uint64_t reused;      /* Allocations served from the free list. */
+    uint64_t frees;       /* mem_pool_free() calls. */
+    uint64_t released;    /* Freed blocks given back to the system because the free list was full. */
+    uint32_t in_use;      /* Blocks currently allocated. */
+    uint32_t peak_in_use; /* Highest in_use so far. */
+    uint32_t cached;      /* Blocks currently on the free list or in thread caches. */
+} Mem_Pool_Stats;
+
+/* return NULL on failure. */
+Mem_Pool *mem_pool_new(size_t block_size, uint32_t max_cached);
+
+/* Free the pool and every block on its free list or in a thread cache. Blocks
+ * that are still in use must be given back with mem_pool_free() first, and no
+ * other thread may use the pool any more.
+ */
+void mem_pool_kill(Mem_Pool *pool);
+
+/* return an uninitialised block of block_size bytes, or NULL on failure. */
+void *mem_pool_alloc(Mem_Pool *pool);
+
+/* Give a block from mem_pool_alloc() back to the pool. NULL is ignored. */
+void mem_pool_free(Mem_Pool *pool, void *block);
+
+/* The counters of a thread cache are added to the pool each time the cache
+ * trades blocks with the shared free list, and those of the calling thread
+ * here. Other threads' recent cache hits may therefore be missing.
+ */
+void mem_pool_get_stats(Mem_Pool *pool, Mem_Pool_Stats *stats);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_MEM_POOL_H
@@ -0,0 +1,170 @@
+#include "mem_pool.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+struct Mem_Pool_Deleter {
+  void operator()(Mem_Pool *pool) { mem_pool_kill(pool); }
+};
+
+using Mem_Pool_Ptr = std::unique_ptr<Mem_Pool, Mem_Pool_Deleter>;
+
+Mem_Pool_Stats get_stats(Mem_Pool *pool) {
+  Mem_Pool_Stats stats;
+  mem_pool_get_stats(pool, &stats);
+  return stats;
+}
+
+TEST(MemPool, NeedsBlockSize) {
+  EXPECT_EQ(mem_pool_new(0, 1), nullptr);
+  EXPECT_NE(Mem_Pool_Ptr(mem_pool_new(1, 0)), nullptr);
+}
+
+TEST(MemPool, ReusesFreedBlocks) {
+  Mem_Pool_Ptr const pool(mem_pool_new(64, 4));
+  ASSERT_NE(pool, nullptr);
+
+  void *block = mem_pool_alloc(pool.get());
+  ASSERT_NE(block, nullptr);
+  mem_pool_free(pool.get(), block);
+
+  EXPECT_EQ(mem_pool_alloc(pool.get()), block);
+  mem_pool_free(pool.get(), block);
+
+  Mem_Pool_Stats const stats = get_stats(pool.get());
+  EXPECT_EQ(stats.allocs, 2u);
+  EXPECT_EQ(stats.reused, 1u);
+  EXPECT_EQ(stats.frees, 2u);
+  EXPECT_EQ(stats.in_use, 0u);
+  EXPECT_EQ(stats.cached, 1u);
+}
+
+TEST(MemPool, KeepsAtMostMaxCachedBlocks) {
+  Mem_Pool_Ptr const pool(mem_pool_new(64, 2));
+  ASSERT_NE(pool, nullptr);
+
+  void *blocks[5];
+
+  for (void *&block : blocks) {
+    block = mem_pool_alloc(pool.get());
+    ASSERT_NE(block, nullptr);
+  }
+
+  EXPECT_EQ(get_stats(pool.get()).peak_in_use, 5u);
+
+  for (void *block : blocks) {
+    mem_pool_free(pool.get(), block);
+  }
+
+  Mem_Pool_Stats const stats = get_stats(pool.get());
+  EXPECT_EQ(stats.in_use, 0u);
+  EXPECT_EQ(stats.peak_in_use, 5u);
+  EXPECT_EQ(stats.cached, 2u);
+  EXPECT_EQ(stats.released, 3u);
+}
+
+TEST(MemPool, KeepsBlocksOfExitedThreads) {
+  Mem_Pool_Ptr const pool(mem_pool_new(64, 4));
+  ASSERT_NE(pool, nullptr);
+
+  std::thread([&pool]() {
+    void *blocks[3];
+
+    for (void *&block : blocks) {
+      block = mem_pool_alloc(pool.get());
+    }
+
+    for (void *block : blocks) {
+      mem_pool_free(pool.get(), block);
+    }
+  }).join();
+
+  Mem_Pool_Stats stats = get_stats(pool.get());
+  EXPECT_EQ(stats.allocs, 3u);
+  EXPECT_EQ(stats.frees, 3u);
+  EXPECT_EQ(stats.in_use, 0u);
+  EXPECT_EQ(stats.cached, 3u);
+
+  void *block = mem_pool_alloc(pool.get());
+  ASSERT_NE(block, nullptr);
+  mem_pool_free(pool.get(), block);
+
+  stats = get_stats(pool.get());
+  EXPECT_EQ(stats.reused, 1u);
+  EXPECT_EQ(stats.cached, 3u);
+}
+
+TEST(MemPool, ManyPoolsShareOneThreadKey) {
+  // More pools than a process has pthread keys (PTHREAD_KEYS_MAX is 1024 on
+  // glibc) must all still get thread caches.
+  std::vector<Mem_Pool_Ptr> pools;
+
+  for (int i = 0; i < 2000; ++i) {
+    pools.emplace_back(mem_pool_new(64, 4));
+    ASSERT_NE(pools.back(), nullptr);
+  }
+
+  for (Mem_Pool_Ptr const &pool : pools) {
+    void *block = mem_pool_alloc(pool.get());
+    ASSERT_NE(block, nullptr);
+    mem_pool_free(pool.get(), block);
+    EXPECT_EQ(mem_pool_alloc(pool.get()), block);
+    mem_pool_free(pool.get(), block);
+  }
+
+  for (Mem_Pool_Ptr const &pool : pools) {
+    Mem_Pool_Stats const stats = get_stats(pool.get());
+    EXPECT_EQ(stats.reused, 1u);
+    EXPECT_EQ(stats.cached, 1u);
+  }
+}
+
+TEST(MemPool, KillsPoolCachedByLiveThread) {
+  Mem_Pool_Ptr pool(mem_pool_new(64, 4));
+  ASSERT_NE(pool, nullptr);
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  int step = 0;
+
+  std::thread thread([&]() {
+    mem_pool_free(pool.get(), mem_pool_alloc(pool.get()));
+
+    std::unique_lock<std::mutex> lock(mutex);
+    step = 1;
+    cond.notify_all();
+    cond.wait(lock, [&step]() { return step == 2; });
+
+    // The cache of the killed pool is dropped here and at thread exit.
+    Mem_Pool_Ptr const other(mem_pool_new(64, 4));
+    mem_pool_free(other.get(), mem_pool_alloc(other.get()));
+    EXPECT_EQ(get_stats(other.get()).cached, 1u);
+  });
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&step]() { return step == 1; });
+    pool.reset();
+    step = 2;
+    cond.notify_all();
+  }
+
+  thread.join();
+}
+
+TEST(MemPool, IgnoresNull) {
+  Mem_Pool_Ptr const pool(mem_pool_new(64, 2));
+  ASSERT_NE(pool, nullptr);
+
+  mem_pool_free(pool.get(), nullptr);
+  EXPECT_EQ(get_stats(pool.get()).frees, 0u);
+}
+
+}  // namespace
@@ -27,27 +27,82 @@
 #include "config.h"
 #endif
 
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
 #include "net_crypto.h"
 
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "key_map.h"
+#include "list.h"
 #include "mono_time.h"
+#include "sack.h"
 #include "util.h"
 
 typedef struct Packet_Data {
     uint64_t sent_time;
     uint16_t length;
-    uint8_t data[MAX_CRYPTO_DATA_SIZE];
+    uint8_t data[];     /* length bytes */
 } Packet_Data;
 
+/* Packets of up to MAX_CRYPTO_DATA_SIZE bytes are allocated from small, only
+ * the jumbo packets of connections whose MTU probe succeeded need a block
+ * from jumbo.
+ */
+typedef struct Packet_Pools {
+    Mem_Pool *small;
+    Mem_Pool *jumbo;
+} Packet_Pools;
+
+/* Ring buffer of packets indexed by packet number. The buffer grows with the
+ * number of packets in it, up to CRYPTO_PACKET_BUFFER_SIZE, and shrinks again
+ * once they are gone.
+ */
 typedef struct Packets_Array {
-    Packet_Data *buffer[CRYPTO_PACKET_BUFFER_SIZE];
+    Packet_Data **buffer;
+    uint32_t  capacity;     /* power of 2, 0 until the first packet is added */
     uint32_t  buffer_start;
     uint32_t  buffer_end; /* packet numbers in array: {buffer_start, buffer_end) */
+    uint32_t  num_stored;   /* packets in array, not counting the holes */
 } Packets_Array;
 
+/* What happened on a connection during the last PACKET_COUNTER_AVERAGE_INTERVAL. */
+typedef struct Congestion_Sample {
+    uint64_t time;          /* Current time in ms. */
+    double interval;        /* Length of the interval in ms. */
+    uint32_t packets_sent;
+    uint32_t packets_resent;
+    uint32_t packets_lost;  /* Packets the peer requested again more than an RTT after we sent them. */
+    uint32_t send_queue;    /* Packets in the send array, including the ones in flight. */
+    bool direct_connected;
+} Congestion_Sample;
+
+/* A congestion controller sets packet_send_rate and packet_send_rate_requested
+ * of the connection from a sample. It is called once per sample interval on
+ * established connections.
+ */
+struct Crypto_Connection;
+typedef void congestion_update_cb(struct Crypto_Connection *conn, const Congestion_Sample *sample);
+
+typedef struct Cubic_State {
+    double cwnd;            /* Congestion window in packets. */
+    double ssthresh;
+    double w_max;           /* Window just before the last reduction. */
+    double k;               /* Seconds it takes the window to grow back to w_max. */
+    uint64_t last_reduction;
+} Cubic_State;
+
+typedef struct TCP_Queued_Packet {
+    int crypt_connection_id;
+    int connection_number_tcp;
+    uint16_t length;
+    uint8_t data[MAX_CRYPTO_JUMBO_PACKET_SIZE];
+} TCP_Queued_Packet;
+
 typedef struct Crypto_Connection {
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE]; /* The real public key of the peer. */
     uint8_t recv_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of received packets. */
@@ -79,6 +134,9 @@ typedef struct Crypto_Connection {
 
     uint64_t last_tcp_sent; /* Time the last TCP packet was sent. */
 
+    /* Threads sending lossless packets add to send_array while the iteration
+     * thread acks and resends them, so its buffer and packets are only
+     * accessed with mutex held. */
     Packets_Array send_array;
     Packets_Array recv_array;
 
@@ -117,14 +175,36 @@ typedef struct Crypto_Connection {
     long signed int last_num_packets_resent[CONGESTION_LAST_SENT_ARRAY_SIZE];
     uint32_t packets_sent;
     uint32_t packets_resent;
+    uint32_t packets_lost;
     uint64_t last_congestion_event;
-    uint64_t rtt_time;
+
+    /* Totals since the connection was created, reported by crypto_connection_get_stats(). */
+    uint64_t total_packets_sent;
+    uint64_t total_packets_resent;
+    uint64_t total_packets_lost;
+    uint32_t congestion_events;
+    uint64_t rtt_time;      /* Lowest RTT seen in ms. */
+    double rtt_smoothed;    /* Moving average of the RTT samples in ms, 0 before the first one. */
+
+    congestion_update_cb *congestion_update;
+    Cubic_State cubic;
 
     /* TCP_connection connection_number */
     unsigned int connection_number_tcp;
 
     uint8_t maximum_speed_reached;
 
+    /* Set once the peer sent us a PACKET_ID_REQUEST_SACK, so it understands them. */
+    bool peer_sends_sack;
+    uint8_t sack_probes_sent;
+
+    /* Path MTU discovery, see do_mtu_discovery(). */
+    IP_Port mtu_ip_port;        /* Direct path the probes are sent on. */
+    bool mtu_confirmed;         /* mtu_ip_port carries packets of MAX_CRYPTO_JUMBO_PACKET_SIZE. */
+    uint8_t mtu_probe_number;   /* Echoed in the PACKET_ID_MTU_PROBE_ACK. */
+    uint8_t mtu_probes_sent;    /* Since the last acknowledged one. */
+    uint64_t last_mtu_probe_time;
+
     pthread_mutex_t mutex;
 
     dht_pk_cb *dht_pk_callback;
@@ -142,8 +222,15 @@ struct Net_Crypto {
     Crypto_Connection *crypto_connections;
     pthread_mutex_t tcp_mutex;
 
-    pthread_mutex_t connections_mutex;
-    unsigned int connection_use_counter;
+    /* Held for reading by the threads sending packets and for writing while the
+     * connections array is reallocated or a connection is killed. */
+    pthread_rwlock_t connections_lock;
+
+    /* Packets that could not be handed to tcp_c right away because another
+     * thread held tcp_mutex. Protected by tcp_queue_mutex, flushed in do_tcp(). */
+    TCP_Queued_Packet *tcp_send_queue[CRYPTO_TCP_SEND_QUEUE_SIZE];
+    uint32_t tcp_send_queue_length;
+    pthread_mutex_t tcp_queue_mutex;
 
     uint32_t crypto_connections_length; /* Length of connections array. */
 
@@ -160,7 +247,13 @@ struct Net_Crypto {
     /* The current optimal sleep time */
     uint32_t current_sleep_time;
 
+    /* Allocators for the packets in the send and receive arrays. */
+    Packet_Pools packet_pools;
+
+    Crypto_Congestion_Control congestion_control;
+
     BS_List ip_port_list;
+    Key_Map public_key_list;
 };
 
 const uint8_t *nc_get_self_public_key(const Net_Crypto *c)
@@ -178,6 +271,17 @@ TCP_Connections *nc_get_tcp_c(const Net_Crypto *c)
     return c->tcp_c;
 }
 
+void nc_get_packet_pool_stats(const Net_Crypto *c, Mem_Pool_Stats *small, Mem_Pool_Stats *jumbo)
+{
+    mem_pool_get_stats(c->packet_pools.small, small);
+    mem_pool_get_stats(c->packet_pools.jumbo, jumbo);
+}
+
+void nc_set_congestion_control(Net_Crypto *c, Crypto_Congestion_Control congestion_control)
+{
+    c->congestion_control = congestion_control;
+}
+
 DHT *nc_get_dht(const Net_Crypto *c)
 {
     return c->dht;
@@ -613,7 +717,7 @@ static int add_ip_port_connection(Net_Crypto *c, int crypt_connection_id, IP_Por
  * return IP_Port with family 0 on failure.
  * return IP_Port on success.
  */
-static IP_Port return_ip_port_connection(Net_Crypto *c, int crypt_connection_id)
+static IP_Port return_ip_port_connection(const Net_Crypto *c, int crypt_connection_id)
 {
     const IP_Port empty = {{{0}}};
 
@@ -664,7 +768,118 @@ static IP_Port return_ip_port_connection(Net_Crypto *c, int crypt_connection_id)
     return empty;
 }
 
+static void set_last_tcp_sent(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+    conn->last_tcp_sent = current_time_monotonic(c->mono_time);
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+static bool tcp_send_queue_empty(Net_Crypto *c)
+{
+    pthread_mutex_lock(&c->tcp_queue_mutex);
+    const bool empty = c->tcp_send_queue_length == 0;
+    pthread_mutex_unlock(&c->tcp_queue_mutex);
+    return empty;
+}
+
+/* Queue a packet of the crypto connection for do_tcp() to send on the TCP
+ * connection connection_number_tcp.
+ *
+ * return -1 if the queue is full.
+ * return 0 on success.
+ */
+static int queue_tcp_packet(Net_Crypto *c, int crypt_connection_id, int connection_number_tcp, const uint8_t *data,
+                            uint16_t length)
+{
+    if (length > MAX_CRYPTO_JUMBO_PACKET_SIZE) {
+        return -1;
+    }
+
+    TCP_Queued_Packet *packet = (TCP_Queued_Packet *)malloc(sizeof(TCP_Queued_Packet));
+
+    if (packet == nullptr) {
+        return -1;
+    }
+
+    packet->crypt_connection_id = crypt_connection_id;
+    packet->connection_number_tcp = connection_number_tcp;
+    packet->length = length;
+    memcpy(packet->data, data, length);
+
+    pthread_mutex_lock(&c->tcp_queue_mutex);
+
+    if (c->tcp_send_queue_length == CRYPTO_TCP_SEND_QUEUE_SIZE) {
+        pthread_mutex_unlock(&c->tcp_queue_mutex);
+        free(packet);
+        return -1;
+    }
+
+    c->tcp_send_queue[c->tcp_send_queue_length] = packet;
+    ++c->tcp_send_queue_length;
+    pthread_mutex_unlock(&c->tcp_queue_mutex);
+    return 0;
+}
+
+/* Send the queued TCP packets in the order they were queued. Must be called
+ * with tcp_mutex held.
+ */
+static void flush_tcp_send_queue(Net_Crypto *c)
+{
+    TCP_Queued_Packet *packets[CRYPTO_TCP_SEND_QUEUE_SIZE];
+
+    pthread_mutex_lock(&c->tcp_queue_mutex);
+    const uint32_t num = c->tcp_send_queue_length;
+    memcpy(packets, c->tcp_send_queue, num * sizeof(TCP_Queued_Packet *));
+    c->tcp_send_queue_length = 0;
+    pthread_mutex_unlock(&c->tcp_queue_mutex);
+
+    for (uint32_t i = 0; i < num; ++i) {
+        const TCP_Queued_Packet *packet = packets[i];
+
+        if (send_packet_tcp_connection(c->tcp_c, packet->connection_number_tcp, packet->data, packet->length) == 0) {
+            set_last_tcp_sent(c, packet->crypt_connection_id);
+        } else {
+            /* Nobody waits for the result any more. Lossless packets are sent
+             * again once the peer asks for them. */
+            LOGGER_DEBUG(c->log, "dropping queued TCP packet of connection %d", packet->crypt_connection_id);
+        }
+
+        free(packets[i]);
+    }
+}
+
+/* Drop the queued TCP packets of a connection that is being killed. */
+static void clear_tcp_send_queue(Net_Crypto *c, int connection_number_tcp)
+{
+    pthread_mutex_lock(&c->tcp_queue_mutex);
+    uint32_t num = 0;
+
+    for (uint32_t i = 0; i < c->tcp_send_queue_length; ++i) {
+        if (c->tcp_send_queue[i]->connection_number_tcp == connection_number_tcp) {
+            free(c->tcp_send_queue[i]);
+        } else {
+            c->tcp_send_queue[num] = c->tcp_send_queue[i];
+            ++num;
+        }
+    }
+
+    c->tcp_send_queue_length = num;
+    pthread_mutex_unlock(&c->tcp_queue_mutex);
+}
+
 /* Sends a packet to the peer using the fastest route.
+ *
+ * The packet is handed to the socket or TCP connection outside of the connection
+ * mutex. If another thread is busy with the TCP connections, the packet is queued
+ * for do_tcp() so that threads sending lossy packets never wait for an iteration.
+ * A queued packet counts as sent; it goes out after the ones queued before it.
  *
  * return -1 on failure.
  * return 0 on success.
@@ -679,49 +894,62 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
     }
 
     int direct_send_attempt = 0;
+    bool direct_connected = 0;
+    bool try_direct = 0;
 
     pthread_mutex_lock(&conn->mutex);
     IP_Port ip_port = return_ip_port_connection(c, crypt_connection_id);
 
     // TODO(irungentoo): on bad networks, direct connections might not last indefinitely.
     if (!net_family_is_unspec(ip_port.ip.family)) {
-        bool direct_connected = 0;
         crypto_connection_status(c, crypt_connection_id, &direct_connected, nullptr);
 
-        if (direct_connected) {
-            if ((uint32_t)sendpacket(dht_get_net(c->dht), ip_port, data, length) == length) {
-                pthread_mutex_unlock(&conn->mutex);
-                return 0;
-            }
-
-            pthread_mutex_unlock(&conn->mutex);
-            return -1;
-        }
-
         // TODO(irungentoo): a better way of sending packets directly to confirm the others ip.
         const uint64_t current_time = mono_time_get(c->mono_time);
 
-        if ((((UDP_DIRECT_TIMEOUT / 2) + conn->direct_send_attempt_time) > current_time && length < 96)
-                || data[0] == NET_PACKET_COOKIE_REQUEST || data[0] == NET_PACKET_CRYPTO_HS) {
-            if ((uint32_t)sendpacket(dht_get_net(c->dht), ip_port, data, length) == length) {
-                direct_send_attempt = 1;
-                conn->direct_send_attempt_time = mono_time_get(c->mono_time);
-            }
-        }
+        try_direct = direct_connected
+                     || (((UDP_DIRECT_TIMEOUT / 2) + conn->direct_send_attempt_time) > current_time && length < 96)
+                     || data[0] == NET_PACKET_COOKIE_REQUEST || data[0] == NET_PACKET_CRYPTO_HS;
     }
 
+    const int connection_number_tcp = conn->connection_number_tcp;
     pthread_mutex_unlock(&conn->mutex);
-    pthread_mutex_lock(&c->tcp_mutex);
-    int ret = send_packet_tcp_connection(c->tcp_c, conn->connection_number_tcp, data, length);
-    pthread_mutex_unlock(&c->tcp_mutex);
 
-    pthread_mutex_lock(&conn->mutex);
+    if (try_direct) {
+        const bool sent = (uint32_t)sendpacket(dht_get_net(c->dht), ip_port, data, length) == length;
+
+        if (direct_connected) {
+            return sent ? 0 : -1;
+        }
 
-    if (ret == 0) {
-        conn->last_tcp_sent = current_time_monotonic(c->mono_time);
+        if (sent) {
+            direct_send_attempt = 1;
+            pthread_mutex_lock(&conn->mutex);
+            conn->direct_send_attempt_time = mono_time_get(c->mono_time);
+            pthread_mutex_unlock(&conn->mutex);
+        }
     }
 
-    pthread_mutex_unlock(&conn->mutex);
+    int ret;
+
+    if (pthread_mutex_trylock(&c->tcp_mutex) == 0) {
+        if (tcp_send_queue_empty(c)) {
+            ret = send_packet_tcp_connection(c->tcp_c, connection_number_tcp, data, length);
+
+            if (ret == 0) {
+                set_last_tcp_sent(c, crypt_connection_id);
+            }
+        } else {
+            /* Don't overtake the packets queued while another thread held
+             * tcp_mutex. */
+            ret = queue_tcp_packet(c, crypt_connection_id, connection_number_tcp, data, length);
+            flush_tcp_send_queue(c);
+        }
+
+        pthread_mutex_unlock(&c->tcp_mutex);
+    } else {
+        ret = queue_tcp_packet(c, crypt_connection_id, connection_number_tcp, data, length);
+    }
 
     if (ret == 0 || direct_send_attempt) {
         return 0;
@@ -741,31 +969,145 @@ static uint32_t num_packets_array(const Packets_Array *array)
     return array->buffer_end - array->buffer_start;
 }
 
+/* Return the slot for packet number. The caller must make sure that number is
+ * in {buffer_start, buffer_start + capacity).
+ */
+static Packet_Data **packets_array_slot(const Packets_Array *array, uint32_t number)
+{
+    return &array->buffer[number & (array->capacity - 1)];
+}
+
+/* Move the packets of array into a new buffer of capacity slots.
+ *
+ * return false on allocation failure, in which case array is left unchanged.
+ */
+static bool packets_array_resize(Packets_Array *array, uint32_t capacity)
+{
+    Packet_Data **buffer = (Packet_Data **)calloc(capacity, sizeof(Packet_Data *));
+
+    if (buffer == nullptr) {
+        return false;
+    }
+
+    for (uint32_t i = array->buffer_start; i != array->buffer_end; ++i) {
+        buffer[i & (capacity - 1)] = *packets_array_slot(array, i);
+    }
+
+    free(array->buffer);
+    array->buffer = buffer;
+    array->capacity = capacity;
+    return true;
+}
+
+/* Make room for at least size packets starting at buffer_start.
+ *
+ * return false if size is too big or on allocation failure.
+ */
+static bool packets_array_reserve(Packets_Array *array, uint32_t size)
+{
+    if (size <= array->capacity) {
+        return true;
+    }
+
+    if (size > CRYPTO_PACKET_BUFFER_SIZE) {
+        return false;
+    }
+
+    uint32_t capacity = array->capacity == 0 ? CRYPTO_PACKET_BUFFER_MIN_SIZE : array->capacity;
+
+    while (capacity < size) {
+        capacity *= 2;
+    }
+
+    return packets_array_resize(array, capacity);
+}
+
+/* Halve the buffer once it is less than an eighth full, so that a connection
+ * that had a big window in flight does not keep the memory for it forever.
+ * The gap between the grow and shrink thresholds keeps a window that hovers
+ * around a power of 2 from resizing on every packet.
+ */
+static void packets_array_shrink(Packets_Array *array)
+{
+    if (array->capacity > CRYPTO_PACKET_BUFFER_MIN_SIZE && num_packets_array(array) < array->capacity / 8) {
+        packets_array_resize(array, array->capacity / 2);
+    }
+}
+
+static Mem_Pool *packet_pool(const Packet_Pools *pools, uint16_t length)
+{
+    return length > MAX_CRYPTO_DATA_SIZE ? pools->jumbo : pools->small;
+}
+
+/* Allocate a packet of length bytes from pools and copy data into it. */
+static Packet_Data *new_packet_data(const Packet_Pools *pools, const uint8_t *data, uint16_t length)
+{
+    Packet_Data *packet = (Packet_Data *)mem_pool_alloc(packet_pool(pools, length));
+
+    if (packet == nullptr) {
+        return nullptr;
+    }
+
+    packet->sent_time = 0;
+    packet->length = length;
+    memcpy(packet->data, data, length);
+    return packet;
+}
+
+static void free_packet_data(const Packet_Pools *pools, Packet_Data *packet)
+{
+    mem_pool_free(packet_pool(pools, packet->length), packet);
+}
+
+static void kill_packet_pools(const Packet_Pools *pools)
+{
+    mem_pool_kill(pools->small);
+    mem_pool_kill(pools->jumbo);
+}
+
+static bool new_packet_pools(Packet_Pools *pools)
+{
+    pools->small = mem_pool_new(sizeof(Packet_Data) + MAX_CRYPTO_DATA_SIZE, CRYPTO_PACKET_POOL_SIZE);
+    pools->jumbo = mem_pool_new(sizeof(Packet_Data) + MAX_CRYPTO_JUMBO_DATA_SIZE, CRYPTO_PACKET_POOL_SIZE);
+
+    if (pools->small == nullptr || pools->jumbo == nullptr) {
+        kill_packet_pools(pools);
+        return false;
+    }
+
+    return true;
+}
+
 /* Add data with packet number to array.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int add_data_to_buffer(const Logger *log, Packets_Array *array, uint32_t number, const Packet_Data *data)
+static int add_data_to_buffer(const Logger *log, const Packet_Pools *pools, Packets_Array *array, uint32_t number,
+                              const uint8_t *data, uint16_t length)
 {
     if (number - array->buffer_start >= CRYPTO_PACKET_BUFFER_SIZE) {
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    if (!packets_array_reserve(array, number - array->buffer_start + 1)) {
+        return -1;
+    }
+
+    Packet_Data **slot = packets_array_slot(array, number);
 
-    if (array->buffer[num]) {
+    if (*slot) {
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
+    Packet_Data *new_d = new_packet_data(pools, data, length);
 
     if (new_d == nullptr) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
-    array->buffer[num] = new_d;
+    *slot = new_d;
+    ++array->num_stored;
 
     if (number - array->buffer_start >= num_packets_array(array)) {
         array->buffer_end = number + 1;
@@ -788,22 +1130,46 @@ static int get_data_pointer(const Logger *log, const Packets_Array *array, Packe
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    Packet_Data *packet = *packets_array_slot(array, number);
 
-    if (!array->buffer[num]) {
+    if (!packet) {
         return 0;
     }
 
-    *data = array->buffer[num];
+    *data = packet;
     return 1;
 }
 
+/* Copy the first packet in array from packet number on that was not sent yet
+ * into data, which must have room for MAX_CRYPTO_JUMBO_DATA_SIZE bytes. The
+ * caller holds the connection mutex while copying so that the packet can then
+ * be sent without it, while other threads add packets to the array.
+ *
+ * return -1 if there is no such packet.
+ * return the packet number on success.
+ */
+static int64_t copy_unsent_packet(const Packets_Array *array, uint32_t number, uint8_t *data, uint16_t *length)
+{
+    for (uint32_t i = number; i - array->buffer_start < num_packets_array(array); ++i) {
+        const Packet_Data *packet = *packets_array_slot(array, i);
+
+        if (packet != nullptr && packet->sent_time == 0) {
+            memcpy(data, packet->data, packet->length);
+            *length = packet->length;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
 /* Add data to end of array.
  *
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t add_data_end_of_buffer(const Logger *log, Packets_Array *array, const Packet_Data *data)
+static int64_t add_data_end_of_buffer(const Logger *log, const Packet_Pools *pools, Packets_Array *array, const uint8_t *data,
+                                      uint16_t length)
 {
     const uint32_t num_spots = num_packets_array(array);
 
@@ -811,42 +1177,65 @@ static int64_t add_data_end_of_buffer(const Logger *log, Packets_Array *array, c
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
+    if (!packets_array_reserve(array, num_spots + 1)) {
+        return -1;
+    }
+
+    Packet_Data *new_d = new_packet_data(pools, data, length);
 
     if (new_d == nullptr) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
     uint32_t id = array->buffer_end;
-    array->buffer[id % CRYPTO_PACKET_BUFFER_SIZE] = new_d;
+    *packets_array_slot(array, id) = new_d;
     ++array->buffer_end;
+    ++array->num_stored;
     return id;
 }
 
-/* Read data from beginning of array.
+/* Remove the packet at the beginning of array and hand it to the caller, who
+ * must give it back to the pool it was allocated from.
  *
- * return -1 on failure.
- * return packet number on success.
+ * return NULL if there is no packet at the beginning of array.
+ * return the packet on success.
  */
-static int64_t read_data_beg_buffer(const Logger *log, Packets_Array *array, Packet_Data *data)
+static Packet_Data *take_data_beg_buffer(const Logger *log, Packets_Array *array)
 {
     if (array->buffer_end == array->buffer_start) {
-        return -1;
+        return nullptr;
+    }
+
+    Packet_Data **slot = packets_array_slot(array, array->buffer_start);
+    Packet_Data *packet = *slot;
+
+    if (!packet) {
+        return nullptr;
     }
 
-    const uint32_t num = array->buffer_start % CRYPTO_PACKET_BUFFER_SIZE;
+    *slot = nullptr;
+    ++array->buffer_start;
+    --array->num_stored;
+    packets_array_shrink(array);
+    return packet;
+}
 
-    if (!array->buffer[num]) {
+/* Move the beginning of array past packet number buffer_start without storing
+ * it, for a packet that is handed to the application right away.
+ *
+ * return -1 if that packet is already in array.
+ * return 0 on success.
+ */
+static int skip_data_beg_buffer(const Logger *log, Packets_Array *array)
+{
+    if (array->buffer_end == array->buffer_start) {
+        ++array->buffer_end;
+    } else if (*packets_array_slot(array, array->buffer_start)) {
         return -1;
     }
 
-    memcpy(data, array->buffer[num], sizeof(Packet_Data));
-    uint32_t id = array->buffer_start;
     ++array->buffer_start;
-    free(array->buffer[num]);
-    array->buffer[num] = nullptr;
-    return id;
+    return 0;
 }
 
 /* Delete all packets in array before number (but not number)
@@ -854,7 +1243,7 @@ static int64_t read_data_beg_buffer(const Logger *log, Packets_Array *array, Pac
  * return -1 on failure.
  * return 0 on success
  */
-static int clear_buffer_until(const Logger *log, Packets_Array *array, uint32_t number)
+static int clear_buffer_until(const Logger *log, const Packet_Pools *pools, Packets_Array *array, uint32_t number)
 {
     const uint32_t num_spots = num_packets_array(array);
 
@@ -865,32 +1254,37 @@ static int clear_buffer_until(const Logger *log, Packets_Array *array, uint32_t
     uint32_t i;
 
     for (i = array->buffer_start; i != number; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        Packet_Data **slot = packets_array_slot(array, i);
 
-        if (array->buffer[num]) {
-            free(array->buffer[num]);
-            array->buffer[num] = nullptr;
+        if (*slot) {
+            free_packet_data(pools, *slot);
+            *slot = nullptr;
+            --array->num_stored;
         }
     }
 
     array->buffer_start = i;
+    packets_array_shrink(array);
     return 0;
 }
 
-static int clear_buffer(Packets_Array *array)
+static int clear_buffer(const Packet_Pools *pools, Packets_Array *array)
 {
     uint32_t i;
 
     for (i = array->buffer_start; i != array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        Packet_Data *packet = *packets_array_slot(array, i);
 
-        if (array->buffer[num]) {
-            free(array->buffer[num]);
-            array->buffer[num] = nullptr;
+        if (packet) {
+            free_packet_data(pools, packet);
         }
     }
 
+    free(array->buffer);
+    array->buffer = nullptr;
+    array->capacity = 0;
     array->buffer_start = i;
+    array->num_stored = 0;
     return 0;
 }
 
@@ -909,6 +1303,10 @@ static int set_buffer_end(const Logger *log, Packets_Array *array, uint32_t numb
         return -1;
     }
 
+    if (!packets_array_reserve(array, number - array->buffer_start)) {
+        return -1;
+    }
+
     array->buffer_end = number;
     return 0;
 }
@@ -940,9 +1338,7 @@ static int generate_request_packet(const Logger *log, uint8_t *data, uint16_t le
     uint32_t i, n = 1;
 
     for (i = recv_array->buffer_start; i != recv_array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
-
-        if (!recv_array->buffer[num]) {
+        if (!*packets_array_slot(recv_array, i)) {
             data[cur_len] = n;
             n = 0;
             ++cur_len;
@@ -966,13 +1362,84 @@ static int generate_request_packet(const Logger *log, uint8_t *data, uint16_t le
     return cur_len;
 }
 
+static bool recv_array_has_packet(const void *object, uint32_t index)
+{
+    const Packets_Array *recv_array = (const Packets_Array *)object;
+    return *packets_array_slot(recv_array, recv_array->buffer_start + index) != nullptr;
+}
+
+/* Create a selective acknowledgement request packet from recv_array into
+ * data of length. Unlike generate_request_packet() it can describe the whole
+ * receive window even with a lot of loss.
+ *
+ * return -1 on failure.
+ * return length of packet on success.
+ */
+static int generate_sack_request_packet(uint8_t *data, uint16_t length, const Packets_Array *recv_array)
+{
+    if (length <= 1) {
+        return -1;
+    }
+
+    data[0] = PACKET_ID_REQUEST_SACK;
+
+    uint32_t covered;
+    const int len = sack_encode(data + 1, length - 1, num_packets_array(recv_array), recv_array_has_packet, recv_array,
+                                &covered);
+
+    if (len == -1) {
+        return -1;
+    }
+
+    return 1 + len;
+}
+
+typedef struct Request_State {
+    const Packet_Pools *pools;
+    Packets_Array *send_array;
+    uint64_t current_time;
+    uint64_t rtt_time;
+    uint64_t latest_send_time;  /* Latest sent_time of the acked packets, 0 if none was sent. */
+    uint32_t lost;
+} Request_State;
+
+/* The peer asked for the packet in slot again: mark it for resending. */
+static void request_packet(Request_State *state, Packet_Data **slot)
+{
+    if (*slot) {
+        const uint64_t sent_time = (*slot)->sent_time;
+
+        if (sent_time != 0 && (sent_time + state->rtt_time) < state->current_time) {
+            (*slot)->sent_time = 0;
+            ++state->lost;
+        }
+    }
+}
+
+/* The peer received the packet in slot: remove it from the send array. */
+static void ack_packet(Request_State *state, Packet_Data **slot)
+{
+    if (*slot) {
+        const uint64_t sent_time = (*slot)->sent_time;
+
+        if (state->latest_send_time < sent_time) {
+            state->latest_send_time = sent_time;
+        }
+
+        free_packet_data(state->pools, *slot);
+        *slot = nullptr;
+        --state->send_array->num_stored;
+    }
+}
+
 /* Handle a request data packet.
  * Remove all the packets the other received from the array.
  *
  * return -1 on failure.
- * return number of requested packets on success.
+ * return number of requested packets that were sent more than rtt_time ago,
+ *   i.e. the ones that were probably lost, on success.
  */
-static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packets_Array *send_array,
+static int handle_request_packet(Mono_Time *mono_time, const Logger *log, const Packet_Pools *pools, Packets_Array *send_array,
                                  const uint8_t *data, uint16_t length, uint64_t *latest_send_time, uint64_t rtt_time)
 {
     if (length == 0) {
@@ -991,42 +1458,23 @@ static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet
     --length;
 
     uint32_t n = 1;
-    uint32_t requested = 0;
 
-    const uint64_t temp_time = current_time_monotonic(mono_time);
-    uint64_t l_sent_time = ~0;
+    Request_State state = {pools, send_array, current_time_monotonic(mono_time), rtt_time, 0, 0};
 
     for (uint32_t i = send_array->buffer_start; i != send_array->buffer_end; ++i) {
         if (length == 0) {
             break;
         }
 
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        Packet_Data **slot = packets_array_slot(send_array, i);
 
         if (n == data[0]) {
-            if (send_array->buffer[num]) {
-                uint64_t sent_time = send_array->buffer[num]->sent_time;
-
-                if ((sent_time + rtt_time) < temp_time) {
-                    send_array->buffer[num]->sent_time = 0;
-                }
-            }
-
+            request_packet(&state, slot);
             ++data;
             --length;
             n = 0;
-            ++requested;
         } else {
-            if (send_array->buffer[num]) {
-                uint64_t sent_time = send_array->buffer[num]->sent_time;
-
-                if (l_sent_time < sent_time) {
-                    l_sent_time = sent_time;
-                }
-
-                free(send_array->buffer[num]);
-                send_array->buffer[num] = nullptr;
-            }
+            ack_packet(&state, slot);
         }
 
         if (n == 255) {
@@ -1043,25 +1491,295 @@ static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet
         }
     }
 
-    if (*latest_send_time < l_sent_time) {
-        *latest_send_time = l_sent_time;
+    if (*latest_send_time < state.latest_send_time) {
+        *latest_send_time = state.latest_send_time;
+    }
+
+    return state.lost;
+}
+
+static void handle_sack_run(void *object, uint32_t start, uint32_t count, bool missing)
+{
+    Request_State *state = (Request_State *)object;
+    const uint32_t num = num_packets_array(state->send_array);
+
+    for (uint32_t i = start; i < num && i - start < count; ++i) {
+        Packet_Data **slot = packets_array_slot(state->send_array, state->send_array->buffer_start + i);
+
+        if (missing) {
+            request_packet(state, slot);
+        } else {
+            ack_packet(state, slot);
+        }
+    }
+}
+
+/* Handle a selective acknowledgement request packet, the same way as
+ * handle_request_packet().
+ *
+ * return -1 on failure.
+ * return number of requested packets that were probably lost on success.
+ */
+static int handle_sack_request_packet(Mono_Time *mono_time, const Packet_Pools *pools, Packets_Array *send_array,
+                                      const uint8_t *data, uint16_t length, uint64_t *latest_send_time, uint64_t rtt_time)
+{
+    if (length <= 1 || data[0] != PACKET_ID_REQUEST_SACK) {
+        return -1;
     }
 
-    return requested;
+    Request_State state = {pools, send_array, current_time_monotonic(mono_time), rtt_time, 0, 0};
+
+    if (sack_decode(data + 1, length - 1, handle_sack_run, &state) == -1) {
+        return -1;
+    }
+
+    if (*latest_send_time < state.latest_send_time) {
+        *latest_send_time = state.latest_send_time;
+    }
+
+    return state.lost;
 }
 
 /** END: Array Related functions **/
 
-#define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE))
+/* Number of request packets also sent as PACKET_ID_REQUEST_SACK to a peer
+ * that has not sent us one yet.
+ */
+#define CRYPTO_SACK_PROBES 8
+
+/* The dT for the average packet receiving rate calculations.
+   Also used as the */
+#define PACKET_COUNTER_AVERAGE_INTERVAL 50
 
-/* Creates and sends a data packet to the peer using the fastest route.
+/* Ratio of recv queue size / recv packet rate (in seconds) times
+ * the number of ms between request packets to send at that ratio
+ */
+#define REQUEST_PACKETS_COMPARE_CONSTANT (0.125 * 100.0)
+
+/* Timeout for increasing speed after congestion event (in ms). */
+#define CONGESTION_EVENT_TIMEOUT 1000
+
+/* If the send queue is SEND_QUEUE_RATIO times larger than the
+ * calculated link speed the packet send speed will be reduced
+ * by a value depending on this number.
+ */
+#define SEND_QUEUE_RATIO 2.0
+
+/* The original toxcore controller. It estimates the link speed from the
+ * number of packets sent over the last CONGESTION_QUEUE_ARRAY_SIZE intervals
+ * and slows down when the send queue grows, speeds up by 20% otherwise.
+ */
+static void legacy_update_send_rate(Crypto_Connection *conn, const Congestion_Sample *sample)
+{
+    unsigned int pos = conn->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
+    conn->last_sendqueue_size[pos] = sample->send_queue;
+    ++conn->last_sendqueue_counter;
+
+    long signed int sum = 0;
+    sum = (long signed int)conn->last_sendqueue_size[(pos) % CONGESTION_QUEUE_ARRAY_SIZE] -
+          (long signed int)conn->last_sendqueue_size[(pos - (CONGESTION_QUEUE_ARRAY_SIZE - 1)) % CONGESTION_QUEUE_ARRAY_SIZE];
+
+    unsigned int n_p_pos = conn->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
+    conn->last_num_packets_sent[n_p_pos] = sample->packets_sent;
+    conn->last_num_packets_resent[n_p_pos] = sample->packets_resent;
+
+    /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
+    if (!(sample->direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > sample->time)) {
+        long signed int total_sent = 0, total_resent = 0;
+
+        // TODO(irungentoo): use real delay
+        unsigned int delay = (unsigned int)((conn->rtt_time / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
+        unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
+
+        if (delay > packets_set_rem_array) {
+            delay = packets_set_rem_array;
+        }
+
+        for (unsigned j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
+            unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
+            total_sent += conn->last_num_packets_sent[ind];
+            total_resent += conn->last_num_packets_resent[ind];
+        }
+
+        if (sum > 0) {
+            total_sent -= sum;
+        } else {
+            if (total_resent > -sum) {
+                total_resent = -sum;
+            }
+        }
+
+        /* if queue is too big only allow resending packets. */
+        uint32_t npackets = sample->send_queue;
+        double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
+                                     PACKET_COUNTER_AVERAGE_INTERVAL));
+
+        double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
+                CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
+
+        if (min_speed < CRYPTO_PACKET_MIN_RATE) {
+            min_speed = CRYPTO_PACKET_MIN_RATE;
+        }
+
+        double send_array_ratio = (((double)npackets) / min_speed);
+
+        // TODO(irungentoo): Improve formula?
+        if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
+            conn->packet_send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
+        } else if (conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < sample->time) {
+            conn->packet_send_rate = min_speed * 1.2;
+        } else {
+            conn->packet_send_rate = min_speed * 0.9;
+        }
+
+        conn->packet_send_rate_requested = min_speed_request * 1.2;
+
+        if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
+            conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
+        }
+
+        if (conn->packet_send_rate_requested < conn->packet_send_rate) {
+            conn->packet_send_rate_requested = conn->packet_send_rate;
+        }
+    }
+}
+
+/* CUBIC (RFC 8312) on top of the rate based sender: the congestion window
+ * is turned into a send rate by dividing it by the RTT, and a loss is a packet
+ * the peer asks for again more than an RTT after it was sent.
+ */
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+/* Smallest window, in packets, CUBIC reduces to. */
+#define CUBIC_MIN_WINDOW 4.0
+
+/* Smallest RTT in ms used to turn the window into a rate. */
+#define CUBIC_MIN_RTT 1.0
+
+/* Weight of a new sample in the smoothed RTT, as in RFC 6298. */
+#define RTT_SMOOTHING_ALPHA 0.125
+
+static double cube_root(double x)
+{
+    if (x <= 0.0) {
+        return 0.0;
+    }
+
+    double root = x < 1.0 ? 1.0 : x;
+
+    /* Newton's method converges from above for any positive start. */
+    for (uint32_t i = 0; i < 64; ++i) {
+        const double next = (2.0 * root + x / (root * root)) / 3.0;
+
+        if (next >= root) {
+            break;
+        }
+
+        root = next;
+    }
+
+    return root;
+}
+
+static void cubic_update_send_rate(Crypto_Connection *conn, const Congestion_Sample *sample)
+{
+    Cubic_State *cubic = &conn->cubic;
+    /* The window is sent once per actual round trip, including the queueing
+     * delay the flow itself causes, so the rate and the growth per round trip
+     * use the smoothed RTT. The lowest RTT only offsets the epoch. */
+    const double min_rtt = conn->rtt_time < CUBIC_MIN_RTT ? CUBIC_MIN_RTT : (double)conn->rtt_time;
+    const double rtt = conn->rtt_smoothed < min_rtt ? min_rtt : conn->rtt_smoothed;
+    const double rtts_passed = sample->interval < rtt ? sample->interval / rtt : 1.0;
+
+    if (cubic->cwnd == 0.0) {
+        cubic->cwnd = CRYPTO_MIN_QUEUE_LENGTH;
+        cubic->ssthresh = CRYPTO_PACKET_BUFFER_SIZE;
+    }
+
+    if (sample->packets_lost > 0 && cubic->last_reduction + rtt < sample->time) {
+        /* Fast convergence: release bandwidth for new flows if the window
+         * did not get back to where it was at the previous loss. */
+        if (cubic->cwnd < cubic->w_max) {
+            cubic->w_max = cubic->cwnd * (1.0 + CUBIC_BETA) / 2.0;
+        } else {
+            cubic->w_max = cubic->cwnd;
+        }
+
+        cubic->cwnd *= CUBIC_BETA;
+
+        if (cubic->cwnd < CUBIC_MIN_WINDOW) {
+            cubic->cwnd = CUBIC_MIN_WINDOW;
+        }
+
+        cubic->ssthresh = cubic->cwnd;
+        cubic->k = cube_root(cubic->w_max * (1.0 - CUBIC_BETA) / CUBIC_C);
+        cubic->last_reduction = sample->time;
+    } else if (sample->send_queue * 2.0 >= cubic->cwnd) {
+        /* Only grow the window while the application keeps it at least half
+         * full, otherwise an idle connection would end up with a window it
+         * never probed. */
+        if (cubic->cwnd < cubic->ssthresh) {
+            cubic->cwnd += cubic->cwnd * rtts_passed;
+        } else {
+            const double elapsed = (double)(sample->time - cubic->last_reduction);
+            const double t = (elapsed + min_rtt) / 1000.0 - cubic->k;
+            double target = CUBIC_C * t * t * t + cubic->w_max;
+
+            /* Never grow slower than Reno would with the same beta. */
+            const double w_est = cubic->w_max * CUBIC_BETA
+                                 + 3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA) * (elapsed / rtt);
+
+            if (target < w_est) {
+                target = w_est;
+            }
+
+            if (target > cubic->cwnd) {
+                cubic->cwnd += (target - cubic->cwnd) * rtts_passed;
+            }
+        }
+    }
+
+    if (cubic->cwnd > CRYPTO_PACKET_BUFFER_SIZE) {
+        cubic->cwnd = CRYPTO_PACKET_BUFFER_SIZE;
+    }
+
+    double rate = cubic->cwnd * 1000.0 / rtt;
+
+    if (rate < CRYPTO_PACKET_MIN_RATE) {
+        rate = CRYPTO_PACKET_MIN_RATE;
+    }
+
+    conn->packet_send_rate = rate;
+    conn->packet_send_rate_requested = rate;
+}
+
+static congestion_update_cb *congestion_controller(Crypto_Congestion_Control congestion_control)
+{
+    switch (congestion_control) {
+        case CRYPTO_CONGESTION_CONTROL_CUBIC:
+            return cubic_update_send_rate;
+
+        case CRYPTO_CONGESTION_CONTROL_LEGACY:
+            break;
+    }
+
+    return legacy_update_send_rate;
+}
+
+
+#define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_JUMBO_PACKET_SIZE - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE))
+
+/* Creates and sends a data packet to the peer, over UDP to direct_ip_port
+ * without fragmentation if it is not NULL, using the fastest route otherwise.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+static int send_data_packet_route(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                                  const IP_Port *direct_ip_port)
 {
-    const uint16_t max_length = MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE);
+    const uint16_t max_length = MAX_DATA_DATA_PACKET_SIZE;
 
     if (length == 0 || length > max_length) {
         return -1;
@@ -1073,23 +1791,41 @@ static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_
         return -1;
     }
 
+    /* Only the nonce is taken under the mutex, the encryption can run
+     * concurrently with other threads using the connection. */
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
     pthread_mutex_lock(&conn->mutex);
+    memcpy(nonce, conn->sent_nonce, CRYPTO_NONCE_SIZE);
+    increment_nonce(conn->sent_nonce);
+    pthread_mutex_unlock(&conn->mutex);
+
     VLA(uint8_t, packet, 1 + sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
     packet[0] = NET_PACKET_CRYPTO_DATA;
-    memcpy(packet + 1, conn->sent_nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
-    const int len = encrypt_data_symmetric(conn->shared_key, conn->sent_nonce, data, length, packet + 1 + sizeof(uint16_t));
+    memcpy(packet + 1, nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
+    const int len = encrypt_data_symmetric(conn->shared_key, nonce, data, length, packet + 1 + sizeof(uint16_t));
 
     if (len + 1 + sizeof(uint16_t) != SIZEOF_VLA(packet)) {
-        pthread_mutex_unlock(&conn->mutex);
         return -1;
     }
 
-    increment_nonce(conn->sent_nonce);
-    pthread_mutex_unlock(&conn->mutex);
+    if (direct_ip_port != nullptr) {
+        const int ret = sendpacket_dont_fragment(dht_get_net(c->dht), *direct_ip_port, packet, SIZEOF_VLA(packet));
+        return (uint32_t)ret == SIZEOF_VLA(packet) ? 0 : -1;
+    }
 
     return send_packet_to(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
 }
 
+/* Creates and sends a data packet to the peer using the fastest route.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+{
+    return send_data_packet_route(c, crypt_connection_id, data, length, nullptr);
+}
+
 /* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
  *
  * return -1 on failure.
@@ -1098,20 +1834,36 @@ static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_
 static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
                                    const uint8_t *data, uint16_t length)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+    if (length == 0 || length > MAX_CRYPTO_JUMBO_DATA_SIZE) {
         return -1;
     }
 
     num = net_htonl(num);
     buffer_start = net_htonl(buffer_start);
-    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
+    /* Same padding as relative to MAX_CRYPTO_DATA_SIZE, the two sizes differ by a multiple of CRYPTO_MAX_PADDING. */
+    uint16_t padding_length = (MAX_CRYPTO_JUMBO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
     VLA(uint8_t, packet, sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length);
     memcpy(packet, &buffer_start, sizeof(uint32_t));
     memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
     memset(packet + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
     memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, data, length);
 
-    return send_data_packet(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
+    return send_data_packet(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
+}
+
+/* Record that the packet with packet_num in the send array was sent, unless it
+ * was acknowledged in the meantime.
+ */
+static void set_packet_sent_time(const Logger *log, Crypto_Connection *conn, uint32_t packet_num, uint64_t time)
+{
+    pthread_mutex_lock(&conn->mutex);
+    Packet_Data *dt = nullptr;
+
+    if (get_data_pointer(log, &conn->send_array, &dt, packet_num) == 1) {
+        dt->sent_time = time;
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
 }
 
 static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
@@ -1125,17 +1877,21 @@ static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
     /* If last packet send failed, try to send packet again.
        If sending it fails we won't be able to send the new packet. */
     if (conn->maximum_speed_reached) {
-        Packet_Data *dt = nullptr;
-        const uint32_t packet_num = conn->send_array.buffer_end - 1;
-        const int ret = get_data_pointer(c->log, &conn->send_array, &dt, packet_num);
+        uint8_t data[MAX_CRYPTO_JUMBO_DATA_SIZE];
+        uint16_t length;
 
-        if (ret == 1 && dt->sent_time == 0) {
+        pthread_mutex_lock(&conn->mutex);
+        const uint32_t last = conn->send_array.buffer_end - 1;
+        const int64_t packet_num = copy_unsent_packet(&conn->send_array, last, data, &length);
+        pthread_mutex_unlock(&conn->mutex);
+
+        if (packet_num != -1) {
             if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num,
-                                        dt->data, dt->length) != 0) {
+                                        data, length) != 0) {
                 return -1;
             }
 
-            dt->sent_time = current_time_monotonic(c->mono_time);
+            set_packet_sent_time(c->log, conn, packet_num, current_time_monotonic(c->mono_time));
         }
 
         conn->maximum_speed_reached = 0;
@@ -1150,7 +1906,7 @@ static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
 static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
                                     uint8_t congestion_control)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+    if (length == 0 || length > MAX_CRYPTO_JUMBO_DATA_SIZE) {
         return -1;
     }
 
@@ -1168,12 +1924,8 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
         return -1;
     }
 
-    Packet_Data dt;
-    dt.sent_time = 0;
-    dt.length = length;
-    memcpy(dt.data, data, length);
     pthread_mutex_lock(&conn->mutex);
-    int64_t packet_num = add_data_end_of_buffer(c->log, &conn->send_array, &dt);
+    int64_t packet_num = add_data_end_of_buffer(c->log, &c->packet_pools, &conn->send_array, data, length);
     pthread_mutex_unlock(&conn->mutex);
 
     if (packet_num == -1) {
@@ -1185,11 +1937,7 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
     }
 
     if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
-        Packet_Data *dt1 = nullptr;
-
-        if (get_data_pointer(c->log, &conn->send_array, &dt1, packet_num) == 1) {
-            dt1->sent_time = current_time_monotonic(c->mono_time);
-        }
+        set_packet_sent_time(c->log, conn, packet_num, current_time_monotonic(c->mono_time));
     } else {
         conn->maximum_speed_reached = 1;
         LOGGER_DEBUG(c->log, "send_data_packet failed");
@@ -1222,7 +1970,7 @@ static int handle_data_packet(const Net_Crypto *c, int crypt_connection_id, uint
 {
     const uint16_t crypto_packet_overhead = 1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE;
 
-    if (length <= crypto_packet_overhead || length > MAX_CRYPTO_PACKET_SIZE) {
+    if (length <= crypto_packet_overhead || length > MAX_CRYPTO_JUMBO_PACKET_SIZE) {
         return -1;
     }
 
@@ -1253,6 +2001,131 @@ static int handle_data_packet(const Net_Crypto *c, int crypt_connection_id, uint
     return len;
 }
 
+/* Send a PACKET_ID_MTU_PROBE of MAX_CRYPTO_JUMBO_PACKET_SIZE over UDP to
+ * ip_port without fragmentation.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_mtu_probe(Net_Crypto *c, int crypt_connection_id, const IP_Port *ip_port)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    const uint32_t buffer_start = net_htonl(conn->recv_array.buffer_start);
+    const uint32_t num = net_htonl(conn->send_array.buffer_end);
+
+    /* No padding is needed, the probe fills the whole packet. */
+    uint8_t packet[sizeof(uint32_t) + sizeof(uint32_t) + MAX_CRYPTO_JUMBO_DATA_SIZE] = {0};
+    memcpy(packet, &buffer_start, sizeof(uint32_t));
+    memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
+    packet[sizeof(uint32_t) * 2] = PACKET_ID_MTU_PROBE;
+    packet[sizeof(uint32_t) * 2 + 1] = conn->mtu_probe_number;
+
+    return send_data_packet_route(c, crypt_connection_id, packet, sizeof(packet), ip_port);
+}
+
+/* Path MTU discovery.
+ *
+ * The direct path of an established connection is probed with packets of
+ * MAX_CRYPTO_JUMBO_PACKET_SIZE that have the don't fragment bit set. Once the
+ * peer acknowledges one, lossless packets of up to MAX_CRYPTO_JUMBO_DATA_SIZE
+ * are sent on the connection. The path is probed again every
+ * CRYPTO_MTU_REPROBE_INTERVAL, then every CRYPTO_MTU_PROBE_INTERVAL while the
+ * probes go unacknowledged. The connection falls back to MAX_CRYPTO_DATA_SIZE
+ * if CRYPTO_MTU_PROBES probes in a row go unacknowledged, as on a path that
+ * silently drops jumbo packets, if a probe can no longer be sent because the
+ * known path MTU went down, or if the direct path changes.
+ *
+ * Older peers drop the probes, so their connections keep the fixed size.
+ */
+static void do_mtu_discovery(Net_Crypto *c, int crypt_connection_id, uint64_t current_time)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return;
+    }
+
+    bool direct_connected = 0;
+    pthread_mutex_lock(&conn->mutex);
+    const IP_Port ip_port = return_ip_port_connection(c, crypt_connection_id);
+    crypto_connection_status(c, crypt_connection_id, &direct_connected, nullptr);
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (!ipport_equal(&ip_port, &conn->mtu_ip_port)) {
+        conn->mtu_ip_port = ip_port;
+        conn->mtu_confirmed = 0;
+        conn->mtu_probes_sent = 0;
+        ++conn->mtu_probe_number;
+    }
+
+    if (!direct_connected) {
+        return;
+    }
+
+    const uint64_t interval = conn->mtu_confirmed && conn->mtu_probes_sent == 0
+                              ? CRYPTO_MTU_REPROBE_INTERVAL : CRYPTO_MTU_PROBE_INTERVAL;
+
+    if (conn->last_mtu_probe_time + interval > current_time) {
+        return;
+    }
+
+    if (conn->mtu_probes_sent >= CRYPTO_MTU_PROBES) {
+        /* The last probe got no acknowledgement in time either. Don't try
+         * again until the path changes. */
+        conn->mtu_confirmed = 0;
+        return;
+    }
+
+    conn->last_mtu_probe_time = current_time;
+
+    if (send_mtu_probe(c, crypt_connection_id, &ip_port) != 0) {
+        /* Our side of the path can't send it unfragmented. */
+        conn->mtu_confirmed = 0;
+        conn->mtu_probes_sent = CRYPTO_MTU_PROBES;
+        return;
+    }
+
+    ++conn->mtu_probes_sent;
+}
+
+/* Handle a PACKET_ID_MTU_PROBE or PACKET_ID_MTU_PROBE_ACK.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_mtu_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length, bool udp)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr || length < 2) {
+        return -1;
+    }
+
+    if (data[0] == PACKET_ID_MTU_PROBE) {
+        /* Only a full size probe that came over the direct path says
+         * something about it. */
+        if (!udp || length != MAX_CRYPTO_JUMBO_DATA_SIZE) {
+            return 0;
+        }
+
+        const uint8_t ack[2] = {PACKET_ID_MTU_PROBE_ACK, data[1]};
+        return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
+                                       ack, sizeof(ack));
+    }
+
+    if (data[1] == conn->mtu_probe_number) {
+        conn->mtu_confirmed = 1;
+        conn->mtu_probes_sent = 0;
+    }
+
+    return 0;
+}
+
 /* Send a request packet.
  *
  * return -1 on failure.
@@ -1267,7 +2140,28 @@ static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
     }
 
     uint8_t data[MAX_CRYPTO_DATA_SIZE];
-    int len = generate_request_packet(c->log, data, sizeof(data), &conn->recv_array);
+
+    if (!conn->peer_sends_sack) {
+        const int len = generate_request_packet(c->log, data, sizeof(data), &conn->recv_array);
+
+        if (len == -1) {
+            return -1;
+        }
+
+        const int ret = send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start,
+                                                conn->send_array.buffer_end, data, len);
+
+        /* Peers that don't know PACKET_ID_REQUEST_SACK drop it, so only the
+         * first few requests are also sent in that form to find out if the
+         * peer does. */
+        if (conn->sack_probes_sent >= CRYPTO_SACK_PROBES) {
+            return ret;
+        }
+
+        ++conn->sack_probes_sent;
+    }
+
+    const int len = generate_sack_request_packet(data, sizeof(data), &conn->recv_array);
 
     if (len == -1) {
         return -1;
@@ -1295,34 +2189,29 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
     }
 
     const uint64_t temp_time = current_time_monotonic(c->mono_time);
-    uint32_t i, num_sent = 0, array_size = num_packets_array(&conn->send_array);
-
-    for (i = 0; i < array_size; ++i) {
-        Packet_Data *dt;
-        const uint32_t packet_num = i + conn->send_array.buffer_start;
-        const int ret = get_data_pointer(c->log, &conn->send_array, &dt, packet_num);
-
-        if (ret == -1) {
-            return -1;
-        }
+    uint32_t num_sent = 0;
+    uint32_t next = conn->send_array.buffer_start;
+    uint8_t data[MAX_CRYPTO_JUMBO_DATA_SIZE];
+    uint16_t length;
 
-        if (ret == 0) {
-            continue;
-        }
+    /* Packets are copied out under the mutex: sending them takes it too, and
+     * other threads may grow the array in the meantime. */
+    while (num_sent < max_num) {
+        pthread_mutex_lock(&conn->mutex);
+        const int64_t packet_num = copy_unsent_packet(&conn->send_array, next, data, &length);
+        pthread_mutex_unlock(&conn->mutex);
 
-        if (dt->sent_time) {
-            continue;
+        if (packet_num == -1) {
+            break;
         }
 
-        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                    dt->length) == 0) {
-            dt->sent_time = temp_time;
+        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data,
+                                    length) == 0) {
+            set_packet_sent_time(c->log, conn, packet_num, temp_time);
             ++num_sent;
         }
 
-        if (num_sent >= max_num) {
-            break;
-        }
+        next = packet_num + 1;
     }
 
     return num_sent;
@@ -1487,7 +2376,7 @@ static void connection_kill(Net_Crypto *c, int crypt_connection_id, void *userda
 static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
                                    bool udp, void *userdata)
 {
-    if (length > MAX_CRYPTO_PACKET_SIZE || length <= CRYPTO_DATA_PACKET_MIN_SIZE) {
+    if (length > MAX_CRYPTO_JUMBO_PACKET_SIZE || length <= CRYPTO_DATA_PACKET_MIN_SIZE) {
         return -1;
     }
 
@@ -1515,11 +2404,16 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
     if (buffer_start != conn->send_array.buffer_start) {
         Packet_Data *packet_time;
 
+        pthread_mutex_lock(&conn->mutex);
+
         if (get_data_pointer(c->log, &conn->send_array, &packet_time, conn->send_array.buffer_start) == 1) {
             rtt_calc_time = packet_time->sent_time;
         }
 
-        if (clear_buffer_until(c->log, &conn->send_array, buffer_start) != 0) {
+        const int ret = clear_buffer_until(c->log, &c->packet_pools, &conn->send_array, buffer_start);
+        pthread_mutex_unlock(&conn->mutex);
+
+        if (ret != 0) {
             return -1;
         }
     }
@@ -1551,7 +2445,13 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         }
     }
 
-    if (real_data[0] == PACKET_ID_REQUEST) {
+    if (real_data[0] == PACKET_ID_MTU_PROBE || real_data[0] == PACKET_ID_MTU_PROBE_ACK) {
+        set_buffer_end(c->log, &conn->recv_array, num);
+
+        if (handle_mtu_packet(c, crypt_connection_id, real_data, real_length, udp) != 0) {
+            return -1;
+        }
+    } else if (real_data[0] == PACKET_ID_REQUEST || real_data[0] == PACKET_ID_REQUEST_SACK) {
         uint64_t rtt_time;
 
         if (udp) {
@@ -1560,38 +2460,74 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
             rtt_time = DEFAULT_TCP_PING_CONNECTION;
         }
 
-        int requested = handle_request_packet(c->mono_time, c->log, &conn->send_array, real_data, real_length, &rtt_calc_time,
-                                              rtt_time);
+        int lost;
+
+        pthread_mutex_lock(&conn->mutex);
+
+        if (real_data[0] == PACKET_ID_REQUEST_SACK) {
+            conn->peer_sends_sack = 1;
+            lost = handle_sack_request_packet(c->mono_time, &c->packet_pools, &conn->send_array, real_data, real_length,
+                                              &rtt_calc_time, rtt_time);
+        } else {
+            lost = handle_request_packet(c->mono_time, c->log, &c->packet_pools, &conn->send_array, real_data, real_length,
+                                         &rtt_calc_time, rtt_time);
+        }
+
+        pthread_mutex_unlock(&conn->mutex);
 
-        if (requested == -1) {
+        if (lost == -1) {
             return -1;
         }
 
+        conn->packets_lost += lost;
+        conn->total_packets_lost += lost;
+
         set_buffer_end(c->log, &conn->recv_array, num);
     } else if (real_data[0] >= PACKET_ID_RANGE_LOSSLESS_START && real_data[0] <= PACKET_ID_RANGE_LOSSLESS_END) {
-        Packet_Data dt = {0};
-        dt.length = real_length;
-        memcpy(dt.data, real_data, real_length);
+        if (num == conn->recv_array.buffer_start) {
+            /* The next packet in order goes straight from the decryption
+             * buffer to the application, only out of order packets are
+             * copied into the receive array. */
+            pthread_mutex_lock(&conn->mutex);
+            const int ret = skip_data_beg_buffer(c->log, &conn->recv_array);
+            pthread_mutex_unlock(&conn->mutex);
+
+            if (ret != 0) {
+                return -1;
+            }
+
+            if (conn->connection_data_callback) {
+                conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, real_data,
+                                               real_length, userdata);
+            }
+
+            /* conn might get killed in callback. */
+            conn = get_crypto_connection(c, crypt_connection_id);
 
-        if (add_data_to_buffer(c->log, &conn->recv_array, num, &dt) != 0) {
+            if (conn == nullptr) {
+                return -1;
+            }
+        } else if (add_data_to_buffer(c->log, &c->packet_pools, &conn->recv_array, num, real_data, real_length) != 0) {
             return -1;
         }
 
         while (1) {
             pthread_mutex_lock(&conn->mutex);
-            int ret = read_data_beg_buffer(c->log, &conn->recv_array, &dt);
+            Packet_Data *dt = take_data_beg_buffer(c->log, &conn->recv_array);
             pthread_mutex_unlock(&conn->mutex);
 
-            if (ret == -1) {
+            if (dt == nullptr) {
                 break;
             }
 
             if (conn->connection_data_callback) {
-                conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, dt.data,
-                                               dt.length, userdata);
+                conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, dt->data,
+                                               dt->length, userdata);
             }
 
-            /* conn might get killed in callback. */
+            /* The packet is no longer in the array, so it is still ours to
+             * free even if conn was killed in the callback. */
+            free_packet_data(&c->packet_pools, dt);
             conn = get_crypto_connection(c, crypt_connection_id);
 
             if (conn == nullptr) {
@@ -1619,6 +2555,12 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         if (rtt_time < conn->rtt_time) {
             conn->rtt_time = rtt_time;
         }
+
+        if (conn->rtt_smoothed == 0.0) {
+            conn->rtt_smoothed = rtt_time;
+        } else {
+            conn->rtt_smoothed += RTT_SMOOTHING_ALPHA * ((double)rtt_time - conn->rtt_smoothed);
+        }
     }
 
     return 0;
@@ -1632,7 +2574,7 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
 static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
                                     bool udp, void *userdata)
 {
-    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
+    if (length == 0 || length > MAX_CRYPTO_JUMBO_PACKET_SIZE) {
         return -1;
     }
 
@@ -1754,15 +2696,7 @@ static int create_crypto_connection(Net_Crypto *c)
         }
     }
 
-    while (1) { /* TODO(irungentoo): is this really the best way to do this? */
-        pthread_mutex_lock(&c->connections_mutex);
-
-        if (!c->connection_use_counter) {
-            break;
-        }
-
-        pthread_mutex_unlock(&c->connections_mutex);
-    }
+    pthread_rwlock_wrlock(&c->connections_lock);
 
     int id = -1;
 
@@ -1776,14 +2710,15 @@ static int create_crypto_connection(Net_Crypto *c)
         c->crypto_connections[id].last_packets_left_rem = 0;
         c->crypto_connections[id].packet_send_rate_requested = 0;
         c->crypto_connections[id].last_packets_left_requested_rem = 0;
+        c->crypto_connections[id].rtt_smoothed = 0;
 
         if (pthread_mutex_init(&c->crypto_connections[id].mutex, nullptr) != 0) {
-            pthread_mutex_unlock(&c->connections_mutex);
+            pthread_rwlock_unlock(&c->connections_lock);
             return -1;
         }
     }
 
-    pthread_mutex_unlock(&c->connections_mutex);
+    pthread_rwlock_unlock(&c->connections_lock);
     return id;
 }
 
@@ -1828,15 +2763,7 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
  */
 static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
 {
-    for (uint32_t i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status != CRYPTO_CONN_NO_CONNECTION) {
-            if (public_key_cmp(public_key, c->crypto_connections[i].public_key) == 0) {
-                return i;
-            }
-        }
-    }
-
-    return -1;
+    return key_map_find(&c->public_key_list, public_key);
 }
 
 /* Add a source to the crypto connection.
@@ -1988,6 +2915,14 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
 
     conn->connection_number_tcp = connection_number_tcp;
     memcpy(conn->public_key, n_c->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (!key_map_add(&c->public_key_list, conn->public_key, crypt_connection_id)) {
+        pthread_mutex_lock(&c->tcp_mutex);
+        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
+        pthread_mutex_unlock(&c->tcp_mutex);
+        return -1;
+    }
+
     memcpy(conn->recv_nonce, n_c->recv_nonce, CRYPTO_NONCE_SIZE);
     memcpy(conn->peersessionpublic_key, n_c->peersessionpublic_key, CRYPTO_PUBLIC_KEY_SIZE);
     random_nonce(conn->sent_nonce);
@@ -1999,6 +2934,7 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
         pthread_mutex_lock(&c->tcp_mutex);
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
+        key_map_remove(&c->public_key_list, conn->public_key, crypt_connection_id);
         conn->status = CRYPTO_CONN_NO_CONNECTION;
         return -1;
     }
@@ -2008,6 +2944,7 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
     conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
     conn->rtt_time = DEFAULT_PING_CONNECTION;
+    conn->congestion_update = congestion_controller(c->congestion_control);
     crypto_connection_add_source(c, crypt_connection_id, n_c->source);
     return crypt_connection_id;
 }
@@ -2044,6 +2981,14 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
 
     conn->connection_number_tcp = connection_number_tcp;
     memcpy(conn->public_key, real_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (!key_map_add(&c->public_key_list, conn->public_key, crypt_connection_id)) {
+        pthread_mutex_lock(&c->tcp_mutex);
+        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
+        pthread_mutex_unlock(&c->tcp_mutex);
+        return -1;
+    }
+
     random_nonce(conn->sent_nonce);
     crypto_new_keypair(conn->sessionpublic_key, conn->sessionsecret_key);
     conn->status = CRYPTO_CONN_COOKIE_REQUESTING;
@@ -2051,6 +2996,7 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
     conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
     conn->rtt_time = DEFAULT_PING_CONNECTION;
+    conn->congestion_update = congestion_controller(c->congestion_control);
     memcpy(conn->dht_public_key, dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
 
     conn->cookie_request_number = random_u64();
@@ -2062,6 +3008,7 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
         pthread_mutex_lock(&c->tcp_mutex);
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
+        key_map_remove(&c->public_key_list, conn->public_key, crypt_connection_id);
         conn->status = CRYPTO_CONN_NO_CONNECTION;
         return -1;
     }
@@ -2105,7 +3052,7 @@ static int tcp_data_callback(void *object, int crypt_connection_id, const uint8_
 {
     Net_Crypto *c = (Net_Crypto *)object;
 
-    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
+    if (length == 0 || length > MAX_CRYPTO_JUMBO_PACKET_SIZE) {
         return -1;
     }
 
@@ -2247,7 +3194,9 @@ unsigned int copy_connected_tcp_relays(Net_Crypto *c, Node_format *tcp_relays, u
 static void do_tcp(Net_Crypto *c, void *userdata)
 {
     pthread_mutex_lock(&c->tcp_mutex);
+    flush_tcp_send_queue(c);
     do_tcp_connections(c->tcp_c, userdata);
+    flush_tcp_send_queue(c);
     pthread_mutex_unlock(&c->tcp_mutex);
 
     uint32_t i;
@@ -2397,7 +3346,7 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
 {
     Net_Crypto *c = (Net_Crypto *)object;
 
-    if (length <= CRYPTO_MIN_PACKET_SIZE || length > MAX_CRYPTO_PACKET_SIZE) {
+    if (length <= CRYPTO_MIN_PACKET_SIZE || length > MAX_CRYPTO_JUMBO_PACKET_SIZE) {
         return 1;
     }
 
@@ -2437,24 +3386,6 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
     return 0;
 }
 
-/* The dT for the average packet receiving rate calculations.
-   Also used as the */
-#define PACKET_COUNTER_AVERAGE_INTERVAL 50
-
-/* Ratio of recv queue size / recv packet rate (in seconds) times
- * the number of ms between request packets to send at that ratio
- */
-#define REQUEST_PACKETS_COMPARE_CONSTANT (0.125 * 100.0)
-
-/* Timeout for increasing speed after congestion event (in ms). */
-#define CONGESTION_EVENT_TIMEOUT 1000
-
-/* If the send queue is SEND_QUEUE_RATIO times larger than the
- * calculated link speed the packet send speed will be reduced
- * by a value depending on this number.
- */
-#define SEND_QUEUE_RATIO 2.0
-
 static void send_crypto_packets(Net_Crypto *c)
 {
     const uint64_t temp_time = current_time_monotonic(c->mono_time);
@@ -2480,6 +3411,8 @@ static void send_crypto_packets(Net_Crypto *c)
         }
 
         if (conn->status == CRYPTO_CONN_ESTABLISHED) {
+            do_mtu_discovery(c, i, temp_time);
+
             if (conn->packet_recv_rate > CRYPTO_PACKET_MIN_RATE) {
                 double request_packet_interval = (REQUEST_PACKETS_COMPARE_CONSTANT / ((num_packets_array(
                                                       &conn->recv_array) + 1.0) / (conn->packet_recv_rate + 1.0)));
@@ -2517,90 +3450,23 @@ static void send_crypto_packets(Net_Crypto *c)
                 conn->packet_counter = 0;
                 conn->packet_counter_set = temp_time;
 
-                uint32_t packets_sent = conn->packets_sent;
-                conn->packets_sent = 0;
-
-                uint32_t packets_resent = conn->packets_resent;
-                conn->packets_resent = 0;
-
-                /* conjestion control
-                    calculate a new value of conn->packet_send_rate based on some data
-                 */
-
-                unsigned int pos = conn->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
-                conn->last_sendqueue_size[pos] = num_packets_array(&conn->send_array);
-                ++conn->last_sendqueue_counter;
-
-                long signed int sum = 0;
-                sum = (long signed int)conn->last_sendqueue_size[(pos) % CONGESTION_QUEUE_ARRAY_SIZE] -
-                      (long signed int)conn->last_sendqueue_size[(pos - (CONGESTION_QUEUE_ARRAY_SIZE - 1)) % CONGESTION_QUEUE_ARRAY_SIZE];
-
-                unsigned int n_p_pos = conn->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                conn->last_num_packets_sent[n_p_pos] = packets_sent;
-                conn->last_num_packets_resent[n_p_pos] = packets_resent;
-
                 bool direct_connected = 0;
                 crypto_connection_status(c, i, &direct_connected, nullptr);
 
-                /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
-                if (!(direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time)) {
-                    long signed int total_sent = 0, total_resent = 0;
-
-                    // TODO(irungentoo): use real delay
-                    unsigned int delay = (unsigned int)((conn->rtt_time / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
-                    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
-
-                    if (delay > packets_set_rem_array) {
-                        delay = packets_set_rem_array;
-                    }
-
-                    for (unsigned j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
-                        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                        total_sent += conn->last_num_packets_sent[ind];
-                        total_resent += conn->last_num_packets_resent[ind];
-                    }
-
-                    if (sum > 0) {
-                        total_sent -= sum;
-                    } else {
-                        if (total_resent > -sum) {
-                            total_resent = -sum;
-                        }
-                    }
-
-                    /* if queue is too big only allow resending packets. */
-                    uint32_t npackets = num_packets_array(&conn->send_array);
-                    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
-                                                 PACKET_COUNTER_AVERAGE_INTERVAL));
-
-                    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
-                            CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
-
-                    if (min_speed < CRYPTO_PACKET_MIN_RATE) {
-                        min_speed = CRYPTO_PACKET_MIN_RATE;
-                    }
-
-                    double send_array_ratio = (((double)npackets) / min_speed);
-
-                    // TODO(irungentoo): Improve formula?
-                    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
-                        conn->packet_send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
-                    } else if (conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < temp_time) {
-                        conn->packet_send_rate = min_speed * 1.2;
-                    } else {
-                        conn->packet_send_rate = min_speed * 0.9;
-                    }
-
-                    conn->packet_send_rate_requested = min_speed_request * 1.2;
-
-                    if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
-                        conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-                    }
+                const Congestion_Sample sample = {
+                    temp_time,
+                    dt,
+                    conn->packets_sent,
+                    conn->packets_resent,
+                    conn->packets_lost,
+                    num_packets_array(&conn->send_array),
+                    direct_connected,
+                };
+                conn->packets_sent = 0;
+                conn->packets_resent = 0;
+                conn->packets_lost = 0;
 
-                    if (conn->packet_send_rate_requested < conn->packet_send_rate) {
-                        conn->packet_send_rate_requested = conn->packet_send_rate;
-                    }
-                }
+                conn->congestion_update(conn, &sample);
             }
 
             if (conn->last_packets_left_set == 0 || conn->last_packets_left_requested_set == 0) {
@@ -2650,11 +3516,13 @@ static void send_crypto_packets(Net_Crypto *c)
             if (ret != -1) {
                 conn->packets_left_requested -= ret;
                 conn->packets_resent += ret;
+                conn->total_packets_resent += ret;
 
                 if ((unsigned int)ret < conn->packets_left) {
                     conn->packets_left -= ret;
                 } else {
                     conn->last_congestion_event = temp_time;
+                    ++conn->congestion_events;
                     conn->packets_left = 0;
                 }
             }
@@ -2745,6 +3613,10 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         return -1;
     }
 
+    if (length > crypto_connection_max_data_size(c, crypt_connection_id)) {
+        return -1;
+    }
+
     if (congestion_control && conn->packets_left == 0) {
         return -1;
     }
@@ -2759,11 +3631,23 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         --conn->packets_left;
         --conn->packets_left_requested;
         ++conn->packets_sent;
+        ++conn->total_packets_sent;
     }
 
     return ret;
 }
 
+uint16_t crypto_connection_max_data_size(const Net_Crypto *c, int crypt_connection_id)
+{
+    const Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return 0;
+    }
+
+    return conn->mtu_confirmed ? MAX_CRYPTO_JUMBO_DATA_SIZE : MAX_CRYPTO_DATA_SIZE;
+}
+
 /* Check if packet_number was received by the other side.
  *
  * packet_number must be a valid packet number of a packet sent on this connection.
@@ -2813,9 +3697,7 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         return -1;
     }
 
-    pthread_mutex_lock(&c->connections_mutex);
-    ++c->connection_use_counter;
-    pthread_mutex_unlock(&c->connections_mutex);
+    pthread_rwlock_rdlock(&c->connections_lock);
 
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
@@ -2829,9 +3711,7 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         ret = send_data_packet_helper(c, crypt_connection_id, buffer_start, buffer_end, data, length);
     }
 
-    pthread_mutex_lock(&c->connections_mutex);
-    --c->connection_use_counter;
-    pthread_mutex_unlock(&c->connections_mutex);
+    pthread_rwlock_unlock(&c->connections_lock);
 
     return ret;
 }
@@ -2843,15 +3723,7 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
  */
 int crypto_kill(Net_Crypto *c, int crypt_connection_id)
 {
-    while (1) { /* TODO(irungentoo): is this really the best way to do this? */
-        pthread_mutex_lock(&c->connections_mutex);
-
-        if (!c->connection_use_counter) {
-            break;
-        }
-
-        pthread_mutex_unlock(&c->connections_mutex);
-    }
+    pthread_rwlock_wrlock(&c->connections_lock);
 
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
@@ -2863,18 +3735,20 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id)
         }
 
         pthread_mutex_lock(&c->tcp_mutex);
+        clear_tcp_send_queue(c, conn->connection_number_tcp);
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
 
         bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
         bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
+        key_map_remove(&c->public_key_list, conn->public_key, crypt_connection_id);
         clear_temp_packet(c, crypt_connection_id);
-        clear_buffer(&conn->send_array);
-        clear_buffer(&conn->recv_array);
+        clear_buffer(&c->packet_pools, &conn->send_array);
+        clear_buffer(&c->packet_pools, &conn->recv_array);
         ret = wipe_crypto_connection(c, crypt_connection_id);
     }
 
-    pthread_mutex_unlock(&c->connections_mutex);
+    pthread_rwlock_unlock(&c->connections_lock);
 
     return ret;
 }
@@ -2914,6 +3788,40 @@ Crypto_Conn_State crypto_connection_status(const Net_Crypto *c, int crypt_connec
     return conn->status;
 }
 
+int crypto_connection_get_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats)
+{
+    const Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    bool direct_connected = 0;
+    unsigned int online_tcp_relays = 0;
+    crypto_connection_status(c, crypt_connection_id, &direct_connected, &online_tcp_relays);
+
+    if (direct_connected) {
+        const IP_Port ip_port = return_ip_port_connection(c, crypt_connection_id);
+        stats->path = net_family_is_ipv6(ip_port.ip.family) ? CRYPTO_PATH_UDP6 : CRYPTO_PATH_UDP4;
+    } else if (online_tcp_relays > 0) {
+        stats->path = CRYPTO_PATH_TCP;
+    } else {
+        stats->path = CRYPTO_PATH_NONE;
+    }
+
+    stats->online_tcp_relays = online_tcp_relays;
+    stats->rtt = conn->rtt_time;
+    stats->send_rate = conn->packet_send_rate;
+    stats->recv_rate = conn->packet_recv_rate;
+    stats->send_queue = num_packets_array(&conn->send_array);
+    stats->recv_queue = conn->recv_array.num_stored;
+    stats->packets_sent = conn->total_packets_sent;
+    stats->packets_resent = conn->total_packets_resent;
+    stats->packets_lost = conn->total_packets_lost;
+    stats->congestion_events = conn->congestion_events;
+    return 0;
+}
+
 void new_keys(Net_Crypto *c)
 {
     crypto_new_keypair(c->self_public_key, c->self_secret_key);
@@ -2957,9 +3865,15 @@ Net_Crypto *new_net_crypto(const Logger *log, Mono_Time *mono_time, DHT *dht, TC
     temp->log = log;
     temp->mono_time = mono_time;
 
+    if (!new_packet_pools(&temp->packet_pools)) {
+        free(temp);
+        return nullptr;
+    }
+
     temp->tcp_c = new_tcp_connections(mono_time, dht_get_self_secret_key(dht), proxy_info);
 
     if (temp->tcp_c == nullptr) {
+        kill_packet_pools(&temp->packet_pools);
         free(temp);
         return nullptr;
     }
@@ -2967,9 +3881,26 @@ Net_Crypto *new_net_crypto(const Logger *log, Mono_Time *mono_time, DHT *dht, TC
     set_packet_tcp_connection_callback(temp->tcp_c, &tcp_data_callback, temp);
     set_oob_packet_tcp_connection_callback(temp->tcp_c, &tcp_oob_callback, temp);
 
-    if (create_recursive_mutex(&temp->tcp_mutex) != 0 ||
-            pthread_mutex_init(&temp->connections_mutex, nullptr) != 0) {
+    if (create_recursive_mutex(&temp->tcp_mutex) != 0) {
+        kill_tcp_connections(temp->tcp_c);
+        kill_packet_pools(&temp->packet_pools);
+        free(temp);
+        return nullptr;
+    }
+
+    if (pthread_rwlock_init(&temp->connections_lock, nullptr) != 0) {
+        pthread_mutex_destroy(&temp->tcp_mutex);
+        kill_tcp_connections(temp->tcp_c);
+        kill_packet_pools(&temp->packet_pools);
+        free(temp);
+        return nullptr;
+    }
+
+    if (pthread_mutex_init(&temp->tcp_queue_mutex, nullptr) != 0) {
+        pthread_rwlock_destroy(&temp->connections_lock);
+        pthread_mutex_destroy(&temp->tcp_mutex);
         kill_tcp_connections(temp->tcp_c);
+        kill_packet_pools(&temp->packet_pools);
         free(temp);
         return nullptr;
     }
@@ -2987,6 +3918,7 @@ Net_Crypto *new_net_crypto(const Logger *log, Mono_Time *mono_time, DHT *dht, TC
     networking_registerhandler(dht_get_net(dht), NET_PACKET_CRYPTO_DATA, &udp_handle_packet, temp);
 
     bs_list_init(&temp->ip_port_list, sizeof(IP_Port), 8);
+    key_map_init(&temp->public_key_list, 8);
 
     return temp;
 }
@@ -3047,11 +3979,18 @@ void kill_net_crypto(Net_Crypto *c)
         crypto_kill(c, i);
     }
 
+    for (i = 0; i < c->tcp_send_queue_length; ++i) {
+        free(c->tcp_send_queue[i]);
+    }
+
     pthread_mutex_destroy(&c->tcp_mutex);
-    pthread_mutex_destroy(&c->connections_mutex);
+    pthread_rwlock_destroy(&c->connections_lock);
+    pthread_mutex_destroy(&c->tcp_queue_mutex);
 
     kill_tcp_connections(c->tcp_c);
+    kill_packet_pools(&c->packet_pools);
     bs_list_free(&c->ip_port_list);
+    key_map_free(&c->public_key_list);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_COOKIE_REQUEST, nullptr, nullptr);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_COOKIE_RESPONSE, nullptr, nullptr);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_CRYPTO_HS, nullptr, nullptr);
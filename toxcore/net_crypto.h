@@ -28,6 +28,7 @@
 #include "LAN_discovery.h"
 #include "TCP_connection.h"
 #include "logger.h"
+#include "mem_pool.h"
 
 #include <pthread.h>
 
@@ -61,6 +62,9 @@
 #define PACKET_ID_PADDING 0 // Denotes padding
 #define PACKET_ID_REQUEST 1 // Used to request unreceived packets
 #define PACKET_ID_KILL    2 // Used to kill connection
+#define PACKET_ID_REQUEST_SACK 3 // Selective acknowledgement form of PACKET_ID_REQUEST
+#define PACKET_ID_MTU_PROBE 4 // Padded to MAX_CRYPTO_JUMBO_PACKET_SIZE to test the direct path
+#define PACKET_ID_MTU_PROBE_ACK 5 // Sent in reply to a PACKET_ID_MTU_PROBE received over UDP
 
 #define PACKET_ID_ONLINE 24
 #define PACKET_ID_OFFLINE 25
@@ -94,6 +98,9 @@ typedef enum Crypto_Conn_State {
 /* Maximum size of receiving and sending packet buffers. */
 #define CRYPTO_PACKET_BUFFER_SIZE 32768 // Must be a power of 2
 
+/* Initial size of the packet buffers, which grow as needed. */
+#define CRYPTO_PACKET_BUFFER_MIN_SIZE 16 // Must be a power of 2
+
 /* Minimum packet rate per second. */
 #define CRYPTO_PACKET_MIN_RATE 4.0
 
@@ -108,6 +115,16 @@ typedef enum Crypto_Conn_State {
 /* Max size of data in packets */
 #define MAX_CRYPTO_DATA_SIZE (uint16_t)(MAX_CRYPTO_PACKET_SIZE - CRYPTO_DATA_PACKET_MIN_SIZE)
 
+/* Maximum total size of packets sent to a peer once path MTU discovery found
+ * that the direct path carries them without fragmentation. Bounded by
+ * MAX_UDP_PACKET_SIZE, which is what older peers receive, and by the size of
+ * a TCP relay packet so a connection can always fall back to TCP.
+ */
+#define MAX_CRYPTO_JUMBO_PACKET_SIZE (uint16_t)2000
+
+/* Max size of data in those packets. */
+#define MAX_CRYPTO_JUMBO_DATA_SIZE (uint16_t)(MAX_CRYPTO_JUMBO_PACKET_SIZE - CRYPTO_DATA_PACKET_MIN_SIZE)
+
 /* Interval in ms between sending cookie request/handshake packets. */
 #define CRYPTO_SEND_PACKET_INTERVAL 1000
 
@@ -129,10 +146,33 @@ typedef enum Crypto_Conn_State {
 #define CONGESTION_QUEUE_ARRAY_SIZE 12
 #define CONGESTION_LAST_SENT_ARRAY_SIZE (CONGESTION_QUEUE_ARRAY_SIZE * 2)
 
+/* Maximum number of freed packet buffers of each size each Net_Crypto keeps for reuse. */
+#define CRYPTO_PACKET_POOL_SIZE 1024
+
+/* Maximum number of packets sent from other threads that wait for do_net_crypto()
+ * to pass them to the TCP connections while it holds them. */
+#define CRYPTO_TCP_SEND_QUEUE_SIZE 256
+
+/* Number of path MTU probes in a row that may go unacknowledged before a direct
+ * path is taken not to carry jumbo packets. */
+#define CRYPTO_MTU_PROBES 3
+
+/* Interval in ms between path MTU probes, and between the probes that check
+ * that a path found to carry jumbo packets still does. */
+#define CRYPTO_MTU_PROBE_INTERVAL 2000
+#define CRYPTO_MTU_REPROBE_INTERVAL 30000
+
 /* Default connection ping in ms. */
 #define DEFAULT_PING_CONNECTION 1000
 #define DEFAULT_TCP_PING_CONNECTION 500
 
+typedef enum Crypto_Congestion_Control {
+    /* Estimates the link speed from the growth of the send queue. */
+    CRYPTO_CONGESTION_CONTROL_LEGACY,
+    /* CUBIC window growth with multiplicative decrease on loss. */
+    CRYPTO_CONGESTION_CONTROL_CUBIC,
+} Crypto_Congestion_Control;
+
 typedef struct Net_Crypto Net_Crypto;
 
 const uint8_t *nc_get_self_public_key(const Net_Crypto *c);
@@ -140,6 +180,17 @@ const uint8_t *nc_get_self_secret_key(const Net_Crypto *c);
 TCP_Connections *nc_get_tcp_c(const Net_Crypto *c);
 DHT *nc_get_dht(const Net_Crypto *c);
 
+/* Copy the counters of the allocators for the packets that wait in the send and
+ * receive buffers of all connections: small for packets of up to
+ * MAX_CRYPTO_DATA_SIZE bytes, jumbo for the bigger ones.
+ */
+void nc_get_packet_pool_stats(const Net_Crypto *c, Mem_Pool_Stats *small, Mem_Pool_Stats *jumbo);
+
+/* Set the congestion controller of the connections created after this call.
+ * Connections that already exist keep theirs.
+ */
+void nc_set_congestion_control(Net_Crypto *c, Crypto_Congestion_Control congestion_control);
+
 typedef struct New_Connection {
     IP_Port source;
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE]; /* The real public key of the peer. */
@@ -258,6 +309,19 @@ bool max_speed_reached(Net_Crypto *c, int crypt_connection_id);
 int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
                           uint8_t congestion_control);
 
+/* Return the size of the largest lossless packet that should currently be
+ * sent on the connection: MAX_CRYPTO_JUMBO_DATA_SIZE once the peer confirmed
+ * that its direct path carries packets of MAX_CRYPTO_JUMBO_PACKET_SIZE,
+ * MAX_CRYPTO_DATA_SIZE otherwise.
+ *
+ * write_cryptpacket() refuses longer lossless packets, so packets sized with an
+ * earlier return value have to be split again after a fallback. Packets that
+ * were queued before it are still sent at their size.
+ *
+ * return 0 if crypt_connection_id is invalid.
+ */
+uint16_t crypto_connection_max_data_size(const Net_Crypto *c, int crypt_connection_id);
+
 /* Check if packet_number was received by the other side.
  *
  * packet_number must be a valid packet number of a packet sent on this connection.
@@ -327,6 +391,35 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id);
 Crypto_Conn_State crypto_connection_status(const Net_Crypto *c, int crypt_connection_id, bool *direct_connected,
         unsigned int *online_tcp_relays);
 
+typedef enum Crypto_Path {
+    CRYPTO_PATH_NONE,
+    CRYPTO_PATH_UDP4,
+    CRYPTO_PATH_UDP6,
+    CRYPTO_PATH_TCP,
+} Crypto_Path;
+
+typedef struct Crypto_Connection_Stats {
+    Crypto_Path path;               /* Route packets currently take to the peer. */
+    unsigned int online_tcp_relays; /* TCP relays through which the peer is reachable. */
+    uint64_t rtt;                   /* Round trip time in ms. */
+    double send_rate;               /* Lossless packets per second we are allowed to send. */
+    double recv_rate;               /* Lossless packets per second received. */
+    uint32_t send_queue;            /* Sent lossless packets not acknowledged yet. */
+    uint32_t recv_queue;            /* Received packets waiting for a missing earlier one. */
+    uint64_t packets_sent;          /* Lossless packets sent. */
+    uint64_t packets_resent;        /* Lossless packets sent again because the peer requested them. */
+    uint64_t packets_lost;          /* Resent packets that were requested more than an RTT after sending. */
+    uint32_t congestion_events;     /* Times resends used up all of the send rate. */
+} Crypto_Connection_Stats;
+
+/* Fill stats with a snapshot of the transport statistics of the connection.
+ * The counters are totals since the connection was created.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int crypto_connection_get_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats);
+
 /* Generate our public and private keys.
  *  Only call this function the first time the program starts.
  */
@@ -39,6 +39,11 @@
 #define _XOPEN_SOURCE 700
 #endif
 
+// For recvmmsg() and sendmmsg() on Linux.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #if defined(_WIN32) && _WIN32_WINNT >= _WIN32_WINNT_WINXP
 #undef _WIN32_WINNT
 #define _WIN32_WINNT  0x501
@@ -89,6 +94,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #ifdef __sun
@@ -176,6 +182,7 @@ static int inet_pton(int family, const char *addrString, void *addrbuf)
 #endif
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -195,6 +202,10 @@ static int inet_pton(int family, const char *addrString, void *addrbuf)
 #endif
 #endif
 
+#if defined(__linux__)
+#define NET_USE_MMSG
+#endif
+
 #if TOX_INET6_ADDRSTRLEN < INET6_ADDRSTRLEN
 #error "TOX_INET6_ADDRSTRLEN should be greater or equal to INET6_ADDRSTRLEN (#INET6_ADDRSTRLEN)"
 #endif
@@ -448,6 +459,36 @@ typedef struct Packet_Handler {
     void *object;
 } Packet_Handler;
 
+#ifdef NET_USE_MMSG
+/* Preallocated buffers for receiving up to `size` datagrams per recvmmsg() call. */
+typedef struct Recv_Batch {
+    uint16_t size;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_storage *addrs;
+    uint8_t *data;
+} Recv_Batch;
+
+/* Outgoing datagrams coalesced until the next networking_flush() call. */
+typedef struct Send_Queue {
+    pthread_mutex_t mutex;
+    uint16_t size;
+    uint16_t count;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_storage *addrs;
+    IP_Port *ip_ports;
+    uint8_t *data;
+} Send_Queue;
+#endif
+
+/* Counters of networking_enable_stats(). They are locked because toxav sends
+ * lossy packets from its own threads. */
+typedef struct Net_Stats {
+    pthread_mutex_t mutex;
+    Net_Packet_Stats packets[256];
+} Net_Stats;
+
 struct Networking_Core {
     const Logger *log;
     Packet_Handler packethandlers[256];
@@ -456,6 +497,19 @@ struct Networking_Core {
     uint16_t port;
     /* Our UDP socket. */
     Socket sock;
+    /* Held for reading while a datagram is sent, and for writing while
+     * sendpacket_dont_fragment() changes the options of the socket or the
+     * send queue is replaced. */
+    pthread_rwlock_t send_lock;
+
+    uint16_t recv_batch_size;
+    uint16_t send_queue_size;
+#ifdef NET_USE_MMSG
+    Recv_Batch *recv_batch;
+    Send_Queue *send_queue;
+#endif
+
+    Net_Stats *stats;
 };
 
 Family net_family(const Networking_Core *net)
@@ -468,16 +522,23 @@ uint16_t net_port(const Networking_Core *net)
     return net->port;
 }
 
-/* Basic network functions:
- * Function to send packet(data) of length length to ip_port.
- */
-int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+Socket net_udp_socket(const Networking_Core *net)
 {
-    if (net_family_is_unspec(net->family)) { /* Socket not initialized */
-        LOGGER_ERROR(net->log, "attempted to send message of length %u on uninitialised socket", (unsigned)length);
-        return -1;
+    if (net_family_is_unspec(net->family)) {
+        return net_invalid_socket;
     }
 
+    return net->sock;
+}
+
+/* Fill addr with the destination address for ip_port on net's socket.
+ *
+ * return 0 on success.
+ * return -1 if the packet can't be sent to ip_port over this socket.
+ */
+static int ip_port_to_sockaddr(const Networking_Core *net, IP_Port ip_port, struct sockaddr_storage *addr,
+                               size_t *addrsize)
+{
     /* socket TOX_AF_INET, but target IP NOT: can't send */
     if (net_family_is_ipv4(net->family) && !net_family_is_ipv4(ip_port.ip.family)) {
         LOGGER_ERROR(net->log, "attempted to send message with network family %d (probably IPv6) on IPv4 socket",
@@ -500,21 +561,17 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
         ip_port.ip.ip.v6 = ip6;
     }
 
-    struct sockaddr_storage addr;
-
-    size_t addrsize;
-
     if (net_family_is_ipv4(ip_port.ip.family)) {
-        struct sockaddr_in *const addr4 = (struct sockaddr_in *)&addr;
+        struct sockaddr_in *const addr4 = (struct sockaddr_in *)addr;
 
-        addrsize = sizeof(struct sockaddr_in);
+        *addrsize = sizeof(struct sockaddr_in);
         addr4->sin_family = AF_INET;
         addr4->sin_port = ip_port.port;
         fill_addr4(ip_port.ip.ip.v4, &addr4->sin_addr);
     } else if (net_family_is_ipv6(ip_port.ip.family)) {
-        struct sockaddr_in6 *const addr6 = (struct sockaddr_in6 *)&addr;
+        struct sockaddr_in6 *const addr6 = (struct sockaddr_in6 *)addr;
 
-        addrsize = sizeof(struct sockaddr_in6);
+        *addrsize = sizeof(struct sockaddr_in6);
         addr6->sin6_family = AF_INET6;
         addr6->sin6_port = ip_port.port;
         fill_addr6(ip_port.ip.ip.v6, &addr6->sin6_addr);
@@ -526,46 +583,359 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
         return -1;
     }
 
-    const int res = sendto(net->sock.socket, (const char *)data, length, 0, (struct sockaddr *)&addr, addrsize);
+    return 0;
+}
+
+#ifdef NET_USE_MMSG
+static void kill_send_queue(Send_Queue *queue)
+{
+    if (queue == nullptr) {
+        return;
+    }
+
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue->data);
+    free(queue->ip_ports);
+    free(queue->addrs);
+    free(queue->iovs);
+    free(queue->msgs);
+    free(queue);
+}
+
+static Send_Queue *new_send_queue(uint16_t size)
+{
+    Send_Queue *queue = (Send_Queue *)calloc(1, sizeof(Send_Queue));
+
+    if (queue == nullptr) {
+        return nullptr;
+    }
+
+    if (pthread_mutex_init(&queue->mutex, nullptr) != 0) {
+        free(queue);
+        return nullptr;
+    }
+
+    queue->size = size;
+    queue->msgs = (struct mmsghdr *)calloc(size, sizeof(struct mmsghdr));
+    queue->iovs = (struct iovec *)calloc(size, sizeof(struct iovec));
+    queue->addrs = (struct sockaddr_storage *)calloc(size, sizeof(struct sockaddr_storage));
+    queue->ip_ports = (IP_Port *)calloc(size, sizeof(IP_Port));
+    queue->data = (uint8_t *)malloc((size_t)size * MAX_UDP_PACKET_SIZE);
+
+    if (queue->msgs == nullptr || queue->iovs == nullptr || queue->addrs == nullptr || queue->ip_ports == nullptr
+            || queue->data == nullptr) {
+        kill_send_queue(queue);
+        return nullptr;
+    }
+
+    for (uint16_t i = 0; i < size; ++i) {
+        queue->iovs[i].iov_base = queue->data + (size_t)i * MAX_UDP_PACKET_SIZE;
+        queue->msgs[i].msg_hdr.msg_name = &queue->addrs[i];
+        queue->msgs[i].msg_hdr.msg_iov = &queue->iovs[i];
+        queue->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return queue;
+}
+
+/* Send all queued datagrams. Must be called with queue->mutex held.
+ *
+ * A datagram that fails to send (e.g. because its destination is unreachable)
+ * is dropped and the rest are still sent, the same as a failed sendto() would
+ * only drop that one. Once the socket send buffer is full, all remaining
+ * datagrams are dropped.
+ */
+static void send_queue_flush_locked(const Networking_Core *net, Send_Queue *queue)
+{
+    uint16_t sent = 0;
+
+    while (sent < queue->count) {
+        const int res = sendmmsg(net->sock.socket, queue->msgs + sent, queue->count - sent, 0);
+
+        if (res < 0) {
+            const int error = net_error();
+
+            if (error == EINTR) {
+                continue;
+            }
+
+            if (error == EAGAIN || error == TOX_EWOULDBLOCK) {
+                break;
+            }
+
+            const struct iovec *const iov = &queue->iovs[sent];
+            loglogdata(net->log, "O=>", (const uint8_t *)iov->iov_base, iov->iov_len, queue->ip_ports[sent], -1);
+            ++sent;
+            continue;
+        }
+
+        if (res == 0) {
+            break;
+        }
+
+        for (int i = 0; i < res; ++i) {
+            const struct mmsghdr *const msg = &queue->msgs[sent + i];
+            loglogdata(net->log, "O=>", (const uint8_t *)msg->msg_hdr.msg_iov->iov_base, msg->msg_hdr.msg_iov->iov_len,
+                       queue->ip_ports[sent + i], msg->msg_len);
+        }
+
+        sent += res;
+    }
+
+    for (uint16_t i = sent; i < queue->count; ++i) {
+        const struct iovec *const iov = &queue->iovs[i];
+        loglogdata(net->log, "O=>", (const uint8_t *)iov->iov_base, iov->iov_len, queue->ip_ports[i], -1);
+    }
+
+    queue->count = 0;
+}
+
+static int send_queue_add(const Networking_Core *net, Send_Queue *queue, IP_Port ip_port,
+                          const struct sockaddr_storage *addr, size_t addrsize, const uint8_t *data, uint16_t length)
+{
+    if (length > MAX_UDP_PACKET_SIZE) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+
+    if (queue->count == queue->size) {
+        send_queue_flush_locked(net, queue);
+    }
+
+    const uint16_t i = queue->count;
+    memcpy(&queue->addrs[i], addr, addrsize);
+    queue->msgs[i].msg_hdr.msg_namelen = addrsize;
+    queue->msgs[i].msg_len = 0;
+    memcpy(queue->iovs[i].iov_base, data, length);
+    queue->iovs[i].iov_len = length;
+    queue->ip_ports[i] = ip_port;
+    ++queue->count;
+
+    pthread_mutex_unlock(&queue->mutex);
+
+    return length;
+}
+#endif
+
+static void count_sent(Net_Stats *stats, const uint8_t *data, int res)
+{
+    if (stats == nullptr || res <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&stats->mutex);
+    ++stats->packets[data[0]].packets_sent;
+    stats->packets[data[0]].bytes_sent += res;
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+static void count_recv(Net_Stats *stats, const uint8_t *data, uint32_t length)
+{
+    if (stats == nullptr || length == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&stats->mutex);
+    ++stats->packets[data[0]].packets_recv;
+    stats->packets[data[0]].bytes_recv += length;
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+bool networking_enable_stats(Networking_Core *net)
+{
+    if (net->stats != nullptr) {
+        return true;
+    }
+
+    Net_Stats *stats = (Net_Stats *)calloc(1, sizeof(Net_Stats));
+
+    if (stats == nullptr) {
+        return false;
+    }
+
+    if (pthread_mutex_init(&stats->mutex, nullptr) != 0) {
+        free(stats);
+        return false;
+    }
+
+    net->stats = stats;
+    return true;
+}
+
+bool networking_get_stats(const Networking_Core *net, Net_Packet_Stats stats[256])
+{
+    if (net->stats == nullptr) {
+        return false;
+    }
+
+    pthread_mutex_lock(&net->stats->mutex);
+    memcpy(stats, net->stats->packets, sizeof(net->stats->packets));
+    pthread_mutex_unlock(&net->stats->mutex);
+    return true;
+}
+
+/* Send a datagram, or queue it if the send queue is enabled. Must be called
+ * with net->send_lock held.
+ */
+static int sendpacket_locked(Networking_Core *net, IP_Port ip_port, const struct sockaddr_storage *addr,
+                             size_t addrsize, const uint8_t *data, uint16_t length)
+{
+#ifdef NET_USE_MMSG
+
+    if (net->send_queue != nullptr) {
+        const int res = send_queue_add(net, net->send_queue, ip_port, addr, addrsize, data, length);
+        count_sent(net->stats, data, res);
+        return res;
+    }
+
+#endif
+
+    const int res = sendto(net->sock.socket, (const char *)data, length, 0, (const struct sockaddr *)addr, addrsize);
 
     loglogdata(net->log, "O=>", data, length, ip_port, res);
+    count_sent(net->stats, data, res);
 
     return res;
 }
 
-/* Function to receive data
- *  ip and port of sender is put into ip_port.
- *  Packet data is put into data.
- *  Packet length is put into length.
+/* Send all queued datagrams. Must be called with net->send_lock held. */
+static void flush_send_queue(Networking_Core *net)
+{
+#ifdef NET_USE_MMSG
+    Send_Queue *const queue = net->send_queue;
+
+    if (queue == nullptr) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    send_queue_flush_locked(net, queue);
+    pthread_mutex_unlock(&queue->mutex);
+#endif
+}
+
+/* Basic network functions:
+ * Function to send packet(data) of length length to ip_port.
  */
-static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
 {
-    memset(ip_port, 0, sizeof(IP_Port));
+    if (net_family_is_unspec(net->family)) { /* Socket not initialized */
+        LOGGER_ERROR(net->log, "attempted to send message of length %u on uninitialised socket", (unsigned)length);
+        return -1;
+    }
+
     struct sockaddr_storage addr;
-#ifdef OS_WIN32
-    int addrlen = sizeof(addr);
+    size_t addrsize;
+
+    if (ip_port_to_sockaddr(net, ip_port, &addr, &addrsize) == -1) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&net->send_lock);
+    const int res = sendpacket_locked(net, ip_port, &addr, addrsize, data, length);
+    pthread_rwlock_unlock(&net->send_lock);
+
+    return res;
+}
+
+int sendpacket_dont_fragment(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+#if defined(IP_MTU_DISCOVER) && defined(IPV6_MTU_DISCOVER)
+
+    if (net_family_is_unspec(net->family)) {
+        return -1;
+    }
+
+    struct sockaddr_storage addr;
+    size_t addrsize;
+
+    if (ip_port_to_sockaddr(net, ip_port, &addr, &addrsize) == -1) {
+        return -1;
+    }
+
+    const bool ipv4 = net_family_is_ipv4(ip_port.ip.family);
+    const int level = ipv4 ? IPPROTO_IP : IPPROTO_IPV6;
+    const int name = ipv4 ? IP_MTU_DISCOVER : IPV6_MTU_DISCOVER;
+    const int mode = ipv4 ? IP_PMTUDISC_DO : IPV6_PMTUDISC_DO;
+    int old_mode;
+    socklen_t optsize = sizeof(old_mode);
+    int res = -1;
+
+    /* The option applies to the whole socket, so no other thread may send
+     * while it is changed for this one sendto(). Queued datagrams go out
+     * before that with the old setting. */
+    pthread_rwlock_wrlock(&net->send_lock);
+    flush_send_queue(net);
+
+    if (getsockopt(net->sock.socket, level, name, (char *)&old_mode, &optsize) == 0
+            && setsockopt(net->sock.socket, level, name, (const char *)&mode, sizeof(mode)) == 0) {
+        res = sendto(net->sock.socket, (const char *)data, length, 0, (struct sockaddr *)&addr, addrsize);
+        loglogdata(net->log, "O=>", data, length, ip_port, res);
+        count_sent(net->stats, data, res);
+
+        setsockopt(net->sock.socket, level, name, (const char *)&old_mode, sizeof(old_mode));
+    }
+
+    pthread_rwlock_unlock(&net->send_lock);
+    return res;
 #else
-    socklen_t addrlen = sizeof(addr);
+    return -1;
 #endif
-    *length = 0;
-    int fail_or_len = recvfrom(sock.socket, (char *) data, MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
+}
 
-    if (fail_or_len < 0) {
-        int error = net_error();
+bool networking_set_send_queue_size(Networking_Core *net, uint16_t queue_size)
+{
+    if (queue_size > MAX_SEND_QUEUE_SIZE) {
+        return false;
+    }
 
-        if (fail_or_len < 0 && error != TOX_EWOULDBLOCK) {
-            const char *strerror = net_new_strerror(error);
-            LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s", error, strerror);
-            net_kill_strerror(strerror);
-        }
+#ifdef NET_USE_MMSG
+    Send_Queue *queue = nullptr;
 
-        return -1; /* Nothing received. */
+    if (queue_size > 0) {
+        queue = new_send_queue(queue_size);
+
+        if (queue == nullptr) {
+            return false;
+        }
     }
 
-    *length = (uint32_t)fail_or_len;
+    /* Senders on other threads may be using the old queue. */
+    pthread_rwlock_wrlock(&net->send_lock);
+    flush_send_queue(net);
+    Send_Queue *const old_queue = net->send_queue;
+    net->send_queue = queue;
+    pthread_rwlock_unlock(&net->send_lock);
 
-    if (addr.ss_family == AF_INET) {
-        struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
+    kill_send_queue(old_queue);
+#endif
+
+    net->send_queue_size = queue_size;
+    return true;
+}
+
+uint16_t networking_send_queue_size(const Networking_Core *net)
+{
+    return net->send_queue_size;
+}
+
+void networking_flush(Networking_Core *net)
+{
+    pthread_rwlock_rdlock(&net->send_lock);
+    flush_send_queue(net);
+    pthread_rwlock_unlock(&net->send_lock);
+}
+
+/* Convert the sender address of a received packet into ip_port.
+ *
+ * return 0 on success.
+ * return -1 if the address family is not supported.
+ */
+static int ip_port_from_sockaddr(const struct sockaddr_storage *addr, IP_Port *ip_port)
+{
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *addr_in = (const struct sockaddr_in *)addr;
 
         const Family *const family = make_tox_family(addr_in->sin_family);
         assert(family != nullptr);
@@ -577,8 +947,8 @@ static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8
         ip_port->ip.family = *family;
         get_ip4(&ip_port->ip.ip.v4, &addr_in->sin_addr);
         ip_port->port = addr_in->sin_port;
-    } else if (addr.ss_family == AF_INET6) {
-        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)&addr;
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr_in6 = (const struct sockaddr_in6 *)addr;
         const Family *const family = make_tox_family(addr_in6->sin6_family);
         assert(family != nullptr);
 
@@ -598,6 +968,48 @@ static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8
         return -1;
     }
 
+    return 0;
+}
+
+static void log_receive_error(const Logger *log)
+{
+    const int error = net_error();
+
+    if (error != TOX_EWOULDBLOCK) {
+        const char *strerror = net_new_strerror(error);
+        LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s", error, strerror);
+        net_kill_strerror(strerror);
+    }
+}
+
+/* Function to receive data
+ *  ip and port of sender is put into ip_port.
+ *  Packet data is put into data.
+ *  Packet length is put into length.
+ */
+static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+{
+    memset(ip_port, 0, sizeof(IP_Port));
+    struct sockaddr_storage addr;
+#ifdef OS_WIN32
+    int addrlen = sizeof(addr);
+#else
+    socklen_t addrlen = sizeof(addr);
+#endif
+    *length = 0;
+    int fail_or_len = recvfrom(sock.socket, (char *) data, MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
+
+    if (fail_or_len < 0) {
+        log_receive_error(log);
+        return -1; /* Nothing received. */
+    }
+
+    *length = (uint32_t)fail_or_len;
+
+    if (ip_port_from_sockaddr(&addr, ip_port) == -1) {
+        return -1;
+    }
+
     loglogdata(log, "=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
 
     return 0;
@@ -609,6 +1021,153 @@ void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handl
     net->packethandlers[byte].object = object;
 }
 
+static void handle_packet(const Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint32_t length,
+                          void *userdata)
+{
+    if (length < 1) {
+        return;
+    }
+
+    if (!(net->packethandlers[data[0]].function)) {
+        LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
+        return;
+    }
+
+    net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+}
+
+#ifdef NET_USE_MMSG
+static void kill_recv_batch(Recv_Batch *batch)
+{
+    if (batch == nullptr) {
+        return;
+    }
+
+    free(batch->data);
+    free(batch->addrs);
+    free(batch->iovs);
+    free(batch->msgs);
+    free(batch);
+}
+
+static Recv_Batch *new_recv_batch(uint16_t size)
+{
+    Recv_Batch *batch = (Recv_Batch *)calloc(1, sizeof(Recv_Batch));
+
+    if (batch == nullptr) {
+        return nullptr;
+    }
+
+    batch->size = size;
+    batch->msgs = (struct mmsghdr *)calloc(size, sizeof(struct mmsghdr));
+    batch->iovs = (struct iovec *)calloc(size, sizeof(struct iovec));
+    batch->addrs = (struct sockaddr_storage *)calloc(size, sizeof(struct sockaddr_storage));
+    batch->data = (uint8_t *)malloc((size_t)size * MAX_UDP_PACKET_SIZE);
+
+    if (batch->msgs == nullptr || batch->iovs == nullptr || batch->addrs == nullptr || batch->data == nullptr) {
+        kill_recv_batch(batch);
+        return nullptr;
+    }
+
+    for (uint16_t i = 0; i < size; ++i) {
+        batch->iovs[i].iov_base = batch->data + (size_t)i * MAX_UDP_PACKET_SIZE;
+        batch->iovs[i].iov_len = MAX_UDP_PACKET_SIZE;
+    }
+
+    return batch;
+}
+
+/* Receive up to batch->size datagrams with a single recvmmsg() call.
+ *
+ * return number of datagrams received.
+ * return -1 if nothing was received.
+ */
+static int receivepackets_batch(const Logger *log, Socket sock, Recv_Batch *batch)
+{
+    for (uint16_t i = 0; i < batch->size; ++i) {
+        struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+        memset(hdr, 0, sizeof(struct msghdr));
+        hdr->msg_name = &batch->addrs[i];
+        hdr->msg_namelen = sizeof(struct sockaddr_storage);
+        hdr->msg_iov = &batch->iovs[i];
+        hdr->msg_iovlen = 1;
+        batch->msgs[i].msg_len = 0;
+    }
+
+    const int count = recvmmsg(sock.socket, batch->msgs, batch->size, 0, nullptr);
+
+    if (count <= 0) {
+        log_receive_error(log);
+        return -1;
+    }
+
+    return count;
+}
+
+static void networking_poll_batch(Networking_Core *net, void *userdata)
+{
+    Recv_Batch *const batch = net->recv_batch;
+    int count;
+
+    while ((count = receivepackets_batch(net->log, net->sock, batch)) != -1) {
+        for (int i = 0; i < count; ++i) {
+            const uint8_t *const data = (const uint8_t *)batch->iovs[i].iov_base;
+            const uint32_t length = batch->msgs[i].msg_len;
+            IP_Port ip_port;
+            memset(&ip_port, 0, sizeof(IP_Port));
+
+            if (ip_port_from_sockaddr(&batch->addrs[i], &ip_port) == -1) {
+                continue;
+            }
+
+            loglogdata(net->log, "=>O", data, MAX_UDP_PACKET_SIZE, ip_port, length);
+            count_recv(net->stats, data, length);
+
+            handle_packet(net, ip_port, data, length, userdata);
+        }
+
+        if (count < batch->size) {
+            /* Socket drained. */
+            break;
+        }
+    }
+}
+#endif
+
+bool networking_set_recv_batch_size(Networking_Core *net, uint16_t batch_size)
+{
+    if (batch_size > MAX_RECV_BATCH_SIZE) {
+        return false;
+    }
+
+    if (batch_size < 1) {
+        batch_size = 1;
+    }
+
+#ifdef NET_USE_MMSG
+    Recv_Batch *batch = nullptr;
+
+    if (batch_size > 1) {
+        batch = new_recv_batch(batch_size);
+
+        if (batch == nullptr) {
+            return false;
+        }
+    }
+
+    kill_recv_batch(net->recv_batch);
+    net->recv_batch = batch;
+#endif
+
+    net->recv_batch_size = batch_size;
+    return true;
+}
+
+uint16_t networking_recv_batch_size(const Networking_Core *net)
+{
+    return net->recv_batch_size;
+}
+
 void networking_poll(Networking_Core *net, void *userdata)
 {
     if (net_family_is_unspec(net->family)) {
@@ -616,24 +1175,31 @@ void networking_poll(Networking_Core *net, void *userdata)
         return;
     }
 
+#ifdef NET_USE_MMSG
+
+    if (net->recv_batch != nullptr) {
+        networking_poll_batch(net, userdata);
+        return;
+    }
+
+#endif
+
     IP_Port ip_port;
     uint8_t data[MAX_UDP_PACKET_SIZE];
     uint32_t length;
 
     while (receivepacket(net->log, net->sock, &ip_port, data, &length) != -1) {
-        if (length < 1) {
-            continue;
-        }
-
-        if (!(net->packethandlers[data[0]].function)) {
-            LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
-            continue;
-        }
-
-        net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+        count_recv(net->stats, data, length);
+        handle_packet(net, ip_port, data, length, userdata);
     }
 }
 
+void networking_handle_packet(const Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length,
+                              void *userdata)
+{
+    handle_packet(net, ip_port, data, length, userdata);
+}
+
 #ifndef VANILLA_NACL
 /* Used for sodium_init() */
 #include <sodium.h>
@@ -742,9 +1308,15 @@ Networking_Core *new_networking_ex(const Logger *log, IP ip, uint16_t port_from,
         return nullptr;
     }
 
+    if (pthread_rwlock_init(&temp->send_lock, nullptr) != 0) {
+        free(temp);
+        return nullptr;
+    }
+
     temp->log = log;
     temp->family = ip.family;
     temp->port = 0;
+    temp->recv_batch_size = 1;
 
     /* Initialize our socket. */
     /* add log message what we're creating */
@@ -756,6 +1328,7 @@ Networking_Core *new_networking_ex(const Logger *log, IP ip, uint16_t port_from,
         const char *strerror = net_new_strerror(neterror);
         LOGGER_ERROR(log, "Failed to get a socket?! %d, %s", neterror, strerror);
         net_kill_strerror(strerror);
+        pthread_rwlock_destroy(&temp->send_lock);
         free(temp);
 
         if (error) {
@@ -826,7 +1399,7 @@ Networking_Core *new_networking_ex(const Logger *log, IP ip, uint16_t port_from,
 
         portptr = &addr6->sin6_port;
     } else {
-        free(temp);
+        kill_networking(temp);
         return nullptr;
     }
 
@@ -927,7 +1500,13 @@ Networking_Core *new_networking_no_udp(const Logger *log)
         return nullptr;
     }
 
+    if (pthread_rwlock_init(&net->send_lock, nullptr) != 0) {
+        free(net);
+        return nullptr;
+    }
+
     net->log = log;
+    net->recv_batch_size = 1;
 
     return net;
 }
@@ -940,10 +1519,22 @@ void kill_networking(Networking_Core *net)
     }
 
     if (!net_family_is_unspec(net->family)) {
-        /* Socket is initialized, so we close it. */
+        /* Flush queued packets and close the socket. */
+        networking_flush(net);
         kill_sock(net->sock);
     }
 
+#ifdef NET_USE_MMSG
+    kill_send_queue(net->send_queue);
+    kill_recv_batch(net->recv_batch);
+#endif
+
+    if (net->stats != nullptr) {
+        pthread_mutex_destroy(&net->stats->mutex);
+        free(net->stats);
+    }
+
+    pthread_rwlock_destroy(&net->send_lock);
     free(net);
 }
 
@@ -1435,11 +2026,53 @@ int net_send(Socket sock, const void *buf, size_t len)
     return send(sock.socket, (const char *)buf, len, MSG_NOSIGNAL);
 }
 
+int net_send_buffers(Socket sock, const Net_Buffer *buffers, uint16_t count)
+{
+#ifdef OS_WIN32
+    int total = 0;
+
+    for (uint16_t i = 0; i < count; ++i) {
+        const int len = net_send(sock, buffers[i].data, buffers[i].length);
+
+        if (len <= 0) {
+            return total > 0 ? total : len;
+        }
+
+        total += len;
+
+        if ((size_t)len != buffers[i].length) {
+            break;
+        }
+    }
+
+    return total;
+#else
+    VLA(struct iovec, iov, count);
+
+    for (uint16_t i = 0; i < count; ++i) {
+        iov[i].iov_base = (void *)buffers[i].data;
+        iov[i].iov_len = buffers[i].length;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    return sendmsg(sock.socket, &msg, MSG_NOSIGNAL);
+#endif
+}
+
 int net_recv(Socket sock, void *buf, size_t len)
 {
     return recv(sock.socket, (char *)buf, len, MSG_NOSIGNAL);
 }
 
+int net_peek(Socket sock, void *buf, size_t len)
+{
+    return recv(sock.socket, (char *)buf, len, MSG_PEEK | MSG_NOSIGNAL);
+}
+
 int net_listen(Socket sock, int backlog)
 {
     return listen(sock.socket, backlog);
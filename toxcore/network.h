@@ -77,10 +77,29 @@ extern const Socket net_invalid_socket;
  * Calls send(sockfd, buf, len, MSG_NOSIGNAL).
  */
 int net_send(Socket sock, const void *buf, size_t len);
+typedef struct Net_Buffer {
+    const uint8_t *data;
+    size_t length;
+} Net_Buffer;
+
+/**
+ * Sends the buffers back to back, like a net_send() of their concatenation,
+ * with a single sendmsg(sockfd, msg, MSG_NOSIGNAL) call. On Windows they are
+ * sent with one net_send() each, stopping at the first one that is not sent
+ * completely.
+ *
+ * @return the number of bytes sent, or the net_send() error if nothing was sent.
+ */
+int net_send_buffers(Socket sock, const Net_Buffer *buffers, uint16_t count);
 /**
  * Calls recv(sockfd, buf, len, MSG_NOSIGNAL).
  */
 int net_recv(Socket sock, void *buf, size_t len);
+/**
+ * Calls recv(sockfd, buf, len, MSG_PEEK | MSG_NOSIGNAL), which leaves the data
+ * in the socket for the next net_recv().
+ */
+int net_peek(Socket sock, void *buf, size_t len);
 /**
  * Calls listen(sockfd, backlog).
  */
@@ -338,6 +357,12 @@ typedef struct Networking_Core Networking_Core;
 Family net_family(const Networking_Core *net);
 uint16_t net_port(const Networking_Core *net);
 
+/* Return the UDP socket, e.g. to wait for it to become readable in an event
+ * loop before calling networking_poll(). The socket is invalid when UDP is
+ * disabled.
+ */
+Socket net_udp_socket(const Networking_Core *net);
+
 /* Run this before creating sockets.
  *
  * return 0 on success
@@ -382,12 +407,95 @@ bool set_socket_dualstack(Socket sock);
 /* Function to send packet(data) of length length to ip_port. */
 int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
 
+/* Like sendpacket(), but the datagram is sent right away with the don't
+ * fragment bit set, and sending fails instead of fragmenting it locally if it
+ * is larger than the known path MTU. Used to probe whether larger datagrams
+ * reach ip_port unfragmented.
+ *
+ * return -1 on failure or if the platform does not support it.
+ */
+int sendpacket_dont_fragment(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
+
+/* Maximum number of datagrams held in the send queue between flushes. */
+#define MAX_SEND_QUEUE_SIZE 256
+
+/**
+ * Enable coalescing of outgoing datagrams. With a queue size greater than 0,
+ * sendpacket() copies each datagram into the queue and networking_flush()
+ * sends the whole queue with sendmmsg(). A full queue is flushed before the
+ * next datagram is added. A queue size of 0 (the default) sends every
+ * datagram immediately. On platforms without sendmmsg() this is a no-op.
+ *
+ * Datagrams from threads other than the one calling networking_flush() also
+ * wait for its next call, which delays them by up to one iteration.
+ *
+ * Datagrams queued so far are sent before the queue is replaced. Other threads
+ * may keep sending while this runs.
+ *
+ * @return true on success, false if queue_size exceeds MAX_SEND_QUEUE_SIZE
+ *   or the queue could not be allocated.
+ */
+bool networking_set_send_queue_size(Networking_Core *net, uint16_t queue_size);
+uint16_t networking_send_queue_size(const Networking_Core *net);
+
+/* Send all datagrams queued by sendpacket(). Call this at the end of every
+ * iteration when the send queue is enabled.
+ */
+void networking_flush(Networking_Core *net);
+
 /* Function to call when packet beginning with byte is received. */
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_cb *cb, void *object);
 
+/* Maximum number of datagrams received per system call in batched receive mode. */
+#define MAX_RECV_BATCH_SIZE 256
+
+/**
+ * Set the number of datagrams networking_poll() drains from the UDP socket
+ * per system call. A value of 1 (the default) receives one datagram at a
+ * time. Larger values use recvmmsg() where available and fall back to
+ * one datagram at a time elsewhere.
+ *
+ * @return true on success, false if batch_size exceeds MAX_RECV_BATCH_SIZE
+ *   or the receive buffers could not be allocated.
+ */
+bool networking_set_recv_batch_size(Networking_Core *net, uint16_t batch_size);
+uint16_t networking_recv_batch_size(const Networking_Core *net);
+
+typedef struct Net_Packet_Stats {
+    uint64_t packets_recv;
+    uint64_t bytes_recv;
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+} Net_Packet_Stats;
+
+/**
+ * Start counting the datagrams and bytes received by networking_poll() and
+ * sent by sendpacket(), per packet type (the first byte of the datagram).
+ * Counting is off by default. Datagrams from the send queue that the socket
+ * refuses still count as sent.
+ *
+ * @return true on success, false if the counters could not be allocated.
+ */
+bool networking_enable_stats(Networking_Core *net);
+
+/**
+ * Copy the counters of all 256 packet types into stats, indexed by packet
+ * type. May be called from any thread.
+ *
+ * @return false if counting is not enabled.
+ */
+bool networking_get_stats(const Networking_Core *net, Net_Packet_Stats stats[256]);
+
 /* Call this several times a second. */
 void networking_poll(Networking_Core *net, void *userdata);
 
+/* Run the handler registered for data[0] on a packet as if networking_poll()
+ * had just received it from ip_port, e.g. to resume a packet that had to wait
+ * for something.
+ */
+void networking_handle_packet(const Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length,
+                              void *userdata);
+
 /* Connect a socket to the address specified by the ip_port. */
 int net_connect(Socket sock, IP_Port ip_port);
 
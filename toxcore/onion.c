@@ -355,7 +355,7 @@ static int handle_send_initial(void *object, IP_Port source, const uint8_t *pack
     return onion_send_1(onion, plain, len, source, packet + 1);
 }
 
-int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port source, const uint8_t *nonce)
+int onion_send_1(Onion *onion, const uint8_t *plain, uint16_t len, IP_Port source, const uint8_t *nonce)
 {
     if (len > ONION_MAX_PACKET_SIZE + SIZE_IPPORT - (1 + CRYPTO_NONCE_SIZE + ONION_RETURN_1)) {
         return 1;
@@ -394,6 +394,7 @@ int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port
         return 1;
     }
 
+    ++onion->stats.relayed_requests;
     return 0;
 }
 
@@ -451,6 +452,7 @@ static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, ui
         return 1;
     }
 
+    ++onion->stats.relayed_requests;
     return 0;
 }
 
@@ -515,6 +517,7 @@ static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, ui
         return 1;
     }
 
+    ++onion->stats.relayed_requests;
     return 0;
 }
 
@@ -562,6 +565,7 @@ static int handle_recv_3(void *object, IP_Port source, const uint8_t *packet, ui
         return 1;
     }
 
+    ++onion->stats.relayed_responses;
     return 0;
 }
 
@@ -608,6 +612,7 @@ static int handle_recv_2(void *object, IP_Port source, const uint8_t *packet, ui
         return 1;
     }
 
+    ++onion->stats.relayed_responses;
     return 0;
 }
 
@@ -649,13 +654,19 @@ static int handle_recv_1(void *object, IP_Port source, const uint8_t *packet, ui
     if (onion->recv_1_function &&
             !net_family_is_ipv4(send_to.ip.family) &&
             !net_family_is_ipv6(send_to.ip.family)) {
-        return onion->recv_1_function(onion->callback_object, send_to, packet + (1 + RETURN_1), data_len);
+        if (onion->recv_1_function(onion->callback_object, send_to, packet + (1 + RETURN_1), data_len) != 0) {
+            return 1;
+        }
+
+        ++onion->stats.relayed_responses;
+        return 0;
     }
 
     if ((uint32_t)sendpacket(onion->net, send_to, packet + (1 + RETURN_1), data_len) != data_len) {
         return 1;
     }
 
+    ++onion->stats.relayed_responses;
     return 0;
 }
 
@@ -665,6 +676,18 @@ void set_callback_handle_recv_1(Onion *onion, onion_recv_1_cb *function, void *o
     onion->callback_object = object;
 }
 
+void onion_get_stats(const Onion *onion, Onion_Stats *stats)
+{
+    *stats = onion->stats;
+}
+
+void onion_get_shared_keys_stats(const Onion *onion, Shared_Keys_Stats stats[3])
+{
+    stats[0] = onion->shared_keys_1.stats;
+    stats[1] = onion->shared_keys_2.stats;
+    stats[2] = onion->shared_keys_3.stats;
+}
+
 Onion *new_onion(Mono_Time *mono_time, DHT *dht)
 {
     if (dht == nullptr) {
@@ -683,6 +706,16 @@ Onion *new_onion(Mono_Time *mono_time, DHT *dht)
     new_symmetric_key(onion->secret_symmetric_key);
     onion->timestamp = mono_time_get(onion->mono_time);
 
+    if (!shared_keys_init(&onion->shared_keys_1, SHARED_KEYS_DEFAULT_CAPACITY)
+            || !shared_keys_init(&onion->shared_keys_2, SHARED_KEYS_DEFAULT_CAPACITY)
+            || !shared_keys_init(&onion->shared_keys_3, SHARED_KEYS_DEFAULT_CAPACITY)) {
+        shared_keys_free(&onion->shared_keys_1);
+        shared_keys_free(&onion->shared_keys_2);
+        shared_keys_free(&onion->shared_keys_3);
+        free(onion);
+        return nullptr;
+    }
+
     networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_INITIAL, &handle_send_initial, onion);
     networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_1, &handle_send_1, onion);
     networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_2, &handle_send_2, onion);
@@ -708,5 +741,8 @@ void kill_onion(Onion *onion)
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_2, nullptr, nullptr);
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_1, nullptr, nullptr);
 
+    shared_keys_free(&onion->shared_keys_1);
+    shared_keys_free(&onion->shared_keys_2);
+    shared_keys_free(&onion->shared_keys_3);
     free(onion);
 }
@@ -29,6 +29,11 @@
 
 typedef int onion_recv_1_cb(void *object, IP_Port dest, const uint8_t *data, uint16_t length);
 
+typedef struct Onion_Stats {
+    uint64_t relayed_requests;  /* Onion packets passed on towards their destination. */
+    uint64_t relayed_responses; /* Onion responses passed back along their path. */
+} Onion_Stats;
+
 typedef struct Onion {
     Mono_Time *mono_time;
     DHT *dht;
@@ -42,6 +47,8 @@ typedef struct Onion {
 
     onion_recv_1_cb *recv_1_function;
     void *callback_object;
+
+    Onion_Stats stats;
 } Onion;
 
 #define ONION_MAX_PACKET_SIZE 1400
@@ -152,7 +159,7 @@ int send_onion_response(Networking_Core *net, IP_Port dest, const uint8_t *data,
  * Source family must be set to something else than TOX_AF_INET6 or TOX_AF_INET so that the callback gets called
  * when the response is received.
  */
-int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port source, const uint8_t *nonce);
+int onion_send_1(Onion *onion, const uint8_t *plain, uint16_t len, IP_Port source, const uint8_t *nonce);
 
 /* Set the callback to be called when the dest ip_port doesn't have TOX_AF_INET6 or TOX_AF_INET as the family.
  *
@@ -160,6 +167,14 @@ int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port
  */
 void set_callback_handle_recv_1(Onion *onion, onion_recv_1_cb *function, void *object);
 
+/* Copy the relay counters of the onion into stats. */
+void onion_get_stats(const Onion *onion, Onion_Stats *stats);
+
+/* Copy the hit, miss and eviction counters of the shared key caches of the
+ * three onion layers into stats, first layer first.
+ */
+void onion_get_shared_keys_stats(const Onion *onion, Shared_Keys_Stats stats[3]);
+
 Onion *new_onion(Mono_Time *mono_time, DHT *dht);
 
 void kill_onion(Onion *onion);
@@ -247,6 +247,24 @@ static void generate_ping_id(const Onion_Announce *onion_a, uint64_t time, const
     crypto_sha256(ping_id, data, sizeof(data));
 }
 
+uint32_t onion_announce_num_entries(const Onion_Announce *onion_a)
+{
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
+        if (!mono_time_is_timeout(onion_a->mono_time, onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)) {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+void onion_announce_get_shared_keys_stats(const Onion_Announce *onion_a, Shared_Keys_Stats *stats)
+{
+    *stats = onion_a->shared_keys_recv.stats;
+}
+
 /* check if public key is in entries list
  *
  * return -1 if no
@@ -516,6 +534,11 @@ Onion_Announce *new_onion_announce(Mono_Time *mono_time, DHT *dht)
     onion_a->net = dht_get_net(dht);
     new_symmetric_key(onion_a->secret_bytes);
 
+    if (!shared_keys_init(&onion_a->shared_keys_recv, SHARED_KEYS_DEFAULT_CAPACITY)) {
+        free(onion_a);
+        return nullptr;
+    }
+
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, &handle_announce_request, onion_a);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, &handle_data_request, onion_a);
 
@@ -530,5 +553,6 @@ void kill_onion_announce(Onion_Announce *onion_a)
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, nullptr, nullptr);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, nullptr, nullptr);
+    shared_keys_free(&onion_a->shared_keys_recv);
     free(onion_a);
 }
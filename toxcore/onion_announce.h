@@ -119,6 +119,15 @@ int send_announce_request(Networking_Core *net, const Onion_Path *path, Node_for
 int send_data_request(Networking_Core *net, const Onion_Path *path, IP_Port dest, const uint8_t *public_key,
                       const uint8_t *encrypt_public_key, const uint8_t *nonce, const uint8_t *data, uint16_t length);
 
+/* return the number of announced public keys that didn't time out yet, out of
+ * at most ONION_ANNOUNCE_MAX_ENTRIES.
+ */
+uint32_t onion_announce_num_entries(const Onion_Announce *onion_a);
+
+/* Copy the hit, miss and eviction counters of the shared key cache for
+ * received announce and data requests into stats.
+ */
+void onion_announce_get_shared_keys_stats(const Onion_Announce *onion_a, Shared_Keys_Stats *stats);
 
 Onion_Announce *new_onion_announce(Mono_Time *mono_time, DHT *dht);
 
@@ -156,7 +156,10 @@ static int handle_ping_request(void *object, IP_Port source, const uint8_t *pack
 
     uint8_t ping_plain[PING_PLAIN_SIZE];
     // Decrypt ping_id
-    dht_get_shared_key_recv(dht, shared_key, packet + 1);
+    if (!dht_get_shared_key_recv_or_park(dht, shared_key, source, packet, length)) {
+        return 0;
+    }
+
     rc = decrypt_data_symmetric(shared_key,
                                 packet + 1 + CRYPTO_PUBLIC_KEY_SIZE,
                                 packet + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE,
@@ -198,7 +201,9 @@ static int handle_ping_response(void *object, IP_Port source, const uint8_t *pac
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
 
     // generate key to encrypt ping_id with recipient privkey
-    dht_get_shared_key_sent(ping->dht, shared_key, packet + 1);
+    if (!dht_get_shared_key_sent_or_park(dht, shared_key, source, packet, length)) {
+        return 0;
+    }
 
     uint8_t ping_plain[PING_PLAIN_SIZE];
     // Decrypt ping_id
@@ -0,0 +1,378 @@
+/*
+ * Worker threads that compute Curve25519 shared keys off the network thread.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "precompute_pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crypto_core.h"
+#include "key_map.h"
+
+/* A packet parked until the shared key for its sender is known. */
+typedef struct Precompute_Packet {
+    struct Precompute_Packet *next;
+    precompute_done_cb *callback;
+    void *object;
+    IP_Port source;
+    uint16_t length;
+    uint8_t data[];
+} Precompute_Packet;
+
+typedef struct Precompute_Job {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+
+    /* Only touched by the thread that submits and dispatches jobs, so packets
+     * can be added while a worker computes the key. */
+    Precompute_Packet *first;
+    Precompute_Packet *last;
+    uint32_t slot;
+
+    struct Precompute_Job *next;
+} Precompute_Job;
+
+typedef struct Precompute_Queue {
+    Precompute_Job *first;
+    Precompute_Job *last;
+} Precompute_Queue;
+
+struct Precompute_Pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /* Jobs waiting for a worker, and jobs waiting to be dispatched. */
+    Precompute_Queue todo;
+    Precompute_Queue done;
+    uint32_t num_packets;
+    uint32_t max_packets;
+
+    /* Jobs that were not dispatched yet by public key, as index into slots.
+     * Only touched by the thread that submits and dispatches jobs. */
+    Key_Map jobs;
+    Precompute_Job **slots;
+    uint32_t *free_slots;
+    uint32_t num_free_slots;
+
+    bool stop;
+    pthread_t *threads;
+    uint32_t num_threads;
+};
+
+static void queue_push(Precompute_Queue *queue, Precompute_Job *job)
+{
+    job->next = nullptr;
+
+    if (queue->last == nullptr) {
+        queue->first = job;
+    } else {
+        queue->last->next = job;
+    }
+
+    queue->last = job;
+}
+
+static Precompute_Job *queue_pop(Precompute_Queue *queue)
+{
+    Precompute_Job *job = queue->first;
+
+    if (job == nullptr) {
+        return nullptr;
+    }
+
+    queue->first = job->next;
+
+    if (queue->first == nullptr) {
+        queue->last = nullptr;
+    }
+
+    return job;
+}
+
+static void free_job(Precompute_Job *job)
+{
+    Precompute_Packet *packet = job->first;
+
+    while (packet != nullptr) {
+        Precompute_Packet *next = packet->next;
+        free(packet);
+        packet = next;
+    }
+
+    crypto_memzero(job->secret_key, sizeof(job->secret_key));
+    crypto_memzero(job->shared_key, sizeof(job->shared_key));
+    free(job);
+}
+
+static void free_queue(Precompute_Queue *queue)
+{
+    Precompute_Job *job;
+
+    while ((job = queue_pop(queue)) != nullptr) {
+        free_job(job);
+    }
+}
+
+static void *precompute_thread(void *arg)
+{
+    Precompute_Pool *pool = (Precompute_Pool *)arg;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (!pool->stop) {
+        Precompute_Job *job = queue_pop(&pool->todo);
+
+        if (job == nullptr) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+        encrypt_precompute(job->public_key, job->secret_key, job->shared_key);
+        crypto_memzero(job->secret_key, sizeof(job->secret_key));
+        pthread_mutex_lock(&pool->mutex);
+
+        queue_push(&pool->done, job);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return nullptr;
+}
+
+static void stop_threads(Precompute_Pool *pool, uint32_t num_threads)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        pthread_join(pool->threads[i], nullptr);
+    }
+}
+
+static void free_pool(Precompute_Pool *pool)
+{
+    key_map_free(&pool->jobs);
+    free(pool->free_slots);
+    free(pool->slots);
+    free(pool->threads);
+    free(pool);
+}
+
+Precompute_Pool *precompute_pool_new(uint32_t num_threads, uint32_t max_packets)
+{
+    if (num_threads == 0 || num_threads > MAX_PRECOMPUTE_THREADS || max_packets == 0) {
+        return nullptr;
+    }
+
+    Precompute_Pool *pool = (Precompute_Pool *)calloc(1, sizeof(Precompute_Pool));
+
+    if (pool == nullptr) {
+        return nullptr;
+    }
+
+    pool->threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+    pool->slots = (Precompute_Job **)calloc(max_packets, sizeof(Precompute_Job *));
+    pool->free_slots = (uint32_t *)calloc(max_packets, sizeof(uint32_t));
+
+    if (pool->threads == nullptr || pool->slots == nullptr || pool->free_slots == nullptr
+            || !key_map_init(&pool->jobs, 0)) {
+        free_pool(pool);
+        return nullptr;
+    }
+
+    for (uint32_t i = 0; i < max_packets; ++i) {
+        pool->free_slots[i] = max_packets - 1 - i;
+    }
+
+    pool->num_free_slots = max_packets;
+
+    if (pthread_mutex_init(&pool->mutex, nullptr) != 0) {
+        free_pool(pool);
+        return nullptr;
+    }
+
+    if (pthread_cond_init(&pool->cond, nullptr) != 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        free_pool(pool);
+        return nullptr;
+    }
+
+    pool->max_packets = max_packets;
+
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        if (pthread_create(&pool->threads[i], nullptr, precompute_thread, pool) != 0) {
+            stop_threads(pool, i);
+            pthread_cond_destroy(&pool->cond);
+            pthread_mutex_destroy(&pool->mutex);
+            free_pool(pool);
+            return nullptr;
+        }
+    }
+
+    pool->num_threads = num_threads;
+    return pool;
+}
+
+void precompute_pool_kill(Precompute_Pool *pool)
+{
+    if (pool == nullptr) {
+        return;
+    }
+
+    stop_threads(pool, pool->num_threads);
+
+    free_queue(&pool->todo);
+    free_queue(&pool->done);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free_pool(pool);
+}
+
+int precompute_pool_submit(Precompute_Pool *pool, const uint8_t *public_key, const uint8_t *secret_key,
+                           IP_Port source, const uint8_t *data, uint16_t length,
+                           precompute_done_cb *callback, void *object)
+{
+    pthread_mutex_lock(&pool->mutex);
+    const bool full = pool->num_packets >= pool->max_packets;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (full) {
+        return -1;
+    }
+
+    Precompute_Packet *packet = (Precompute_Packet *)malloc(sizeof(Precompute_Packet) + length);
+
+    if (packet == nullptr) {
+        return -1;
+    }
+
+    packet->next = nullptr;
+    packet->callback = callback;
+    packet->object = object;
+    packet->source = source;
+    packet->length = length;
+
+    if (length > 0) {
+        memcpy(packet->data, data, length);
+    }
+
+    const int slot = key_map_find(&pool->jobs, public_key);
+
+    if (slot != -1) {
+        Precompute_Job *const job = pool->slots[slot];
+        job->last->next = packet;
+        job->last = packet;
+
+        pthread_mutex_lock(&pool->mutex);
+        ++pool->num_packets;
+        pthread_mutex_unlock(&pool->mutex);
+        return 0;
+    }
+
+    Precompute_Job *job = (Precompute_Job *)calloc(1, sizeof(Precompute_Job));
+
+    if (job == nullptr) {
+        free(packet);
+        return -1;
+    }
+
+    /* There are never more jobs than packets, so a slot is always free. */
+    job->slot = pool->free_slots[pool->num_free_slots - 1];
+
+    if (!key_map_add(&pool->jobs, public_key, job->slot)) {
+        free(packet);
+        free(job);
+        return -1;
+    }
+
+    --pool->num_free_slots;
+    pool->slots[job->slot] = job;
+
+    memcpy(job->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(job->secret_key, secret_key, CRYPTO_SECRET_KEY_SIZE);
+    job->first = packet;
+    job->last = packet;
+
+    pthread_mutex_lock(&pool->mutex);
+    queue_push(&pool->todo, job);
+    ++pool->num_packets;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return 1;
+}
+
+uint32_t precompute_pool_dispatch(Precompute_Pool *pool, void *userdata)
+{
+    pthread_mutex_lock(&pool->mutex);
+    Precompute_Job *job = pool->done.first;
+    pool->done.first = nullptr;
+    pool->done.last = nullptr;
+    pthread_mutex_unlock(&pool->mutex);
+
+    uint32_t count = 0;
+
+    while (job != nullptr) {
+        Precompute_Job *next = job->next;
+
+        /* Removed first, so that packets the callbacks submit get a new job. */
+        key_map_remove(&pool->jobs, job->public_key, job->slot);
+        pool->slots[job->slot] = nullptr;
+        pool->free_slots[pool->num_free_slots] = job->slot;
+        ++pool->num_free_slots;
+
+        for (const Precompute_Packet *packet = job->first; packet != nullptr; packet = packet->next) {
+            packet->callback(packet->object, job->public_key, job->shared_key, packet->source, packet->data,
+                             packet->length, userdata);
+            ++count;
+        }
+
+        free_job(job);
+
+        job = next;
+    }
+
+    if (count > 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->num_packets -= count;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return count;
+}
+
+uint32_t precompute_pool_packets(Precompute_Pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    const uint32_t num_packets = pool->num_packets;
+    pthread_mutex_unlock(&pool->mutex);
+    return num_packets;
+}
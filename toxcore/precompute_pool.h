@@ -0,0 +1,96 @@
+/*
+ * Worker threads that compute Curve25519 shared keys off the network thread.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_PRECOMPUTE_POOL_H
+#define C_TOXCORE_TOXCORE_PRECOMPUTE_POOL_H
+
+#include "network.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAX_PRECOMPUTE_THREADS 64
+
+typedef struct Precompute_Pool Precompute_Pool;
+
+/* Called by precompute_pool_dispatch() on the thread that calls it, once the
+ * shared key between public_key and the secret key of the job is known. data is
+ * the packet that was parked with the job.
+ */
+typedef void precompute_done_cb(void *object, const uint8_t *public_key, const uint8_t *shared_key,
+                                IP_Port source, const uint8_t *data, uint16_t length, void *userdata);
+
+/* Jobs are submitted and dispatched by one thread, usually the one running
+ * networking_poll(). Only the key computations run on the worker threads.
+ *
+ * There is at most one job per public key: packets from a peer whose key is
+ * still being computed are parked with the job that is already there.
+ */
+
+/* Start num_threads worker threads. At most max_packets packets can be parked
+ * with jobs that were not dispatched yet at any time.
+ *
+ * return NULL on failure.
+ */
+Precompute_Pool *precompute_pool_new(uint32_t num_threads, uint32_t max_packets);
+
+/* Stop the worker threads and free the pool. Jobs that were not dispatched
+ * yet are dropped without calling their callback.
+ */
+void precompute_pool_kill(Precompute_Pool *pool);
+
+/* Queue the computation of the shared key between public_key and secret_key.
+ * The packet in data is copied and handed back to callback along with the
+ * key.
+ *
+ * If a job for public_key is queued already, the packet is added to it
+ * instead, and the key is computed only once. All jobs for the same public
+ * key must use the same secret key.
+ *
+ * return 1 if a new job was queued.
+ * return 0 if the packet was added to the job queued for public_key.
+ * return -1 if the pool is full or out of memory. The caller should then
+ *   drop the packet rather than compute the key itself, so that a flood of
+ *   new peers can't stall the network thread.
+ */
+int precompute_pool_submit(Precompute_Pool *pool, const uint8_t *public_key, const uint8_t *secret_key,
+                           IP_Port source, const uint8_t *data, uint16_t length,
+                           precompute_done_cb *callback, void *object);
+
+/* Call the callbacks of all finished jobs, once for every packet parked with
+ * them.
+ *
+ * return the number of callbacks called.
+ */
+uint32_t precompute_pool_dispatch(Precompute_Pool *pool, void *userdata);
+
+/* return the number of packets parked with jobs that are queued, running or
+ * waiting to be dispatched.
+ */
+uint32_t precompute_pool_packets(Precompute_Pool *pool);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_PRECOMPUTE_POOL_H
@@ -0,0 +1,155 @@
+#include "precompute_pool.h"
+
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "crypto_core.h"
+#include "network.h"
+
+namespace {
+
+struct Precompute_Pool_Deleter {
+  void operator()(Precompute_Pool *pool) { precompute_pool_kill(pool); }
+};
+
+using Precompute_Pool_Ptr = std::unique_ptr<Precompute_Pool, Precompute_Pool_Deleter>;
+
+struct Result {
+  std::vector<uint8_t> public_key;
+  std::vector<uint8_t> shared_key;
+  std::vector<uint8_t> data;
+};
+
+void collect_result(void *object, const uint8_t *public_key, const uint8_t *shared_key,
+                    IP_Port /*source*/, const uint8_t *data, uint16_t length, void * /*userdata*/) {
+  auto *results = static_cast<std::vector<Result> *>(object);
+  results->push_back({
+      std::vector<uint8_t>(public_key, public_key + CRYPTO_PUBLIC_KEY_SIZE),
+      std::vector<uint8_t>(shared_key, shared_key + CRYPTO_SHARED_KEY_SIZE),
+      std::vector<uint8_t>(data, data + length),
+  });
+}
+
+IP_Port test_source() {
+  IP_Port source;
+  ip_init(&source.ip, false);
+  source.port = net_htons(33445);
+  return source;
+}
+
+void dispatch_all(Precompute_Pool *pool) {
+  for (int i = 0; i < 1000 && precompute_pool_packets(pool) > 0; ++i) {
+    precompute_pool_dispatch(pool, nullptr);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+TEST(PrecomputePool, NeedsThreadsAndJobs) {
+  EXPECT_EQ(precompute_pool_new(0, 1), nullptr);
+  EXPECT_EQ(precompute_pool_new(1, 0), nullptr);
+  EXPECT_EQ(precompute_pool_new(MAX_PRECOMPUTE_THREADS + 1, 1), nullptr);
+  EXPECT_NE(Precompute_Pool_Ptr(precompute_pool_new(1, 1)), nullptr);
+}
+
+TEST(PrecomputePool, ComputesTheSameKeyAsEncryptPrecompute) {
+  Precompute_Pool_Ptr const pool(precompute_pool_new(2, 16));
+  ASSERT_NE(pool, nullptr);
+
+  uint8_t self_pk[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t self_sk[CRYPTO_SECRET_KEY_SIZE];
+  crypto_new_keypair(self_pk, self_sk);
+
+  std::vector<Result> results;
+  std::vector<std::vector<uint8_t>> pks;
+
+  for (uint8_t i = 0; i < 8; ++i) {
+    uint8_t pk[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t sk[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(pk, sk);
+    pks.emplace_back(pk, pk + sizeof(pk));
+
+    uint8_t const packet[] = {i, 1, 2, 3};
+    IP_Port const source = test_source();
+    EXPECT_EQ(precompute_pool_submit(pool.get(), pk, self_sk, source, packet, sizeof(packet),
+                                     collect_result, &results), 1);
+  }
+
+  dispatch_all(pool.get());
+  ASSERT_EQ(results.size(), pks.size());
+  EXPECT_EQ(precompute_pool_packets(pool.get()), 0u);
+
+  for (Result const &result : results) {
+    uint8_t expected[CRYPTO_SHARED_KEY_SIZE];
+    encrypt_precompute(result.public_key.data(), self_sk, expected);
+    EXPECT_EQ(result.shared_key, std::vector<uint8_t>(expected, expected + sizeof(expected)));
+
+    ASSERT_EQ(result.data.size(), 4u);
+    EXPECT_EQ(result.public_key, pks[result.data[0]]);
+  }
+}
+
+TEST(PrecomputePool, RejectsPacketsWhenFull) {
+  Precompute_Pool_Ptr const pool(precompute_pool_new(1, 2));
+  ASSERT_NE(pool, nullptr);
+
+  uint8_t pk1[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t pk2[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t pk3[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t sk[CRYPTO_SECRET_KEY_SIZE];
+  crypto_new_keypair(pk1, sk);
+  crypto_new_keypair(pk2, sk);
+  crypto_new_keypair(pk3, sk);
+
+  std::vector<Result> results;
+  IP_Port const source = test_source();
+  EXPECT_EQ(precompute_pool_submit(pool.get(), pk1, sk, source, nullptr, 0, collect_result, &results), 1);
+  EXPECT_EQ(precompute_pool_submit(pool.get(), pk2, sk, source, nullptr, 0, collect_result, &results), 1);
+  EXPECT_EQ(precompute_pool_submit(pool.get(), pk3, sk, source, nullptr, 0, collect_result, &results), -1);
+
+  dispatch_all(pool.get());
+  EXPECT_EQ(results.size(), 2u);
+  EXPECT_EQ(precompute_pool_submit(pool.get(), pk3, sk, source, nullptr, 0, collect_result, &results), 1);
+}
+
+TEST(PrecomputePool, ParksPacketsFromOnePeerWithOneJob) {
+  Precompute_Pool_Ptr const pool(precompute_pool_new(1, 8));
+  ASSERT_NE(pool, nullptr);
+
+  uint8_t self_pk[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t self_sk[CRYPTO_SECRET_KEY_SIZE];
+  crypto_new_keypair(self_pk, self_sk);
+
+  uint8_t pk[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t sk[CRYPTO_SECRET_KEY_SIZE];
+  crypto_new_keypair(pk, sk);
+
+  std::vector<Result> results;
+  IP_Port const source = test_source();
+
+  for (uint8_t i = 0; i < 4; ++i) {
+    uint8_t const packet[] = {i};
+    EXPECT_EQ(precompute_pool_submit(pool.get(), pk, self_sk, source, packet, sizeof(packet),
+                                     collect_result, &results), i == 0 ? 1 : 0);
+  }
+
+  EXPECT_EQ(precompute_pool_packets(pool.get()), 4u);
+
+  dispatch_all(pool.get());
+  ASSERT_EQ(results.size(), 4u);
+
+  uint8_t expected[CRYPTO_SHARED_KEY_SIZE];
+  encrypt_precompute(pk, self_sk, expected);
+
+  for (uint8_t i = 0; i < 4; ++i) {
+    EXPECT_EQ(results[i].shared_key, std::vector<uint8_t>(expected, expected + sizeof(expected)));
+    EXPECT_EQ(results[i].data, std::vector<uint8_t>{i});
+  }
+
+  // Once dispatched, the next packet from the peer starts a new job.
+  EXPECT_EQ(precompute_pool_submit(pool.get(), pk, self_sk, source, nullptr, 0, collect_result, &results), 1);
+}
+
+}  // namespace
@@ -0,0 +1,259 @@
+/*
+ * Selective acknowledgement lists: a compact encoding of which packets of a
+ * window have been received and which are missing.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sack.h"
+
+#include <string.h>
+
+#include "ccompat.h"
+
+/* A uint32_t takes at most this many bytes as a varint. */
+#define MAX_VARINT_SIZE 5
+
+static uint16_t varint_size(uint32_t value)
+{
+    uint16_t size = 1;
+
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+
+    return size;
+}
+
+/* return false if the varint does not fit in the length bytes of data after pos. */
+static bool write_varint(uint8_t *data, uint16_t length, uint16_t *pos, uint32_t value)
+{
+    if (length - *pos < varint_size(value)) {
+        return false;
+    }
+
+    while (value >= 0x80) {
+        data[*pos] = (uint8_t)(value | 0x80);
+        value >>= 7;
+        ++*pos;
+    }
+
+    data[*pos] = (uint8_t)value;
+    ++*pos;
+    return true;
+}
+
+/* return false if there is no valid varint in data after pos. */
+static bool read_varint(const uint8_t *data, uint16_t length, uint16_t *pos, uint32_t *value)
+{
+    uint64_t result = 0;
+
+    for (uint32_t i = 0; i < MAX_VARINT_SIZE; ++i) {
+        if (*pos >= length) {
+            return false;
+        }
+
+        const uint8_t byte = data[*pos];
+        ++*pos;
+        result |= (uint64_t)(byte & 0x7f) << (7 * i);
+
+        if (!(byte & 0x80)) {
+            if (result > UINT32_MAX) {
+                return false;
+            }
+
+            *value = (uint32_t)result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static uint16_t encode_runs(uint8_t *data, uint16_t length, uint32_t num, sack_received_cb *received,
+                            const void *object, uint32_t *covered)
+{
+    uint16_t pos = 0;
+    data[pos] = SACK_RUNS;
+    ++pos;
+
+    *covered = 0;
+    bool missing = false;
+    uint32_t run = 0;
+
+    for (uint32_t i = 0; i < num; ++i) {
+        const bool packet_missing = !received(object, i);
+
+        if (packet_missing != missing) {
+            if (!write_varint(data, length, &pos, run)) {
+                return pos;
+            }
+
+            *covered += run;
+            run = 0;
+            missing = packet_missing;
+        }
+
+        ++run;
+    }
+
+    if (run > 0 && write_varint(data, length, &pos, run)) {
+        *covered += run;
+    }
+
+    return pos;
+}
+
+/* The largest number of packets a bitmap list of length bytes can describe. */
+static uint32_t bitmap_capacity(uint16_t length, uint32_t num)
+{
+    const uint16_t header = 1 + varint_size(num);
+
+    if (length <= header) {
+        return 0;
+    }
+
+    const uint32_t max_bits = (uint32_t)(length - header) * 8;
+    return num < max_bits ? num : max_bits;
+}
+
+static uint16_t encode_bitmap(uint8_t *data, uint16_t length, uint32_t num, sack_received_cb *received,
+                              const void *object, uint32_t *covered)
+{
+    uint16_t pos = 0;
+    data[pos] = SACK_BITMAP;
+    ++pos;
+
+    const uint32_t count = bitmap_capacity(length, num);
+    write_varint(data, length, &pos, count);
+
+    const uint16_t bitmap_length = count / 8 + (count % 8 != 0);
+    memset(data + pos, 0, bitmap_length);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!received(object, i)) {
+            data[pos + i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    *covered = count;
+    return pos + bitmap_length;
+}
+
+int sack_encode(uint8_t *data, uint16_t length, uint32_t num, sack_received_cb *received, const void *object,
+                uint32_t *covered)
+{
+    if (length < SACK_MIN_LENGTH) {
+        return -1;
+    }
+
+    const uint16_t runs_length = encode_runs(data, length, num, received, object, covered);
+
+    if (*covered == num || bitmap_capacity(length, num) <= *covered) {
+        return runs_length;
+    }
+
+    return encode_bitmap(data, length, num, received, object, covered);
+}
+
+static int64_t decode_runs(const uint8_t *data, uint16_t length, sack_run_cb *run, void *object)
+{
+    uint16_t pos = 1;
+    uint64_t start = 0;
+    bool missing = false;
+
+    while (pos < length) {
+        uint32_t count;
+
+        if (!read_varint(data, length, &pos, &count)) {
+            return -1;
+        }
+
+        if (start + count > UINT32_MAX) {
+            return -1;
+        }
+
+        if (count > 0) {
+            run(object, (uint32_t)start, count, missing);
+        }
+
+        start += count;
+        missing = !missing;
+    }
+
+    return start;
+}
+
+static bool bitmap_get(const uint8_t *bitmap, uint32_t index)
+{
+    return (bitmap[index / 8] >> (index % 8)) & 1;
+}
+
+static int64_t decode_bitmap(const uint8_t *data, uint16_t length, sack_run_cb *run, void *object)
+{
+    uint16_t pos = 1;
+    uint32_t count;
+
+    if (!read_varint(data, length, &pos, &count)) {
+        return -1;
+    }
+
+    if ((uint32_t)(length - pos) != count / 8 + (count % 8 != 0)) {
+        return -1;
+    }
+
+    const uint8_t *bitmap = data + pos;
+    uint32_t start = 0;
+
+    while (start < count) {
+        const bool missing = bitmap_get(bitmap, start);
+        uint32_t end = start + 1;
+
+        while (end < count && bitmap_get(bitmap, end) == missing) {
+            ++end;
+        }
+
+        run(object, start, end - start, missing);
+        start = end;
+    }
+
+    return count;
+}
+
+int64_t sack_decode(const uint8_t *data, uint16_t length, sack_run_cb *run, void *object)
+{
+    if (length == 0) {
+        return -1;
+    }
+
+    switch (data[0]) {
+        case SACK_RUNS:
+            return decode_runs(data, length, run, object);
+
+        case SACK_BITMAP:
+            return decode_bitmap(data, length, run, object);
+    }
+
+    return -1;
+}
@@ -0,0 +1,85 @@
+/*
+ * Selective acknowledgement lists: a compact encoding of which packets of a
+ * window have been received and which are missing.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_SACK_H
+#define C_TOXCORE_TOXCORE_SACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The first byte of an encoded list says how the rest is laid out:
+ *
+ * SACK_RUNS: the lengths of alternating runs of received and missing
+ *   packets, starting with a (possibly empty) run of received packets. Each
+ *   length is a little endian base 128 varint. Suited to bursts of loss.
+ *
+ * SACK_BITMAP: a varint number of packets followed by one bit per packet,
+ *   least significant bit first, set if the packet is missing. Suited to
+ *   scattered loss.
+ *
+ * The encoder picks whichever describes more of the window.
+ */
+typedef enum Sack_Format {
+    SACK_RUNS = 0,
+    SACK_BITMAP = 1,
+} Sack_Format;
+
+/* Shortest buffer sack_encode() can write to. */
+#define SACK_MIN_LENGTH 2
+
+/* return true if the packet at index of the window was received. */
+typedef bool sack_received_cb(const void *object, uint32_t index);
+
+/* Called by sack_decode() for each run of count packets starting at index
+ * start of the window that were all received or all missing.
+ */
+typedef void sack_run_cb(void *object, uint32_t start, uint32_t count, bool missing);
+
+/* Encode the state of the num packets at the start of a window into data of
+ * length. If the whole window does not fit, the list describes as much of its
+ * beginning as possible and covered is set to the number of packets described.
+ *
+ * return -1 if length is smaller than SACK_MIN_LENGTH.
+ * return the length of the encoded list on success.
+ */
+int sack_encode(uint8_t *data, uint16_t length, uint32_t num, sack_received_cb *received, const void *object,
+                uint32_t *covered);
+
+/* Decode a list made by sack_encode() and call run for each run of packets
+ * in it, in order. If the list turns out to be malformed, run may already have
+ * been called for the runs before the error.
+ *
+ * return -1 if the list is malformed.
+ * return the number of packets described by the list on success.
+ */
+int64_t sack_decode(const uint8_t *data, uint16_t length, sack_run_cb *run, void *object);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_SACK_H
@@ -0,0 +1,102 @@
+#include "sack.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+namespace {
+
+using Window = std::vector<bool>;  // true if the packet is missing.
+
+bool is_received(const void *object, uint32_t index) {
+  return !(*static_cast<const Window *>(object))[index];
+}
+
+void collect_run(void *object, uint32_t start, uint32_t count, bool missing) {
+  Window *window = static_cast<Window *>(object);
+  EXPECT_EQ(window->size(), start);
+  window->insert(window->end(), count, missing);
+}
+
+Window round_trip(const Window &window, uint16_t length, uint32_t *covered, uint8_t *format = nullptr) {
+  std::vector<uint8_t> data(length);
+  const int encoded = sack_encode(data.data(), length, window.size(), is_received, &window, covered);
+  EXPECT_GE(encoded, 1);
+  EXPECT_LE(encoded, length);
+
+  if (format != nullptr) {
+    *format = data[0];
+  }
+
+  Window decoded;
+  EXPECT_EQ(sack_decode(data.data(), encoded, collect_run, &decoded), *covered);
+  return decoded;
+}
+
+TEST(Sack, NeedsRoomForTheFormat) {
+  uint8_t data[1];
+  uint32_t covered;
+  const Window window(10);
+  EXPECT_EQ(sack_encode(data, sizeof(data), window.size(), is_received, &window, &covered), -1);
+}
+
+TEST(Sack, EncodesBurstsAsRuns) {
+  Window window(30000, false);
+
+  for (uint32_t i = 1000; i < 3000; ++i) {
+    window[i] = true;
+  }
+
+  uint32_t covered;
+  uint8_t format;
+  EXPECT_EQ(round_trip(window, 16, &covered, &format), window);
+  EXPECT_EQ(covered, window.size());
+  EXPECT_EQ(format, SACK_RUNS);
+}
+
+TEST(Sack, EncodesScatteredLossAsBitmap) {
+  Window window(8000, false);
+
+  for (uint32_t i = 0; i < window.size(); i += 3) {
+    window[i] = true;
+  }
+
+  uint32_t covered;
+  uint8_t format;
+  EXPECT_EQ(round_trip(window, 1200, &covered, &format), window);
+  EXPECT_EQ(covered, window.size());
+  EXPECT_EQ(format, SACK_BITMAP);
+}
+
+TEST(Sack, DescribesThePrefixThatFits) {
+  Window window(40000, false);
+
+  for (uint32_t i = 0; i < window.size(); i += 2) {
+    window[i] = true;
+  }
+
+  uint32_t covered;
+  const Window decoded = round_trip(window, 100, &covered);
+  EXPECT_GT(covered, 0);
+  EXPECT_LT(covered, window.size());
+  EXPECT_EQ(decoded, Window(window.begin(), window.begin() + covered));
+}
+
+TEST(Sack, RejectsMalformedLists) {
+  Window decoded;
+  const uint8_t unknown_format[] = {7, 1};
+  EXPECT_EQ(sack_decode(unknown_format, sizeof(unknown_format), collect_run, &decoded), -1);
+
+  const uint8_t truncated_varint[] = {SACK_RUNS, 0x80};
+  EXPECT_EQ(sack_decode(truncated_varint, sizeof(truncated_varint), collect_run, &decoded), -1);
+
+  const uint8_t short_bitmap[] = {SACK_BITMAP, 20, 0xff};
+  EXPECT_EQ(sack_decode(short_bitmap, sizeof(short_bitmap), collect_run, &decoded), -1);
+
+  const uint8_t too_big[] = {SACK_RUNS, 0xff, 0xff, 0xff, 0xff, 0x1f};
+  EXPECT_EQ(sack_decode(too_big, sizeof(too_big), collect_run, &decoded), -1);
+
+  EXPECT_TRUE(decoded.empty());
+}
+
+}  // namespace
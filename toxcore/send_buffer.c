@@ -0,0 +1,213 @@
+/*
+ * Queue of bytes waiting to be written to a stream socket.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "send_buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccompat.h"
+
+void send_buffer_init(Send_Buffer *buf, uint32_t max_length)
+{
+    memset(buf, 0, sizeof(Send_Buffer));
+    buf->max_length = max_length;
+}
+
+void send_buffer_free(Send_Buffer *buf)
+{
+    free(buf->data);
+    buf->data = nullptr;
+    buf->size = 0;
+    buf->start = 0;
+    buf->length = 0;
+    buf->drain_peak = 0;
+    buf->low_drains = 0;
+}
+
+uint32_t send_buffer_length(const Send_Buffer *buf)
+{
+    return buf->length;
+}
+
+uint32_t send_buffer_space(const Send_Buffer *buf)
+{
+    return buf->max_length - buf->length;
+}
+
+uint16_t send_buffer_parts(const Send_Buffer *buf, Net_Buffer parts[2])
+{
+    if (buf->length == 0) {
+        return 0;
+    }
+
+    const uint32_t tail = buf->size - buf->start;
+
+    parts[0].data = buf->data + buf->start;
+
+    if (buf->length <= tail) {
+        parts[0].length = buf->length;
+        return 1;
+    }
+
+    parts[0].length = tail;
+    parts[1].data = buf->data;
+    parts[1].length = buf->length - tail;
+    return 2;
+}
+
+/* Move the queue into a new block of at least min_size bytes, unwrapping it
+ * to the start of the block.
+ */
+static bool send_buffer_grow(Send_Buffer *buf, uint32_t min_size)
+{
+    uint32_t size = buf->size != 0 ? buf->size : SEND_BUFFER_MIN_SIZE;
+
+    while (size < min_size && size <= UINT32_MAX / 2) {
+        size *= 2;
+    }
+
+    if (size > buf->max_length) {
+        size = buf->max_length;
+    }
+
+    uint8_t *data = (uint8_t *)malloc(size);
+
+    if (data == nullptr) {
+        return false;
+    }
+
+    Net_Buffer parts[2];
+    const uint16_t count = send_buffer_parts(buf, parts);
+    uint32_t offset = 0;
+
+    for (uint16_t i = 0; i < count; ++i) {
+        memcpy(data + offset, parts[i].data, parts[i].length);
+        offset += parts[i].length;
+    }
+
+    free(buf->data);
+    buf->data = data;
+    buf->size = size;
+    buf->start = 0;
+    return true;
+}
+
+bool send_buffer_add(Send_Buffer *buf, const uint8_t *data, uint32_t length)
+{
+    if (length > send_buffer_space(buf)) {
+        ++buf->refused;
+        return false;
+    }
+
+    if (length == 0) {
+        return true;
+    }
+
+    if (buf->length + length > buf->size && !send_buffer_grow(buf, buf->length + length)) {
+        return false;
+    }
+
+    uint32_t end = buf->start + buf->length;
+
+    if (end >= buf->size) {
+        end -= buf->size;
+    }
+
+    const uint32_t tail = buf->size - end;
+
+    if (length <= tail) {
+        memcpy(buf->data + end, data, length);
+    } else {
+        memcpy(buf->data + end, data, tail);
+        memcpy(buf->data, data + tail, length - tail);
+    }
+
+    buf->length += length;
+
+    if (buf->length > buf->drain_peak) {
+        buf->drain_peak = buf->length;
+    }
+
+    if (buf->length > buf->peak_length) {
+        buf->peak_length = buf->length;
+    }
+
+    return true;
+}
+
+void send_buffer_consume(Send_Buffer *buf, uint32_t length)
+{
+    if (length >= buf->length) {
+        buf->start = 0;
+        buf->length = 0;
+
+        /* A slow consumer made the buffer grow. Keep the block while the
+         * queue still fills a good part of it, so a busy connection doesn't
+         * reallocate on every drain, but don't hold that much memory for
+         * the rest of the connection once the burst is over. */
+        if (buf->size > SEND_BUFFER_MIN_SIZE && buf->drain_peak <= buf->size / 4) {
+            ++buf->low_drains;
+        } else {
+            buf->low_drains = 0;
+        }
+
+        buf->drain_peak = 0;
+
+        if (buf->low_drains >= SEND_BUFFER_SHRINK_DRAINS) {
+            send_buffer_free(buf);
+        }
+
+        return;
+    }
+
+    buf->start += length;
+
+    if (buf->start >= buf->size) {
+        buf->start -= buf->size;
+    }
+
+    buf->length -= length;
+}
+
+bool send_buffer_flush(Send_Buffer *buf, Socket sock)
+{
+    Net_Buffer parts[2];
+    const uint16_t count = send_buffer_parts(buf, parts);
+
+    if (count == 0) {
+        return true;
+    }
+
+    const int len = net_send_buffers(sock, parts, count);
+
+    if (len <= 0) {
+        return false;
+    }
+
+    send_buffer_consume(buf, len);
+    return buf->length == 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Queue of bytes waiting to be written to a stream socket.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_SEND_BUFFER_H
+#define C_TOXCORE_TOXCORE_SEND_BUFFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "network.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Size of the first allocation, and the size a drained buffer shrinks back to. */
+#define SEND_BUFFER_MIN_SIZE 4096
+
+/* A grown buffer is only shrunk after this many drains in a row during which
+ * it never got more than a quarter full.
+ */
+#define SEND_BUFFER_SHRINK_DRAINS 16
+
+/* The queued bytes live in one contiguous block used as a ring, so queueing a
+ * packet is a copy instead of an allocation, and everything queued is written
+ * with a single send call. The block is allocated on first use and doubles in
+ * size as needed, but never holds more than max_length bytes.
+ *
+ * The struct is meant to be embedded in a connection. An all zero struct is an
+ * empty buffer that refuses everything; use send_buffer_init() to set a cap.
+ */
+typedef struct Send_Buffer {
+    uint8_t *data;
+    uint32_t size;        /* Allocated bytes in data. */
+    uint32_t start;       /* Offset of the first queued byte. */
+    uint32_t length;      /* Queued bytes, possibly wrapping around the end of data. */
+    uint32_t max_length;  /* Adding bytes beyond this fails. */
+
+    uint32_t peak_length; /* Highest length so far. */
+    uint32_t drain_peak;  /* Highest length since the queue was last empty. */
+    uint32_t low_drains;  /* Drains in a row with drain_peak at most a quarter of size. */
+    uint64_t refused;     /* send_buffer_add() calls that failed because of max_length. */
+} Send_Buffer;
+
+void send_buffer_init(Send_Buffer *buf, uint32_t max_length);
+
+/* Drop all queued bytes and free the memory. The cap and counters are kept. */
+void send_buffer_free(Send_Buffer *buf);
+
+uint32_t send_buffer_length(const Send_Buffer *buf);
+
+/* return the number of bytes that can still be added. */
+uint32_t send_buffer_space(const Send_Buffer *buf);
+
+/* Append length bytes to the end of the queue.
+ *
+ * return false if they do not fit under the cap or memory allocation failed.
+ * Nothing is queued in that case.
+ */
+bool send_buffer_add(Send_Buffer *buf, const uint8_t *data, uint32_t length);
+
+/* Fill parts with the queued bytes in order, at most two since the queue may
+ * wrap around.
+ *
+ * return the number of parts used, 0 if the queue is empty.
+ */
+uint16_t send_buffer_parts(const Send_Buffer *buf, Net_Buffer parts[2]);
+
+/* Remove length bytes from the front of the queue. A grown block is kept when
+ * the queue drains, and only given back after SEND_BUFFER_SHRINK_DRAINS drains
+ * that used little of it.
+ */
+void send_buffer_consume(Send_Buffer *buf, uint32_t length);
+
+/* Send as much of the queue as the socket takes with one net_send_buffers().
+ *
+ * return true if the queue is empty afterwards.
+ */
+bool send_buffer_flush(Send_Buffer *buf, Socket sock);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_SEND_BUFFER_H
@@ -0,0 +1,163 @@
+#include "send_buffer.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+std::vector<uint8_t> make_bytes(uint32_t length, uint8_t first) {
+  std::vector<uint8_t> bytes(length);
+
+  for (uint32_t i = 0; i < length; ++i) {
+    bytes[i] = static_cast<uint8_t>(first + i);
+  }
+
+  return bytes;
+}
+
+std::vector<uint8_t> queued_bytes(const Send_Buffer *buf) {
+  Net_Buffer parts[2];
+  const uint16_t count = send_buffer_parts(buf, parts);
+  std::vector<uint8_t> bytes;
+
+  for (uint16_t i = 0; i < count; ++i) {
+    bytes.insert(bytes.end(), parts[i].data, parts[i].data + parts[i].length);
+  }
+
+  return bytes;
+}
+
+TEST(SendBuffer, StartsEmpty) {
+  Send_Buffer buf;
+  send_buffer_init(&buf, 1000);
+
+  Net_Buffer parts[2];
+  EXPECT_EQ(send_buffer_parts(&buf, parts), 0);
+  EXPECT_EQ(send_buffer_length(&buf), 0);
+  EXPECT_EQ(send_buffer_space(&buf), 1000);
+  EXPECT_EQ(buf.data, nullptr);
+
+  send_buffer_free(&buf);
+}
+
+TEST(SendBuffer, KeepsBytesInOrder) {
+  Send_Buffer buf;
+  send_buffer_init(&buf, 1000);
+
+  const std::vector<uint8_t> first = make_bytes(100, 0);
+  const std::vector<uint8_t> second = make_bytes(50, 100);
+  ASSERT_TRUE(send_buffer_add(&buf, first.data(), first.size()));
+  ASSERT_TRUE(send_buffer_add(&buf, second.data(), second.size()));
+
+  EXPECT_EQ(queued_bytes(&buf), make_bytes(150, 0));
+  EXPECT_EQ(send_buffer_space(&buf), 850);
+
+  send_buffer_consume(&buf, 30);
+  EXPECT_EQ(queued_bytes(&buf), make_bytes(120, 30));
+
+  send_buffer_free(&buf);
+}
+
+TEST(SendBuffer, WrapsAroundTheEnd) {
+  Send_Buffer buf;
+  send_buffer_init(&buf, SEND_BUFFER_MIN_SIZE);
+
+  const std::vector<uint8_t> head = make_bytes(SEND_BUFFER_MIN_SIZE - 100, 0);
+  ASSERT_TRUE(send_buffer_add(&buf, head.data(), head.size()));
+  send_buffer_consume(&buf, SEND_BUFFER_MIN_SIZE - 200);
+
+  const std::vector<uint8_t> tail = make_bytes(300, 7);
+  ASSERT_TRUE(send_buffer_add(&buf, tail.data(), tail.size()));
+
+  Net_Buffer parts[2];
+  ASSERT_EQ(send_buffer_parts(&buf, parts), 2);
+  EXPECT_EQ(parts[0].length + parts[1].length, 400);
+
+  std::vector<uint8_t> expected(head.end() - 100, head.end());
+  expected.insert(expected.end(), tail.begin(), tail.end());
+  EXPECT_EQ(queued_bytes(&buf), expected);
+
+  send_buffer_free(&buf);
+}
+
+TEST(SendBuffer, GrowsAndUnwraps) {
+  Send_Buffer buf;
+  send_buffer_init(&buf, 4 * SEND_BUFFER_MIN_SIZE);
+
+  const std::vector<uint8_t> head = make_bytes(SEND_BUFFER_MIN_SIZE - 10, 0);
+  ASSERT_TRUE(send_buffer_add(&buf, head.data(), head.size()));
+  send_buffer_consume(&buf, SEND_BUFFER_MIN_SIZE - 20);
+
+  /* Wraps, then needs more room than the first block has. */
+  const std::vector<uint8_t> more = make_bytes(SEND_BUFFER_MIN_SIZE, 3);
+  ASSERT_TRUE(send_buffer_add(&buf, more.data(), more.size()));
+  EXPECT_EQ(buf.size, 2 * SEND_BUFFER_MIN_SIZE);
+
+  std::vector<uint8_t> expected(head.end() - 10, head.end());
+  expected.insert(expected.end(), more.begin(), more.end());
+  EXPECT_EQ(queued_bytes(&buf), expected);
+  EXPECT_EQ(buf.peak_length, SEND_BUFFER_MIN_SIZE + 10);
+
+  send_buffer_free(&buf);
+}
+
+TEST(SendBuffer, ShrinksAfterItStaysMostlyEmpty) {
+  Send_Buffer buf;
+  send_buffer_init(&buf, 4 * SEND_BUFFER_MIN_SIZE);
+
+  const std::vector<uint8_t> burst = make_bytes(2 * SEND_BUFFER_MIN_SIZE, 0);
+  ASSERT_TRUE(send_buffer_add(&buf, burst.data(), burst.size()));
+  send_buffer_consume(&buf, send_buffer_length(&buf));
+
+  /* Draining keeps the grown block. */
+  const uint8_t *const data = buf.data;
+  EXPECT_EQ(buf.size, 2 * SEND_BUFFER_MIN_SIZE);
+
+  /* Filling more than a quarter of it restarts the count. */
+  const std::vector<uint8_t> small = make_bytes(100, 1);
+
+  for (int i = 0; i < SEND_BUFFER_SHRINK_DRAINS - 1; ++i) {
+    ASSERT_TRUE(send_buffer_add(&buf, small.data(), small.size()));
+    send_buffer_consume(&buf, send_buffer_length(&buf));
+  }
+
+  ASSERT_TRUE(send_buffer_add(&buf, burst.data(), SEND_BUFFER_MIN_SIZE));
+  send_buffer_consume(&buf, send_buffer_length(&buf));
+  EXPECT_EQ(buf.data, data);
+
+  for (int i = 0; i < SEND_BUFFER_SHRINK_DRAINS - 1; ++i) {
+    ASSERT_TRUE(send_buffer_add(&buf, small.data(), small.size()));
+    send_buffer_consume(&buf, send_buffer_length(&buf));
+    EXPECT_EQ(buf.data, data);
+  }
+
+  /* The last of enough mostly empty drains gives the memory back. */
+  ASSERT_TRUE(send_buffer_add(&buf, small.data(), small.size()));
+  send_buffer_consume(&buf, send_buffer_length(&buf));
+  EXPECT_EQ(buf.data, nullptr);
+  EXPECT_EQ(buf.size, 0);
+
+  send_buffer_free(&buf);
+}
+
+TEST(SendBuffer, RefusesBytesOverTheCap) {
+  Send_Buffer buf;
+  send_buffer_init(&buf, 100);
+
+  const std::vector<uint8_t> bytes = make_bytes(60, 0);
+  ASSERT_TRUE(send_buffer_add(&buf, bytes.data(), bytes.size()));
+  EXPECT_FALSE(send_buffer_add(&buf, bytes.data(), bytes.size()));
+  EXPECT_EQ(buf.refused, 1);
+  EXPECT_EQ(send_buffer_length(&buf), 60);
+  EXPECT_LE(buf.size, 100);
+
+  ASSERT_TRUE(send_buffer_add(&buf, bytes.data(), 40));
+  EXPECT_EQ(send_buffer_space(&buf), 0);
+
+  send_buffer_free(&buf);
+  EXPECT_EQ(send_buffer_length(&buf), 0);
+  EXPECT_EQ(send_buffer_space(&buf), 100);
+}
+
+}  // namespace
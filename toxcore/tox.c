@@ -39,6 +39,7 @@
 #include "group.h"
 #include "logger.h"
 #include "mono_time.h"
+#include "util.h"
 
 #include "../toxencryptsave/defines.h"
 
@@ -405,6 +406,19 @@ Tox *tox_new(const struct Tox_Options *options, Tox_Err_New *error)
     m_options.tcp_server_port = tox_options_get_tcp_port(opts);
     m_options.hole_punching_enabled = tox_options_get_hole_punching_enabled(opts);
     m_options.local_discovery_enabled = tox_options_get_local_discovery_enabled(opts);
+    m_options.udp_recv_batch_size = min_u32(tox_options_get_udp_recv_batch_size(opts), MAX_RECV_BATCH_SIZE);
+    m_options.udp_send_queue_size = min_u32(tox_options_get_udp_send_queue_size(opts), MAX_SEND_QUEUE_SIZE);
+
+    switch (tox_options_get_congestion_control(opts)) {
+        case TOX_CONGESTION_CONTROL_CUBIC:
+            m_options.congestion_control = CRYPTO_CONGESTION_CONTROL_CUBIC;
+            break;
+
+        case TOX_CONGESTION_CONTROL_LEGACY:
+        default:
+            m_options.congestion_control = CRYPTO_CONGESTION_CONTROL_LEGACY;
+            break;
+    }
 
     m_options.log_callback = (logger_cb *)tox_options_get_log_callback(opts);
     m_options.log_context = tox;
@@ -666,6 +680,54 @@ uint32_t tox_iteration_interval(const Tox *tox)
     return messenger_run_interval(m);
 }
 
+uint32_t tox_iteration_deadline(const Tox *tox)
+{
+    const Messenger *m = tox->m;
+    return messenger_run_deadline(m);
+}
+
+size_t tox_get_wait_sockets_size(const Tox *tox)
+{
+    const Messenger *m = tox->m;
+    return messenger_wait_sockets(m, nullptr, 0);
+}
+
+/* Number of sockets tox_get_wait_sockets() converts without allocating. */
+#define WAIT_SOCKETS_STACK_SIZE 64
+
+size_t tox_get_wait_sockets(const Tox *tox, int32_t *wait_sockets, size_t length)
+{
+    const Messenger *m = tox->m;
+
+    if (wait_sockets == nullptr || length == 0) {
+        return messenger_wait_sockets(m, nullptr, 0);
+    }
+
+    const uint32_t max_socks = length < UINT32_MAX / sizeof(Socket) ? length : UINT32_MAX / sizeof(Socket);
+    Socket stack_socks[WAIT_SOCKETS_STACK_SIZE];
+    Socket *socks = stack_socks;
+
+    if (max_socks > WAIT_SOCKETS_STACK_SIZE) {
+        socks = (Socket *)malloc(max_socks * sizeof(Socket));
+
+        if (socks == nullptr) {
+            return 0;
+        }
+    }
+
+    const uint32_t count = messenger_wait_sockets(m, socks, max_socks);
+
+    for (uint32_t i = 0; i < count && i < max_socks; ++i) {
+        wait_sockets[i] = socks[i].socket;
+    }
+
+    if (socks != stack_socks) {
+        free(socks);
+    }
+
+    return count;
+}
+
 void tox_iterate(Tox *tox, void *user_data)
 {
     mono_time_update(tox->mono_time);
@@ -674,6 +736,7 @@ void tox_iterate(Tox *tox, void *user_data)
     struct Tox_Userdata tox_data = { tox, user_data };
     do_messenger(m, &tox_data);
     do_groupchats(m->conferences_object, &tox_data);
+    networking_flush(m->net);
 }
 
 void tox_self_get_address(const Tox *tox, uint8_t *address)
@@ -1096,6 +1159,167 @@ void tox_callback_friend_typing(Tox *tox, tox_friend_typing_cb *callback)
     tox->friend_typing_callback = callback;
 }
 
+static Tox_Transport_Path transport_path(Crypto_Path path)
+{
+    switch (path) {
+        case CRYPTO_PATH_UDP4:
+            return TOX_TRANSPORT_PATH_UDP4;
+
+        case CRYPTO_PATH_UDP6:
+            return TOX_TRANSPORT_PATH_UDP6;
+
+        case CRYPTO_PATH_TCP:
+            return TOX_TRANSPORT_PATH_TCP_RELAY;
+
+        case CRYPTO_PATH_NONE:
+            return TOX_TRANSPORT_PATH_NONE;
+    }
+
+    return TOX_TRANSPORT_PATH_NONE;
+}
+
+static uint32_t packet_rate(double rate)
+{
+    if (rate >= UINT32_MAX) {
+        return UINT32_MAX;
+    }
+
+    return (uint32_t)(rate + 0.5);
+}
+
+static bool get_transport_stats(const Tox *tox, uint32_t friend_number, Crypto_Connection_Stats *stats,
+                                Tox_Err_Friend_Query *error)
+{
+    if (m_get_friend_transport_stats(tox->m, friend_number, stats) == -1) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND);
+        return 0;
+    }
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_OK);
+    return 1;
+}
+
+Tox_Transport_Path tox_friend_get_transport_path(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
+{
+    Crypto_Connection_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return TOX_TRANSPORT_PATH_NONE;
+    }
+
+    return transport_path(stats.path);
+}
+
+uint32_t tox_friend_get_transport_tcp_relays(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
+{
+    Crypto_Connection_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return stats.online_tcp_relays;
+}
+
+uint32_t tox_friend_get_transport_rtt(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
+{
+    Crypto_Connection_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return stats.rtt < UINT32_MAX ? (uint32_t)stats.rtt : UINT32_MAX;
+}
+
+uint32_t tox_friend_get_transport_send_rate(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
+{
+    Crypto_Connection_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return packet_rate(stats.send_rate);
+}
+
+uint32_t tox_friend_get_transport_recv_rate(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
+{
+    Crypto_Connection_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return packet_rate(stats.recv_rate);
+}
+
+uint32_t tox_friend_get_transport_send_queue(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
+{
+    Crypto_Connection_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return stats.send_queue;
+}
+
+uint32_t tox_friend_get_transport_recv_queue(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
+{
+    Crypto_Connection_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return stats.recv_queue;
+}
+
+uint64_t tox_friend_get_transport_packets_sent(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
+{
+    Crypto_Connection_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return stats.packets_sent;
+}
+
+uint64_t tox_friend_get_transport_packets_resent(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
+{
+    Crypto_Connection_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return stats.packets_resent;
+}
+
+uint64_t tox_friend_get_transport_packets_lost(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
+{
+    Crypto_Connection_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return stats.packets_lost;
+}
+
+uint32_t tox_friend_get_transport_congestion_events(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
+{
+    Crypto_Connection_Stats stats;
+
+    if (!get_transport_stats(tox, friend_number, &stats, error)) {
+        return 0;
+    }
+
+    return stats.congestion_events;
+}
+
 bool tox_self_set_typing(Tox *tox, uint32_t friend_number, bool typing, Tox_Err_Set_Typing *error)
 {
     Messenger *m = tox->m;
@@ -484,6 +484,31 @@ typedef enum TOX_SAVEDATA_TYPE {
 } TOX_SAVEDATA_TYPE;
 
 
+/**
+ * Algorithm that decides how fast lossless data (messages, file transfers,
+ * custom lossless packets) is sent to a friend.
+ *
+ * @deprecated All UPPER_CASE enum type names are deprecated. Use the
+ *   Camel_Snake_Case versions, instead.
+ */
+typedef enum TOX_CONGESTION_CONTROL {
+
+    /**
+     * The send rate follows the measured throughput and backs off when the
+     * send queue grows.
+     */
+    TOX_CONGESTION_CONTROL_LEGACY,
+
+    /**
+     * CUBIC: the send window grows along a cubic curve and shrinks when
+     * packets are lost. Makes better use of links with a high
+     * bandwidth-delay product.
+     */
+    TOX_CONGESTION_CONTROL_CUBIC,
+
+} TOX_CONGESTION_CONTROL;
+
+
 /**
  * Severity level of log messages.
  *
@@ -658,6 +683,34 @@ struct Tox_Options {
     bool hole_punching_enabled;
 
 
+    /**
+     * The congestion control algorithm for friend connections.
+     * (Default: TOX_CONGESTION_CONTROL_LEGACY).
+     */
+    TOX_CONGESTION_CONTROL congestion_control;
+
+
+    /**
+     * Number of UDP datagrams received with one system call. 0 and 1 receive
+     * one datagram at a time. Larger values use recvmmsg() where the platform
+     * has it. Values above 256 are taken as 256. (Default: 0).
+     */
+    uint16_t udp_recv_batch_size;
+
+
+    /**
+     * Number of outgoing UDP datagrams collected and sent with one sendmmsg()
+     * call at the end of tox_iterate, where the platform has it. 0 sends every
+     * datagram right away. Values above 256 are taken as 256. (Default: 0).
+     *
+     * With a queue, datagrams sent from other threads between two tox_iterate
+     * calls, such as the audio and video packets of toxav, wait until the end
+     * of the next tox_iterate call or until the queue is full. This adds up to
+     * one iteration interval of latency to them.
+     */
+    uint16_t udp_send_queue_size;
+
+
     /**
      * The type of savedata to load from.
      */
@@ -733,6 +786,18 @@ bool tox_options_get_hole_punching_enabled(const struct Tox_Options *options);
 
 void tox_options_set_hole_punching_enabled(struct Tox_Options *options, bool hole_punching_enabled);
 
+TOX_CONGESTION_CONTROL tox_options_get_congestion_control(const struct Tox_Options *options);
+
+void tox_options_set_congestion_control(struct Tox_Options *options, TOX_CONGESTION_CONTROL congestion_control);
+
+uint16_t tox_options_get_udp_recv_batch_size(const struct Tox_Options *options);
+
+void tox_options_set_udp_recv_batch_size(struct Tox_Options *options, uint16_t udp_recv_batch_size);
+
+uint16_t tox_options_get_udp_send_queue_size(const struct Tox_Options *options);
+
+void tox_options_set_udp_send_queue_size(struct Tox_Options *options, uint16_t udp_send_queue_size);
+
 TOX_SAVEDATA_TYPE tox_options_get_savedata_type(const struct Tox_Options *options);
 
 void tox_options_set_savedata_type(struct Tox_Options *options, TOX_SAVEDATA_TYPE type);
@@ -1051,6 +1116,42 @@ void tox_callback_self_connection_status(Tox *tox, tox_self_connection_status_cb
  */
 uint32_t tox_iteration_interval(const Tox *tox);
 
+/**
+ * Return the time in milliseconds until the earliest internal timer expires
+ * and tox_iterate() must be called again. Returns 0 if tox_iterate() should be
+ * called again immediately. While data is waiting for a socket to become
+ * writable, this is a short back-off instead, as only readability of the
+ * sockets is waited for.
+ *
+ * Unlike tox_iteration_interval(), this is not capped to a minimum interval.
+ * It is meant for clients that drive Tox from their own event loop: wait
+ * until one of the sockets returned by tox_get_wait_sockets becomes readable or
+ * this many milliseconds have passed, whichever comes first, then call
+ * tox_iterate().
+ */
+uint32_t tox_iteration_deadline(const Tox *tox);
+
+/**
+ * Return the number of sockets tox_get_wait_sockets would write. The set of
+ * sockets changes as TCP relay connections are made and closed, so it should
+ * be fetched again after every call to tox_iterate().
+ */
+size_t tox_get_wait_sockets_size(const Tox *tox);
+
+/**
+ * Write the file descriptors (or socket handles) that tox_iterate() reads
+ * from to an array. These are the UDP socket and the sockets of all TCP
+ * relay connections. Clients must only wait for them to become readable
+ * and must not read from, write to or close them.
+ *
+ * @param wait_sockets A memory region for at most length sockets. If this
+ *   parameter is NULL, nothing is written.
+ *
+ * @return the number of sockets, which is larger than length if they did not
+ *   all fit, or 0 if memory allocation failed.
+ */
+size_t tox_get_wait_sockets(const Tox *tox, int32_t *wait_sockets, size_t length);
+
 /**
  * The main loop that needs to be run in intervals of tox_iteration_interval()
  * milliseconds.
@@ -1681,6 +1782,128 @@ typedef void tox_friend_typing_cb(Tox *tox, uint32_t friend_number, bool is_typi
  */
 void tox_callback_friend_typing(Tox *tox, tox_friend_typing_cb *callback);
 
+/**
+ * The route packets to a friend currently take.
+ */
+typedef enum TOX_TRANSPORT_PATH {
+
+    /**
+     * The friend is not connected.
+     */
+    TOX_TRANSPORT_PATH_NONE,
+
+    /**
+     * Direct UDP over IPv4.
+     */
+    TOX_TRANSPORT_PATH_UDP4,
+
+    /**
+     * Direct UDP over IPv6.
+     */
+    TOX_TRANSPORT_PATH_UDP6,
+
+    /**
+     * Through one or more TCP relays.
+     */
+    TOX_TRANSPORT_PATH_TCP_RELAY,
+
+} TOX_TRANSPORT_PATH;
+
+
+/**
+ * The functions below report the state of the connection to a friend. They
+ * don't allocate and take constant time, so they can be polled regularly for
+ * every friend. If the friend is offline, the path is TOX_TRANSPORT_PATH_NONE
+ * and all the other values are 0.
+ *
+ * The packet counters only count lossless packets (messages, file transfers
+ * and custom lossless packets) and are totals since the connection to the
+ * friend was established; they start over when the friend reconnects.
+ */
+
+/**
+ * Return the route packets to the friend currently take.
+ *
+ * @return TOX_TRANSPORT_PATH_NONE on failure.
+ */
+TOX_TRANSPORT_PATH tox_friend_get_transport_path(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error);
+
+/**
+ * Return the number of TCP relays through which the friend is reachable.
+ *
+ * @return 0 on failure.
+ */
+uint32_t tox_friend_get_transport_tcp_relays(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error);
+
+/**
+ * Return the round trip time to the friend in milliseconds.
+ *
+ * @return 0 on failure.
+ */
+uint32_t tox_friend_get_transport_rtt(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error);
+
+/**
+ * Return the number of packets per second the congestion control lets us
+ * send to the friend.
+ *
+ * @return 0 on failure.
+ */
+uint32_t tox_friend_get_transport_send_rate(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error);
+
+/**
+ * Return the number of packets per second received from the friend.
+ *
+ * @return 0 on failure.
+ */
+uint32_t tox_friend_get_transport_recv_rate(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error);
+
+/**
+ * Return the number of packets sent to the friend that it has not
+ * acknowledged yet.
+ *
+ * @return 0 on failure.
+ */
+uint32_t tox_friend_get_transport_send_queue(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error);
+
+/**
+ * Return the number of packets received from the friend that are held back
+ * until a missing earlier packet arrives.
+ *
+ * @return 0 on failure.
+ */
+uint32_t tox_friend_get_transport_recv_queue(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error);
+
+/**
+ * Return the number of packets sent to the friend.
+ *
+ * @return 0 on failure.
+ */
+uint64_t tox_friend_get_transport_packets_sent(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error);
+
+/**
+ * Return the number of packets sent again because the friend did not receive
+ * them.
+ *
+ * @return 0 on failure.
+ */
+uint64_t tox_friend_get_transport_packets_resent(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error);
+
+/**
+ * Return the number of resent packets that were lost rather than late, i.e.
+ * the friend asked for them more than a round trip after they were sent.
+ *
+ * @return 0 on failure.
+ */
+uint64_t tox_friend_get_transport_packets_lost(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error);
+
+/**
+ * Return the number of times resending packets used up all of the send rate.
+ *
+ * @return 0 on failure.
+ */
+uint32_t tox_friend_get_transport_congestion_events(const Tox *tox, uint32_t friend_number,
+                                                    TOX_ERR_FRIEND_QUERY *error);
+
 
 /*******************************************************************************
  *
@@ -2299,6 +2522,11 @@ bool tox_file_send_chunk(Tox *tox, uint32_t friend_number, uint32_t file_number,
  * This happens when a chunk was requested, but the send failed. A seek-back
  * request can occur an arbitrary number of times for any given chunk.
  *
+ * Chunks longer than the usual size are requested while the connection to the
+ * friend carries larger packets. If it stops doing so before such a chunk is
+ * sent, `tox_file_send_chunk` drops the chunk but still succeeds, and the same
+ * position is requested again in smaller pieces.
+ *
  * In response to receiving this callback, the client should call the function
  * `tox_file_send_chunk` with the requested chunk. If the number of bytes sent
  * through that function is zero, the file transfer is assumed complete. A
@@ -3162,8 +3390,10 @@ typedef TOX_USER_STATUS Tox_User_Status;
 typedef TOX_MESSAGE_TYPE Tox_Message_Type;
 typedef TOX_PROXY_TYPE Tox_Proxy_Type;
 typedef TOX_SAVEDATA_TYPE Tox_Savedata_Type;
+typedef TOX_CONGESTION_CONTROL Tox_Congestion_Control;
 typedef TOX_LOG_LEVEL Tox_Log_Level;
 typedef TOX_CONNECTION Tox_Connection;
+typedef TOX_TRANSPORT_PATH Tox_Transport_Path;
 typedef TOX_FILE_CONTROL Tox_File_Control;
 typedef TOX_CONFERENCE_TYPE Tox_Conference_Type;
 
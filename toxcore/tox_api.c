@@ -51,6 +51,9 @@ ACCESSORS(uint16_t,, start_port)
 ACCESSORS(uint16_t,, end_port)
 ACCESSORS(uint16_t,, tcp_port)
 ACCESSORS(bool,, hole_punching_enabled)
+ACCESSORS(TOX_CONGESTION_CONTROL,, congestion_control)
+ACCESSORS(uint16_t,, udp_recv_batch_size)
+ACCESSORS(uint16_t,, udp_send_queue_size)
 ACCESSORS(TOX_SAVEDATA_TYPE, savedata_, type)
 ACCESSORS(size_t, savedata_, length)
 ACCESSORS(tox_log_cb *, log_, callback)
@@ -78,6 +81,7 @@ void tox_options_default(struct Tox_Options *options)
         tox_options_set_proxy_type(options, TOX_PROXY_TYPE_NONE);
         tox_options_set_hole_punching_enabled(options, true);
         tox_options_set_local_discovery_enabled(options, true);
+        tox_options_set_congestion_control(options, TOX_CONGESTION_CONTROL_LEGACY);
     }
 }
 